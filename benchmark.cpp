@@ -0,0 +1,514 @@
+/*
+    Yojimbo Benchmark.
+
+    Copyright © 2016 - 2019, The Network Protocol Company, Inc.
+
+    Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+        1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+        2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer 
+           in the documentation and/or other materials provided with the distribution.
+
+        3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived 
+           from this software without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+    INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+    WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+    USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include "shared.h"
+
+static const int NumIterations = 10000;
+
+void BenchmarkReliableOrderedPacketBuild( int numMessages, int messageCacheSize = 0 )
+{
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
+
+    double time = 100.0;
+
+    ConnectionConfig connectionConfig;
+    connectionConfig.channel[0].messageCacheSize = messageCacheSize;
+
+    Connection connection( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+
+    for ( int i = 0; i < numMessages; ++i )
+    {
+        TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
+        yojimbo_assert( message );
+        message->sequence = uint16_t( i );
+        connection.SendMessage( 0, message );
+    }
+
+    uint8_t * packetData = (uint8_t*) YOJIMBO_ALLOCATE( GetDefaultAllocator(), connectionConfig.maxPacketSize );
+
+    uint16_t packetSequence = 0;
+
+    int totalPacketBytes = 0;
+
+    const double startTime = yojimbo_time();
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        // nothing is ever acked, so every packet resends the whole send queue
+
+        time += connectionConfig.channel[0].messageResendTime;
+
+        connection.AdvanceTime( time );
+
+        int packetBytes = 0;
+        if ( connection.GeneratePacket( NULL, packetSequence++, packetData, connectionConfig.maxPacketSize, packetBytes ) )
+            totalPacketBytes += packetBytes;
+    }
+
+    const double finishTime = yojimbo_time();
+
+    const double microsecondsPerPacket = ( finishTime - startTime ) * 1000000.0 / NumIterations;
+
+    printf( "reliable ordered packet build (%d messages, %dk message cache): %.2f us/packet, %d bytes/packet\n", numMessages, messageCacheSize / 1024, microsecondsPerPacket, totalPacketBytes / NumIterations );
+
+    YOJIMBO_FREE( GetDefaultAllocator(), packetData );
+}
+
+void BenchmarkReliableOrderedMessageSelection( int numMessages )
+{
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
+
+    double time = 100.0;
+
+    ChannelConfig channelConfig;
+
+    ReliableOrderedChannel channel( GetDefaultAllocator(), messageFactory, channelConfig, 0, time );
+
+    for ( int i = 0; i < numMessages; ++i )
+    {
+        TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
+        yojimbo_assert( message );
+        message->sequence = uint16_t( i );
+        channel.SendMessage( message, NULL );
+    }
+
+    uint16_t * messageIds = (uint16_t*) YOJIMBO_ALLOCATE( GetDefaultAllocator(), sizeof( uint16_t ) * channelConfig.maxMessagesPerPacket );
+
+    const int availableBits = ConnectionConfig().maxPacketSize * 8;
+
+    int totalMessageIds = 0;
+
+    const double startTime = yojimbo_time();
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        time += channelConfig.messageResendTime;
+
+        channel.AdvanceTime( time );
+
+        int numMessageIds = 0;
+        channel.GetMessagesToSend( messageIds, numMessageIds, availableBits, NULL );
+        totalMessageIds += numMessageIds;
+    }
+
+    const double finishTime = yojimbo_time();
+
+    const double microsecondsPerPacket = ( finishTime - startTime ) * 1000000.0 / NumIterations;
+
+    printf( "reliable ordered message selection (%d messages): %.2f us/packet, %d messages/packet\n", numMessages, microsecondsPerPacket, totalMessageIds / NumIterations );
+
+    YOJIMBO_FREE( GetDefaultAllocator(), messageIds );
+}
+
+void BenchmarkReliableOrderedMessageSelectionWithPacketLoss( int messagesPerPacket, int packetLossPercent, int roundTripPackets )
+{
+    srand( 0 );
+
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
+
+    double time = 100.0;
+
+    const double deltaTime = 1.0 / 60.0;
+
+    ChannelConfig channelConfig;
+
+    ReliableOrderedChannel channel( GetDefaultAllocator(), messageFactory, channelConfig, 0, time );
+
+    uint16_t * messageIds = (uint16_t*) YOJIMBO_ALLOCATE( GetDefaultAllocator(), sizeof( uint16_t ) * channelConfig.maxMessagesPerPacket );
+
+    const int availableBits = ConnectionConfig().maxPacketSize * 8;
+
+    // acks for packets that were received come back to the sender one round trip later
+
+    bool * packetReceived = (bool*) YOJIMBO_ALLOCATE( GetDefaultAllocator(), sizeof( bool ) * roundTripPackets );
+    memset( packetReceived, 0, sizeof( bool ) * roundTripPackets );
+
+    uint16_t packetSequence = 0;
+
+    int totalMessageIds = 0;
+
+    double selectionTime = 0.0;
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        for ( int j = 0; j < messagesPerPacket; ++j )
+        {
+            if ( !channel.CanSendMessage() )
+                break;
+
+            TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
+            yojimbo_assert( message );
+            message->sequence = uint16_t( i );
+            channel.SendMessage( message, NULL );
+        }
+
+        int numMessageIds = 0;
+
+        const double startTime = yojimbo_time();
+
+        if ( channel.HasMessagesToSend() )
+        {
+            channel.GetMessagesToSend( messageIds, numMessageIds, availableBits, NULL );
+            channel.AddMessagePacketEntry( messageIds, numMessageIds, packetSequence );
+        }
+
+        selectionTime += yojimbo_time() - startTime;
+
+        totalMessageIds += numMessageIds;
+
+        const int roundTripIndex = i % roundTripPackets;
+
+        if ( packetReceived[roundTripIndex] )
+            channel.ProcessAck( uint16_t( packetSequence - roundTripPackets ) );
+
+        packetReceived[roundTripIndex] = numMessageIds > 0 && random_int( 0, 99 ) >= packetLossPercent;
+
+        packetSequence++;
+
+        time += deltaTime;
+
+        channel.AdvanceTime( time );
+    }
+
+    const double microsecondsPerPacket = selectionTime * 1000000.0 / NumIterations;
+
+    printf( "reliable ordered message selection (%d new messages/packet, %d%% loss, %d packet rtt): %.2f us/packet, %d messages/packet\n",
+        messagesPerPacket, packetLossPercent, roundTripPackets, microsecondsPerPacket, totalMessageIds / NumIterations );
+
+    YOJIMBO_FREE( GetDefaultAllocator(), packetReceived );
+    YOJIMBO_FREE( GetDefaultAllocator(), messageIds );
+}
+
+void BenchmarkReliableOrderedBlockFragmentSelection( int blockSize, int packetLossPercent, int roundTripPackets )
+{
+    srand( 0 );
+
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
+
+    double time = 100.0;
+
+    const double deltaTime = 1.0 / 60.0;
+
+    ChannelConfig channelConfig;
+    channelConfig.maxBlockSize = blockSize;
+
+    ReliableOrderedChannel channel( GetDefaultAllocator(), messageFactory, channelConfig, 0, time );
+
+    // acks for packets that were received come back to the sender one round trip later
+
+    bool * packetReceived = (bool*) YOJIMBO_ALLOCATE( GetDefaultAllocator(), sizeof( bool ) * roundTripPackets );
+    memset( packetReceived, 0, sizeof( bool ) * roundTripPackets );
+
+    uint16_t packetSequence = 0;
+
+    int numBlocksSent = 0;
+    int numFragmentsSent = 0;
+
+    double selectionTime = 0.0;
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        if ( !channel.HasMessagesToSend() )
+        {
+            TestBlockMessage * message = (TestBlockMessage*) messageFactory.CreateMessage( TEST_BLOCK_MESSAGE );
+            yojimbo_assert( message );
+            uint8_t * blockData = (uint8_t*) YOJIMBO_ALLOCATE( messageFactory.GetAllocator(), blockSize );
+            memset( blockData, 0, blockSize );
+            message->AttachBlock( messageFactory.GetAllocator(), blockData, blockSize );
+            channel.SendMessage( message, NULL );
+            numBlocksSent++;
+        }
+
+        uint16_t messageId = 0;
+        uint16_t fragmentId = 0;
+        int numFragments = 0;
+
+        const double startTime = yojimbo_time();
+
+        channel.UpdateSendBlocks();
+
+        channel.GetFragmentsToSend( &messageId, &fragmentId, numFragments, 8 * 1024 * 8 );
+
+        selectionTime += yojimbo_time() - startTime;
+
+        const bool fragmentSent = numFragments > 0;
+
+        if ( fragmentSent )
+        {
+            channel.AddFragmentPacketEntry( &messageId, &fragmentId, numFragments, packetSequence );
+            numFragmentsSent++;
+        }
+
+        const int roundTripIndex = i % roundTripPackets;
+
+        if ( packetReceived[roundTripIndex] )
+            channel.ProcessAck( uint16_t( packetSequence - roundTripPackets ) );
+
+        packetReceived[roundTripIndex] = fragmentSent && random_int( 0, 99 ) >= packetLossPercent;
+
+        packetSequence++;
+
+        time += deltaTime;
+
+        channel.AdvanceTime( time );
+    }
+
+    const double microsecondsPerPacket = selectionTime * 1000000.0 / NumIterations;
+
+    printf( "reliable ordered block fragment selection (%dk block, %d%% loss, %d packet rtt): %.2f us/packet, %d fragments sent, %d blocks\n",
+        blockSize / 1024, packetLossPercent, roundTripPackets, microsecondsPerPacket, numFragmentsSent, numBlocksSent );
+
+    YOJIMBO_FREE( GetDefaultAllocator(), packetReceived );
+}
+
+void BenchmarkReliableOrderedBlockThroughput( int blockSize, int maxFragmentsPerPacket, int maxBlocksInFlight, int packetLossPercent, int roundTripPackets )
+{
+    srand( 0 );
+
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
+
+    double time = 100.0;
+
+    const double deltaTime = 1.0 / 60.0;
+
+    ChannelConfig channelConfig;
+    channelConfig.maxBlockSize = blockSize;
+    channelConfig.maxFragmentsPerPacket = maxFragmentsPerPacket;
+    channelConfig.maxBlocksInFlight = maxBlocksInFlight;
+
+    ReliableOrderedChannel sender( GetDefaultAllocator(), messageFactory, channelConfig, 0, time );
+    ReliableOrderedChannel receiver( GetDefaultAllocator(), messageFactory, channelConfig, 0, time );
+
+    // acks for packets that were received come back to the sender one round trip later
+
+    bool * packetReceived = (bool*) YOJIMBO_ALLOCATE( GetDefaultAllocator(), sizeof( bool ) * roundTripPackets );
+    memset( packetReceived, 0, sizeof( bool ) * roundTripPackets );
+
+    const int availableBits = ConnectionConfig().maxPacketSize * 8 - ConservativePacketHeaderBits - ConservativeChannelHeaderBits;
+
+    uint16_t packetSequence = 0;
+
+    int numBlocksReceived = 0;
+
+    double sendTime = 0.0;
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        if ( !sender.HasMessagesToSend() )
+        {
+            for ( int j = 0; j < maxBlocksInFlight; ++j )
+            {
+                TestBlockMessage * message = (TestBlockMessage*) messageFactory.CreateMessage( TEST_BLOCK_MESSAGE );
+                yojimbo_assert( message );
+                uint8_t * blockData = (uint8_t*) YOJIMBO_ALLOCATE( messageFactory.GetAllocator(), blockSize );
+                memset( blockData, 0, blockSize );
+                message->AttachBlock( messageFactory.GetAllocator(), blockData, blockSize );
+                sender.SendMessage( message, NULL );
+            }
+        }
+
+        ChannelPacketData packetData;
+
+        const double startTime = yojimbo_time();
+
+        const bool packetSent = sender.GetPacketData( NULL, packetData, packetSequence, availableBits ) > 0;
+
+        sendTime += yojimbo_time() - startTime;
+
+        const int roundTripIndex = i % roundTripPackets;
+
+        if ( packetReceived[roundTripIndex] )
+            sender.ProcessAck( uint16_t( packetSequence - roundTripPackets ) );
+
+        packetReceived[roundTripIndex] = packetSent && random_int( 0, 99 ) >= packetLossPercent;
+
+        if ( packetSent )
+        {
+            if ( packetReceived[roundTripIndex] )
+                receiver.ProcessPacketData( packetData, packetSequence );
+            packetData.Free( messageFactory );
+        }
+
+        while ( Message * message = receiver.ReceiveMessage() )
+        {
+            messageFactory.ReleaseMessage( message );
+            numBlocksReceived++;
+        }
+
+        packetSequence++;
+
+        time += deltaTime;
+
+        sender.AdvanceTime( time );
+        receiver.AdvanceTime( time );
+    }
+
+    const double microsecondsPerPacket = sendTime * 1000000.0 / NumIterations;
+
+    printf( "reliable ordered block throughput (%dk block, %d fragments per packet, %d blocks in flight, %d%% loss, %d packet rtt): %.2f us/packet, %d blocks received\n",
+        blockSize / 1024, maxFragmentsPerPacket, maxBlocksInFlight, packetLossPercent, roundTripPackets, microsecondsPerPacket, numBlocksReceived );
+
+    YOJIMBO_FREE( GetDefaultAllocator(), packetReceived );
+}
+
+template <typename MessageFactoryClass> void BenchmarkMessageFactoryChurn( const char * name, int messagesPerFrame )
+{
+    MessageFactoryClass messageFactory( GetDefaultAllocator() );
+
+    Message ** messages = (Message**) YOJIMBO_ALLOCATE( GetDefaultAllocator(), sizeof( Message* ) * messagesPerFrame );
+
+    const double startTime = yojimbo_time();
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        for ( int j = 0; j < messagesPerFrame; ++j )
+        {
+            messages[j] = messageFactory.CreateMessage( TEST_MESSAGE );
+            yojimbo_assert( messages[j] );
+        }
+
+        for ( int j = 0; j < messagesPerFrame; ++j )
+        {
+            messageFactory.ReleaseMessage( messages[j] );
+        }
+    }
+
+    const double finishTime = yojimbo_time();
+
+    const double nanosecondsPerMessage = ( finishTime - startTime ) * 1000000000.0 / ( double( NumIterations ) * messagesPerFrame );
+
+    printf( "%s message factory churn (%d messages): %.1f ns/message\n", name, messagesPerFrame, nanosecondsPerMessage );
+
+    YOJIMBO_FREE( GetDefaultAllocator(), messages );
+}
+
+void BenchmarkBlockAllocation( bool pooled, int blocksPerFrame )
+{
+    const int MemorySize = 16 * 1024 * 1024;
+
+    uint8_t * memory = (uint8_t*) YOJIMBO_ALLOCATE( GetDefaultAllocator(), MemorySize );
+
+    {
+        TLSF_Allocator tlsfAllocator( memory, MemorySize );
+
+        BlockAllocator blockAllocator( tlsfAllocator );
+
+        Allocator & allocator = pooled ? (Allocator&) blockAllocator : (Allocator&) tlsfAllocator;
+
+        uint8_t ** blocks = (uint8_t**) YOJIMBO_ALLOCATE( GetDefaultAllocator(), sizeof( uint8_t* ) * blocksPerFrame );
+
+        const double startTime = yojimbo_time();
+
+        for ( int i = 0; i < NumIterations; ++i )
+        {
+            // snapshot sized blocks that vary a bit from frame to frame
+
+            for ( int j = 0; j < blocksPerFrame; ++j )
+            {
+                blocks[j] = (uint8_t*) YOJIMBO_ALLOCATE( allocator, 8 * 1024 + ( ( i * 97 + j * 31 ) % 4096 ) );
+                yojimbo_assert( blocks[j] );
+            }
+
+            for ( int j = 0; j < blocksPerFrame; ++j )
+            {
+                YOJIMBO_FREE( allocator, blocks[j] );
+            }
+        }
+
+        const double finishTime = yojimbo_time();
+
+        const double nanosecondsPerBlock = ( finishTime - startTime ) * 1000000000.0 / ( double( NumIterations ) * blocksPerFrame );
+
+        printf( "%s block allocation (%d blocks): %.1f ns/block\n", pooled ? "pooled" : "tlsf", blocksPerFrame, nanosecondsPerBlock );
+
+        YOJIMBO_FREE( GetDefaultAllocator(), blocks );
+    }
+
+    YOJIMBO_FREE( GetDefaultAllocator(), memory );
+}
+
+int main()
+{
+    printf( "\nbenchmark\n\n" );
+
+    if ( !InitializeYojimbo() )
+    {
+        printf( "error: failed to initialize Yojimbo!\n" );
+        return 1;
+    }
+
+    yojimbo_log_level( YOJIMBO_LOG_LEVEL_NONE );
+
+    BenchmarkReliableOrderedPacketBuild( 16 );
+    BenchmarkReliableOrderedPacketBuild( 64 );
+    BenchmarkReliableOrderedPacketBuild( 256 );
+    BenchmarkReliableOrderedPacketBuild( 16, 16 * 1024 );
+    BenchmarkReliableOrderedPacketBuild( 64, 16 * 1024 );
+    BenchmarkReliableOrderedPacketBuild( 256, 16 * 1024 );
+
+    printf( "\n" );
+
+    BenchmarkReliableOrderedMessageSelection( 16 );
+    BenchmarkReliableOrderedMessageSelection( 64 );
+    BenchmarkReliableOrderedMessageSelection( 256 );
+
+    printf( "\n" );
+
+    BenchmarkReliableOrderedMessageSelectionWithPacketLoss( 16, 10, 6 );
+    BenchmarkReliableOrderedMessageSelectionWithPacketLoss( 32, 10, 12 );
+    BenchmarkReliableOrderedMessageSelectionWithPacketLoss( 64, 10, 12 );
+    BenchmarkReliableOrderedMessageSelectionWithPacketLoss( 16, 10, 30 );
+
+    printf( "\n" );
+
+    BenchmarkReliableOrderedBlockFragmentSelection( 256 * 1024, 10, 6 );
+    BenchmarkReliableOrderedBlockFragmentSelection( 1024 * 1024, 10, 6 );
+
+    printf( "\n" );
+
+    BenchmarkReliableOrderedBlockThroughput( 16 * 1024, 1, 1, 10, 6 );
+    BenchmarkReliableOrderedBlockThroughput( 16 * 1024, 4, 1, 10, 6 );
+    BenchmarkReliableOrderedBlockThroughput( 16 * 1024, 4, 4, 10, 6 );
+    BenchmarkReliableOrderedBlockThroughput( 4 * 1024, 1, 1, 10, 30 );
+    BenchmarkReliableOrderedBlockThroughput( 4 * 1024, 4, 4, 10, 30 );
+
+    printf( "\n" );
+
+    BenchmarkMessageFactoryChurn<TestMessageFactory>( "default", 64 );
+    BenchmarkMessageFactoryChurn<PooledTestMessageFactory>( "pooled", 64 );
+    BenchmarkMessageFactoryChurn<TestMessageFactory>( "default", 256 );
+    BenchmarkMessageFactoryChurn<PooledTestMessageFactory>( "pooled", 256 );
+
+    printf( "\n" );
+
+    BenchmarkBlockAllocation( false, 64 );
+    BenchmarkBlockAllocation( true, 64 );
+
+    ShutdownYojimbo();
+
+    printf( "\n" );
+
+    return 0;
+}
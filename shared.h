@@ -132,12 +132,88 @@ struct TestExhaustStreamAllocatorOnReadMessage : public Message
     YOJIMBO_VIRTUAL_SERIALIZE_FUNCTIONS();
 };
 
+struct TestAlignedMessage : public Message
+{
+    uint16_t sequence;
+    uint8_t data[5];
+
+    TestAlignedMessage()
+    {
+        sequence = 0;
+        memset( data, 0, sizeof( data ) );
+    }
+
+    template <typename Stream> bool Serialize( Stream & stream )
+    {        
+        serialize_bits( stream, sequence, 16 );
+
+        // leave the bytes below at a different bit alignment depending on the sequence
+
+        uint32_t dummy = 0;
+        int numBits = sequence % 8;
+        if ( numBits > 0 )
+            serialize_bits( stream, dummy, numBits );
+
+        serialize_bytes( stream, data, sizeof( data ) );
+
+        return true;
+    }
+
+    YOJIMBO_VIRTUAL_SERIALIZE_FUNCTIONS();
+};
+
+struct TestSnapshotMessage : public Message
+{
+    enum { NumValues = 16 };
+
+    uint32_t values[NumValues];
+    bool deltaEncoded;
+
+    TestSnapshotMessage()
+    {
+        memset( values, 0, sizeof( values ) );
+        deltaEncoded = false;
+    }
+
+    template <typename Stream> bool Serialize( Stream & stream )
+    {        
+        // only values that changed since the baseline are written
+
+        const TestSnapshotMessage * baseline = (const TestSnapshotMessage*) GetBaseline();
+
+        if ( Stream::IsReading )
+            deltaEncoded = baseline != NULL;
+
+        for ( int i = 0; i < NumValues; ++i )
+        {
+            if ( baseline )
+            {
+                bool changed = Stream::IsWriting && values[i] != baseline->values[i];
+                serialize_bool( stream, changed );
+                if ( !changed )
+                {
+                    values[i] = baseline->values[i];
+                    continue;
+                }
+            }
+
+            serialize_bits( stream, values[i], 32 );
+        }
+
+        return true;
+    }
+
+    YOJIMBO_VIRTUAL_SERIALIZE_FUNCTIONS();
+};
+
 enum TestMessageType
 {
     TEST_MESSAGE,
     TEST_BLOCK_MESSAGE,
     TEST_SERIALIZE_FAIL_ON_READ_MESSAGE,
     TEST_EXHAUST_STREAM_ALLOCATOR_ON_READ_MESSAGE,
+    TEST_ALIGNED_MESSAGE,
+    TEST_SNAPSHOT_MESSAGE,
     NUM_TEST_MESSAGE_TYPES
 };
 
@@ -146,6 +222,8 @@ YOJIMBO_MESSAGE_FACTORY_START( TestMessageFactory, NUM_TEST_MESSAGE_TYPES );
     YOJIMBO_DECLARE_MESSAGE_TYPE( TEST_BLOCK_MESSAGE, TestBlockMessage );
     YOJIMBO_DECLARE_MESSAGE_TYPE( TEST_SERIALIZE_FAIL_ON_READ_MESSAGE, TestSerializeFailOnReadMessage );
     YOJIMBO_DECLARE_MESSAGE_TYPE( TEST_EXHAUST_STREAM_ALLOCATOR_ON_READ_MESSAGE, TestExhaustStreamAllocatorOnReadMessage );
+    YOJIMBO_DECLARE_MESSAGE_TYPE( TEST_ALIGNED_MESSAGE, TestAlignedMessage );
+    YOJIMBO_DECLARE_MESSAGE_TYPE( TEST_SNAPSHOT_MESSAGE, TestSnapshotMessage );
 YOJIMBO_MESSAGE_FACTORY_FINISH();
 
 enum SingleTestMessageType
@@ -154,6 +232,15 @@ enum SingleTestMessageType
     NUM_SINGLE_TEST_MESSAGE_TYPES
 };
 
+YOJIMBO_MESSAGE_FACTORY_START( PooledTestMessageFactory, NUM_TEST_MESSAGE_TYPES );
+    YOJIMBO_DECLARE_POOLED_MESSAGE_TYPE( TEST_MESSAGE, TestMessage, 256 );
+    YOJIMBO_DECLARE_POOLED_MESSAGE_TYPE( TEST_BLOCK_MESSAGE, TestBlockMessage, 16 );
+    YOJIMBO_DECLARE_MESSAGE_TYPE( TEST_SERIALIZE_FAIL_ON_READ_MESSAGE, TestSerializeFailOnReadMessage );
+    YOJIMBO_DECLARE_MESSAGE_TYPE( TEST_EXHAUST_STREAM_ALLOCATOR_ON_READ_MESSAGE, TestExhaustStreamAllocatorOnReadMessage );
+    YOJIMBO_DECLARE_MESSAGE_TYPE( TEST_ALIGNED_MESSAGE, TestAlignedMessage );
+    YOJIMBO_DECLARE_MESSAGE_TYPE( TEST_SNAPSHOT_MESSAGE, TestSnapshotMessage );
+YOJIMBO_MESSAGE_FACTORY_FINISH();
+
 YOJIMBO_MESSAGE_FACTORY_START( SingleTestMessageFactory, NUM_SINGLE_TEST_MESSAGE_TYPES );
     YOJIMBO_DECLARE_MESSAGE_TYPE( SINGLE_TEST_MESSAGE, TestMessage );
 YOJIMBO_MESSAGE_FACTORY_FINISH();
@@ -242,6 +242,14 @@ void test_bits_required()
     check( bits_required( 0, 255 ) == 8 );
     check( bits_required( 0, 65535 ) == 16 );
     check( bits_required( 0, 4294967295 ) == 32 );
+
+    check( count_trailing_zeros( 1 ) == 0 );
+    check( count_trailing_zeros( 2 ) == 1 );
+    check( count_trailing_zeros( 12 ) == 2 );
+    check( count_trailing_zeros( uint64_t(1) << 31 ) == 31 );
+    check( count_trailing_zeros( uint64_t(1) << 32 ) == 32 );
+    check( count_trailing_zeros( uint64_t(1) << 63 ) == 63 );
+    check( count_trailing_zeros( UINT64_MAX ) == 0 );
 }
 
 const int MaxItems = 11;
@@ -389,6 +397,40 @@ void test_stream()
     check( readObject == writeObject );
 }
 
+void test_sequence_relative_bits()
+{
+    const uint16_t sequences[] = { 0, 1, 2, 100, 1000, 32767, 32768, 65000, 65534, 65535 };
+    const uint16_t differences[] = { 1, 2, 6, 7, 23, 24, 280, 281, 4377, 4378, 32768, 65535 };
+
+    for ( int i = 0; i < (int) ( sizeof( sequences ) / sizeof( sequences[0] ) ); ++i )
+    {
+        for ( int j = 0; j < (int) ( sizeof( differences ) / sizeof( differences[0] ) ); ++j )
+        {
+            uint16_t sequence1 = sequences[i];
+            uint16_t sequence2 = uint16_t( sequence1 + differences[j] );
+
+            MeasureStream stream( GetDefaultAllocator() );
+            serialize_sequence_relative_internal( stream, sequence1, sequence2 );
+            check( sequence_relative_bits( sequence1, sequence2 ) == stream.GetBitsProcessed() );
+        }
+    }
+
+    const uint32_t previous[] = { 0, 1, 1000, 100000 };
+    const uint32_t currentOffsets[] = { 1, 6, 7, 23, 24, 280, 281, 4377, 4378, 69914, 69915, 1000000 };
+
+    for ( int i = 0; i < (int) ( sizeof( previous ) / sizeof( previous[0] ) ); ++i )
+    {
+        for ( int j = 0; j < (int) ( sizeof( currentOffsets ) / sizeof( currentOffsets[0] ) ); ++j )
+        {
+            uint32_t current = previous[i] + currentOffsets[j];
+
+            MeasureStream stream( GetDefaultAllocator() );
+            serialize_int_relative_internal( stream, previous[i], current );
+            check( int_relative_bits( previous[i], current ) == stream.GetBitsProcessed() );
+        }
+    }
+}
+
 bool parse_address( const char string[] )
 {
     Address address( string );
@@ -754,6 +796,14 @@ void test_bit_array()
         }
     }
 
+    // find set bits from every start index
+
+    for ( int i = 0; i < Size; ++i )
+    {
+        const int expected = ( ( i + 9 ) / 10 ) * 10;
+        check( bit_array.FindFirstSetBit( i ) == ( ( expected < Size ) ? expected : -1 ) );
+    }
+
     // clear and verify all bits are zero
 
     bit_array.Clear();
@@ -762,6 +812,20 @@ void test_bit_array()
     {
         check( bit_array.GetBit(i) == 0 );
     }
+
+    check( bit_array.FindFirstSetBit() == -1 );
+
+    // find bits at word boundaries and the last bit
+
+    bit_array.SetBit( 63 );
+    bit_array.SetBit( 64 );
+    bit_array.SetBit( Size - 1 );
+
+    check( bit_array.FindFirstSetBit() == 63 );
+    check( bit_array.FindFirstSetBit( 64 ) == 64 );
+    check( bit_array.FindFirstSetBit( 65 ) == Size - 1 );
+    check( bit_array.FindFirstSetBit( Size - 1 ) == Size - 1 );
+    check( bit_array.FindFirstSetBit( Size ) == -1 );
 }
 
 struct TestSequenceData
@@ -860,6 +924,213 @@ void test_allocator_tlsf()
     free( memory );
 }
 
+void test_allocator_bump()
+{
+    const int NumBlocks = 16;
+    const int BlockSize = 100;
+    const int MemorySize = NumBlocks * 104;
+
+    BumpAllocator allocator( GetDefaultAllocator(), MemorySize );
+
+    for ( int iteration = 0; iteration < 2; ++iteration )
+    {
+        uint8_t * blockData[NumBlocks+1];
+
+        for ( int i = 0; i < NumBlocks; ++i )
+        {
+            blockData[i] = (uint8_t*) YOJIMBO_ALLOCATE( allocator, BlockSize );
+            check( blockData[i] );
+            check( ( uintptr_t( blockData[i] ) % 8 ) == 0 );
+            if ( i > 0 )
+                check( blockData[i] == blockData[i-1] + 104 );
+            memset( blockData[i], i + 10, BlockSize );
+        }
+
+        // the arena is full, so this comes from the fallback allocator
+
+        blockData[NumBlocks] = (uint8_t*) YOJIMBO_ALLOCATE( allocator, BlockSize );
+        check( blockData[NumBlocks] );
+        check( blockData[NumBlocks] < blockData[0] || blockData[NumBlocks] >= blockData[0] + MemorySize );
+        memset( blockData[NumBlocks], NumBlocks + 10, BlockSize );
+
+        for ( int i = 0; i <= NumBlocks; ++i )
+        {
+            for ( int j = 0; j < BlockSize; ++j )
+                check( blockData[i][j] == uint8_t( i + 10 ) );
+            YOJIMBO_FREE( allocator, blockData[i] );
+        }
+
+        check( allocator.GetErrorLevel() == ALLOCATOR_ERROR_NONE );
+
+        allocator.Reset();
+    }
+}
+
+void test_allocator_block()
+{
+    const int NumBlocks = 8;
+
+    BlockAllocator allocator( GetDefaultAllocator() );
+
+    check( BlockAllocator::GetSizeClassBytes( 0 ) == 64 );
+
+    for ( int iteration = 0; iteration < 2; ++iteration )
+    {
+        uint8_t * blockData[NumBlocks];
+
+        for ( int i = 0; i < NumBlocks; ++i )
+        {
+            const int blockSize = 1000 + i;
+            blockData[i] = (uint8_t*) YOJIMBO_ALLOCATE( allocator, blockSize );
+            check( blockData[i] );
+            check( ( uintptr_t( blockData[i] ) % 8 ) == 0 );
+            memset( blockData[i], i + 10, blockSize );
+        }
+
+        // 1000 bytes rounds up to the 1024 byte size class
+
+        const int sizeClass = 4;
+        check( BlockAllocator::GetSizeClassBytes( sizeClass ) == 1024 );
+
+        const BlockAllocatorStats & stats = allocator.GetStats( sizeClass );
+        check( stats.numLive == NumBlocks );
+        check( stats.maxLive == NumBlocks );
+        check( stats.numFree == 0 );
+        check( stats.numAllocated == uint64_t( NumBlocks * ( iteration + 1 ) ) );
+        check( stats.numRecycled == uint64_t( NumBlocks * iteration ) );
+
+        for ( int i = 0; i < NumBlocks; ++i )
+        {
+            for ( int j = 0; j < 1000 + i; ++j )
+                check( blockData[i][j] == uint8_t( i + 10 ) );
+            YOJIMBO_FREE( allocator, blockData[i] );
+        }
+
+        check( stats.numLive == 0 );
+        check( stats.numFree == NumBlocks );
+    }
+
+    // blocks of a different size class don't reuse these
+
+    uint8_t * block = (uint8_t*) YOJIMBO_ALLOCATE( allocator, 4000 );
+    check( block );
+    check( allocator.GetStats( 6 ).numLive == 1 );
+    check( allocator.GetStats( 6 ).numRecycled == 0 );
+    YOJIMBO_FREE( allocator, block );
+
+    allocator.Trim();
+
+    for ( int i = 0; i < BlockAllocator::GetNumSizeClasses(); ++i )
+        check( allocator.GetStats( i ).numFree == 0 );
+
+    check( allocator.GetErrorLevel() == ALLOCATOR_ERROR_NONE );
+}
+
+void test_message_factory_pooled()
+{
+    const int NumMessages = 300;
+
+    PooledTestMessageFactory messageFactory( GetDefaultAllocator() );
+
+    Message * messages[NumMessages];
+
+    for ( int iteration = 0; iteration < 2; ++iteration )
+    {
+        for ( int i = 0; i < NumMessages; ++i )
+        {
+            TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
+            check( message );
+            check( message->GetType() == TEST_MESSAGE );
+            check( message->GetRefCount() == 1 );
+            check( message->sequence == 0 );
+            message->sequence = uint16_t( i + 1 );
+            messages[i] = message;
+        }
+
+        const MessagePoolStats & stats = messageFactory.GetMessagePoolStats( TEST_MESSAGE );
+        check( stats.numLive == NumMessages );
+        check( stats.numFree == 0 );
+        check( stats.maxFree == 256 );
+        check( stats.numCreated == uint64_t( NumMessages * ( iteration + 1 ) ) );
+        check( stats.numRecycled == uint64_t( iteration * 256 ) );
+
+        for ( int i = 0; i < NumMessages; ++i )
+        {
+            messageFactory.ReleaseMessage( messages[i] );
+        }
+
+        // only pool size messages are kept for reuse. the rest go back to the allocator
+
+        check( stats.numLive == 0 );
+        check( stats.numFree == 256 );
+    }
+
+    // recycled block messages must come back without the block from their previous life
+
+    for ( int iteration = 0; iteration < 2; ++iteration )
+    {
+        BlockMessage * message = (BlockMessage*) messageFactory.CreateMessage( TEST_BLOCK_MESSAGE );
+        check( message );
+        check( message->GetBlockData() == NULL );
+        check( message->GetBlockSize() == 0 );
+        uint8_t * blockData = (uint8_t*) YOJIMBO_ALLOCATE( messageFactory.GetAllocator(), 64 );
+        message->AttachBlock( messageFactory.GetAllocator(), blockData, 64 );
+        messageFactory.ReleaseMessage( message );
+    }
+
+    check( messageFactory.GetMessagePoolStats( TEST_BLOCK_MESSAGE ).numRecycled == 1 );
+
+    // message types that are not pooled are tracked, but never recycled
+
+    Message * message = messageFactory.CreateMessage( TEST_SERIALIZE_FAIL_ON_READ_MESSAGE );
+    check( message );
+    check( messageFactory.GetMessagePoolStats( TEST_SERIALIZE_FAIL_ON_READ_MESSAGE ).numLive == 1 );
+    messageFactory.ReleaseMessage( message );
+    check( messageFactory.GetMessagePoolStats( TEST_SERIALIZE_FAIL_ON_READ_MESSAGE ).numLive == 0 );
+    check( messageFactory.GetMessagePoolStats( TEST_SERIALIZE_FAIL_ON_READ_MESSAGE ).numFree == 0 );
+}
+
+void test_message_factory_out_of_memory()
+{
+    const int MemorySize = 64 * 1024;
+
+    uint8_t * memory = (uint8_t*) malloc( MemorySize );
+
+    TLSF_Allocator allocator( memory, MemorySize );
+
+    // use up all the memory so the message factory can't allocate its pools
+
+    void * blocks[MemorySize / 16];
+    int numBlocks = 0;
+    while ( numBlocks < MemorySize / 16 )
+    {
+        void * block = YOJIMBO_ALLOCATE( allocator, 16 );
+        if ( !block )
+            break;
+        blocks[numBlocks++] = block;
+    }
+    check( numBlocks < MemorySize / 16 );
+    allocator.ClearError();
+
+    {
+        PooledTestMessageFactory messageFactory( allocator );
+
+        check( messageFactory.GetErrorLevel() == MESSAGE_FACTORY_ERROR_FAILED_TO_ALLOCATE_MESSAGE );
+
+        messageFactory.ClearErrorLevel();
+
+        check( messageFactory.CreateMessage( TEST_MESSAGE ) == NULL );
+        check( messageFactory.CreateMessage( TEST_SERIALIZE_FAIL_ON_READ_MESSAGE ) == NULL );
+        check( messageFactory.GetErrorLevel() == MESSAGE_FACTORY_ERROR_FAILED_TO_ALLOCATE_MESSAGE );
+        check( messageFactory.GetMessagePoolStats( TEST_MESSAGE ).numCreated == 0 );
+    }
+
+    for ( int i = 0; i < numBlocks; ++i )
+        YOJIMBO_FREE( allocator, blocks[i] );
+
+    free( memory );
+}
+
 void PumpConnectionUpdate( ConnectionConfig & connectionConfig, double & time, Connection & sender, Connection & receiver, uint16_t & senderSequence, uint16_t & receiverSequence, float deltaTime = 0.1f, int packetLossPercent = 90 )
 {
     uint8_t * packetData = (uint8_t*) alloca( connectionConfig.maxPacketSize );
@@ -955,6 +1226,111 @@ void test_connection_reliable_ordered_messages()
     check( numMessagesReceived == NumMessagesSent );
 }
 
+void test_connection_reliable_ordered_message_cache()
+{
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
+
+    // the second pass uses a cache too small to hold a packet worth of messages, so cached messages are evicted before they are copied
+
+    const int MessageCacheSizes[] = { 16 * 1024, 64 };
+
+    for ( int pass = 0; pass < 2; ++pass )
+    {
+        double time = 100.0;
+
+        ConnectionConfig connectionConfig;
+        connectionConfig.channel[0].messageCacheSize = MessageCacheSizes[pass];
+
+        Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+        Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+
+        // every other message contains an align, so it isn't cached and is serialized each time it is sent
+
+        const int NumMessagesSent = 64;
+
+        for ( int i = 0; i < NumMessagesSent; ++i )
+        {
+            if ( i % 2 )
+            {
+                TestAlignedMessage * message = (TestAlignedMessage*) messageFactory.CreateMessage( TEST_ALIGNED_MESSAGE );
+                check( message );
+                message->sequence = uint16_t( i );
+                for ( int j = 0; j < (int) sizeof( message->data ); ++j )
+                    message->data[j] = uint8_t( i + j );
+                sender.SendMessage( 0, message );
+            }
+            else
+            {
+                TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
+                check( message );
+                message->sequence = uint16_t( i );
+                sender.SendMessage( 0, message );
+            }
+        }
+
+        // nothing is acked, so the second packet resends every message, copying most of them from the message cache. both packets must be the same
+
+        uint8_t * firstPacketData = (uint8_t*) alloca( connectionConfig.maxPacketSize );
+        uint8_t * packetData = (uint8_t*) alloca( connectionConfig.maxPacketSize );
+
+        int firstPacketBytes = 0;
+        int packetBytes = 0;
+
+        check( sender.GeneratePacket( NULL, 0, firstPacketData, connectionConfig.maxPacketSize, firstPacketBytes ) );
+
+        time += connectionConfig.channel[0].messageResendTime;
+        sender.AdvanceTime( time );
+
+        check( sender.GeneratePacket( NULL, 1, packetData, connectionConfig.maxPacketSize, packetBytes ) );
+        check( packetBytes == firstPacketBytes );
+        check( memcmp( packetData, firstPacketData, packetBytes ) == 0 );
+
+        uint16_t senderSequence = 2;
+        uint16_t receiverSequence = 0;
+
+        int numMessagesReceived = 0;
+
+        const int NumIterations = 1000;
+
+        for ( int i = 0; i < NumIterations; ++i )
+        {
+            PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence );
+
+            while ( true )
+            {
+                Message * message = receiver.ReceiveMessage( 0 );
+                if ( !message )
+                    break;
+
+                check( message->GetId() == numMessagesReceived );
+
+                if ( numMessagesReceived % 2 )
+                {
+                    check( message->GetType() == TEST_ALIGNED_MESSAGE );
+                    TestAlignedMessage * alignedMessage = (TestAlignedMessage*) message;
+                    check( alignedMessage->sequence == uint16_t( numMessagesReceived ) );
+                    for ( int j = 0; j < (int) sizeof( alignedMessage->data ); ++j )
+                        check( alignedMessage->data[j] == uint8_t( numMessagesReceived + j ) );
+                }
+                else
+                {
+                    check( message->GetType() == TEST_MESSAGE );
+                    check( ( (TestMessage*) message )->sequence == uint16_t( numMessagesReceived ) );
+                }
+
+                ++numMessagesReceived;
+
+                messageFactory.ReleaseMessage( message );
+            }
+
+            if ( numMessagesReceived == NumMessagesSent )
+                break;
+        }
+
+        check( numMessagesReceived == NumMessagesSent );
+    }
+}
+
 void test_connection_reliable_ordered_blocks()
 {
     TestMessageFactory messageFactory( GetDefaultAllocator() );
@@ -1145,50 +1521,43 @@ void test_connection_reliable_ordered_messages_and_blocks()
     check( numMessagesReceived == NumMessagesSent );
 }
 
-void test_connection_reliable_ordered_messages_and_blocks_multiple_channels()
+void test_connection_reliable_ordered_pipelined_blocks()
 {
-    const int NumChannels = 2;
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
 
     double time = 100.0;
     
-    TestMessageFactory messageFactory( GetDefaultAllocator() );
-
     ConnectionConfig connectionConfig;
-    connectionConfig.numChannels = NumChannels;
-    connectionConfig.channel[0].type = CHANNEL_TYPE_RELIABLE_ORDERED;
-    connectionConfig.channel[0].maxMessagesPerPacket = 8;
-    connectionConfig.channel[1].type = CHANNEL_TYPE_RELIABLE_ORDERED;
-    connectionConfig.channel[1].maxMessagesPerPacket = 8;
-
+    connectionConfig.channel[0].blockFragmentSize = 256;
+    connectionConfig.channel[0].maxFragmentsPerPacket = 4;
+    connectionConfig.channel[0].maxBlocksInFlight = 4;
+    
     Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
 
     Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
 
-    const int NumMessagesSent = 32;
+    const int NumMessagesSent = 64;
 
-    for ( int channelIndex = 0; channelIndex < NumChannels; ++channelIndex )
+    for ( int i = 0; i < NumMessagesSent; ++i )
     {
-        for ( int i = 0; i < NumMessagesSent; ++i )
+        if ( rand() % 2 )
         {
-            if ( rand() % 2 )
-            {
-                TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
-                check( message );
-                message->sequence = i;
-                sender.SendMessage( channelIndex, message );
-            }
-            else
-            {
-                TestBlockMessage * message = (TestBlockMessage*) messageFactory.CreateMessage( TEST_BLOCK_MESSAGE );
-                check( message );
-                message->sequence = i;
-                const int blockSize = 1 + ( ( i * 901 ) % 3333 );
-                uint8_t * blockData = (uint8_t*) YOJIMBO_ALLOCATE( messageFactory.GetAllocator(), blockSize );
-                for ( int j = 0; j < blockSize; ++j )
-                    blockData[j] = i + j;
-                message->AttachBlock( messageFactory.GetAllocator(), blockData, blockSize );
-                sender.SendMessage( channelIndex, message );
-            }
+            TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
+            check( message );
+            message->sequence = i;
+            sender.SendMessage( 0, message );
+        }
+        else
+        {
+            TestBlockMessage * message = (TestBlockMessage*) messageFactory.CreateMessage( TEST_BLOCK_MESSAGE );
+            check( message );
+            message->sequence = i;
+            const int blockSize = 1 + ( ( i * 901 ) % 3333 );
+            uint8_t * blockData = (uint8_t*) YOJIMBO_ALLOCATE( messageFactory.GetAllocator(), blockSize );
+            for ( int j = 0; j < blockSize; ++j )
+                blockData[j] = i + j;
+            message->AttachBlock( messageFactory.GetAllocator(), blockData, blockSize );
+            sender.SendMessage( 0, message );
         }
     }
 
@@ -1198,31 +1567,149 @@ void test_connection_reliable_ordered_messages_and_blocks_multiple_channels()
     Address senderAddress( "::1", SenderPort );
     Address receiverAddress( "::1", ReceiverPort );
 
-    const int NumIterations = 10000;
-
-    int numMessagesReceived[NumChannels];
-    memset( numMessagesReceived, 0, sizeof( numMessagesReceived ) );
+    int numMessagesReceived = 0;
 
     uint16_t senderSequence = 0;
     uint16_t receiverSequence = 0;
 
+    const int NumIterations = 10000;
+
     for ( int i = 0; i < NumIterations; ++i )
     {
         PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence );
 
-        for ( int channelIndex = 0; channelIndex < NumChannels; ++channelIndex )
+        while ( true )
         {
-            while ( true )
-            {
-                Message * message = receiver.ReceiveMessage( channelIndex );
-                if ( !message )
-                    break;
+            Message * message = receiver.ReceiveMessage( 0 );
+            if ( !message )
+                break;
 
-                check( message->GetId() == (int) numMessagesReceived[channelIndex] );
+            check( message->GetId() == (int) numMessagesReceived );
 
-                switch ( message->GetType() )
+            switch ( message->GetType() )
+            {
+                case TEST_MESSAGE:
                 {
-                    case TEST_MESSAGE:
+                    TestMessage * testMessage = (TestMessage*) message;
+
+                    check( testMessage->sequence == uint16_t( numMessagesReceived ) );
+
+                    ++numMessagesReceived;
+                }
+                break;
+
+                case TEST_BLOCK_MESSAGE:
+                {
+                    TestBlockMessage * blockMessage = (TestBlockMessage*) message;
+
+                    check( blockMessage->sequence == uint16_t( numMessagesReceived ) );
+
+                    const int blockSize = blockMessage->GetBlockSize();
+
+                    check( blockSize == 1 + ( ( numMessagesReceived * 901 ) % 3333 ) );
+        
+                    const uint8_t * blockData = blockMessage->GetBlockData();
+
+                    check( blockData );
+
+                    for ( int j = 0; j < blockSize; ++j )
+                    {
+                        check( blockData[j] == uint8_t( numMessagesReceived + j ) );
+                    }
+
+                    ++numMessagesReceived;
+                }
+                break;
+            }
+
+            messageFactory.ReleaseMessage( message );
+        }
+
+        if ( numMessagesReceived == NumMessagesSent )
+            break;
+    }
+
+    check( numMessagesReceived == NumMessagesSent );
+}
+
+void test_connection_reliable_ordered_messages_and_blocks_multiple_channels()
+{
+    const int NumChannels = 2;
+
+    double time = 100.0;
+    
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
+
+    ConnectionConfig connectionConfig;
+    connectionConfig.numChannels = NumChannels;
+    connectionConfig.channel[0].type = CHANNEL_TYPE_RELIABLE_ORDERED;
+    connectionConfig.channel[0].maxMessagesPerPacket = 8;
+    connectionConfig.channel[1].type = CHANNEL_TYPE_RELIABLE_ORDERED;
+    connectionConfig.channel[1].maxMessagesPerPacket = 8;
+
+    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+
+    Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+
+    const int NumMessagesSent = 32;
+
+    for ( int channelIndex = 0; channelIndex < NumChannels; ++channelIndex )
+    {
+        for ( int i = 0; i < NumMessagesSent; ++i )
+        {
+            if ( rand() % 2 )
+            {
+                TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
+                check( message );
+                message->sequence = i;
+                sender.SendMessage( channelIndex, message );
+            }
+            else
+            {
+                TestBlockMessage * message = (TestBlockMessage*) messageFactory.CreateMessage( TEST_BLOCK_MESSAGE );
+                check( message );
+                message->sequence = i;
+                const int blockSize = 1 + ( ( i * 901 ) % 3333 );
+                uint8_t * blockData = (uint8_t*) YOJIMBO_ALLOCATE( messageFactory.GetAllocator(), blockSize );
+                for ( int j = 0; j < blockSize; ++j )
+                    blockData[j] = i + j;
+                message->AttachBlock( messageFactory.GetAllocator(), blockData, blockSize );
+                sender.SendMessage( channelIndex, message );
+            }
+        }
+    }
+
+    const int SenderPort = 10000;
+    const int ReceiverPort = 10001;
+
+    Address senderAddress( "::1", SenderPort );
+    Address receiverAddress( "::1", ReceiverPort );
+
+    const int NumIterations = 10000;
+
+    int numMessagesReceived[NumChannels];
+    memset( numMessagesReceived, 0, sizeof( numMessagesReceived ) );
+
+    uint16_t senderSequence = 0;
+    uint16_t receiverSequence = 0;
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence );
+
+        for ( int channelIndex = 0; channelIndex < NumChannels; ++channelIndex )
+        {
+            while ( true )
+            {
+                Message * message = receiver.ReceiveMessage( channelIndex );
+                if ( !message )
+                    break;
+
+                check( message->GetId() == (int) numMessagesReceived[channelIndex] );
+
+                switch ( message->GetType() )
+                {
+                    case TEST_MESSAGE:
                     {
                         TestMessage * testMessage = (TestMessage*) message;
 
@@ -1281,7 +1768,193 @@ void test_connection_reliable_ordered_messages_and_blocks_multiple_channels()
     }
 }
 
-void test_connection_unreliable_unordered_messages()
+void test_reliable_ordered_channel_resend_queue()
+{
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
+
+    double time = 100.0;
+
+    ChannelConfig channelConfig;
+
+    ReliableOrderedChannel channel( GetDefaultAllocator(), messageFactory, channelConfig, 0, time );
+
+    const int NumMessagesSent = 32;
+
+    for ( int i = 0; i < NumMessagesSent; ++i )
+    {
+        TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
+        check( message );
+        message->sequence = i;
+        channel.SendMessage( message, NULL );
+    }
+
+    uint16_t * messageIds = (uint16_t*) alloca( sizeof( uint16_t ) * channelConfig.maxMessagesPerPacket );
+
+    const int availableBits = 8 * 1024 * 8;
+
+    int numMessageIds = 0;
+
+    // all messages go out in the first packet
+
+    channel.GetMessagesToSend( messageIds, numMessageIds, availableBits, NULL );
+
+    check( numMessageIds == NumMessagesSent );
+    for ( int i = 0; i < numMessageIds; ++i )
+        check( messageIds[i] == i );
+
+    // nothing is sent again until the resend time has passed
+
+    channel.GetMessagesToSend( messageIds, numMessageIds, availableBits, NULL );
+
+    check( numMessageIds == 0 );
+
+    // ack the even messages, then resend. only the odd messages should be resent, in order
+
+    uint16_t evenMessageIds[NumMessagesSent/2];
+    for ( int i = 0; i < NumMessagesSent / 2; ++i )
+        evenMessageIds[i] = uint16_t( i * 2 );
+
+    channel.AddMessagePacketEntry( evenMessageIds, NumMessagesSent / 2, 0 );
+    channel.ProcessAck( 0 );
+
+    time += channelConfig.messageResendTime;
+    channel.AdvanceTime( time );
+
+    channel.GetMessagesToSend( messageIds, numMessageIds, availableBits, NULL );
+
+    check( numMessageIds == NumMessagesSent / 2 );
+    for ( int i = 0; i < numMessageIds; ++i )
+        check( messageIds[i] == i * 2 + 1 );
+
+    // new messages are sent right away, while the odd messages wait for their resend time
+
+    for ( int i = 0; i < 4; ++i )
+    {
+        TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
+        check( message );
+        message->sequence = NumMessagesSent + i;
+        channel.SendMessage( message, NULL );
+    }
+
+    time += channelConfig.messageResendTime * 0.5;
+    channel.AdvanceTime( time );
+
+    channel.GetMessagesToSend( messageIds, numMessageIds, availableBits, NULL );
+
+    check( numMessageIds == 4 );
+    for ( int i = 0; i < numMessageIds; ++i )
+        check( messageIds[i] == NumMessagesSent + i );
+
+    // once the resend time passes for both, the odd messages and the new messages are resent together in id order
+
+    time += channelConfig.messageResendTime;
+    channel.AdvanceTime( time );
+
+    channel.GetMessagesToSend( messageIds, numMessageIds, availableBits, NULL );
+
+    check( numMessageIds == NumMessagesSent / 2 + 4 );
+    for ( int i = 0; i < NumMessagesSent / 2; ++i )
+        check( messageIds[i] == i * 2 + 1 );
+    for ( int i = 0; i < 4; ++i )
+        check( messageIds[NumMessagesSent/2+i] == NumMessagesSent + i );
+}
+
+void test_reliable_ordered_channel_adaptive_resend()
+{
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
+
+    double time = 100.0;
+
+    ChannelConfig channelConfig;
+    channelConfig.adaptiveResendTime = true;
+    channelConfig.fastRetransmitPackets = 3;
+
+    ReliableOrderedChannel channel( GetDefaultAllocator(), messageFactory, channelConfig, 0, time );
+
+    uint16_t * messageIds = (uint16_t*) alloca( sizeof( uint16_t ) * channelConfig.maxMessagesPerPacket );
+
+    const int availableBits = 8 * 1024 * 8;
+
+    int numMessageIds = 0;
+
+    uint16_t sequence = 0;
+
+    // the first ack has a round trip time of 20ms, so the resend time becomes 20ms + 4 * 10ms
+
+    TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
+    check( message );
+    channel.SendMessage( message, NULL );
+
+    channel.GetMessagesToSend( messageIds, numMessageIds, availableBits, NULL );
+    check( numMessageIds == 1 );
+    channel.AddMessagePacketEntry( messageIds, numMessageIds, sequence++ );
+
+    time += 0.02;
+    channel.AdvanceTime( time );
+    channel.ProcessAck( 0 );
+
+    message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
+    check( message );
+    channel.SendMessage( message, NULL );
+
+    channel.GetMessagesToSend( messageIds, numMessageIds, availableBits, NULL );
+    check( numMessageIds == 1 );
+    check( messageIds[0] == 1 );
+    channel.AddMessagePacketEntry( messageIds, numMessageIds, sequence++ );
+
+    time += 0.05;
+    channel.AdvanceTime( time );
+
+    channel.GetMessagesToSend( messageIds, numMessageIds, availableBits, NULL );
+    check( numMessageIds == 0 );
+
+    // resent well before the fixed message resend time
+
+    time += 0.02;
+    channel.AdvanceTime( time );
+
+    check( 0.07 < channelConfig.messageResendTime );
+
+    channel.GetMessagesToSend( messageIds, numMessageIds, availableBits, NULL );
+    check( numMessageIds == 1 );
+    check( messageIds[0] == 1 );
+    channel.AddMessagePacketEntry( messageIds, numMessageIds, sequence++ );
+
+    // send messages 2, 3, 4 and 5 in a packet each
+
+    for ( int i = 0; i < 4; ++i )
+    {
+        message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
+        check( message );
+        channel.SendMessage( message, NULL );
+
+        channel.GetMessagesToSend( messageIds, numMessageIds, availableBits, NULL );
+        check( numMessageIds == 1 );
+        check( messageIds[0] == 2 + i );
+        channel.AddMessagePacketEntry( messageIds, numMessageIds, sequence++ );
+    }
+
+    // acking the last three packets means the packets with the resent message 1 and message 2 were lost. both are resent straight away
+
+    time += 0.01;
+    channel.AdvanceTime( time );
+    channel.ProcessAck( 4 );
+    channel.ProcessAck( 5 );
+    channel.ProcessAck( 6 );
+
+    channel.GetMessagesToSend( messageIds, numMessageIds, availableBits, NULL );
+    check( numMessageIds == 2 );
+    check( messageIds[0] == 1 );
+    check( messageIds[1] == 2 );
+    channel.AddMessagePacketEntry( messageIds, numMessageIds, sequence++ );
+
+    // only once
+
+    channel.GetMessagesToSend( messageIds, numMessageIds, availableBits, NULL );
+    check( numMessageIds == 0 );
+}
+
+void test_connection_reliable_ordered_keys()
 {
     TestMessageFactory messageFactory( GetDefaultAllocator() );
 
@@ -1289,37 +1962,70 @@ void test_connection_unreliable_unordered_messages()
 
     ConnectionConfig connectionConfig;
     connectionConfig.numChannels = 1;
-    connectionConfig.channel[0].type = CHANNEL_TYPE_UNRELIABLE_UNORDERED;
+    connectionConfig.channel[0].numOrderingKeys = 4;
 
     Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
     Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
 
-    const int SenderPort = 10000;
-    const int ReceiverPort = 10001;
+    // the packet with message 0 (key 0) is lost. message 1 (key 1) must be delivered straight away, but message 2 (key 0) must wait for message 0
 
-    Address senderAddress( "::1", SenderPort );
-    Address receiverAddress( "::1", ReceiverPort );
+    uint8_t * packetData = (uint8_t*) alloca( connectionConfig.maxPacketSize );
+    int packetBytes = 0;
 
-    const int NumIterations = 256;
+    uint16_t senderSequence = 0;
+    uint16_t receiverSequence = 0;
 
-    const int NumMessagesSent = 16;
+    const uint32_t keys[] = { 0, 1, 0 };
 
-    for ( int j = 0; j < NumMessagesSent; ++j )
+    for ( int i = 0; i < 3; ++i )
     {
         TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
         check( message );
-        message->sequence = j;
+        message->sequence = i;
+        message->SetOrderingKey( keys[i] );
         sender.SendMessage( 0, message );
+
+        check( sender.GeneratePacket( NULL, senderSequence, packetData, connectionConfig.maxPacketSize, packetBytes ) );
+        if ( i > 0 )
+            check( receiver.ProcessPacket( NULL, senderSequence, packetData, packetBytes ) );
+        senderSequence++;
     }
 
-    int numMessagesReceived = 0;
+    Message * message = receiver.ReceiveMessage( 0 );
+    check( message );
+    check( message->GetId() == 1 );
+    messageFactory.ReleaseMessage( message );
+    check( receiver.ReceiveMessage( 0 ) == NULL );
 
-    uint16_t senderSequence = 0;
-    uint16_t receiverSequence = 0;
+    // send more messages with different keys under heavy packet loss. messages must arrive exactly once, and in order for each key
+
+    const int NumMessagesSent = 64;
+    const int NumKeys = 6;
+
+    for ( int i = 3; i < NumMessagesSent; ++i )
+    {
+        TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
+        check( message );
+        message->sequence = i;
+        message->SetOrderingKey( i % NumKeys );
+        sender.SendMessage( 0, message );
+    }
+
+    bool received[NumMessagesSent];
+    memset( received, 0, sizeof( received ) );
+    received[1] = true;
+
+    int lastMessageIdPerKey[NumKeys];
+    for ( int i = 0; i < NumKeys; ++i )
+        lastMessageIdPerKey[i] = -1;
+
+    int numMessagesReceived = 1;
+
+    const int NumIterations = 10000;
 
     for ( int i = 0; i < NumIterations; ++i )
     {
-        PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence, 0.1f, 0 );
+        PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence );
 
         while ( true )
         {
@@ -1327,11 +2033,21 @@ void test_connection_unreliable_unordered_messages()
             if ( !message )
                 break;
 
+            const int messageId = message->GetId();
+
             check( message->GetType() == TEST_MESSAGE );
+            check( messageId < NumMessagesSent );
+            check( ((TestMessage*)message)->sequence == messageId );
+            check( !received[messageId] );
 
-            TestMessage * testMessage = (TestMessage*) message;
+            // messages 0 and 2 were sent with key 0. every other message was sent with key messageId % NumKeys, which maps onto the same channel key
 
-            check( testMessage->sequence == uint16_t( numMessagesReceived ) );
+            const int key = ( messageId < 3 ? keys[messageId] : messageId % NumKeys ) % connectionConfig.channel[0].numOrderingKeys;
+
+            check( messageId > lastMessageIdPerKey[key] );
+            lastMessageIdPerKey[key] = messageId;
+
+            received[messageId] = true;
 
             ++numMessagesReceived;
 
@@ -1343,49 +2059,53 @@ void test_connection_unreliable_unordered_messages()
     }
 
     check( numMessagesReceived == NumMessagesSent );
+    check( receiver.GetErrorLevel() == CONNECTION_ERROR_NONE );
 }
 
-void test_connection_unreliable_unordered_blocks()
+void test_connection_reliable_latest_value()
 {
     TestMessageFactory messageFactory( GetDefaultAllocator() );
 
     double time = 100.0;
-    
+
     ConnectionConfig connectionConfig;
     connectionConfig.numChannels = 1;
-    connectionConfig.channel[0].type = CHANNEL_TYPE_UNRELIABLE_UNORDERED;
+    connectionConfig.channel[0].type = CHANNEL_TYPE_RELIABLE_LATEST_VALUE;
 
     Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
-
     Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
 
-    const int SenderPort = 10000;
-    const int ReceiverPort = 10001;
+    uint8_t * packetData = (uint8_t*) alloca( connectionConfig.maxPacketSize );
+    int packetBytes = 0;
 
-    Address senderAddress( "::1", SenderPort );
-    Address receiverAddress( "::1", ReceiverPort );
+    uint16_t senderSequence = 0;
+    uint16_t receiverSequence = 0;
 
-    const int NumIterations = 256;
+    // value 2 replaces value 0 before it is sent. value 3 is lost, then replaced by value 4 while it is still unacked
 
-    const int NumMessagesSent = 8;
+    const uint32_t keys[] = { 0, 1, 0, 2, 2 };
 
-    for ( int j = 0; j < NumMessagesSent; ++j )
+    for ( int i = 0; i < 5; ++i )
     {
-        TestBlockMessage * message = (TestBlockMessage*) messageFactory.CreateMessage( TEST_BLOCK_MESSAGE );
+        TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
         check( message );
-        message->sequence = j;
-        const int blockSize = 1 + ( j * 7 );
-        uint8_t * blockData = (uint8_t*) YOJIMBO_ALLOCATE( messageFactory.GetAllocator(), blockSize );
-        for ( int k = 0; k < blockSize; ++k )
-            blockData[k] = j + k;
-        message->AttachBlock( messageFactory.GetAllocator(), blockData, blockSize );
+        message->sequence = i;
+        message->SetOrderingKey( keys[i] );
         sender.SendMessage( 0, message );
+
+        if ( i == 3 )
+        {
+            check( sender.GeneratePacket( NULL, senderSequence, packetData, connectionConfig.maxPacketSize, packetBytes ) );
+            senderSequence++;
+        }
     }
 
-    int numMessagesReceived = 0;
+    const int expectedValues[] = { 2, 1, 4 };
+    const int NumExpectedValues = sizeof( expectedValues ) / sizeof( int );
 
-    uint16_t senderSequence = 0;
-    uint16_t receiverSequence = 0;
+    int numValuesReceived = 0;
+
+    const int NumIterations = 1000;
 
     for ( int i = 0; i < NumIterations; ++i )
     {
@@ -1397,388 +2117,2330 @@ void test_connection_unreliable_unordered_blocks()
             if ( !message )
                 break;
 
-            check( message->GetType() == TEST_BLOCK_MESSAGE );
+            check( message->GetType() == TEST_MESSAGE );
+            check( numValuesReceived < NumExpectedValues );
+            check( ((TestMessage*)message)->sequence == expectedValues[numValuesReceived] );
 
-            TestBlockMessage * blockMessage = (TestBlockMessage*) message;
+            ++numValuesReceived;
 
-            check( blockMessage->sequence == uint16_t( numMessagesReceived ) );
+            messageFactory.ReleaseMessage( message );
+        }
 
-            const int blockSize = blockMessage->GetBlockSize();
+        if ( numValuesReceived == NumExpectedValues )
+            break;
+    }
 
-            check( blockSize == 1 + ( numMessagesReceived * 7 ) );
+    check( numValuesReceived == NumExpectedValues );
 
-            const uint8_t * blockData = blockMessage->GetBlockData();
+    // keep updating a few keys under heavy packet loss. values for each key must arrive in order, and the latest value for each key must arrive
 
-            check( blockData );
+    const int NumKeys = 4;
+    const int NumValuesSent = 256;
 
-            for ( int j = 0; j < blockSize; ++j )
-            {
-                check( blockData[j] == uint8_t( numMessagesReceived + j ) );
-            }
+    int lastValueSent[NumKeys];
+    int lastValueReceived[NumKeys];
+    for ( int i = 0; i < NumKeys; ++i )
+    {
+        lastValueSent[i] = -1;
+        lastValueReceived[i] = -1;
+    }
 
-            ++numMessagesReceived;
+    int valueKeys[NumValuesSent];
+    int numValuesSent = 0;
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        for ( int j = 0; j < 4 && numValuesSent < NumValuesSent; ++j )
+        {
+            TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
+            check( message );
+            const int key = random_int( 0, NumKeys - 1 );
+            message->sequence = numValuesSent;
+            message->SetOrderingKey( key );
+            sender.SendMessage( 0, message );
+            valueKeys[numValuesSent] = key;
+            lastValueSent[key] = numValuesSent++;
+        }
+
+        PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence );
+
+        while ( true )
+        {
+            Message * message = receiver.ReceiveMessage( 0 );
+            if ( !message )
+                break;
+
+            check( message->GetType() == TEST_MESSAGE );
+
+            // the key is not sent over the network, so look up the key the value was sent with
+
+            const int value = ((TestMessage*)message)->sequence;
+
+            check( value < numValuesSent );
+
+            const int key = valueKeys[value];
+
+            check( value > lastValueReceived[key] );
+            lastValueReceived[key] = value;
 
             messageFactory.ReleaseMessage( message );
         }
 
-        if ( numMessagesReceived == NumMessagesSent )
+        if ( numValuesSent == NumValuesSent && memcmp( lastValueSent, lastValueReceived, sizeof( lastValueSent ) ) == 0 )
             break;
     }
 
-    check( numMessagesReceived == NumMessagesSent );
+    for ( int i = 0; i < NumKeys; ++i )
+        check( lastValueReceived[i] == lastValueSent[i] );
+
+    check( receiver.GetErrorLevel() == CONNECTION_ERROR_NONE );
 }
 
-void PumpClientServerUpdate( double & time, Client ** client, int numClients, Server ** server, int numServers, float deltaTime = 0.1f )
+void test_connection_reliable_latest_value_many_keys()
 {
-    for ( int i = 0; i < numClients; ++i )
-        client[i]->SendPackets();
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
 
-    for ( int i = 0; i < numServers; ++i )
-        server[i]->SendPackets();
+    double time = 100.0;
 
-    for ( int i = 0; i < numClients; ++i )
-        client[i]->ReceivePackets();
+    ConnectionConfig connectionConfig;
+    connectionConfig.numChannels = 1;
+    connectionConfig.channel[0].type = CHANNEL_TYPE_RELIABLE_LATEST_VALUE;
 
-    for ( int i = 0; i < numServers; ++i )
-        server[i]->ReceivePackets();
+    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+    Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
 
-    time += deltaTime;
+    uint16_t senderSequence = 0;
+    uint16_t receiverSequence = 0;
 
-    for ( int i = 0; i < numClients; ++i )
-        client[i]->AdvanceTime( time );
+    // send a value for so many keys that they collide in the latest-value index, then replace every value while the first values 
+    // are being acked in random order. acked keys are removed from the middle of probe sequences, and the keys after them must still be found
 
-    for ( int i = 0; i < numServers; ++i )
-        server[i]->AdvanceTime( time );
+    const int NumKeys = connectionConfig.channel[0].messageSendQueueSize / 2;
+    const int NumRounds = 2;
+    const int NumValuesSent = NumKeys * NumRounds;
 
-    yojimbo_sleep( 0.0f );
-}
+    int * lastValueReceived = (int*) alloca( sizeof( int ) * NumKeys );
+    for ( int i = 0; i < NumKeys; ++i )
+        lastValueReceived[i] = -1;
 
-void SendClientToServerMessages( Client & client, int numMessagesToSend, int channelIndex = 0 )
-{
-    for ( int i = 0; i < numMessagesToSend; ++i )
-    {
-        if ( !client.CanSendMessage( channelIndex ) )
-            break;
+    int numValuesSent = 0;
 
-        if ( rand() % 10 )
+    for ( int round = 0; round < NumRounds; ++round )
+    {
+        for ( int i = 0; i < NumKeys; ++i )
         {
-            TestMessage * message = (TestMessage*) client.CreateMessage( TEST_MESSAGE );
+            TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
             check( message );
-            message->sequence = i;
-            client.SendMessage( channelIndex, message );
+            message->sequence = uint16_t( numValuesSent++ );
+            message->SetOrderingKey( uint32_t( i ) << 24 | uint32_t( i ) );
+            sender.SendMessage( 0, message );
+
+            if ( i % 64 == 63 )
+                PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence, 0.1f, 50 );
         }
-        else
+    }
+
+    const int NumIterations = 1000;
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence, 0.1f, 50 );
+
+        while ( true )
         {
-            TestBlockMessage * message = (TestBlockMessage*) client.CreateMessage( TEST_BLOCK_MESSAGE );
-            check( message );
-            message->sequence = i;
-            const int blockSize = 1 + ( ( i * 901 ) % 1001 );
-            uint8_t * blockData = client.AllocateBlock( blockSize );
-            check( blockData );
-            for ( int j = 0; j < blockSize; ++j )
-                blockData[j] = i + j;
-            client.AttachBlockToMessage( message, blockData, blockSize );
-            client.SendMessage( channelIndex, message );
+            Message * message = receiver.ReceiveMessage( 0 );
+            if ( !message )
+                break;
+
+            // values are sent key by key, so the key is the value modulo the number of keys
+
+            const int value = ((TestMessage*)message)->sequence;
+            check( value < NumValuesSent );
+
+            const int key = value % NumKeys;
+            check( value > lastValueReceived[key] );
+            lastValueReceived[key] = value;
+
+            messageFactory.ReleaseMessage( message );
         }
+
+        bool done = true;
+        for ( int j = 0; j < NumKeys; ++j )
+            done = done && lastValueReceived[j] == NumValuesSent - NumKeys + j;
+
+        if ( done )
+            break;
     }
+
+    for ( int i = 0; i < NumKeys; ++i )
+        check( lastValueReceived[i] == NumValuesSent - NumKeys + i );
+
+    check( sender.GetErrorLevel() == CONNECTION_ERROR_NONE );
+    check( receiver.GetErrorLevel() == CONNECTION_ERROR_NONE );
 }
 
-void SendServerToClientMessages( Server & server, int clientIndex, int numMessagesToSend, int channelIndex = 0 )
+void test_connection_channel_weights()
 {
-    for ( int i = 0; i < numMessagesToSend; ++i )
-    {
-        if ( !server.CanSendMessage( clientIndex, channelIndex ) )
-            break;
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
 
-        if ( rand() % 10 )
+    double time = 100.0;
+
+    ConnectionConfig connectionConfig;
+    connectionConfig.maxPacketSize = 256;
+    connectionConfig.numChannels = 2;
+    connectionConfig.channel[0].type = CHANNEL_TYPE_RELIABLE_ORDERED;
+    connectionConfig.channel[0].weight = 1.0f;
+    connectionConfig.channel[1].type = CHANNEL_TYPE_UNRELIABLE_UNORDERED;
+    connectionConfig.channel[1].weight = 3.0f;
+
+    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+    Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+
+    // both channels have more messages than fit in a packet. without weights the reliable channel would fill the whole packet
+
+    const int NumMessagesSent = 256;
+
+    for ( int channelIndex = 0; channelIndex < connectionConfig.numChannels; ++channelIndex )
+    {
+        for ( int i = 0; i < NumMessagesSent; ++i )
         {
-            TestMessage * message = (TestMessage*) server.CreateMessage( clientIndex, TEST_MESSAGE );
+            TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
             check( message );
             message->sequence = i;
-            server.SendMessage( clientIndex, channelIndex, message );
+            sender.SendMessage( channelIndex, message );
         }
-        else
+    }
+
+    uint8_t * packetData = (uint8_t*) alloca( connectionConfig.maxPacketSize );
+    int packetBytes = 0;
+
+    check( sender.GeneratePacket( NULL, 0, packetData, connectionConfig.maxPacketSize, packetBytes ) );
+    check( receiver.ProcessPacket( NULL, 0, packetData, packetBytes ) );
+
+    int numMessagesReceived[2] = { 0, 0 };
+
+    for ( int channelIndex = 0; channelIndex < connectionConfig.numChannels; ++channelIndex )
+    {
+        while ( true )
         {
-            TestBlockMessage * message = (TestBlockMessage*) server.CreateMessage( clientIndex, TEST_BLOCK_MESSAGE );
-            check( message );
-            message->sequence = i;
-            const int blockSize = 1 + ( ( i * 901 ) % 1001 );
-            uint8_t * blockData = server.AllocateBlock( clientIndex, blockSize );
-            check( blockData );
-            for ( int j = 0; j < blockSize; ++j )
-                blockData[j] = i + j;
-            server.AttachBlockToMessage( clientIndex, message, blockData, blockSize );
-            server.SendMessage( clientIndex, channelIndex, message );
+            Message * message = receiver.ReceiveMessage( channelIndex );
+            if ( !message )
+                break;
+            check( message->GetType() == TEST_MESSAGE );
+            numMessagesReceived[channelIndex]++;
+            messageFactory.ReleaseMessage( message );
         }
     }
+
+    check( numMessagesReceived[0] > 0 );
+    check( numMessagesReceived[0] < NumMessagesSent );
+    check( numMessagesReceived[1] >= 2 * numMessagesReceived[0] );
 }
 
-void ProcessServerToClientMessages( Client & client, int & numMessagesReceivedFromServer )
+void test_connection_channel_weights_blocks()
 {
-    while ( true )
-    {
-        Message * message = client.ReceiveMessage( 0 );
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
 
-        if ( !message )
-            break;
+    double time = 100.0;
 
-        check( message->GetId() == (int) numMessagesReceivedFromServer );
-        
-        switch ( message->GetType() )
-        {
-            case TEST_MESSAGE:
-            {
-                TestMessage * testMessage = (TestMessage*) message;
-                check( !message->IsBlockMessage() );
-                check( testMessage->sequence == uint16_t( numMessagesReceivedFromServer ) );
-                ++numMessagesReceivedFromServer;
-            }
-            break;
+    ConnectionConfig connectionConfig;
+    connectionConfig.maxPacketSize = 1024;
+    connectionConfig.numChannels = 2;
+    connectionConfig.channel[0].type = CHANNEL_TYPE_RELIABLE_ORDERED;
+    connectionConfig.channel[0].weight = 1.0f;
+    connectionConfig.channel[0].blockFragmentSize = 256;
+    connectionConfig.channel[0].maxFragmentsPerPacket = 4;
+    connectionConfig.channel[1].type = CHANNEL_TYPE_UNRELIABLE_UNORDERED;
+    connectionConfig.channel[1].weight = 1.0f;
 
-            case TEST_BLOCK_MESSAGE:
-            {
-                check( message->IsBlockMessage() );
-                TestBlockMessage * blockMessage = (TestBlockMessage*) message;
-                check( blockMessage->sequence == uint16_t( numMessagesReceivedFromServer ) );
-                const int blockSize = blockMessage->GetBlockSize();
-                check( blockSize == 1 + ( ( numMessagesReceivedFromServer * 901 ) % 1001 ) );
-                const uint8_t * blockData = blockMessage->GetBlockData();
-                check( blockData );
-                for ( int j = 0; j < blockSize; ++j )
-                {
-                    check( blockData[j] == uint8_t( numMessagesReceivedFromServer + j ) );
-                }
-                ++numMessagesReceivedFromServer;
-            }
-            break;
-        }
+    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+    Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
 
-        client.ReleaseMessage( message );
+    uint8_t * packetData = (uint8_t*) alloca( connectionConfig.maxPacketSize );
+    int packetBytes = 0;
+
+    uint16_t senderSequence = 0;
+    uint16_t receiverSequence = 0;
+
+    // lose every packet of a block, then keep generating packets while none of its fragments are due for resend.
+    // the block channel has data in flight, but nothing it could send. that must not build up a deficit, otherwise
+    // the block channel takes the whole packet once the fragments are due, and the unreliable message gets dropped
+
+    int numBlocksSent = 0;
+    int numBlocksReceived = 0;
+
+    {
+        TestBlockMessage * blockMessage = (TestBlockMessage*) messageFactory.CreateMessage( TEST_BLOCK_MESSAGE );
+        check( blockMessage );
+        blockMessage->sequence = uint16_t( numBlocksSent );
+        const int blockSize = 2048;
+        uint8_t * blockData = (uint8_t*) YOJIMBO_ALLOCATE( messageFactory.GetAllocator(), blockSize );
+        check( blockData );
+        memset( blockData, numBlocksSent, blockSize );
+        blockMessage->AttachBlock( messageFactory.GetAllocator(), blockData, blockSize );
+        sender.SendMessage( 0, blockMessage );
+        numBlocksSent++;
     }
-}
 
-void ProcessClientToServerMessages( Server & server, int clientIndex, int & numMessagesReceivedFromClient )
-{
-    while ( true )
+    for ( int i = 0; i < 8; ++i )
     {
-        Message * message = server.ReceiveMessage( clientIndex, 0 );
+        check( sender.GeneratePacket( NULL, senderSequence++, packetData, connectionConfig.maxPacketSize, packetBytes ) );
+        time += 0.01;
+        sender.AdvanceTime( time );
+        receiver.AdvanceTime( time );
+    }
 
-        if ( !message )
-            break;
+    time += connectionConfig.channel[0].blockFragmentResendTime;
+    sender.AdvanceTime( time );
+    receiver.AdvanceTime( time );
 
-        check( message->GetId() == (int) numMessagesReceivedFromClient );
+    {
+        TestBlockMessage * message = (TestBlockMessage*) messageFactory.CreateMessage( TEST_BLOCK_MESSAGE );
+        check( message );
+        message->sequence = 0;
+        const int blockSize = 256;
+        uint8_t * blockData = (uint8_t*) YOJIMBO_ALLOCATE( messageFactory.GetAllocator(), blockSize );
+        check( blockData );
+        memset( blockData, 0, blockSize );
+        message->AttachBlock( messageFactory.GetAllocator(), blockData, blockSize );
+        sender.SendMessage( 1, message );
 
-        switch ( message->GetType() )
-        {
-            case TEST_MESSAGE:
-            {
-                check( !message->IsBlockMessage() );
-                TestMessage * testMessage = (TestMessage*) message;
-                check( testMessage->sequence == uint16_t( numMessagesReceivedFromClient ) );
-                ++numMessagesReceivedFromClient;
-            }
-            break;
+        check( sender.GeneratePacket( NULL, senderSequence, packetData, connectionConfig.maxPacketSize, packetBytes ) );
+        check( receiver.ProcessPacket( NULL, senderSequence, packetData, packetBytes ) );
+        sender.ProcessAcks( &senderSequence, 1 );
+        senderSequence++;
+
+        Message * receivedMessage = receiver.ReceiveMessage( 1 );
+        check( receivedMessage );
+        messageFactory.ReleaseMessage( receivedMessage );
+    }
+
+    // keep the block channel busy under packet loss, while sending one unreliable message per-packet. every packet that arrives must carry the unreliable message
+
+    const int NumIterations = 1000;
+
+    int numPacketsReceived = 0;
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        if ( sender.CanSendMessage( 0 ) )
+        {
+            TestBlockMessage * blockMessage = (TestBlockMessage*) messageFactory.CreateMessage( TEST_BLOCK_MESSAGE );
+            check( blockMessage );
+            blockMessage->sequence = uint16_t( numBlocksSent );
+            const int blockSize = 2048;
+            uint8_t * blockData = (uint8_t*) YOJIMBO_ALLOCATE( messageFactory.GetAllocator(), blockSize );
+            check( blockData );
+            memset( blockData, numBlocksSent, blockSize );
+            blockMessage->AttachBlock( messageFactory.GetAllocator(), blockData, blockSize );
+            sender.SendMessage( 0, blockMessage );
+            numBlocksSent++;
+        }
+
+        TestBlockMessage * message = (TestBlockMessage*) messageFactory.CreateMessage( TEST_BLOCK_MESSAGE );
+        check( message );
+        message->sequence = uint16_t( i );
+        const int blockSize = 256;
+        uint8_t * blockData = (uint8_t*) YOJIMBO_ALLOCATE( messageFactory.GetAllocator(), blockSize );
+        check( blockData );
+        memset( blockData, i, blockSize );
+        message->AttachBlock( messageFactory.GetAllocator(), blockData, blockSize );
+        sender.SendMessage( 1, message );
+
+        check( sender.GeneratePacket( NULL, senderSequence, packetData, connectionConfig.maxPacketSize, packetBytes ) );
+
+        if ( random_int( 0, 100 ) >= 50 )
+        {
+            check( receiver.ProcessPacket( NULL, senderSequence, packetData, packetBytes ) );
+            sender.ProcessAcks( &senderSequence, 1 );
+            numPacketsReceived++;
+
+            Message * receivedMessage = receiver.ReceiveMessage( 1 );
+            check( receivedMessage );
+            check( ( (TestBlockMessage*) receivedMessage )->sequence == uint16_t( i ) );
+            messageFactory.ReleaseMessage( receivedMessage );
+            check( receiver.ReceiveMessage( 1 ) == NULL );
+        }
+
+        if ( receiver.GeneratePacket( NULL, receiverSequence, packetData, connectionConfig.maxPacketSize, packetBytes ) )
+        {
+            sender.ProcessPacket( NULL, receiverSequence, packetData, packetBytes );
+            receiver.ProcessAcks( &receiverSequence, 1 );
+        }
+
+        while ( true )
+        {
+            Message * receivedMessage = receiver.ReceiveMessage( 0 );
+            if ( !receivedMessage )
+                break;
+            check( receivedMessage->GetType() == TEST_BLOCK_MESSAGE );
+            check( ( (TestBlockMessage*) receivedMessage )->sequence == uint16_t( numBlocksReceived ) );
+            numBlocksReceived++;
+            messageFactory.ReleaseMessage( receivedMessage );
+        }
+
+        senderSequence++;
+        receiverSequence++;
+
+        time += 0.1;
+
+        sender.AdvanceTime( time );
+        receiver.AdvanceTime( time );
+    }
+
+    check( numPacketsReceived > 0 );
+    check( numBlocksReceived > 0 );
+}
+
+void test_congestion_controller()
+{
+    ConnectionConfig connectionConfig;
+
+    double time = 100.0;
+
+    CongestionController congestionController( connectionConfig, time );
+
+    check( congestionController.GetSendBandwidth() == connectionConfig.minSendBandwidth );
+
+    // without congestion the send rate ramps up to the maximum
+
+    for ( int i = 0; i < 1000; ++i )
+    {
+        time += 0.1;
+        congestionController.AdvanceTime( time );
+        congestionController.UpdateNetworkConditions( 50.0f, 0.0f );
+    }
+
+    check( congestionController.GetSendBandwidth() == connectionConfig.maxSendBandwidth );
+
+    // packet loss halves the send rate, which then holds while the network statistics catch up
+
+    time += 0.1;
+    congestionController.AdvanceTime( time );
+    congestionController.UpdateNetworkConditions( 50.0f, connectionConfig.congestionPacketLoss * 2.0f );
+
+    check( congestionController.GetSendBandwidth() == connectionConfig.maxSendBandwidth * 0.5f );
+
+    time += 0.1;
+    congestionController.AdvanceTime( time );
+    congestionController.UpdateNetworkConditions( 50.0f, connectionConfig.congestionPacketLoss * 2.0f );
+
+    check( congestionController.GetSendBandwidth() == connectionConfig.maxSendBandwidth * 0.5f );
+
+    // so does round trip time well above the lowest seen
+
+    time += CongestionHoldTime;
+    congestionController.AdvanceTime( time );
+    congestionController.UpdateNetworkConditions( 50.0f + connectionConfig.congestionRTT * 2.0f, 0.0f );
+
+    check( congestionController.GetSendBandwidth() == connectionConfig.maxSendBandwidth * 0.25f );
+
+    // after congestion the send rate grows linearly
+
+    time += CongestionHoldTime;
+    congestionController.AdvanceTime( time );
+    congestionController.UpdateNetworkConditions( 50.0f, 0.0f );
+
+    check( congestionController.GetSendBandwidth() > connectionConfig.maxSendBandwidth * 0.25f );
+    check( congestionController.GetSendBandwidth() < connectionConfig.maxSendBandwidth * 0.5f );
+
+    // the send rate never drops below the minimum
+
+    for ( int i = 0; i < 100; ++i )
+    {
+        time += CongestionHoldTime;
+        congestionController.AdvanceTime( time );
+        congestionController.UpdateNetworkConditions( 50.0f, 100.0f );
+        check( congestionController.GetSendBandwidth() >= connectionConfig.minSendBandwidth );
+    }
+
+    check( congestionController.GetSendBandwidth() == connectionConfig.minSendBandwidth );
+
+    // when the route gets longer, the higher round trip time is treated as congestion until it becomes the lowest seen recently. then the send rate recovers
+
+    for ( int i = 0; i < 1000; ++i )
+    {
+        time += 0.1;
+        congestionController.AdvanceTime( time );
+        congestionController.UpdateNetworkConditions( 50.0f, 0.0f );
+    }
+
+    check( congestionController.GetSendBandwidth() == connectionConfig.maxSendBandwidth );
+
+    const float longerRTT = 50.0f + connectionConfig.congestionRTT * 2.0f;
+
+    time += 0.1;
+    congestionController.AdvanceTime( time );
+    congestionController.UpdateNetworkConditions( longerRTT, 0.0f );
+
+    check( congestionController.GetSendBandwidth() == connectionConfig.maxSendBandwidth * 0.5f );
+
+    for ( int i = 0; i < int( MinRTTWindowTime * 2 * 10 ) + 1000; ++i )
+    {
+        time += 0.1;
+        congestionController.AdvanceTime( time );
+        congestionController.UpdateNetworkConditions( longerRTT, 0.0f );
+    }
+
+    check( congestionController.GetSendBandwidth() == connectionConfig.maxSendBandwidth );
+
+    // the token bucket holds one packet. packets are never cut down below the smallest useful packet
+
+    check( congestionController.GetMaxPacketBytes( connectionConfig.maxPacketSize ) == connectionConfig.maxPacketSize );
+
+    congestionController.PacketSent( connectionConfig.maxPacketSize * 2 );
+
+    const int minPacketBytes = congestionController.GetMaxPacketBytes( connectionConfig.maxPacketSize );
+
+    check( minPacketBytes > 0 );
+    check( minPacketBytes < 64 );
+
+    congestionController.Reset();
+
+    check( congestionController.GetMaxPacketBytes( connectionConfig.maxPacketSize ) == minPacketBytes );
+
+    time += 0.5;
+    congestionController.AdvanceTime( time );
+
+    const int expectedPacketBytes = int( connectionConfig.minSendBandwidth * 1000.0f / 8.0f * 0.5f );
+
+    check( congestionController.GetMaxPacketBytes( connectionConfig.maxPacketSize ) == expectedPacketBytes - ( expectedPacketBytes % 4 ) );
+
+    // a connection with congestion control sends no faster than its send rate
+
+    connectionConfig.congestionControl = true;
+    connectionConfig.channel[0].type = CHANNEL_TYPE_UNRELIABLE_UNORDERED;
+
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
+
+    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+
+    check( sender.GetSendBandwidthLimit() == connectionConfig.minSendBandwidth );
+
+    uint8_t * packetData = (uint8_t*) alloca( connectionConfig.maxPacketSize );
+
+    const int NumIterations = 60;
+    const double DeltaTime = 1.0 / NumIterations;
+
+    int totalPacketBytes = 0;
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        for ( int j = 0; j < 64 && sender.CanSendMessage( 0 ); ++j )
+        {
+            TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
+            check( message );
+            message->sequence = j;
+            sender.SendMessage( 0, message );
+        }
+
+        time += DeltaTime;
+        sender.AdvanceTime( time );
+
+        int packetBytes = 0;
+        check( sender.GeneratePacket( NULL, uint16_t( i ), packetData, connectionConfig.maxPacketSize, packetBytes ) );
+        totalPacketBytes += packetBytes;
+    }
+
+    const int maxBytesPerSecond = int( connectionConfig.minSendBandwidth * 1000.0f / 8.0f );
+
+    check( totalPacketBytes > maxBytesPerSecond / 2 );
+    check( totalPacketBytes <= maxBytesPerSecond + minPacketBytes * NumIterations );
+}
+
+void test_connection_flush()
+{
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
+
+    double time = 100.0;
+
+    ConnectionConfig connectionConfig;
+    connectionConfig.numChannels = 2;
+    connectionConfig.minFlushInterval = 0.01f;
+
+    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+
+    uint8_t * packetData = (uint8_t*) alloca( connectionConfig.maxPacketSize );
+
+    uint16_t packetSequence = 0;
+
+    // flushes happen between updates, so the flush interval runs on its own clock. the connection time doesn't move in this test
+
+    double flushTime = 0.0;
+
+    // nothing to flush until a message is sent, and only on the channel it was sent on
+
+    check( !sender.CanFlush( -1, flushTime ) );
+
+    TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
+    check( message );
+    sender.SendMessage( 0, message );
+
+    check( sender.CanFlush( -1, flushTime ) );
+    check( sender.CanFlush( 0, flushTime ) );
+    check( !sender.CanFlush( 1, flushTime ) );
+
+    // once a packet has been generated, there is nothing left to flush
+
+    int packetBytes = 0;
+    sender.PacketFlushed( flushTime );
+    check( sender.GeneratePacket( NULL, packetSequence++, packetData, connectionConfig.maxPacketSize, packetBytes ) );
+
+    check( !sender.CanFlush( -1, flushTime ) );
+
+    // messages sent soon after a flush wait for the flush interval. the second flush goes out once it has passed, within the same update
+
+    message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
+    check( message );
+    sender.SendMessage( 1, message );
+
+    check( !sender.CanFlush( -1, flushTime ) );
+
+    flushTime += connectionConfig.minFlushInterval * 0.5;
+
+    check( !sender.CanFlush( -1, flushTime ) );
+
+    flushTime += connectionConfig.minFlushInterval * 0.5;
+
+    check( sender.CanFlush( -1, flushTime ) );
+    check( !sender.CanFlush( 0, flushTime ) );
+    check( sender.CanFlush( 1, flushTime ) );
+
+    sender.PacketFlushed( flushTime );
+    check( sender.GeneratePacket( NULL, packetSequence++, packetData, connectionConfig.maxPacketSize, packetBytes ) );
+
+    check( !sender.CanFlush( -1, flushTime ) );
+
+    // a regular packet sends messages too, without resetting the flush interval
+
+    message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
+    check( message );
+    sender.SendMessage( 1, message );
+
+    check( sender.GeneratePacket( NULL, packetSequence++, packetData, connectionConfig.maxPacketSize, packetBytes ) );
+
+    check( !sender.CanFlush( -1, flushTime ) );
+
+    message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
+    check( message );
+    sender.SendMessage( 0, message );
+
+    check( !sender.CanFlush( 0, flushTime ) );
+
+    flushTime += connectionConfig.minFlushInterval;
+
+    check( sender.CanFlush( 0, flushTime ) );
+
+    // resetting the connection allows a flush right away
+
+    sender.Reset();
+
+    message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
+    check( message );
+    sender.SendMessage( 0, message );
+
+    check( sender.CanFlush( 0, flushTime ) );
+}
+
+void test_max_min_fair_share()
+{
+    int order[4];
+    int shares[4];
+
+    // the small consumer gets all it wants. the rest is shared by weight
+
+    {
+        const int demands[] = { 100, 1000, 1000 };
+        const float weights[] = { 1.0f, 1.0f, 2.0f };
+        max_min_fair_share( demands, weights, 3, 1300, order, shares );
+        check( shares[0] == 100 );
+        check( shares[1] == 400 );
+        check( shares[2] == 800 );
+    }
+
+    // consumers are visited in order of demand per-weight, not index order
+
+    {
+        const int demands[] = { 1000, 50, 1000, 150 };
+        const float weights[] = { 1.0f, 1.0f, 1.0f, 1.0f };
+        max_min_fair_share( demands, weights, 4, 1000, order, shares );
+        check( shares[0] == 400 );
+        check( shares[1] == 50 );
+        check( shares[2] == 400 );
+        check( shares[3] == 150 );
+    }
+
+    // when the budget covers every demand, everybody gets what they want
+
+    {
+        const int demands[] = { 100, 200, 300 };
+        const float weights[] = { 1.0f, 4.0f, 1.0f };
+        max_min_fair_share( demands, weights, 3, 10000, order, shares );
+        check( shares[0] == 100 );
+        check( shares[1] == 200 );
+        check( shares[2] == 300 );
+    }
+
+    // nothing to share
+
+    {
+        const int demands[] = { 100, 200 };
+        const float weights[] = { 1.0f, 1.0f };
+        max_min_fair_share( demands, weights, 2, -500, order, shares );
+        check( shares[0] == 0 );
+        check( shares[1] == 0 );
+    }
+}
+
+void test_connection_reliable_unordered_messages()
+{
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
+
+    double time = 100.0;
+
+    ConnectionConfig connectionConfig;
+    connectionConfig.numChannels = 1;
+    connectionConfig.channel[0].type = CHANNEL_TYPE_RELIABLE_UNORDERED;
+
+    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+    Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+
+    // the packet with the first message is lost. the second message is sent before the first is due for resend, and must be delivered straight away
+
+    uint8_t * packetData = (uint8_t*) alloca( connectionConfig.maxPacketSize );
+    int packetBytes = 0;
+
+    uint16_t senderSequence = 0;
+    uint16_t receiverSequence = 0;
+
+    for ( int i = 0; i < 2; ++i )
+    {
+        TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
+        check( message );
+        message->sequence = i;
+        sender.SendMessage( 0, message );
+
+        check( sender.GeneratePacket( NULL, senderSequence, packetData, connectionConfig.maxPacketSize, packetBytes ) );
+        senderSequence++;
+    }
+
+    check( receiver.ProcessPacket( NULL, senderSequence - 1, packetData, packetBytes ) );
+
+    Message * message = receiver.ReceiveMessage( 0 );
+    check( message );
+    check( message->GetId() == 1 );
+    check( ((TestMessage*)message)->sequence == 1 );
+    messageFactory.ReleaseMessage( message );
+    check( receiver.ReceiveMessage( 0 ) == NULL );
+
+    // send more messages under heavy packet loss. each message must be received exactly once
+
+    const int NumMessagesSent = 64;
+
+    for ( int i = 2; i < NumMessagesSent; ++i )
+    {
+        TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
+        check( message );
+        message->sequence = i;
+        sender.SendMessage( 0, message );
+    }
+
+    bool received[NumMessagesSent];
+    memset( received, 0, sizeof( received ) );
+    received[1] = true;
+
+    int numMessagesReceived = 1;
+
+    const int NumIterations = 10000;
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence );
+
+        while ( true )
+        {
+            Message * message = receiver.ReceiveMessage( 0 );
+            if ( !message )
+                break;
+
+            check( message->GetType() == TEST_MESSAGE );
+            check( message->GetId() < NumMessagesSent );
+
+            TestMessage * testMessage = (TestMessage*) message;
+
+            check( testMessage->sequence == message->GetId() );
+            check( !received[message->GetId()] );
+
+            received[message->GetId()] = true;
+
+            ++numMessagesReceived;
+
+            messageFactory.ReleaseMessage( message );
+        }
+
+        if ( numMessagesReceived == NumMessagesSent )
+            break;
+    }
+
+    check( numMessagesReceived == NumMessagesSent );
+    check( receiver.GetErrorLevel() == CONNECTION_ERROR_NONE );
+}
+
+void test_connection_unreliable_unordered_messages()
+{
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
+
+    double time = 100.0;
+
+    ConnectionConfig connectionConfig;
+    connectionConfig.numChannels = 1;
+    connectionConfig.channel[0].type = CHANNEL_TYPE_UNRELIABLE_UNORDERED;
+
+    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+    Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+
+    const int SenderPort = 10000;
+    const int ReceiverPort = 10001;
+
+    Address senderAddress( "::1", SenderPort );
+    Address receiverAddress( "::1", ReceiverPort );
+
+    const int NumIterations = 256;
+
+    const int NumMessagesSent = 16;
+
+    for ( int j = 0; j < NumMessagesSent; ++j )
+    {
+        TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
+        check( message );
+        message->sequence = j;
+        sender.SendMessage( 0, message );
+    }
+
+    int numMessagesReceived = 0;
+
+    uint16_t senderSequence = 0;
+    uint16_t receiverSequence = 0;
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence, 0.1f, 0 );
+
+        while ( true )
+        {
+            Message * message = receiver.ReceiveMessage( 0 );
+            if ( !message )
+                break;
+
+            check( message->GetType() == TEST_MESSAGE );
+
+            TestMessage * testMessage = (TestMessage*) message;
+
+            check( testMessage->sequence == uint16_t( numMessagesReceived ) );
+
+            ++numMessagesReceived;
+
+            messageFactory.ReleaseMessage( message );
+        }
+
+        if ( numMessagesReceived == NumMessagesSent )
+            break;
+    }
+
+    check( numMessagesReceived == NumMessagesSent );
+}
+
+void test_connection_unreliable_unordered_blocks()
+{
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
+
+    double time = 100.0;
+    
+    ConnectionConfig connectionConfig;
+    connectionConfig.numChannels = 1;
+    connectionConfig.channel[0].type = CHANNEL_TYPE_UNRELIABLE_UNORDERED;
+
+    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+
+    Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+
+    const int SenderPort = 10000;
+    const int ReceiverPort = 10001;
+
+    Address senderAddress( "::1", SenderPort );
+    Address receiverAddress( "::1", ReceiverPort );
+
+    const int NumIterations = 256;
+
+    const int NumMessagesSent = 8;
+
+    for ( int j = 0; j < NumMessagesSent; ++j )
+    {
+        TestBlockMessage * message = (TestBlockMessage*) messageFactory.CreateMessage( TEST_BLOCK_MESSAGE );
+        check( message );
+        message->sequence = j;
+        const int blockSize = 1 + ( j * 7 );
+        uint8_t * blockData = (uint8_t*) YOJIMBO_ALLOCATE( messageFactory.GetAllocator(), blockSize );
+        for ( int k = 0; k < blockSize; ++k )
+            blockData[k] = j + k;
+        message->AttachBlock( messageFactory.GetAllocator(), blockData, blockSize );
+        sender.SendMessage( 0, message );
+    }
+
+    int numMessagesReceived = 0;
+
+    uint16_t senderSequence = 0;
+    uint16_t receiverSequence = 0;
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence, 0.1f, 0 );
+
+        while ( true )
+        {
+            Message * message = receiver.ReceiveMessage( 0 );
+            if ( !message )
+                break;
+
+            check( message->GetType() == TEST_BLOCK_MESSAGE );
+
+            TestBlockMessage * blockMessage = (TestBlockMessage*) message;
+
+            check( blockMessage->sequence == uint16_t( numMessagesReceived ) );
+
+            const int blockSize = blockMessage->GetBlockSize();
+
+            check( blockSize == 1 + ( numMessagesReceived * 7 ) );
+
+            const uint8_t * blockData = blockMessage->GetBlockData();
+
+            check( blockData );
+
+            for ( int j = 0; j < blockSize; ++j )
+            {
+                check( blockData[j] == uint8_t( numMessagesReceived + j ) );
+            }
+
+            ++numMessagesReceived;
+
+            messageFactory.ReleaseMessage( message );
+        }
+
+        if ( numMessagesReceived == NumMessagesSent )
+            break;
+    }
+
+    check( numMessagesReceived == NumMessagesSent );
+}
+
+
+void test_connection_unreliable_sequenced_messages()
+{
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
+
+    double time = 100.0;
+
+    ConnectionConfig connectionConfig;
+    connectionConfig.numChannels = 1;
+    connectionConfig.channel[0].type = CHANNEL_TYPE_UNRELIABLE_SEQUENCED;
+
+    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+    Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+
+    // generate one packet per message, then deliver the packets in reverse order within each group of four.
+    // only the first packet delivered from each group is newer than everything received before it
+
+    const int NumPackets = 16;
+
+    uint8_t * packetData[NumPackets];
+    int packetBytes[NumPackets];
+
+    for ( int i = 0; i < NumPackets; ++i )
+    {
+        TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
+        check( message );
+        message->sequence = i;
+        sender.SendMessage( 0, message );
+
+        packetData[i] = (uint8_t*) malloc( connectionConfig.maxPacketSize );
+        check( sender.GeneratePacket( NULL, uint16_t( i ), packetData[i], connectionConfig.maxPacketSize, packetBytes[i] ) );
+    }
+
+    int numMessagesReceived = 0;
+
+    for ( int i = 0; i < NumPackets; i += 4 )
+    {
+        for ( int j = 3; j >= 0; --j )
+        {
+            check( receiver.ProcessPacket( NULL, uint16_t( i + j ), packetData[i+j], packetBytes[i+j] ) );
+        }
+
+        while ( true )
+        {
+            Message * message = receiver.ReceiveMessage( 0 );
+            if ( !message )
+                break;
+
+            check( message->GetType() == TEST_MESSAGE );
+            check( message->GetId() == i + 3 );
+
+            TestMessage * testMessage = (TestMessage*) message;
+
+            check( testMessage->sequence == uint16_t( i + 3 ) );
+
+            ++numMessagesReceived;
+
+            messageFactory.ReleaseMessage( message );
+        }
+    }
+
+    check( numMessagesReceived == NumPackets / 4 );
+
+    // staleness doesn't depend on packets sent while the channel is idle, so messages still arrive after the connection packet sequence has wrapped around
+
+    uint16_t packetSequence = NumPackets;
+
+    for ( int i = 0; i < 4; ++i )
+    {
+        packetSequence += 40000;
+
+        TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
+        check( message );
+        message->sequence = uint16_t( NumPackets + i );
+        sender.SendMessage( 0, message );
+
+        check( sender.GeneratePacket( NULL, packetSequence, packetData[0], connectionConfig.maxPacketSize, packetBytes[0] ) );
+        check( receiver.ProcessPacket( NULL, packetSequence, packetData[0], packetBytes[0] ) );
+
+        Message * receivedMessage = receiver.ReceiveMessage( 0 );
+        check( receivedMessage );
+        check( ( (TestMessage*) receivedMessage )->sequence == uint16_t( NumPackets + i ) );
+        messageFactory.ReleaseMessage( receivedMessage );
+    }
+
+    for ( int i = 0; i < NumPackets; ++i )
+        free( packetData[i] );
+}
+
+void SetTestSnapshotValues( TestSnapshotMessage * message, int snapshotId )
+{
+    for ( int i = 0; i < TestSnapshotMessage::NumValues; ++i )
+        message->values[i] = ( i == 0 ) ? snapshotId : ( i * 1000 + snapshotId / 8 );
+}
+
+bool CheckTestSnapshotValues( const TestSnapshotMessage * message, int snapshotId )
+{
+    for ( int i = 0; i < TestSnapshotMessage::NumValues; ++i )
+    {
+        if ( message->values[i] != uint32_t( ( i == 0 ) ? snapshotId : ( i * 1000 + snapshotId / 8 ) ) )
+            return false;
+    }
+    return true;
+}
+
+void test_connection_snapshot_delta()
+{
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
+
+    double time = 100.0;
+
+    ConnectionConfig connectionConfig;
+    connectionConfig.numChannels = 1;
+    connectionConfig.channel[0].type = CHANNEL_TYPE_SNAPSHOT_DELTA;
+    connectionConfig.channel[0].snapshotHistorySize = 8;
+
+    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+    Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+
+    uint16_t senderSequence = 0;
+    uint16_t receiverSequence = 0;
+
+    // send one snapshot per-update with packet loss. every snapshot received must reconstruct exactly, whether it was delta encoded or not
+
+    const int NumSnapshotsSent = 256;
+
+    int numSnapshotsReceived = 0;
+    int numDeltaSnapshotsReceived = 0;
+
+    for ( int i = 0; i < NumSnapshotsSent; ++i )
+    {
+        TestSnapshotMessage * message = (TestSnapshotMessage*) messageFactory.CreateMessage( TEST_SNAPSHOT_MESSAGE );
+        check( message );
+        SetTestSnapshotValues( message, i );
+        sender.SendMessage( 0, message );
+
+        PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence, 0.1f, 25 );
+
+        while ( true )
+        {
+            Message * message = receiver.ReceiveMessage( 0 );
+            if ( !message )
+                break;
+
+            check( message->GetType() == TEST_SNAPSHOT_MESSAGE );
+
+            TestSnapshotMessage * snapshotMessage = (TestSnapshotMessage*) message;
+
+            check( CheckTestSnapshotValues( snapshotMessage, snapshotMessage->GetId() ) );
+            check( snapshotMessage->GetBaseline() == NULL );
+
+            if ( snapshotMessage->deltaEncoded )
+                numDeltaSnapshotsReceived++;
+
+            numSnapshotsReceived++;
+
+            messageFactory.ReleaseMessage( message );
+        }
+    }
+
+    check( numSnapshotsReceived > 0 );
+    check( numDeltaSnapshotsReceived > 0 );
+    check( sender.GetErrorLevel() == CONNECTION_ERROR_NONE );
+    check( receiver.GetErrorLevel() == CONNECTION_ERROR_NONE );
+
+    // hold back a delta encoded packet until its baseline has left the receiver history. it must be dropped without error
+
+    uint8_t * latePacketData = (uint8_t*) alloca( connectionConfig.maxPacketSize );
+
+    TestSnapshotMessage * message = (TestSnapshotMessage*) messageFactory.CreateMessage( TEST_SNAPSHOT_MESSAGE );
+    check( message );
+    SetTestSnapshotValues( message, 0 );
+    sender.SendMessage( 0, message );
+
+    const uint16_t latePacketSequence = senderSequence++;
+
+    int latePacketBytes = 0;
+    check( sender.GeneratePacket( NULL, latePacketSequence, latePacketData, connectionConfig.maxPacketSize, latePacketBytes ) );
+
+    for ( int i = 0; i < connectionConfig.channel[0].snapshotHistorySize * 2; ++i )
+    {
+        message = (TestSnapshotMessage*) messageFactory.CreateMessage( TEST_SNAPSHOT_MESSAGE );
+        check( message );
+        SetTestSnapshotValues( message, 0 );
+        sender.SendMessage( 0, message );
+
+        PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence, 0.1f, 0 );
+
+        while ( Message * received = receiver.ReceiveMessage( 0 ) )
+        {
+            check( ((TestSnapshotMessage*)received)->deltaEncoded );
+            messageFactory.ReleaseMessage( received );
+        }
+    }
+
+    check( !receiver.ProcessPacket( NULL, latePacketSequence, latePacketData, latePacketBytes ) );
+    check( receiver.ReceiveMessage( 0 ) == NULL );
+    check( receiver.GetErrorLevel() == CONNECTION_ERROR_NONE );
+}
+
+void test_connection_snapshot_delta_baseline_eviction()
+{
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
+
+    double time = 100.0;
+
+    ConnectionConfig connectionConfig;
+    connectionConfig.numChannels = 1;
+    connectionConfig.channel[0].type = CHANNEL_TYPE_SNAPSHOT_DELTA;
+    connectionConfig.channel[0].snapshotHistorySize = 8;
+
+    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+    Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+
+    uint8_t * packetData = (uint8_t*) alloca( connectionConfig.maxPacketSize );
+    int packetBytes = 0;
+
+    // get snapshot 0 acked, so it becomes the baseline
+
+    TestSnapshotMessage * message = (TestSnapshotMessage*) messageFactory.CreateMessage( TEST_SNAPSHOT_MESSAGE );
+    check( message );
+    SetTestSnapshotValues( message, 0 );
+    sender.SendMessage( 0, message );
+
+    uint16_t senderSequence = 0;
+
+    check( sender.GeneratePacket( NULL, senderSequence, packetData, connectionConfig.maxPacketSize, packetBytes ) );
+    check( receiver.ProcessPacket( NULL, senderSequence, packetData, packetBytes ) );
+    sender.ProcessAcks( &senderSequence, 1 );
+    senderSequence++;
+
+    Message * received = receiver.ReceiveMessage( 0 );
+    check( received );
+    messageFactory.ReleaseMessage( received );
+
+    // snapshots 1-6 are lost
+
+    for ( int i = 1; i <= 6; ++i )
+    {
+        message = (TestSnapshotMessage*) messageFactory.CreateMessage( TEST_SNAPSHOT_MESSAGE );
+        check( message );
+        SetTestSnapshotValues( message, i );
+        sender.SendMessage( 0, message );
+        check( sender.GeneratePacket( NULL, senderSequence++, packetData, connectionConfig.maxPacketSize, packetBytes ) );
+    }
+
+    // snapshot 7 is delta encoded against snapshot 0. snapshot 8 is in the same packet and its slot in the history is the one holding snapshot 0, 
+    // so snapshot 0 must stay alive until the packet is written
+
+    TestSnapshotMessage * deltaMessage = (TestSnapshotMessage*) messageFactory.CreateMessage( TEST_SNAPSHOT_MESSAGE );
+    check( deltaMessage );
+    SetTestSnapshotValues( deltaMessage, 7 );
+    messageFactory.AcquireMessage( deltaMessage );
+    sender.SendMessage( 0, deltaMessage );
+
+    message = (TestSnapshotMessage*) messageFactory.CreateMessage( TEST_SNAPSHOT_MESSAGE );
+    check( message );
+    SetTestSnapshotValues( message, 8 );
+    sender.SendMessage( 0, message );
+
+    check( sender.GeneratePacket( NULL, senderSequence, packetData, connectionConfig.maxPacketSize, packetBytes ) );
+    check( deltaMessage->GetBaseline() == NULL );
+    messageFactory.ReleaseMessage( deltaMessage );
+
+    check( receiver.ProcessPacket( NULL, senderSequence, packetData, packetBytes ) );
+
+    for ( int i = 7; i <= 8; ++i )
+    {
+        received = receiver.ReceiveMessage( 0 );
+        check( received );
+        check( received->GetId() == i );
+        check( CheckTestSnapshotValues( (TestSnapshotMessage*) received, i ) );
+        check( ( (TestSnapshotMessage*) received )->deltaEncoded == ( i == 7 ) );
+        messageFactory.ReleaseMessage( received );
+    }
+
+    check( sender.GetErrorLevel() == CONNECTION_ERROR_NONE );
+    check( receiver.GetErrorLevel() == CONNECTION_ERROR_NONE );
+}
+
+void PumpClientServerUpdate( double & time, Client ** client, int numClients, Server ** server, int numServers, float deltaTime = 0.1f )
+{
+    for ( int i = 0; i < numClients; ++i )
+        client[i]->SendPackets();
+
+    for ( int i = 0; i < numServers; ++i )
+        server[i]->SendPackets();
+
+    for ( int i = 0; i < numClients; ++i )
+        client[i]->ReceivePackets();
+
+    for ( int i = 0; i < numServers; ++i )
+        server[i]->ReceivePackets();
+
+    time += deltaTime;
+
+    for ( int i = 0; i < numClients; ++i )
+        client[i]->AdvanceTime( time );
+
+    for ( int i = 0; i < numServers; ++i )
+        server[i]->AdvanceTime( time );
+
+    yojimbo_sleep( 0.0f );
+}
+
+void SendClientToServerMessages( Client & client, int numMessagesToSend, int channelIndex = 0 )
+{
+    for ( int i = 0; i < numMessagesToSend; ++i )
+    {
+        if ( !client.CanSendMessage( channelIndex ) )
+            break;
+
+        if ( rand() % 10 )
+        {
+            TestMessage * message = (TestMessage*) client.CreateMessage( TEST_MESSAGE );
+            check( message );
+            message->sequence = i;
+            client.SendMessage( channelIndex, message );
+        }
+        else
+        {
+            TestBlockMessage * message = (TestBlockMessage*) client.CreateMessage( TEST_BLOCK_MESSAGE );
+            check( message );
+            message->sequence = i;
+            const int blockSize = 1 + ( ( i * 901 ) % 1001 );
+            uint8_t * blockData = client.AllocateBlock( blockSize );
+            check( blockData );
+            for ( int j = 0; j < blockSize; ++j )
+                blockData[j] = i + j;
+            client.AttachBlockToMessage( message, blockData, blockSize );
+            client.SendMessage( channelIndex, message );
+        }
+    }
+}
+
+void SendServerToClientMessages( Server & server, int clientIndex, int numMessagesToSend, int channelIndex = 0 )
+{
+    for ( int i = 0; i < numMessagesToSend; ++i )
+    {
+        if ( !server.CanSendMessage( clientIndex, channelIndex ) )
+            break;
+
+        if ( rand() % 10 )
+        {
+            TestMessage * message = (TestMessage*) server.CreateMessage( clientIndex, TEST_MESSAGE );
+            check( message );
+            message->sequence = i;
+            server.SendMessage( clientIndex, channelIndex, message );
+        }
+        else
+        {
+            TestBlockMessage * message = (TestBlockMessage*) server.CreateMessage( clientIndex, TEST_BLOCK_MESSAGE );
+            check( message );
+            message->sequence = i;
+            const int blockSize = 1 + ( ( i * 901 ) % 1001 );
+            uint8_t * blockData = server.AllocateBlock( clientIndex, blockSize );
+            check( blockData );
+            for ( int j = 0; j < blockSize; ++j )
+                blockData[j] = i + j;
+            server.AttachBlockToMessage( clientIndex, message, blockData, blockSize );
+            server.SendMessage( clientIndex, channelIndex, message );
+        }
+    }
+}
+
+void ProcessServerToClientMessages( Client & client, int & numMessagesReceivedFromServer )
+{
+    while ( true )
+    {
+        Message * message = client.ReceiveMessage( 0 );
+
+        if ( !message )
+            break;
+
+        check( message->GetId() == (int) numMessagesReceivedFromServer );
+        
+        switch ( message->GetType() )
+        {
+            case TEST_MESSAGE:
+            {
+                TestMessage * testMessage = (TestMessage*) message;
+                check( !message->IsBlockMessage() );
+                check( testMessage->sequence == uint16_t( numMessagesReceivedFromServer ) );
+                ++numMessagesReceivedFromServer;
+            }
+            break;
+
+            case TEST_BLOCK_MESSAGE:
+            {
+                check( message->IsBlockMessage() );
+                TestBlockMessage * blockMessage = (TestBlockMessage*) message;
+                check( blockMessage->sequence == uint16_t( numMessagesReceivedFromServer ) );
+                const int blockSize = blockMessage->GetBlockSize();
+                check( blockSize == 1 + ( ( numMessagesReceivedFromServer * 901 ) % 1001 ) );
+                const uint8_t * blockData = blockMessage->GetBlockData();
+                check( blockData );
+                for ( int j = 0; j < blockSize; ++j )
+                {
+                    check( blockData[j] == uint8_t( numMessagesReceivedFromServer + j ) );
+                }
+                ++numMessagesReceivedFromServer;
+            }
+            break;
+        }
+
+        client.ReleaseMessage( message );
+    }
+}
+
+void ProcessClientToServerMessages( Server & server, int clientIndex, int & numMessagesReceivedFromClient )
+{
+    while ( true )
+    {
+        Message * message = server.ReceiveMessage( clientIndex, 0 );
+
+        if ( !message )
+            break;
+
+        check( message->GetId() == (int) numMessagesReceivedFromClient );
+
+        switch ( message->GetType() )
+        {
+            case TEST_MESSAGE:
+            {
+                check( !message->IsBlockMessage() );
+                TestMessage * testMessage = (TestMessage*) message;
+                check( testMessage->sequence == uint16_t( numMessagesReceivedFromClient ) );
+                ++numMessagesReceivedFromClient;
+            }
+            break;
 
             case TEST_BLOCK_MESSAGE:
             {
-                check( message->IsBlockMessage() );
-                TestBlockMessage * blockMessage = (TestBlockMessage*) message;
-                check( blockMessage->sequence == uint16_t( numMessagesReceivedFromClient ) );
-                const int blockSize = blockMessage->GetBlockSize();
-                check( blockSize == 1 + ( ( numMessagesReceivedFromClient * 901 ) % 1001 ) );
-                const uint8_t * blockData = blockMessage->GetBlockData();
-                check( blockData );
-                for ( int j = 0; j < blockSize; ++j )
+                check( message->IsBlockMessage() );
+                TestBlockMessage * blockMessage = (TestBlockMessage*) message;
+                check( blockMessage->sequence == uint16_t( numMessagesReceivedFromClient ) );
+                const int blockSize = blockMessage->GetBlockSize();
+                check( blockSize == 1 + ( ( numMessagesReceivedFromClient * 901 ) % 1001 ) );
+                const uint8_t * blockData = blockMessage->GetBlockData();
+                check( blockData );
+                for ( int j = 0; j < blockSize; ++j )
+                {
+                    check( blockData[j] == uint8_t( numMessagesReceivedFromClient + j ) );
+                }
+                ++numMessagesReceivedFromClient;
+            }
+            break;
+        }
+
+        server.ReleaseMessage( clientIndex, message );
+    }
+}
+
+void test_client_server_messages()
+{
+    const uint64_t clientId = 1;
+
+    Address clientAddress( "0.0.0.0", ClientPort );
+    Address serverAddress( "127.0.0.1", ServerPort );
+
+    double time = 100.0;
+    
+    ClientServerConfig config;
+    config.channel[0].messageSendQueueSize = 32;
+    config.channel[0].maxMessagesPerPacket = 8;
+    config.channel[0].maxBlockSize = 1024;
+    config.channel[0].blockFragmentSize = 200;
+
+    Client client( GetDefaultAllocator(), clientAddress, config, adapter, time );
+
+    uint8_t privateKey[KeyBytes];
+    memset( privateKey, 0, KeyBytes );
+
+    Server server( GetDefaultAllocator(), privateKey, serverAddress, config, adapter, time );
+
+    server.Start( MaxClients );
+
+    client.SetLatency( 250 );
+    client.SetJitter( 100 );
+    client.SetPacketLoss( 25 );
+    client.SetDuplicates( 25 );
+
+    server.SetLatency( 250 );
+    server.SetJitter( 100 );
+    server.SetPacketLoss( 25 );
+    server.SetDuplicates( 25 );
+
+    for ( int iteration = 0; iteration < 2; ++iteration )
+    {
+        client.InsecureConnect( privateKey, clientId, serverAddress );
+
+        const int NumIterations = 10000;
+
+        for ( int i = 0; i < NumIterations; ++i )
+        {
+            Client * clients[] = { &client };
+            Server * servers[] = { &server };
+            
+            PumpClientServerUpdate( time, clients, 1, servers, 1 );
+
+            if ( client.ConnectionFailed() )
+                break;
+
+            if ( !client.IsConnecting() && client.IsConnected() && server.GetNumConnectedClients() == 1 )
+                break;
+        }
+
+        check( !client.IsConnecting() );
+        check( client.IsConnected() );
+        check( server.GetNumConnectedClients() == 1 );
+        check( client.GetClientIndex() == 0 );
+        check( server.IsClientConnected(0) );
+
+        const int NumMessagesSent = config.channel[0].messageSendQueueSize;
+
+        SendClientToServerMessages( client, NumMessagesSent );
+
+        SendServerToClientMessages( server, client.GetClientIndex(), NumMessagesSent );
+
+        int numMessagesReceivedFromClient = 0;
+        int numMessagesReceivedFromServer = 0;
+
+        for ( int i = 0; i < NumIterations; ++i )
+        {
+            if ( !client.IsConnected() )
+                break;
+
+            Client * clients[] = { &client };
+            Server * servers[] = { &server };
+
+            PumpClientServerUpdate( time, clients, 1, servers, 1 );
+
+            ProcessServerToClientMessages( client, numMessagesReceivedFromServer );
+
+            ProcessClientToServerMessages( server, client.GetClientIndex(), numMessagesReceivedFromClient );
+
+            if ( numMessagesReceivedFromClient == NumMessagesSent && numMessagesReceivedFromServer == NumMessagesSent )
+                break;
+        }
+
+        check( client.IsConnected() );
+        check( server.IsClientConnected( client.GetClientIndex() ) );
+        check( numMessagesReceivedFromClient == NumMessagesSent );
+        check( numMessagesReceivedFromServer == NumMessagesSent );
+
+        client.Disconnect();
+
+        for ( int i = 0; i < NumIterations; ++i )
+        {
+            Client * clients[] = { &client };
+            Server * servers[] = { &server };
+
+            PumpClientServerUpdate( time, clients, 1, servers, 1 );
+
+            if ( !client.IsConnected() && server.GetNumConnectedClients() == 0 )
+                break;
+        }
+
+        check( !client.IsConnected() && server.GetNumConnectedClients() == 0 );
+    }
+
+    server.Stop();
+}
+
+void CreateClients( int numClients, Client ** clients, const Address & address, const ClientServerConfig & config, Adapter & _adapter, double time )
+{
+    for ( int i = 0; i < numClients; ++i )
+    {
+        clients[i] = YOJIMBO_NEW( GetDefaultAllocator(), Client, GetDefaultAllocator(), address, config, _adapter, time );
+        clients[i]->SetLatency( 250 );
+        clients[i]->SetJitter( 100 );
+        clients[i]->SetPacketLoss( 25 );
+        clients[i]->SetDuplicates( 25 );
+    }
+}
+
+void ConnectClients( int numClients, Client ** clients, const uint8_t privateKey[], const Address & serverAddress )
+{
+    for ( int i = 0; i < numClients; ++i )
+    {
+        clients[i]->InsecureConnect( privateKey, i + 1, serverAddress );
+    }
+}
+
+void DestroyClients( int numClients, Client ** clients )
+{
+    for ( int i = 0; i < numClients; ++i )
+    {
+        clients[i]->Disconnect();
+
+        YOJIMBO_DELETE( GetDefaultAllocator(), Client, clients[i] );
+    }
+}
+
+bool AllClientsConnected( int numClients, Server & server, Client ** clients )
+{
+    if ( server.GetNumConnectedClients() != numClients )
+        return false;
+
+    for ( int i = 0; i < numClients; ++i )
+    {
+        if ( !clients[i]->IsConnected() )
+            return false;
+    }
+
+    return true;    
+}
+
+bool AnyClientDisconnected( int numClients, Client ** clients )
+{
+    for ( int i = 0; i < numClients; ++i )
+    {
+        if ( clients[i]->IsDisconnected() )
+            return true;
+    }
+
+    return false;
+}
+
+void test_client_server_start_stop_restart()
+{
+    Address clientAddress( "0.0.0.0", 0 );
+    Address serverAddress( "127.0.0.1", ServerPort );
+
+    double time = 100.0;
+    
+    ClientServerConfig config;
+    config.channel[0].messageSendQueueSize = 32;
+    config.channel[0].maxMessagesPerPacket = 8;
+    config.channel[0].maxBlockSize = 1024;
+    config.channel[0].blockFragmentSize = 200;
+
+    uint8_t privateKey[KeyBytes];
+    memset( privateKey, 0, KeyBytes );
+
+    Server server( GetDefaultAllocator(), privateKey, serverAddress, config, adapter, time );
+
+    server.Start( MaxClients );
+
+    server.SetLatency( 250 );
+    server.SetJitter( 100 );
+    server.SetPacketLoss( 25 );
+    server.SetDuplicates( 25 );
+
+    int numClients[] = { 3, 5, 1 };
+
+    const int NumIterations = sizeof( numClients ) / sizeof( int );
+
+    for ( int iteration = 0; iteration < NumIterations; ++iteration )
+    {
+        server.Start( numClients[iteration] );
+
+        Client * clients[MaxClients];
+
+        CreateClients( numClients[iteration], clients, clientAddress, config, adapter, time );
+
+        ConnectClients( numClients[iteration], clients, privateKey, serverAddress );
+
+        while ( true )
+        {
+            Server * servers[] = { &server };
+
+            PumpClientServerUpdate( time, (Client**) clients, numClients[iteration], servers, 1 );
+
+            if ( AnyClientDisconnected( numClients[iteration], clients ) )
+                break;
+
+            if ( AllClientsConnected( numClients[iteration], server, clients ) )
+                break;
+        }
+
+        check( AllClientsConnected( numClients[iteration], server, clients ) );
+
+        const int NumMessagesSent = config.channel[0].messageSendQueueSize;
+
+        for ( int clientIndex = 0; clientIndex < numClients[iteration]; ++clientIndex )
+        {
+            SendClientToServerMessages( *clients[clientIndex], NumMessagesSent );
+            SendServerToClientMessages( server, clientIndex, NumMessagesSent );
+        }
+
+        int numMessagesReceivedFromClient[MaxClients];
+        int numMessagesReceivedFromServer[MaxClients];
+
+        memset( numMessagesReceivedFromClient, 0, sizeof( numMessagesReceivedFromClient ) );
+        memset( numMessagesReceivedFromServer, 0, sizeof( numMessagesReceivedFromServer ) );
+
+		const int NumInternalIterations = 10000;
+
+        for ( int i = 0; i < NumInternalIterations; ++i )
+        {
+            Server * servers[] = { &server };
+
+            PumpClientServerUpdate( time, clients, numClients[iteration], servers, 1 );
+
+            bool allMessagesReceived = true;
+
+            for ( int j = 0; j < numClients[iteration]; ++j )
+            {
+                ProcessServerToClientMessages( *clients[j], numMessagesReceivedFromServer[j] );
+
+                if ( numMessagesReceivedFromServer[j] != NumMessagesSent )
+                    allMessagesReceived = false;
+
+                int clientIndex = clients[j]->GetClientIndex();
+
+                ProcessClientToServerMessages( server, clientIndex, numMessagesReceivedFromClient[clientIndex] );
+
+                if ( numMessagesReceivedFromClient[clientIndex] != NumMessagesSent )
+                    allMessagesReceived = false;
+            }
+
+            if ( allMessagesReceived )
+                break;
+        }
+
+        for ( int clientIndex = 0; clientIndex < numClients[iteration]; ++clientIndex )
+        {
+            check( numMessagesReceivedFromClient[clientIndex] == NumMessagesSent );
+            check( numMessagesReceivedFromServer[clientIndex] == NumMessagesSent );
+        }
+
+        DestroyClients( numClients[iteration], clients );
+
+        server.Stop();
+    }
+}
+
+void test_client_server_worker_threads()
+{
+    Address clientAddress( "0.0.0.0", 0 );
+    Address serverAddress( "127.0.0.1", ServerPort );
+
+    double time = 100.0;
+    
+    ClientServerConfig config;
+    config.serverWorkerThreads = 4;
+    config.channel[0].messageSendQueueSize = 32;
+    config.channel[0].maxMessagesPerPacket = 8;
+    config.channel[0].maxBlockSize = 1024;
+    config.channel[0].blockFragmentSize = 200;
+
+    uint8_t privateKey[KeyBytes];
+    memset( privateKey, 0, KeyBytes );
+
+    Server server( GetDefaultAllocator(), privateKey, serverAddress, config, adapter, time );
+
+    const int NumClients = 8;
+
+    server.Start( NumClients );
+
+    server.SetLatency( 250 );
+    server.SetJitter( 100 );
+    server.SetPacketLoss( 25 );
+    server.SetDuplicates( 25 );
+
+    Client * clients[NumClients];
+
+    CreateClients( NumClients, clients, clientAddress, config, adapter, time );
+
+    ConnectClients( NumClients, clients, privateKey, serverAddress );
+
+    while ( true )
+    {
+        Server * servers[] = { &server };
+
+        PumpClientServerUpdate( time, (Client**) clients, NumClients, servers, 1 );
+
+        if ( AnyClientDisconnected( NumClients, clients ) )
+            break;
+
+        if ( AllClientsConnected( NumClients, server, clients ) )
+            break;
+    }
+
+    check( AllClientsConnected( NumClients, server, clients ) );
+
+    const int NumMessagesSent = config.channel[0].messageSendQueueSize;
+
+    for ( int clientIndex = 0; clientIndex < NumClients; ++clientIndex )
+    {
+        SendClientToServerMessages( *clients[clientIndex], NumMessagesSent );
+        SendServerToClientMessages( server, clientIndex, NumMessagesSent );
+    }
+
+    int numMessagesReceivedFromClient[NumClients];
+    int numMessagesReceivedFromServer[NumClients];
+
+    memset( numMessagesReceivedFromClient, 0, sizeof( numMessagesReceivedFromClient ) );
+    memset( numMessagesReceivedFromServer, 0, sizeof( numMessagesReceivedFromServer ) );
+
+    const int NumIterations = 10000;
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        Server * servers[] = { &server };
+
+        PumpClientServerUpdate( time, clients, NumClients, servers, 1 );
+
+        bool allMessagesReceived = true;
+
+        for ( int j = 0; j < NumClients; ++j )
+        {
+            ProcessServerToClientMessages( *clients[j], numMessagesReceivedFromServer[j] );
+
+            if ( numMessagesReceivedFromServer[j] != NumMessagesSent )
+                allMessagesReceived = false;
+
+            int clientIndex = clients[j]->GetClientIndex();
+
+            ProcessClientToServerMessages( server, clientIndex, numMessagesReceivedFromClient[clientIndex] );
+
+            if ( numMessagesReceivedFromClient[clientIndex] != NumMessagesSent )
+                allMessagesReceived = false;
+        }
+
+        if ( allMessagesReceived )
+            break;
+    }
+
+    for ( int clientIndex = 0; clientIndex < NumClients; ++clientIndex )
+    {
+        check( numMessagesReceivedFromClient[clientIndex] == NumMessagesSent );
+        check( numMessagesReceivedFromServer[clientIndex] == NumMessagesSent );
+    }
+
+    DestroyClients( NumClients, clients );
+
+    server.Stop();
+}
+
+void test_client_server_broadcast_messages()
+{
+    Address clientAddress( "0.0.0.0", 0 );
+    Address serverAddress( "127.0.0.1", ServerPort );
+
+    double time = 100.0;
+    
+    ClientServerConfig config;
+    config.serverWorkerThreads = 2;
+    config.numChannels = 2;
+    config.channel[0].messageSendQueueSize = 64;
+    config.channel[0].maxMessagesPerPacket = 8;
+    config.channel[1].type = CHANNEL_TYPE_RELIABLE_LATEST_VALUE;
+
+    uint8_t privateKey[KeyBytes];
+    memset( privateKey, 0, KeyBytes );
+
+    Server server( GetDefaultAllocator(), privateKey, serverAddress, config, adapter, time );
+
+    const int NumClients = 4;
+
+    server.Start( NumClients );
+
+    server.SetLatency( 250 );
+    server.SetJitter( 100 );
+    server.SetPacketLoss( 25 );
+    server.SetDuplicates( 25 );
+
+    Client * clients[NumClients];
+
+    CreateClients( NumClients, clients, clientAddress, config, adapter, time );
+
+    ConnectClients( NumClients, clients, privateKey, serverAddress );
+
+    while ( true )
+    {
+        Server * servers[] = { &server };
+
+        PumpClientServerUpdate( time, (Client**) clients, NumClients, servers, 1 );
+
+        if ( AnyClientDisconnected( NumClients, clients ) )
+            break;
+
+        if ( AllClientsConnected( NumClients, server, clients ) )
+            break;
+    }
+
+    check( AllClientsConnected( NumClients, server, clients ) );
+
+    // alternate between a message that doesn't depend on bit alignment, and one that does
+
+    const int NumMessagesSent = config.channel[0].messageSendQueueSize;
+
+    for ( int i = 0; i < NumMessagesSent; ++i )
+    {
+        if ( i % 2 )
+        {
+            TestAlignedMessage * message = (TestAlignedMessage*) server.CreateBroadcastMessage( TEST_ALIGNED_MESSAGE );
+            check( message );
+            message->sequence = uint16_t( i );
+            for ( int j = 0; j < (int) sizeof( message->data ); ++j )
+                message->data[j] = uint8_t( i + j );
+            server.BroadcastMessage( 0, message );
+        }
+        else
+        {
+            TestMessage * message = (TestMessage*) server.CreateBroadcastMessage( TEST_MESSAGE );
+            check( message );
+            message->sequence = uint16_t( i );
+            server.BroadcastMessage( 0, message );
+        }
+    }
+
+    // broadcast several values for each key on the latest-value channel. the key must survive the broadcast, so the latest value for every key arrives
+
+    const int NumKeys = 4;
+    const int NumValuesPerKey = 4;
+
+    for ( int i = 0; i < NumValuesPerKey; ++i )
+    {
+        for ( int key = 0; key < NumKeys; ++key )
+        {
+            TestMessage * message = (TestMessage*) server.CreateBroadcastMessage( TEST_MESSAGE );
+            check( message );
+            message->sequence = uint16_t( key * NumValuesPerKey + i );
+            message->SetOrderingKey( key );
+            server.BroadcastMessage( 1, message );
+        }
+    }
+
+    int numMessagesReceivedFromServer[NumClients];
+
+    memset( numMessagesReceivedFromServer, 0, sizeof( numMessagesReceivedFromServer ) );
+
+    int lastValueReceived[NumClients][NumKeys];
+
+    for ( int i = 0; i < NumClients; ++i )
+    {
+        for ( int key = 0; key < NumKeys; ++key )
+            lastValueReceived[i][key] = -1;
+    }
+
+    const int NumIterations = 10000;
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        Server * servers[] = { &server };
+
+        PumpClientServerUpdate( time, clients, NumClients, servers, 1 );
+
+        bool allMessagesReceived = true;
+
+        for ( int j = 0; j < NumClients; ++j )
+        {
+            while ( true )
+            {
+                Message * message = clients[j]->ReceiveMessage( 0 );
+
+                if ( !message )
+                    break;
+
+                const int sequence = numMessagesReceivedFromServer[j];
+
+                check( message->GetId() == sequence );
+                check( !message->IsProxyMessage() );
+
+                if ( sequence % 2 )
                 {
-                    check( blockData[j] == uint8_t( numMessagesReceivedFromClient + j ) );
+                    check( message->GetType() == TEST_ALIGNED_MESSAGE );
+                    TestAlignedMessage * alignedMessage = (TestAlignedMessage*) message;
+                    check( alignedMessage->sequence == uint16_t( sequence ) );
+                    for ( int k = 0; k < (int) sizeof( alignedMessage->data ); ++k )
+                        check( alignedMessage->data[k] == uint8_t( sequence + k ) );
                 }
-                ++numMessagesReceivedFromClient;
+                else
+                {
+                    check( message->GetType() == TEST_MESSAGE );
+                    check( ( (TestMessage*) message )->sequence == uint16_t( sequence ) );
+                }
+
+                numMessagesReceivedFromServer[j]++;
+
+                clients[j]->ReleaseMessage( message );
+            }
+
+            while ( true )
+            {
+                Message * message = clients[j]->ReceiveMessage( 1 );
+
+                if ( !message )
+                    break;
+
+                check( message->GetType() == TEST_MESSAGE );
+
+                const int value = ( (TestMessage*) message )->sequence;
+                const int key = value / NumValuesPerKey;
+                check( key < NumKeys );
+                check( value > lastValueReceived[j][key] );
+                lastValueReceived[j][key] = value;
+
+                clients[j]->ReleaseMessage( message );
+            }
+
+            if ( numMessagesReceivedFromServer[j] != NumMessagesSent )
+                allMessagesReceived = false;
+
+            for ( int key = 0; key < NumKeys; ++key )
+            {
+                if ( lastValueReceived[j][key] != key * NumValuesPerKey + NumValuesPerKey - 1 )
+                    allMessagesReceived = false;
             }
+        }
+
+        if ( allMessagesReceived )
+            break;
+    }
+
+    for ( int clientIndex = 0; clientIndex < NumClients; ++clientIndex )
+    {
+        check( numMessagesReceivedFromServer[clientIndex] == NumMessagesSent );
+        for ( int key = 0; key < NumKeys; ++key )
+            check( lastValueReceived[clientIndex][key] == key * NumValuesPerKey + NumValuesPerKey - 1 );
+    }
+
+    DestroyClients( NumClients, clients );
+
+    server.Stop();
+}
+
+void test_client_server_shared_blocks()
+{
+    Address clientAddress( "0.0.0.0", 0 );
+    Address serverAddress( "127.0.0.1", ServerPort );
+
+    double time = 100.0;
+    
+    ClientServerConfig config;
+    config.serverWorkerThreads = 2;
+    config.channel[0].maxFragmentsPerPacket = 4;
+
+    uint8_t privateKey[KeyBytes];
+    memset( privateKey, 0, KeyBytes );
+
+    Server server( GetDefaultAllocator(), privateKey, serverAddress, config, adapter, time );
+
+    const int NumClients = 4;
+
+    server.Start( NumClients );
+
+    server.SetLatency( 250 );
+    server.SetJitter( 100 );
+    server.SetPacketLoss( 25 );
+    server.SetDuplicates( 25 );
+
+    Client * clients[NumClients];
+
+    CreateClients( NumClients, clients, clientAddress, config, adapter, time );
+
+    ConnectClients( NumClients, clients, privateKey, serverAddress );
+
+    while ( true )
+    {
+        Server * servers[] = { &server };
+
+        PumpClientServerUpdate( time, (Client**) clients, NumClients, servers, 1 );
+
+        if ( AnyClientDisconnected( NumClients, clients ) )
             break;
+
+        if ( AllClientsConnected( NumClients, server, clients ) )
+            break;
+    }
+
+    check( AllClientsConnected( NumClients, server, clients ) );
+
+    // one copy of the block is attached to a message for every client
+
+    const int BlockSize = 10000;
+
+    uint8_t * blockData = server.AllocateSharedBlock( BlockSize );
+    check( blockData );
+    for ( int i = 0; i < BlockSize; ++i )
+        blockData[i] = uint8_t( i * 7 );
+
+    for ( int clientIndex = 0; clientIndex < NumClients; ++clientIndex )
+    {
+        TestBlockMessage * message = (TestBlockMessage*) server.CreateMessage( clientIndex, TEST_BLOCK_MESSAGE );
+        check( message );
+        message->sequence = uint16_t( clientIndex );
+        server.AttachSharedBlockToMessage( clientIndex, message, blockData, BlockSize );
+        server.SendMessage( clientIndex, 0, message );
+    }
+
+    server.FreeSharedBlock( blockData );
+
+    bool blockReceived[NumClients];
+
+    memset( blockReceived, 0, sizeof( blockReceived ) );
+
+    const int NumIterations = 10000;
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        Server * servers[] = { &server };
+
+        PumpClientServerUpdate( time, clients, NumClients, servers, 1 );
+
+        bool allBlocksReceived = true;
+
+        for ( int j = 0; j < NumClients; ++j )
+        {
+            Message * message = clients[j]->ReceiveMessage( 0 );
+
+            if ( message )
+            {
+                check( message->GetType() == TEST_BLOCK_MESSAGE );
+                TestBlockMessage * blockMessage = (TestBlockMessage*) message;
+                check( blockMessage->sequence == uint16_t( clients[j]->GetClientIndex() ) );
+                check( blockMessage->GetBlockSize() == BlockSize );
+                const uint8_t * receivedBlockData = blockMessage->GetBlockData();
+                check( receivedBlockData );
+                for ( int k = 0; k < BlockSize; ++k )
+                    check( receivedBlockData[k] == uint8_t( k * 7 ) );
+                blockReceived[j] = true;
+                clients[j]->ReleaseMessage( message );
+            }
+
+            if ( !blockReceived[j] )
+                allBlocksReceived = false;
         }
 
-        server.ReleaseMessage( clientIndex, message );
+        if ( allBlocksReceived )
+            break;
+    }
+
+    for ( int j = 0; j < NumClients; ++j )
+    {
+        check( blockReceived[j] );
     }
+
+    DestroyClients( NumClients, clients );
+
+    server.Stop();
 }
 
-void test_client_server_messages()
+void test_client_server_client_memory_pool()
 {
-    const uint64_t clientId = 1;
-
-    Address clientAddress( "0.0.0.0", ClientPort );
+    Address clientAddress( "0.0.0.0", 0 );
     Address serverAddress( "127.0.0.1", ServerPort );
 
     double time = 100.0;
     
     ClientServerConfig config;
+    config.serverClientMemoryPool = 2;
     config.channel[0].messageSendQueueSize = 32;
     config.channel[0].maxMessagesPerPacket = 8;
     config.channel[0].maxBlockSize = 1024;
     config.channel[0].blockFragmentSize = 200;
 
-    Client client( GetDefaultAllocator(), clientAddress, config, adapter, time );
-
     uint8_t privateKey[KeyBytes];
     memset( privateKey, 0, KeyBytes );
 
     Server server( GetDefaultAllocator(), privateKey, serverAddress, config, adapter, time );
 
-    server.Start( MaxClients );
-
-    client.SetLatency( 250 );
-    client.SetJitter( 100 );
-    client.SetPacketLoss( 25 );
-    client.SetDuplicates( 25 );
+    server.Start( 8 );
 
-    server.SetLatency( 250 );
-    server.SetJitter( 100 );
-    server.SetPacketLoss( 25 );
-    server.SetDuplicates( 25 );
+    const int NumClients = 2;
 
     for ( int iteration = 0; iteration < 2; ++iteration )
     {
-        client.InsecureConnect( privateKey, clientId, serverAddress );
+        Client * clients[NumClients];
 
-        const int NumIterations = 10000;
+        CreateClients( NumClients, clients, clientAddress, config, adapter, time );
 
-        for ( int i = 0; i < NumIterations; ++i )
+        ConnectClients( NumClients, clients, privateKey, serverAddress );
+
+        for ( int i = 0; i < 10000; ++i )
         {
-            Client * clients[] = { &client };
             Server * servers[] = { &server };
-            
-            PumpClientServerUpdate( time, clients, 1, servers, 1 );
 
-            if ( client.ConnectionFailed() )
+            PumpClientServerUpdate( time, (Client**) clients, NumClients, servers, 1 );
+
+            if ( AnyClientDisconnected( NumClients, clients ) )
                 break;
 
-            if ( !client.IsConnecting() && client.IsConnected() && server.GetNumConnectedClients() == 1 )
+            if ( AllClientsConnected( NumClients, server, clients ) )
                 break;
         }
 
-        check( !client.IsConnecting() );
-        check( client.IsConnected() );
-        check( server.GetNumConnectedClients() == 1 );
-        check( client.GetClientIndex() == 0 );
-        check( server.IsClientConnected(0) );
-
-        const int NumMessagesSent = config.channel[0].messageSendQueueSize;
+        check( AllClientsConnected( NumClients, server, clients ) );
 
-        SendClientToServerMessages( client, NumMessagesSent );
+        // the pool is empty, so a third client gets disconnected
 
-        SendServerToClientMessages( server, client.GetClientIndex(), NumMessagesSent );
+        Client * extraClient = YOJIMBO_NEW( GetDefaultAllocator(), Client, GetDefaultAllocator(), clientAddress, config, adapter, time );
 
-        int numMessagesReceivedFromClient = 0;
-        int numMessagesReceivedFromServer = 0;
+        extraClient->InsecureConnect( privateKey, NumClients + 1, serverAddress );
 
-        for ( int i = 0; i < NumIterations; ++i )
+        for ( int i = 0; i < 10000; ++i )
         {
-            if ( !client.IsConnected() )
+            Server * servers[] = { &server };
+            Client * allClients[] = { clients[0], clients[1], extraClient };
+
+            PumpClientServerUpdate( time, allClients, NumClients + 1, servers, 1 );
+
+            if ( extraClient->IsDisconnected() )
                 break;
+        }
 
-            Client * clients[] = { &client };
+        check( extraClient->IsDisconnected() );
+        check( AllClientsConnected( NumClients, server, clients ) );
+
+        YOJIMBO_DELETE( GetDefaultAllocator(), Client, extraClient );
+
+        const int NumMessagesSent = config.channel[0].messageSendQueueSize;
+
+        for ( int clientIndex = 0; clientIndex < NumClients; ++clientIndex )
+        {
+            SendClientToServerMessages( *clients[clientIndex], NumMessagesSent );
+            SendServerToClientMessages( server, clients[clientIndex]->GetClientIndex(), NumMessagesSent );
+        }
+
+        int numMessagesReceivedFromClient[NumClients];
+        int numMessagesReceivedFromServer[NumClients];
+
+        memset( numMessagesReceivedFromClient, 0, sizeof( numMessagesReceivedFromClient ) );
+        memset( numMessagesReceivedFromServer, 0, sizeof( numMessagesReceivedFromServer ) );
+
+        for ( int i = 0; i < 10000; ++i )
+        {
             Server * servers[] = { &server };
 
-            PumpClientServerUpdate( time, clients, 1, servers, 1 );
+            PumpClientServerUpdate( time, clients, NumClients, servers, 1 );
 
-            ProcessServerToClientMessages( client, numMessagesReceivedFromServer );
+            bool allMessagesReceived = true;
 
-            ProcessClientToServerMessages( server, client.GetClientIndex(), numMessagesReceivedFromClient );
+            for ( int j = 0; j < NumClients; ++j )
+            {
+                ProcessServerToClientMessages( *clients[j], numMessagesReceivedFromServer[j] );
 
-            if ( numMessagesReceivedFromClient == NumMessagesSent && numMessagesReceivedFromServer == NumMessagesSent )
+                if ( numMessagesReceivedFromServer[j] != NumMessagesSent )
+                    allMessagesReceived = false;
+
+                ProcessClientToServerMessages( server, clients[j]->GetClientIndex(), numMessagesReceivedFromClient[j] );
+
+                if ( numMessagesReceivedFromClient[j] != NumMessagesSent )
+                    allMessagesReceived = false;
+            }
+
+            if ( allMessagesReceived )
                 break;
         }
 
-        check( client.IsConnected() );
-        check( server.IsClientConnected( client.GetClientIndex() ) );
-        check( numMessagesReceivedFromClient == NumMessagesSent );
-        check( numMessagesReceivedFromServer == NumMessagesSent );
+        for ( int j = 0; j < NumClients; ++j )
+        {
+            check( numMessagesReceivedFromClient[j] == NumMessagesSent );
+            check( numMessagesReceivedFromServer[j] == NumMessagesSent );
+        }
 
-        client.Disconnect();
+        // disconnecting returns the memory to the pool, so the next iteration can connect again
 
-        for ( int i = 0; i < NumIterations; ++i )
+        DestroyClients( NumClients, clients );
+
+        for ( int i = 0; i < 10000; ++i )
         {
-            Client * clients[] = { &client };
             Server * servers[] = { &server };
 
-            PumpClientServerUpdate( time, clients, 1, servers, 1 );
+            PumpClientServerUpdate( time, NULL, 0, servers, 1 );
 
-            if ( !client.IsConnected() && server.GetNumConnectedClients() == 0 )
+            if ( server.GetNumConnectedClients() == 0 )
                 break;
         }
 
-        check( !client.IsConnected() && server.GetNumConnectedClients() == 0 );
+        check( server.GetNumConnectedClients() == 0 );
     }
 
     server.Stop();
 }
 
-void CreateClients( int numClients, Client ** clients, const Address & address, const ClientServerConfig & config, Adapter & _adapter, double time )
+class TestActiveClientsServer : public Server
 {
-    for ( int i = 0; i < numClients; ++i )
-    {
-        clients[i] = YOJIMBO_NEW( GetDefaultAllocator(), Client, GetDefaultAllocator(), address, config, _adapter, time );
-        clients[i]->SetLatency( 250 );
-        clients[i]->SetJitter( 100 );
-        clients[i]->SetPacketLoss( 25 );
-        clients[i]->SetDuplicates( 25 );
-    }
-}
+public:
 
-void ConnectClients( int numClients, Client ** clients, const uint8_t privateKey[], const Address & serverAddress )
+    TestActiveClientsServer( Allocator & allocator, const uint8_t privateKey[], const Address & address, const ClientServerConfig & config, Adapter & _adapter, double time )
+        : Server( allocator, privateKey, address, config, _adapter, time ) {}
+
+    int GetNumActive() const { return GetNumActiveClients(); }
+
+    int GetActive( int index ) const { return GetActiveClients()[index]; }
+
+    bool HasSlot( int clientIndex ) const { return HasClientSlot( clientIndex ); }
+};
+
+void test_client_server_active_clients()
 {
-    for ( int i = 0; i < numClients; ++i )
+    Address clientAddress( "0.0.0.0", 0 );
+    Address serverAddress( "127.0.0.1", ServerPort );
+
+    double time = 100.0;
+
+    const int NumClients = 4;
+    
+    // with a client memory pool, disconnected clients give their slot back, so a slot exists only while its client is connected
+
+    ClientServerConfig config;
+    config.serverClientMemoryPool = NumClients;
+
+    uint8_t privateKey[KeyBytes];
+    memset( privateKey, 0, KeyBytes );
+
+    TestActiveClientsServer server( GetDefaultAllocator(), privateKey, serverAddress, config, adapter, time );
+
+    server.Start( NumClients );
+
+    Client * clients[NumClients];
+
+    CreateClients( NumClients, clients, clientAddress, config, adapter, time );
+
+    ConnectClients( NumClients, clients, privateKey, serverAddress );
+
+    for ( int i = 0; i < 10000; ++i )
     {
-        clients[i]->InsecureConnect( privateKey, i + 1, serverAddress );
+        Server * servers[] = { &server };
+
+        PumpClientServerUpdate( time, clients, NumClients, servers, 1 );
+
+        if ( AnyClientDisconnected( NumClients, clients ) || AllClientsConnected( NumClients, server, clients ) )
+            break;
     }
-}
 
-void DestroyClients( int numClients, Client ** clients )
-{
-    for ( int i = 0; i < numClients; ++i )
-    {
-        clients[i]->Disconnect();
+    check( AllClientsConnected( NumClients, server, clients ) );
+    check( server.GetNumActive() == NumClients );
+    for ( int i = 0; i < NumClients; ++i )
+        check( server.GetActive( i ) == i );
 
-        YOJIMBO_DELETE( GetDefaultAllocator(), Client, clients[i] );
+    // disconnect one client from the middle and one from the end. the active list stays sorted and the slots are released
+
+    server.DisconnectClient( 1 );
+    server.DisconnectClient( 3 );
+
+    check( server.GetNumActive() == 2 );
+    check( server.GetActive( 0 ) == 0 );
+    check( server.GetActive( 1 ) == 2 );
+    check( !server.HasSlot( 1 ) );
+    check( !server.HasSlot( 3 ) );
+
+    // sending, receiving and advancing time only visit the remaining clients, which get exactly one packet per update
+
+    NetworkInfo before[NumClients];
+    server.GetNetworkInfo( 0, before[0] );
+    server.GetNetworkInfo( 2, before[2] );
+
+    const int NumUpdates = 10;
+
+    for ( int i = 0; i < NumUpdates; ++i )
+    {
+        Server * servers[] = { &server };
+        PumpClientServerUpdate( time, clients, NumClients, servers, 1 );
     }
-}
 
-bool AllClientsConnected( int numClients, Server & server, Client ** clients )
-{
-    if ( server.GetNumConnectedClients() != numClients )
-        return false;
+    check( clients[0]->IsConnected() );
+    check( clients[2]->IsConnected() );
+    check( server.GetNumActive() == 2 );
 
-    for ( int i = 0; i < numClients; ++i )
+    NetworkInfo after;
+    server.GetNetworkInfo( 0, after );
+    check( after.numPacketsSent == before[0].numPacketsSent + NumUpdates );
+    server.GetNetworkInfo( 2, after );
+    check( after.numPacketsSent == before[2].numPacketsSent + NumUpdates );
+
+    // reconnect. the clients fill the free slots and the list is back in order
+
+    for ( int i = 0; i < 10000; ++i )
     {
-        if ( !clients[i]->IsConnected() )
-            return false;
+        if ( clients[1]->IsDisconnected() && clients[3]->IsDisconnected() )
+            break;
+        Server * servers[] = { &server };
+        PumpClientServerUpdate( time, clients, NumClients, servers, 1 );
     }
 
-    return true;    
-}
+    check( clients[1]->IsDisconnected() );
+    check( clients[3]->IsDisconnected() );
 
-bool AnyClientDisconnected( int numClients, Client ** clients )
-{
-    for ( int i = 0; i < numClients; ++i )
+    clients[1]->InsecureConnect( privateKey, NumClients + 1, serverAddress );
+    clients[3]->InsecureConnect( privateKey, NumClients + 2, serverAddress );
+
+    for ( int i = 0; i < 10000; ++i )
     {
-        if ( clients[i]->IsDisconnected() )
-            return true;
+        Server * servers[] = { &server };
+
+        PumpClientServerUpdate( time, clients, NumClients, servers, 1 );
+
+        if ( AnyClientDisconnected( NumClients, clients ) || AllClientsConnected( NumClients, server, clients ) )
+            break;
     }
 
-    return false;
+    check( AllClientsConnected( NumClients, server, clients ) );
+    check( server.GetNumActive() == NumClients );
+    for ( int i = 0; i < NumClients; ++i )
+    {
+        check( server.GetActive( i ) == i );
+        check( server.HasSlot( i ) );
+    }
+
+    DestroyClients( NumClients, clients );
+
+    server.Stop();
 }
 
-void test_client_server_start_stop_restart()
+void test_client_server_flush()
 {
-    Address clientAddress( "0.0.0.0", 0 );
+    Address clientAddress( "0.0.0.0", ClientPort );
     Address serverAddress( "127.0.0.1", ServerPort );
 
     double time = 100.0;
-    
+
     ClientServerConfig config;
-    config.channel[0].messageSendQueueSize = 32;
-    config.channel[0].maxMessagesPerPacket = 8;
-    config.channel[0].maxBlockSize = 1024;
-    config.channel[0].blockFragmentSize = 200;
+    config.minFlushInterval = 0.1f;
 
     uint8_t privateKey[KeyBytes];
     memset( privateKey, 0, KeyBytes );
@@ -1787,93 +4449,86 @@ void test_client_server_start_stop_restart()
 
     server.Start( MaxClients );
 
-    server.SetLatency( 250 );
-    server.SetJitter( 100 );
-    server.SetPacketLoss( 25 );
-    server.SetDuplicates( 25 );
-
-    int numClients[] = { 3, 5, 1 };
+    Client client( GetDefaultAllocator(), clientAddress, config, adapter, time );
 
-    const int NumIterations = sizeof( numClients ) / sizeof( int );
+    client.InsecureConnect( privateKey, 1, serverAddress );
 
-    for ( int iteration = 0; iteration < NumIterations; ++iteration )
+    for ( int i = 0; i < 10000; ++i )
     {
-        server.Start( numClients[iteration] );
+        Client * clients[] = { &client };
+        Server * servers[] = { &server };
 
-        Client * clients[MaxClients];
+        PumpClientServerUpdate( time, clients, 1, servers, 1 );
 
-        CreateClients( numClients[iteration], clients, clientAddress, config, adapter, time );
+        if ( client.ConnectionFailed() || ( client.IsConnected() && server.GetNumConnectedClients() == 1 ) )
+            break;
+    }
 
-        ConnectClients( numClients[iteration], clients, privateKey, serverAddress );
+    check( client.IsConnected() );
+    check( server.GetNumConnectedClients() == 1 );
 
-        while ( true )
-        {
-            Server * servers[] = { &server };
+    // flush twice at the same time. the second flush is held back until the flush interval has passed
 
-            PumpClientServerUpdate( time, (Client**) clients, numClients[iteration], servers, 1 );
+    NetworkInfo before;
+    client.GetNetworkInfo( before );
 
-            if ( AnyClientDisconnected( numClients[iteration], clients ) )
-                break;
+    NetworkInfo after;
 
-            if ( AllClientsConnected( numClients[iteration], server, clients ) )
-                break;
-        }
+    for ( int i = 0; i < 2; ++i )
+    {
+        TestMessage * message = (TestMessage*) client.CreateMessage( TEST_MESSAGE );
+        check( message );
+        message->sequence = uint16_t( i );
+        client.SendMessage( 0, message );
 
-        check( AllClientsConnected( numClients[iteration], server, clients ) );
+        client.FlushPackets( time );
 
-        const int NumMessagesSent = config.channel[0].messageSendQueueSize;
+        client.GetNetworkInfo( after );
+        check( after.numPacketsSent == before.numPacketsSent + 1 );
+    }
 
-        for ( int clientIndex = 0; clientIndex < numClients[iteration]; ++clientIndex )
-        {
-            SendClientToServerMessages( *clients[clientIndex], NumMessagesSent );
-            SendServerToClientMessages( server, clientIndex, NumMessagesSent );
-        }
+    client.FlushPackets( time + config.minFlushInterval * 0.5 );
 
-        int numMessagesReceivedFromClient[MaxClients];
-        int numMessagesReceivedFromServer[MaxClients];
+    client.GetNetworkInfo( after );
+    check( after.numPacketsSent == before.numPacketsSent + 1 );
 
-        memset( numMessagesReceivedFromClient, 0, sizeof( numMessagesReceivedFromClient ) );
-        memset( numMessagesReceivedFromServer, 0, sizeof( numMessagesReceivedFromServer ) );
+    client.FlushPackets( time + config.minFlushInterval );
 
-		const int NumInternalIterations = 10000;
+    client.GetNetworkInfo( after );
+    check( after.numPacketsSent == before.numPacketsSent + 2 );
 
-        for ( int i = 0; i < NumInternalIterations; ++i )
-        {
-            Server * servers[] = { &server };
+    // nothing new to send, so nothing is flushed
 
-            PumpClientServerUpdate( time, clients, numClients[iteration], servers, 1 );
+    client.FlushPackets( time + config.minFlushInterval * 2 );
 
-            bool allMessagesReceived = true;
+    client.GetNetworkInfo( after );
+    check( after.numPacketsSent == before.numPacketsSent + 2 );
 
-            for ( int j = 0; j < numClients[iteration]; ++j )
-            {
-                ProcessServerToClientMessages( *clients[j], numMessagesReceivedFromServer[j] );
+    // the server coalesces flushes to each client the same way
 
-                if ( numMessagesReceivedFromServer[j] != NumMessagesSent )
-                    allMessagesReceived = false;
+    server.GetNetworkInfo( 0, before );
 
-                int clientIndex = clients[j]->GetClientIndex();
+    for ( int i = 0; i < 2; ++i )
+    {
+        TestMessage * message = (TestMessage*) server.CreateMessage( 0, TEST_MESSAGE );
+        check( message );
+        message->sequence = uint16_t( i );
+        server.SendMessage( 0, 0, message );
 
-                ProcessClientToServerMessages( server, clientIndex, numMessagesReceivedFromClient[clientIndex] );
+        server.FlushPackets( time, 0 );
 
-                if ( numMessagesReceivedFromClient[clientIndex] != NumMessagesSent )
-                    allMessagesReceived = false;
-            }
+        server.GetNetworkInfo( 0, after );
+        check( after.numPacketsSent == before.numPacketsSent + 1 );
+    }
 
-            if ( allMessagesReceived )
-                break;
-        }
+    server.FlushPackets( time + config.minFlushInterval, 0 );
 
-        for ( int clientIndex = 0; clientIndex < numClients[iteration]; ++clientIndex )
-        {
-            check( numMessagesReceivedFromClient[clientIndex] == NumMessagesSent );
-            check( numMessagesReceivedFromServer[clientIndex] == NumMessagesSent );
-        }
+    server.GetNetworkInfo( 0, after );
+    check( after.numPacketsSent == before.numPacketsSent + 2 );
 
-        DestroyClients( numClients[iteration], clients );
+    client.Disconnect();
 
-        server.Stop();
-    }
+    server.Stop();
 }
 
 void test_client_server_message_failed_to_serialize_reliable_ordered()
@@ -2533,20 +5188,47 @@ int main()
         RUN_TEST( test_bitpacker );
         RUN_TEST( test_bits_required );
         RUN_TEST( test_stream );
+        RUN_TEST( test_sequence_relative_bits );
         RUN_TEST( test_address );
         RUN_TEST( test_bit_array );
         RUN_TEST( test_sequence_buffer );
         RUN_TEST( test_allocator_tlsf );
+        RUN_TEST( test_allocator_bump );
+        RUN_TEST( test_allocator_block );
+        RUN_TEST( test_message_factory_pooled );
+        RUN_TEST( test_message_factory_out_of_memory );
 
         RUN_TEST( test_connection_reliable_ordered_messages );
+        RUN_TEST( test_connection_reliable_ordered_message_cache );
         RUN_TEST( test_connection_reliable_ordered_blocks );
         RUN_TEST( test_connection_reliable_ordered_messages_and_blocks );
+        RUN_TEST( test_connection_reliable_ordered_pipelined_blocks );
         RUN_TEST( test_connection_reliable_ordered_messages_and_blocks_multiple_channels );
+        RUN_TEST( test_reliable_ordered_channel_resend_queue );
+        RUN_TEST( test_reliable_ordered_channel_adaptive_resend );
+        RUN_TEST( test_connection_reliable_ordered_keys );
+        RUN_TEST( test_connection_channel_weights );
+        RUN_TEST( test_connection_channel_weights_blocks );
+        RUN_TEST( test_congestion_controller );
+        RUN_TEST( test_connection_flush );
+        RUN_TEST( test_max_min_fair_share );
+        RUN_TEST( test_connection_reliable_unordered_messages );
+        RUN_TEST( test_connection_reliable_latest_value );
+        RUN_TEST( test_connection_reliable_latest_value_many_keys );
         RUN_TEST( test_connection_unreliable_unordered_messages );
         RUN_TEST( test_connection_unreliable_unordered_blocks );
+        RUN_TEST( test_connection_unreliable_sequenced_messages );
+        RUN_TEST( test_connection_snapshot_delta );
+        RUN_TEST( test_connection_snapshot_delta_baseline_eviction );
 
         RUN_TEST( test_client_server_messages );
         RUN_TEST( test_client_server_start_stop_restart );
+        RUN_TEST( test_client_server_worker_threads );
+        RUN_TEST( test_client_server_broadcast_messages );
+        RUN_TEST( test_client_server_shared_blocks );
+        RUN_TEST( test_client_server_client_memory_pool );
+        RUN_TEST( test_client_server_active_clients );
+        RUN_TEST( test_client_server_flush );
         RUN_TEST( test_client_server_message_failed_to_serialize_reliable_ordered );
         RUN_TEST( test_client_server_message_failed_to_serialize_unreliable_unordered );
         RUN_TEST( test_client_server_message_exhaust_stream_allocator );
@@ -34,6 +34,12 @@
 #include <map>
 #endif // YOJIMBO_DEBUG_MEMORY_LEAKS
 
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
 static yojimbo::Allocator * g_defaultAllocator = NULL;
 
 namespace yojimbo
@@ -341,6 +347,176 @@ namespace yojimbo
 
         tlsf_free( m_tlsf, p );
     }
+
+    BumpAllocator::BumpAllocator( Allocator & allocator, size_t bytes )
+    {
+        yojimbo_assert( bytes > 0 );
+
+        SetErrorLevel( ALLOCATOR_ERROR_NONE );
+
+        m_allocator = &allocator;
+        m_memory = (uint8_t*) YOJIMBO_ALLOCATE( allocator, bytes );
+        m_size = m_memory ? bytes : 0;
+        m_offset = 0;
+    }
+
+    BumpAllocator::~BumpAllocator()
+    {
+        YOJIMBO_FREE( *m_allocator, m_memory );
+    }
+
+    void * BumpAllocator::Allocate( size_t size, const char * file, int line )
+    {
+        const size_t AlignBytes = 8;
+
+        const size_t offset = ( m_offset + AlignBytes - 1 ) & ~( AlignBytes - 1 );
+
+        if ( offset + size <= m_size )
+        {
+            m_offset = offset + size;
+            return m_memory + offset;
+        }
+
+        void * p = m_allocator->Allocate( size, file, line );
+
+        if ( !p )
+        {
+            SetErrorLevel( ALLOCATOR_ERROR_OUT_OF_MEMORY );
+            return NULL;
+        }
+
+        return p;
+    }
+
+    void BumpAllocator::Free( void * p, const char * file, int line )
+    {
+        if ( !p )
+            return;
+
+        if ( (uint8_t*) p >= m_memory && (uint8_t*) p < m_memory + m_size )
+            return;
+
+        m_allocator->Free( p, file, line );
+    }
+
+    void BumpAllocator::Reset()
+    {
+        m_offset = 0;
+    }
+
+    BlockAllocator::BlockAllocator( Allocator & allocator )
+    {
+        SetErrorLevel( ALLOCATOR_ERROR_NONE );
+
+        m_allocator = &allocator;
+        memset( m_freeList, 0, sizeof( m_freeList ) );
+        memset( m_stats, 0, sizeof( m_stats ) );
+    }
+
+    BlockAllocator::~BlockAllocator()
+    {
+        Trim();
+    }
+
+    void * BlockAllocator::Allocate( size_t size, const char * file, int line )
+    {
+        yojimbo_assert( size <= ( size_t(1) << MaxSizeClassBits ) );
+
+        const int sizeClass = ( size <= ( size_t(1) << MinSizeClassBits ) ) ? 0 : bits_required( 0, uint32_t( size - 1 ) ) - MinSizeClassBits;
+
+        yojimbo_assert( sizeClass >= 0 );
+        yojimbo_assert( sizeClass < NumSizeClasses );
+        yojimbo_assert( size <= GetSizeClassBytes( sizeClass ) );
+
+        BlockAllocatorStats & stats = m_stats[sizeClass];
+
+        uint8_t * header = (uint8_t*) m_freeList[sizeClass];
+
+        if ( header )
+        {
+            m_freeList[sizeClass] = *( (void**) header );
+            stats.numFree--;
+            stats.numRecycled++;
+        }
+        else
+        {
+            header = (uint8_t*) m_allocator->Allocate( GetSizeClassBytes( sizeClass ) + HeaderBytes, file, line );
+
+            if ( !header )
+            {
+                // memory held in the free lists of other size classes may be what's missing
+
+                Trim();
+
+                header = (uint8_t*) m_allocator->Allocate( GetSizeClassBytes( sizeClass ) + HeaderBytes, file, line );
+            }
+
+            if ( !header )
+            {
+                SetErrorLevel( ALLOCATOR_ERROR_OUT_OF_MEMORY );
+                return NULL;
+            }
+        }
+
+        *( (uint32_t*) ( header + sizeof( void* ) ) ) = uint32_t( sizeClass );
+
+        stats.numAllocated++;
+        stats.numLive++;
+        if ( stats.numLive > stats.maxLive )
+            stats.maxLive = stats.numLive;
+
+        TrackAlloc( header + HeaderBytes, size, file, line );
+
+        return header + HeaderBytes;
+    }
+
+    void BlockAllocator::Free( void * p, const char * file, int line )
+    {
+        if ( !p )
+            return;
+
+        TrackFree( p, file, line );
+
+        uint8_t * header = ( (uint8_t*) p ) - HeaderBytes;
+
+        const int sizeClass = (int) *( (uint32_t*) ( header + sizeof( void* ) ) );
+
+        yojimbo_assert( sizeClass >= 0 );
+        yojimbo_assert( sizeClass < NumSizeClasses );
+
+        BlockAllocatorStats & stats = m_stats[sizeClass];
+
+        yojimbo_assert( stats.numLive > 0 );
+
+        stats.numLive--;
+
+        *( (void**) header ) = m_freeList[sizeClass];
+        m_freeList[sizeClass] = header;
+        stats.numFree++;
+    }
+
+    void BlockAllocator::Trim()
+    {
+        for ( int i = 0; i < NumSizeClasses; ++i )
+        {
+            void * header = m_freeList[i];
+            while ( header )
+            {
+                void * next = *( (void**) header );
+                YOJIMBO_FREE( *m_allocator, header );
+                header = next;
+            }
+            m_freeList[i] = NULL;
+            m_stats[i].numFree = 0;
+        }
+    }
+
+    const BlockAllocatorStats & BlockAllocator::GetStats( int sizeClass ) const
+    {
+        yojimbo_assert( sizeClass >= 0 );
+        yojimbo_assert( sizeClass < NumSizeClasses );
+        return m_stats[sizeClass];
+    }
 }
 
 // ---------------------------------------------------------------------------------
@@ -664,6 +840,10 @@ namespace yojimbo
 #include "yojimbo.h"
 #include "netcode.h"
 #include "reliable.h"
+
+#if YOJIMBO_MAX_CLIENTS > NETCODE_MAX_CLIENTS
+#error YOJIMBO_MAX_CLIENTS must not exceed NETCODE_MAX_CLIENTS
+#endif // #if YOJIMBO_MAX_CLIENTS > NETCODE_MAX_CLIENTS
 #include <stdarg.h>
 #include <stdio.h>
 
@@ -1109,14 +1289,20 @@ namespace yojimbo
         channelIndex = 0;
         blockMessage = 0;
         messageFailedToSerialize = 0;
+        baselineMissing = 0;
         message.numMessages = 0;
+        message.sequence = 0;
         initialized = 1;
     }
 
     void ChannelPacketData::Free( MessageFactory & messageFactory )
+    {
+        Free( messageFactory, messageFactory.GetAllocator() );
+    }
+
+    void ChannelPacketData::Free( MessageFactory & messageFactory, Allocator & allocator )
     {
         yojimbo_assert( initialized );
-        Allocator & allocator = messageFactory.GetAllocator();
         if ( !blockMessage )
         {
             if ( message.numMessages > 0 )
@@ -1133,24 +1319,115 @@ namespace yojimbo
         }
         else
         {
-            if ( block.message )
+            if ( block.numPacketFragments > 0 )
             {
-                messageFactory.ReleaseMessage( block.message );
-                block.message = NULL;
+                for ( int i = 0; i < block.numPacketFragments; ++i )
+                {
+                    if ( block.fragments[i].message )
+                    {
+                        messageFactory.ReleaseMessage( block.fragments[i].message );
+                        block.fragments[i].message = NULL;
+                    }
+                    if ( block.fragments[i].ownsFragmentData )
+                    {
+                        YOJIMBO_FREE( allocator, block.fragments[i].fragmentData );
+                    }
+                }
+                YOJIMBO_FREE( allocator, block.fragments );
             }
-            YOJIMBO_FREE( allocator, block.fragmentData );
         }
         initialized = 0;
     }
 
+    template <typename Stream> bool SerializeOrderedMessage( Stream & stream, 
+                                                             MessageFactory & messageFactory, 
+                                                             Message * & message, 
+                                                             uint16_t messageId, 
+                                                             int maxOrderingOffset, 
+                                                             bool supersededMessages )
+    {
+        const int maxMessageType = messageFactory.GetNumTypes() - 1;
+
+        int messageType = Stream::IsWriting ? message->GetType() : 0;
+
+        if ( maxMessageType > 0 )
+            serialize_int( stream, messageType, 0, maxMessageType );
+
+        if ( Stream::IsReading )
+        {
+            message = messageFactory.CreateMessage( messageType );
+
+            if ( !message )
+            {
+                yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: failed to create message of type %d (SerializeOrderedMessages)\n", messageType );
+                return false;
+            }
+
+            message->SetId( messageId );
+        }
+
+        yojimbo_assert( message );
+
+        if ( supersededMessages )
+        {
+            // superseded messages are sent without their contents. the receiver only needs the id to skip over them
+
+            bool superseded = Stream::IsWriting && message->IsSuperseded();
+
+            serialize_bool( stream, superseded );
+
+            if ( superseded )
+            {
+                if ( Stream::IsReading )
+                    message->SetSuperseded();
+                return true;
+            }
+        }
+
+        if ( !message->SerializeInternal( stream ) )
+        {
+            yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: failed to serialize message of type %d (SerializeOrderedMessages)\n", messageType );
+            return false;
+        }
+
+        if ( maxOrderingOffset > 0 )
+        {
+            int orderingOffset = Stream::IsWriting ? message->GetOrderingOffset() : 0;
+            serialize_int( stream, orderingOffset, 0, maxOrderingOffset );
+            if ( Stream::IsReading )
+                message->SetOrderingOffset( uint16_t( orderingOffset ) );
+        }
+
+        return true;
+    }
+
+    inline bool write_cached_message( WriteStream & stream, const Message * message, const ReliableOrderedChannel * channel )
+    {
+        const uint32_t * data;
+        int bits;
+        if ( !channel || !channel->GetCachedMessage( uint16_t( message->GetId() ), data, bits ) )
+            return false;
+        return stream.SerializeBitArray( data, bits );
+    }
+
+    template <typename Stream> bool write_cached_message( Stream & stream, const Message * message, const ReliableOrderedChannel * channel )
+    {
+        (void) stream;
+        (void) message;
+        (void) channel;
+        return false;
+    }
+
     template <typename Stream> bool SerializeOrderedMessages( Stream & stream, 
                                                               MessageFactory & messageFactory, 
+                                                              Allocator & allocator, 
                                                               int & numMessages, 
                                                               Message ** & messages, 
-                                                              int maxMessagesPerPacket )
+                                                              int maxMessagesPerPacket, 
+                                                              int maxOrderingOffset, 
+                                                              bool supersededMessages,
+                                                              const ReliableOrderedChannel * channel )
     {
-        const int maxMessageType = messageFactory.GetNumTypes() - 1;
-
         bool hasMessages = Stream::IsWriting && numMessages != 0;
 
         serialize_bool( stream, hasMessages );
@@ -1159,11 +1436,8 @@ namespace yojimbo
         {
             serialize_int( stream, numMessages, 1, maxMessagesPerPacket );
 
-            int * messageTypes = (int*) alloca( sizeof( int ) * numMessages );
-
             uint16_t * messageIds = (uint16_t*) alloca( sizeof( uint16_t ) * numMessages );
 
-            memset( messageTypes, 0, sizeof( int ) * numMessages );
             memset( messageIds, 0, sizeof( uint16_t ) * numMessages );
 
             if ( Stream::IsWriting )
@@ -1173,14 +1447,11 @@ namespace yojimbo
                 for ( int i = 0; i < numMessages; ++i )
                 {
                     yojimbo_assert( messages[i] );
-                    messageTypes[i] = messages[i]->GetType();
                     messageIds[i] = messages[i]->GetId();
                 }
             }
             else
             {
-                Allocator & allocator = messageFactory.GetAllocator();
-
                 messages = (Message**) YOJIMBO_ALLOCATE( allocator, sizeof( Message* ) * numMessages );
 
                 for ( int i = 0; i < numMessages; ++i )
@@ -1196,35 +1467,13 @@ namespace yojimbo
 
             for ( int i = 0; i < numMessages; ++i )
             {
-                if ( maxMessageType > 0 )
-                {
-                    serialize_int( stream, messageTypes[i], 0, maxMessageType );
-                }
-                else
-                {
-                    messageTypes[i] = 0;
-                }
-
-                if ( Stream::IsReading )
-                {
-                    messages[i] = messageFactory.CreateMessage( messageTypes[i] );
-
-                    if ( !messages[i] )
-                    {
-                        yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: failed to create message of type %d (SerializeOrderedMessages)\n", messageTypes[i] );
-                        return false;
-                    }
+                // messages that are being resent are copied from the message cache of the sending channel, when they are in it
 
-                    messages[i]->SetId( messageIds[i] );
-                }
-
-                yojimbo_assert( messages[i] );
+                if ( Stream::IsWriting && write_cached_message( stream, messages[i], channel ) )
+                    continue;
 
-                if ( !messages[i]->SerializeInternal( stream ) )
-                {
-                    yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: failed to serialize message of type %d (SerializeOrderedMessages)\n", messageTypes[i] );
+                if ( !SerializeOrderedMessage( stream, messageFactory, messages[i], messageIds[i], maxOrderingOffset, supersededMessages ) )
                     return false;
-                }
             }
         }
 
@@ -1241,7 +1490,7 @@ namespace yojimbo
 
         if ( Stream::IsReading )
         {
-            Allocator & allocator = messageFactory.GetAllocator();
+            Allocator & allocator = messageFactory.GetBlockAllocator();
             blockData = (uint8_t*) YOJIMBO_ALLOCATE( allocator, blockSize );
             if ( !blockData )
             {
@@ -1262,6 +1511,7 @@ namespace yojimbo
 
     template <typename Stream> bool SerializeUnorderedMessages( Stream & stream, 
                                                                 MessageFactory & messageFactory, 
+                                                                Allocator & allocator, 
                                                                 int & numMessages, 
                                                                 Message ** & messages, 
                                                                 int maxMessagesPerPacket, 
@@ -1293,8 +1543,6 @@ namespace yojimbo
             }
             else
             {
-                Allocator & allocator = messageFactory.GetAllocator();
-
                 messages = (Message**) YOJIMBO_ALLOCATE( allocator, sizeof( Message* ) * numMessages );
 
                 for ( int i = 0; i < numMessages; ++i )
@@ -1346,81 +1594,211 @@ namespace yojimbo
         return true;
     }
 
-    template <typename Stream> bool SerializeBlockFragment( Stream & stream, 
-                                                            MessageFactory & messageFactory, 
-                                                            ChannelPacketData::BlockData & block, 
-                                                            const ChannelConfig & channelConfig )
+    template <typename Stream> bool SerializeSnapshotMessages( Stream & stream, 
+                                                               MessageFactory & messageFactory, 
+                                                               Allocator & allocator, 
+                                                               int & numMessages, 
+                                                               Message ** & messages, 
+                                                               const ChannelConfig & channelConfig, 
+                                                               const SnapshotDeltaChannel * channel, 
+                                                               bool & baselineMissing )
     {
         const int maxMessageType = messageFactory.GetNumTypes() - 1;
 
-        serialize_bits( stream, block.messageId, 16 );
+        bool hasMessages = Stream::IsWriting && numMessages != 0;
 
-        if ( channelConfig.GetMaxFragmentsPerBlock() > 1 )
-        {
-            serialize_int( stream, block.numFragments, 1, channelConfig.GetMaxFragmentsPerBlock() );
-        }
-        else
-        {
-            if ( Stream::IsReading )
-                block.numFragments = 1;
-        }
+        serialize_bool( stream, hasMessages );
 
-        if ( block.numFragments > 1 )
-        {
-            serialize_int( stream, block.fragmentId, 0, block.numFragments - 1 );
-        }
-        else
+        if ( hasMessages )
         {
-            if ( Stream::IsReading )
-                block.fragmentId = 0;
-        }
+            serialize_int( stream, numMessages, 1, channelConfig.maxMessagesPerPacket );
 
-        serialize_int( stream, block.fragmentSize, 1, channelConfig.blockFragmentSize );
+            int * messageTypes = (int*) alloca( sizeof( int ) * numMessages );
 
-        if ( Stream::IsReading )
-        {
-            block.fragmentData = (uint8_t*) YOJIMBO_ALLOCATE( messageFactory.GetAllocator(), block.fragmentSize );
+            memset( messageTypes, 0, sizeof( int ) * numMessages );
 
-            if ( !block.fragmentData )
+            if ( Stream::IsWriting )
             {
-                yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: failed to serialize block fragment (SerializeBlockFragment)\n" );
-                return false;
-            }
-        }
-
-        serialize_bytes( stream, block.fragmentData, block.fragmentSize );
-
-        if ( block.fragmentId == 0 )
-        {
-            // block message
+                yojimbo_assert( messages );
 
-            if ( maxMessageType > 0 )
-            {
-                serialize_int( stream, block.messageType, 0, maxMessageType );
+                for ( int i = 0; i < numMessages; ++i )
+                {
+                    yojimbo_assert( messages[i] );
+                    messageTypes[i] = messages[i]->GetType();
+                }
             }
             else
             {
-                block.messageType = 0;
+                messages = (Message**) YOJIMBO_ALLOCATE( allocator, sizeof( Message* ) * numMessages );
+
+                for ( int i = 0; i < numMessages; ++i )
+                    messages[i] = NULL;
             }
 
-            if ( Stream::IsReading )
+            for ( int i = 0; i < numMessages; ++i )
             {
-                Message * message = messageFactory.CreateMessage( block.messageType );
-
-                if ( !message )
+                if ( maxMessageType > 0 )
                 {
-                    yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: failed to create block message type %d (SerializeBlockFragment)\n", block.messageType );
-                    return false;
+                    serialize_int( stream, messageTypes[i], 0, maxMessageType );
                 }
-
-                if ( !message->IsBlockMessage() )
+                else
                 {
-                    yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: received block fragment attached to non-block message (SerializeBlockFragment)\n" );
-                    return false;
+                    messageTypes[i] = 0;
                 }
 
-                block.message = (BlockMessage*) message;
-            }
+                if ( Stream::IsReading )
+                {
+                    messages[i] = messageFactory.CreateMessage( messageTypes[i] );
+
+                    if ( !messages[i] )
+                    {
+                        yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: failed to create message type %d (SerializeSnapshotMessages)\n", messageTypes[i] );
+                        return false;
+                    }
+                }
+
+                yojimbo_assert( messages[i] );
+
+                // the baseline is sent as an offset back from the snapshot id. it is always within the snapshot history
+
+                uint32_t snapshotId = Stream::IsWriting ? messages[i]->GetId() : 0;
+
+                serialize_bits( stream, snapshotId, 16 );
+
+                const Message * baseline = Stream::IsWriting ? messages[i]->GetBaseline() : NULL;
+
+                bool hasBaseline = baseline != NULL;
+
+                serialize_bool( stream, hasBaseline );
+
+                if ( hasBaseline )
+                {
+                    int baselineOffset = Stream::IsWriting ? uint16_t( snapshotId - baseline->GetId() ) : 0;
+
+                    serialize_int( stream, baselineOffset, 1, channelConfig.snapshotHistorySize - 1 );
+
+                    if ( Stream::IsReading )
+                    {
+                        yojimbo_assert( channel );
+
+                        baseline = channel->FindReceivedSnapshot( uint16_t( snapshotId - baselineOffset ) );
+
+                        if ( !baseline )
+                        {
+                            baselineMissing = true;
+                            return false;
+                        }
+                    }
+                }
+
+                if ( Stream::IsReading )
+                {
+                    messages[i]->SetId( uint16_t( snapshotId ) );
+                    messages[i]->SetBaseline( baseline );
+                }
+
+                if ( !messages[i]->SerializeInternal( stream ) )
+                {
+                    yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: failed to serialize message type %d (SerializeSnapshotMessages)\n", messageTypes[i] );
+                    return false;
+                }
+
+                if ( Stream::IsReading )
+                    messages[i]->SetBaseline( NULL );
+
+                if ( messages[i]->IsBlockMessage() )
+                {
+                    BlockMessage * blockMessage = (BlockMessage*) messages[i];
+                    if ( !SerializeMessageBlock( stream, messageFactory, blockMessage, channelConfig.maxBlockSize ) )
+                    {
+                        yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: failed to serialize message block (SerializeSnapshotMessages)\n" );
+                        return false;
+                    }
+                }
+            }
+        }
+
+        return true;
+    }
+
+    template <typename Stream> bool SerializeBlockFragment( Stream & stream, 
+                                                            MessageFactory & messageFactory, 
+                                                            Allocator & allocator, 
+                                                            ChannelPacketData::FragmentData & block, 
+                                                            const ChannelConfig & channelConfig )
+    {
+        const int maxMessageType = messageFactory.GetNumTypes() - 1;
+
+        serialize_bits( stream, block.messageId, 16 );
+
+        if ( channelConfig.GetMaxFragmentsPerBlock() > 1 )
+        {
+            serialize_int( stream, block.numFragments, 1, channelConfig.GetMaxFragmentsPerBlock() );
+        }
+        else
+        {
+            if ( Stream::IsReading )
+                block.numFragments = 1;
+        }
+
+        if ( block.numFragments > 1 )
+        {
+            serialize_int( stream, block.fragmentId, 0, block.numFragments - 1 );
+        }
+        else
+        {
+            if ( Stream::IsReading )
+                block.fragmentId = 0;
+        }
+
+        serialize_int( stream, block.fragmentSize, 1, channelConfig.blockFragmentSize );
+
+        if ( Stream::IsReading )
+        {
+            block.fragmentData = (uint8_t*) YOJIMBO_ALLOCATE( allocator, block.fragmentSize );
+
+            if ( !block.fragmentData )
+            {
+                yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: failed to serialize block fragment (SerializeBlockFragment)\n" );
+                return false;
+            }
+
+            block.ownsFragmentData = 1;
+        }
+
+        serialize_bytes( stream, block.fragmentData, block.fragmentSize );
+
+        if ( block.fragmentId == 0 )
+        {
+            // block message
+
+            if ( maxMessageType > 0 )
+            {
+                serialize_int( stream, block.messageType, 0, maxMessageType );
+            }
+            else
+            {
+                block.messageType = 0;
+            }
+
+            if ( Stream::IsReading )
+            {
+                Message * message = messageFactory.CreateMessage( block.messageType );
+
+                if ( !message )
+                {
+                    yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: failed to create block message type %d (SerializeBlockFragment)\n", block.messageType );
+                    return false;
+                }
+
+                if ( !message->IsBlockMessage() )
+                {
+                    yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: received block fragment attached to non-block message (SerializeBlockFragment)\n" );
+                    return false;
+                }
+
+                block.message = (BlockMessage*) message;
+            }
 
             yojimbo_assert( block.message );
 
@@ -1429,6 +1807,16 @@ namespace yojimbo
                 yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: failed to serialize block message of type %d (SerializeBlockFragment)\n", block.messageType );
                 return false;
             }
+
+            const int maxOrderingOffset = channelConfig.GetMaxOrderingOffset();
+
+            if ( maxOrderingOffset > 0 )
+            {
+                int orderingOffset = Stream::IsWriting ? block.message->GetOrderingOffset() : 0;
+                serialize_int( stream, orderingOffset, 0, maxOrderingOffset );
+                if ( Stream::IsReading )
+                    block.message->SetOrderingOffset( uint16_t( orderingOffset ) );
+            }
         }
         else
         {
@@ -1441,8 +1829,10 @@ namespace yojimbo
 
     template <typename Stream> bool ChannelPacketData::Serialize( Stream & stream, 
                                                                   MessageFactory & messageFactory, 
+                                                                  Allocator & allocator, 
                                                                   const ChannelConfig * channelConfigs, 
-                                                                  int numChannels )
+                                                                  int numChannels, 
+                                                                  Channel ** channels )
     {
         yojimbo_assert( initialized );
 
@@ -1464,8 +1854,20 @@ namespace yojimbo
             switch ( channelConfig.type )
             {
                 case CHANNEL_TYPE_RELIABLE_ORDERED:
+                case CHANNEL_TYPE_RELIABLE_UNORDERED:
+                case CHANNEL_TYPE_RELIABLE_LATEST_VALUE:
                 {
-                    if ( !SerializeOrderedMessages( stream, messageFactory, message.numMessages, message.messages, channelConfig.maxMessagesPerPacket ) )
+                    const ReliableOrderedChannel * channel = ( Stream::IsWriting && channels ) ? (const ReliableOrderedChannel*) channels[channelIndex] : NULL;
+
+                    if ( !SerializeOrderedMessages( stream, 
+                                                    messageFactory, 
+                                                    allocator, 
+                                                    message.numMessages, 
+                                                    message.messages, 
+                                                    channelConfig.maxMessagesPerPacket, 
+                                                    channelConfig.GetMaxOrderingOffset(), 
+                                                    channelConfig.type == CHANNEL_TYPE_RELIABLE_LATEST_VALUE,
+                                                    channel ) )
                     {
                         messageFailedToSerialize = 1;
                         return true;
@@ -1474,9 +1876,14 @@ namespace yojimbo
                 break;
 
                 case CHANNEL_TYPE_UNRELIABLE_UNORDERED:
+                case CHANNEL_TYPE_UNRELIABLE_SEQUENCED:
                 {
+                    if ( channelConfig.type == CHANNEL_TYPE_UNRELIABLE_SEQUENCED )
+                        serialize_bits( stream, message.sequence, 16 );
+
                     if ( !SerializeUnorderedMessages( stream, 
                                                       messageFactory, 
+                                                      allocator, 
                                                       message.numMessages, 
                                                       message.messages, 
                                                       channelConfig.maxMessagesPerPacket, 
@@ -1487,6 +1894,30 @@ namespace yojimbo
                     }
                 }
                 break;
+
+                case CHANNEL_TYPE_SNAPSHOT_DELTA:
+                {
+                    const SnapshotDeltaChannel * channel = channels ? (const SnapshotDeltaChannel*) channels[channelIndex] : NULL;
+
+                    bool missing = false;
+
+                    if ( !SerializeSnapshotMessages( stream, 
+                                                     messageFactory, 
+                                                     allocator, 
+                                                     message.numMessages, 
+                                                     message.messages, 
+                                                     channelConfig, 
+                                                     channel, 
+                                                     missing ) )
+                    {
+                        if ( missing )
+                            baselineMissing = 1;
+                        else
+                            messageFailedToSerialize = 1;
+                        return true;
+                    }
+                }
+                break;
             }
 
 #if YOJIMBO_DEBUG_MESSAGE_BUDGET
@@ -1501,26 +1932,56 @@ namespace yojimbo
             if ( channelConfig.disableBlocks )
                 return false;
 
-            if ( !SerializeBlockFragment( stream, messageFactory, block, channelConfig ) )
-                return false;
+            int numPacketFragments = Stream::IsWriting ? block.numPacketFragments : 0;
+
+            if ( channelConfig.maxFragmentsPerPacket > 1 )
+            {
+                serialize_int( stream, numPacketFragments, 1, channelConfig.maxFragmentsPerPacket );
+            }
+            else
+            {
+                if ( Stream::IsReading )
+                    numPacketFragments = 1;
+            }
+
+            if ( Stream::IsReading )
+            {
+                block.fragments = (FragmentData*) YOJIMBO_ALLOCATE( allocator, sizeof( FragmentData ) * numPacketFragments );
+
+                if ( !block.fragments )
+                {
+                    yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: failed to allocate block fragments (ChannelPacketData::Serialize)\n" );
+                    return false;
+                }
+
+                memset( block.fragments, 0, sizeof( FragmentData ) * numPacketFragments );
+
+                block.numPacketFragments = numPacketFragments;
+            }
+
+            for ( int i = 0; i < numPacketFragments; ++i )
+            {
+                if ( !SerializeBlockFragment( stream, messageFactory, allocator, block.fragments[i], channelConfig ) )
+                    return false;
+            }
         }
 
         return true;
     }
 
-    bool ChannelPacketData::SerializeInternal( ReadStream & stream, MessageFactory & messageFactory, const ChannelConfig * channelConfigs, int numChannels )
+    bool ChannelPacketData::SerializeInternal( ReadStream & stream, MessageFactory & messageFactory, Allocator & allocator, const ChannelConfig * channelConfigs, int numChannels, Channel ** channels )
     {
-        return Serialize( stream, messageFactory, channelConfigs, numChannels );
+        return Serialize( stream, messageFactory, allocator, channelConfigs, numChannels, channels );
     }
 
-    bool ChannelPacketData::SerializeInternal( WriteStream & stream, MessageFactory & messageFactory, const ChannelConfig * channelConfigs, int numChannels )
+    bool ChannelPacketData::SerializeInternal( WriteStream & stream, MessageFactory & messageFactory, Allocator & allocator, const ChannelConfig * channelConfigs, int numChannels, Channel ** channels )
     {
-        return Serialize( stream, messageFactory, channelConfigs, numChannels );
+        return Serialize( stream, messageFactory, allocator, channelConfigs, numChannels, channels );
     }
 
-    bool ChannelPacketData::SerializeInternal( MeasureStream & stream, MessageFactory & messageFactory, const ChannelConfig * channelConfigs, int numChannels )
+    bool ChannelPacketData::SerializeInternal( MeasureStream & stream, MessageFactory & messageFactory, Allocator & allocator, const ChannelConfig * channelConfigs, int numChannels, Channel ** channels )
     {
-        return Serialize( stream, messageFactory, channelConfigs, numChannels );
+        return Serialize( stream, messageFactory, allocator, channelConfigs, numChannels, channels );
     }
 
     // ------------------------------------------------------------------------------------
@@ -1531,12 +1992,19 @@ namespace yojimbo
         yojimbo_assert( channelIndex < MaxChannels );
         m_channelIndex = channelIndex;
         m_allocator = &allocator;
+        m_packetAllocator = &messageFactory.GetAllocator();
         m_messageFactory = &messageFactory;
         m_errorLevel = CHANNEL_ERROR_NONE;
+        m_packetDataLimited = false;
         m_time = time;
         ResetCounters();
     }
 
+    void Channel::SetPacketAllocator( Allocator & allocator )
+    {
+        m_packetAllocator = &allocator;
+    }
+
     uint64_t Channel::GetCounter( int index ) const
     {
         yojimbo_assert( index >= 0 );
@@ -1554,6 +2022,11 @@ namespace yojimbo
         return m_channelIndex;
     }
 
+    bool Channel::IsPacketDataLimited() const
+    {
+        return m_packetDataLimited;
+    }
+
     void Channel::SetErrorLevel( ChannelErrorLevel errorLevel )
     {
         if ( errorLevel != m_errorLevel && errorLevel != CHANNEL_ERROR_NONE )
@@ -1573,7 +2046,7 @@ namespace yojimbo
     ReliableOrderedChannel::ReliableOrderedChannel( Allocator & allocator, MessageFactory & messageFactory, const ChannelConfig & config, int channelIndex, double time ) 
         : Channel( allocator, messageFactory, config, channelIndex, time )
     {
-        yojimbo_assert( config.type == CHANNEL_TYPE_RELIABLE_ORDERED );
+        yojimbo_assert( config.type == CHANNEL_TYPE_RELIABLE_ORDERED || config.type == CHANNEL_TYPE_RELIABLE_UNORDERED || config.type == CHANNEL_TYPE_RELIABLE_LATEST_VALUE );
 
         yojimbo_assert( ( 65536 % config.sentPacketBufferSize ) == 0 );
         yojimbo_assert( ( 65536 % config.messageSendQueueSize ) == 0 );
@@ -1581,18 +2054,65 @@ namespace yojimbo
 
         m_sentPackets = YOJIMBO_NEW( *m_allocator, SequenceBuffer<SentPacketEntry>, *m_allocator, m_config.sentPacketBufferSize );
         m_messageSendQueue = YOJIMBO_NEW( *m_allocator, SequenceBuffer<MessageSendQueueEntry>, *m_allocator, m_config.messageSendQueueSize );
+        m_messageResendQueue = YOJIMBO_NEW( *m_allocator, Queue<MessageResendQueueEntry>, *m_allocator, m_config.messageSendQueueSize * 2 );
+        m_messageFastRetransmitQueue = NULL;
         m_messageReceiveQueue = YOJIMBO_NEW( *m_allocator, SequenceBuffer<MessageReceiveQueueEntry>, *m_allocator, m_config.messageReceiveQueueSize );
         m_sentPacketMessageIds = (uint16_t*) YOJIMBO_ALLOCATE( *m_allocator, sizeof( uint16_t ) * m_config.maxMessagesPerPacket * m_config.sentPacketBufferSize );
 
+        m_messageArrivalQueue = NULL;
+        m_waitingMessageIds = NULL;
+        m_orderingKeyMessageIds = NULL;
+        m_latestValues = NULL;
+        m_latestValueMask = 0;
+
+        m_messageCache = NULL;
+        m_messageCacheWords = m_config.messageCacheSize / 4;
+        m_messageCacheHead = 0;
+
+        if ( m_messageCacheWords > 0 )
+            m_messageCache = (uint32_t*) YOJIMBO_ALLOCATE( *m_allocator, sizeof( uint32_t ) * m_messageCacheWords );
+
+        if ( config.type == CHANNEL_TYPE_RELIABLE_LATEST_VALUE )
+        {
+            // the send queue size divides 65536, so it is a power of two
+
+            m_latestValueMask = m_config.messageSendQueueSize * 2 - 1;
+            m_latestValues = (LatestValueEntry*) YOJIMBO_ALLOCATE( *m_allocator, sizeof( LatestValueEntry ) * ( m_latestValueMask + 1 ) );
+        }
+
+        if ( config.fastRetransmitPackets > 0 )
+            m_messageFastRetransmitQueue = YOJIMBO_NEW( *m_allocator, Queue<MessageResendQueueEntry>, *m_allocator, m_config.messageSendQueueSize );
+
+        if ( config.type == CHANNEL_TYPE_RELIABLE_UNORDERED || config.GetMaxOrderingOffset() > 0 )
+            m_messageArrivalQueue = YOJIMBO_NEW( *m_allocator, Queue<uint16_t>, *m_allocator, m_config.messageReceiveQueueSize );
+
+        if ( config.GetMaxOrderingOffset() > 0 )
+        {
+            m_waitingMessageIds = YOJIMBO_NEW( *m_allocator, SequenceBuffer<uint16_t>, *m_allocator, m_config.messageReceiveQueueSize );
+            m_orderingKeyMessageIds = (uint32_t*) YOJIMBO_ALLOCATE( *m_allocator, sizeof( uint32_t ) * m_config.numOrderingKeys );
+        }
+
         if ( !config.disableBlocks )
         {
-            m_sendBlock = YOJIMBO_NEW( *m_allocator, SendBlockData, *m_allocator, m_config.GetMaxFragmentsPerBlock() ); 
-            m_receiveBlock = YOJIMBO_NEW( *m_allocator, ReceiveBlockData, *m_allocator, m_config.maxBlockSize, m_config.GetMaxFragmentsPerBlock() );
+            yojimbo_assert( m_config.maxFragmentsPerPacket >= 1 );
+            yojimbo_assert( m_config.maxBlocksInFlight >= 1 );
+
+            m_sentPacketFragments = (SentPacketFragment*) YOJIMBO_ALLOCATE( *m_allocator, sizeof( SentPacketFragment ) * m_config.maxFragmentsPerPacket * m_config.sentPacketBufferSize );
+            m_pendingBlockMessageIds = YOJIMBO_NEW( *m_allocator, Queue<uint16_t>, *m_allocator, m_config.messageSendQueueSize );
+            m_sendBlocks = (SendBlockData**) YOJIMBO_ALLOCATE( *m_allocator, sizeof( SendBlockData* ) * m_config.maxBlocksInFlight );
+            m_receiveBlocks = (ReceiveBlockData**) YOJIMBO_ALLOCATE( *m_allocator, sizeof( ReceiveBlockData* ) * m_config.maxBlocksInFlight );
+            for ( int i = 0; i < m_config.maxBlocksInFlight; ++i )
+            {
+                m_sendBlocks[i] = YOJIMBO_NEW( *m_allocator, SendBlockData, *m_allocator, m_config.GetMaxFragmentsPerBlock() ); 
+                m_receiveBlocks[i] = YOJIMBO_NEW( *m_allocator, ReceiveBlockData, *m_allocator, m_config.GetMaxFragmentsPerBlock() );
+            }
         }
         else
         {
-            m_sendBlock = NULL;
-            m_receiveBlock = NULL;
+            m_sentPacketFragments = NULL;
+            m_pendingBlockMessageIds = NULL;
+            m_sendBlocks = NULL;
+            m_receiveBlocks = NULL;
         }
 
         Reset();
@@ -1602,13 +2122,31 @@ namespace yojimbo
     {
         Reset();
 
-        YOJIMBO_DELETE( *m_allocator, SendBlockData, m_sendBlock );
-        YOJIMBO_DELETE( *m_allocator, ReceiveBlockData, m_receiveBlock );
+        if ( m_sendBlocks )
+        {
+            for ( int i = 0; i < m_config.maxBlocksInFlight; ++i )
+            {
+                YOJIMBO_DELETE( *m_allocator, SendBlockData, m_sendBlocks[i] );
+                YOJIMBO_DELETE( *m_allocator, ReceiveBlockData, m_receiveBlocks[i] );
+            }
+        }
+
+        YOJIMBO_FREE( *m_allocator, m_sendBlocks );
+        YOJIMBO_FREE( *m_allocator, m_receiveBlocks );
+        YOJIMBO_DELETE( *m_allocator, Queue<uint16_t>, m_pendingBlockMessageIds );
         YOJIMBO_DELETE( *m_allocator, SequenceBuffer<SentPacketEntry>, m_sentPackets );
         YOJIMBO_DELETE( *m_allocator, SequenceBuffer<MessageSendQueueEntry>, m_messageSendQueue );
+        YOJIMBO_DELETE( *m_allocator, Queue<MessageResendQueueEntry>, m_messageResendQueue );
+        YOJIMBO_DELETE( *m_allocator, Queue<MessageResendQueueEntry>, m_messageFastRetransmitQueue );
         YOJIMBO_DELETE( *m_allocator, SequenceBuffer<MessageReceiveQueueEntry>, m_messageReceiveQueue );
+        YOJIMBO_DELETE( *m_allocator, Queue<uint16_t>, m_messageArrivalQueue );
+        YOJIMBO_DELETE( *m_allocator, SequenceBuffer<uint16_t>, m_waitingMessageIds );
+        YOJIMBO_FREE( *m_allocator, m_orderingKeyMessageIds );
+        YOJIMBO_FREE( *m_allocator, m_latestValues );
+        YOJIMBO_FREE( *m_allocator, m_messageCache );
         
         YOJIMBO_FREE( *m_allocator, m_sentPacketMessageIds );
+        YOJIMBO_FREE( *m_allocator, m_sentPacketFragments );
 
         m_sentPacketMessageIds = NULL;
     }
@@ -1620,6 +2158,7 @@ namespace yojimbo
         m_sendMessageId = 0;
         m_receiveMessageId = 0;
         m_oldestUnackedMessageId = 0;
+        m_firstUnsentMessageId = 0;
 
         for ( int i = 0; i < m_messageSendQueue->GetSize(); ++i )
         {
@@ -1637,23 +2176,49 @@ namespace yojimbo
 
         m_sentPackets->Reset();
         m_messageSendQueue->Reset();
+        m_messageResendQueue->Clear();
         m_messageReceiveQueue->Reset();
 
-        if ( m_sendBlock )
+        if ( m_messageFastRetransmitQueue )
+            m_messageFastRetransmitQueue->Clear();
+
+        if ( m_messageArrivalQueue )
+            m_messageArrivalQueue->Clear();
+
+        m_smoothedRTT = -1.0f;
+        m_rttVariance = 0.0f;
+        m_highestAckedSequence = 0;
+        m_fastRetransmitSequence = 0;
+
+        if ( m_waitingMessageIds )
         {
-            m_sendBlock->Reset();
+            m_waitingMessageIds->Reset();
+            memset( m_orderingKeyMessageIds, 0xFF, sizeof( uint32_t ) * m_config.numOrderingKeys );
         }
 
-        if ( m_receiveBlock )
+        if ( m_latestValues )
+            memset( m_latestValues, 0, sizeof( LatestValueEntry ) * ( m_latestValueMask + 1 ) );
+
+        if ( !m_config.disableBlocks )
         {
-            m_receiveBlock->Reset();
-            if ( m_receiveBlock->blockMessage )
+            m_pendingBlockMessageIds->Clear();
+
+            for ( int i = 0; i < m_config.maxBlocksInFlight; ++i )
             {
-                m_messageFactory->ReleaseMessage( m_receiveBlock->blockMessage );
-                m_receiveBlock->blockMessage = NULL;
+                m_sendBlocks[i]->Reset();
+
+                m_receiveBlocks[i]->Reset();
+                if ( m_receiveBlocks[i]->blockMessage )
+                {
+                    m_messageFactory->ReleaseMessage( m_receiveBlocks[i]->blockMessage );
+                    m_receiveBlocks[i]->blockMessage = NULL;
+                }
+                YOJIMBO_FREE( m_messageFactory->GetBlockAllocator(), m_receiveBlocks[i]->blockData );
             }
         }
 
+        m_sendFragmentsNext = false;
+
         ResetCounters();
     }
 
@@ -1695,8 +2260,43 @@ namespace yojimbo
             return;
         }
 
+        uint16_t replacedMessageId;
+
+        if ( m_config.type == CHANNEL_TYPE_RELIABLE_LATEST_VALUE && !message->IsBlockMessage() && ReplaceLatestValue( message, replacedMessageId ) )
+        {
+            // the message takes the place of an older value that was never sent, so it doesn't need a new message id
+
+            MessageSendQueueEntry * replacedEntry = m_messageSendQueue->Find( replacedMessageId );
+            yojimbo_assert( replacedEntry );
+            message->SetId( replacedMessageId );
+            m_messageFactory->ReleaseMessage( replacedEntry->message );
+            replacedEntry->message = message;
+            replacedEntry->cachedBits = 0;
+
+            MeasureStream measureStream( m_messageFactory->GetAllocator() );
+            measureStream.SetContext( context );
+            message->SerializeInternal( measureStream );
+            replacedEntry->measuredBits = measureStream.GetBitsProcessed() + 1;
+            m_counters[CHANNEL_COUNTER_MESSAGES_SENT]++;
+            return;
+        }
+
         message->SetId( m_sendMessageId );
 
+        const int maxOrderingOffset = m_config.GetMaxOrderingOffset();
+
+        if ( maxOrderingOffset > 0 )
+        {
+            // point back at the previous message with the same key. once that message is further back than the receive window, 
+            // the sender can't have sent this message until it was acked, so the receiver already has it and the offset is 0.
+
+            const int key = message->GetOrderingKey() % m_config.numOrderingKeys;
+            const uint32_t previousMessageId = m_orderingKeyMessageIds[key];
+            const uint16_t orderingOffset = ( previousMessageId != 0xFFFFFFFF ) ? uint16_t( m_sendMessageId - previousMessageId ) : 0;
+            message->SetOrderingOffset( orderingOffset <= maxOrderingOffset ? orderingOffset : 0 );
+            m_orderingKeyMessageIds[key] = m_sendMessageId;
+        }
+
         MessageSendQueueEntry * entry = m_messageSendQueue->Insert( m_sendMessageId );
 
         yojimbo_assert( entry );
@@ -1704,18 +2304,28 @@ namespace yojimbo
         entry->block = message->IsBlockMessage();
         entry->message = message;
         entry->measuredBits = 0;
+        entry->cachedBits = 0;
         entry->timeLastSent = -1.0;
 
+        if ( m_latestValues && !message->IsBlockMessage() )
+            SetLatestValue( message->GetOrderingKey(), m_sendMessageId );
+
         if ( message->IsBlockMessage() )
         {
             yojimbo_assert( ((BlockMessage*)message)->GetBlockSize() > 0 );
             yojimbo_assert( ((BlockMessage*)message)->GetBlockSize() <= m_config.maxBlockSize );
+
+            m_pendingBlockMessageIds->Push( m_sendMessageId );
         }
 
         MeasureStream measureStream( m_messageFactory->GetAllocator() );
 		measureStream.SetContext( context );
         message->SerializeInternal( measureStream );
         entry->measuredBits = measureStream.GetBitsProcessed();
+        if ( maxOrderingOffset > 0 )
+            entry->measuredBits += bits_required( 0, maxOrderingOffset );
+        if ( m_config.type == CHANNEL_TYPE_RELIABLE_LATEST_VALUE )
+            entry->measuredBits += 1;
         m_counters[CHANNEL_COUNTER_MESSAGES_SENT]++;
         m_sendMessageId++;
     }
@@ -1725,7 +2335,20 @@ namespace yojimbo
         if ( GetErrorLevel() != CHANNEL_ERROR_NONE )
             return NULL;
 
+        if ( m_messageArrivalQueue )
+            return ReceiveMessageUnordered();
+
         MessageReceiveQueueEntry * entry = m_messageReceiveQueue->Find( m_receiveMessageId );
+
+        // skip over messages that were superseded by a later message with the same key
+
+        while ( entry && !entry->message )
+        {
+            m_messageReceiveQueue->Remove( m_receiveMessageId );
+            m_receiveMessageId++;
+            entry = m_messageReceiveQueue->Find( m_receiveMessageId );
+        }
+
         if ( !entry )
             return NULL;
 
@@ -1739,120 +2362,450 @@ namespace yojimbo
         return message;
     }
 
-    void ReliableOrderedChannel::AdvanceTime( double time )
-    {
-        m_time = time;
-    }
-    
-    int ReliableOrderedChannel::GetPacketData( void *context, ChannelPacketData & packetData, uint16_t packetSequence, int availableBits )
+    Message * ReliableOrderedChannel::ReceiveMessageUnordered()
     {
-        if ( !HasMessagesToSend() )
-            return 0;
+        yojimbo_assert( m_messageArrivalQueue );
 
-        if ( SendingBlockMessage() )
-        {
-            if (m_config.blockFragmentSize * 8 > availableBits)
-                return 0;
+        if ( m_messageArrivalQueue->IsEmpty() )
+            return NULL;
 
-            uint16_t messageId;
-            uint16_t fragmentId;
-            int fragmentBytes;
-            int numFragments;
-            int messageType;
+        const uint16_t messageId = m_messageArrivalQueue->Pop();
 
-            uint8_t * fragmentData = GetFragmentToSend( messageId, fragmentId, fragmentBytes, numFragments, messageType );
+        MessageReceiveQueueEntry * entry = m_messageReceiveQueue->Find( messageId );
+        yojimbo_assert( entry );
 
-            if ( fragmentData )
-            {
-                const int fragmentBits = GetFragmentPacketData( packetData, messageId, fragmentId, fragmentData, fragmentBytes, numFragments, messageType );
-                AddFragmentPacketEntry( messageId, fragmentId, packetSequence );
-                return fragmentBits;
-            }
-        }
-        else
-        {
-            int numMessageIds = 0;
-            uint16_t * messageIds = (uint16_t*) alloca( m_config.maxMessagesPerPacket * sizeof( uint16_t ) );
-            const int messageBits = GetMessagesToSend( messageIds, numMessageIds, availableBits, context );
+        Message * message = entry->message;
+        yojimbo_assert( message );
+        yojimbo_assert( message->GetId() == messageId );
 
-            if ( numMessageIds > 0 )
-            {
-                GetMessagePacketData( packetData, messageIds, numMessageIds );
-                AddMessagePacketEntry( messageIds, numMessageIds, packetSequence );
-                return messageBits;
-            }
+        // the entry stays in the receive queue with no message, so duplicates of this message are ignored. 
+        // entries are removed once every message before them has been delivered, which moves the receive window forward
+
+        entry->message = NULL;
+
+        while ( true )
+        {
+            MessageReceiveQueueEntry * oldestEntry = m_messageReceiveQueue->Find( m_receiveMessageId );
+            if ( !oldestEntry || oldestEntry->message )
+                break;
+            m_messageReceiveQueue->Remove( m_receiveMessageId );
+            m_receiveMessageId++;
         }
 
-        return 0;
-    }
+        m_counters[CHANNEL_COUNTER_MESSAGES_RECEIVED]++;
 
-    bool ReliableOrderedChannel::HasMessagesToSend() const
-    {
-        return m_oldestUnackedMessageId != m_sendMessageId;
+        return message;
     }
 
-    int ReliableOrderedChannel::GetMessagesToSend( uint16_t * messageIds, int & numMessageIds, int availableBits, void *context )
+    bool ReliableOrderedChannel::ReplaceLatestValue( Message * message, uint16_t & messageId )
     {
-        yojimbo_assert( HasMessagesToSend() );
+        yojimbo_assert( m_config.type == CHANNEL_TYPE_RELIABLE_LATEST_VALUE );
+        yojimbo_assert( !message->IsBlockMessage() );
 
-        numMessageIds = 0;
+        // each send replaces the previous message with the same key, so there is at most one unacked message per key that isn't superseded
 
-        if ( m_config.packetBudget > 0 )
-            availableBits = yojimbo_min( m_config.packetBudget * 8, availableBits );
+        if ( !FindLatestValue( message->GetOrderingKey(), messageId ) )
+            return false;
+
+        MessageSendQueueEntry * entry = m_messageSendQueue->Find( messageId );
+
+        yojimbo_assert( entry );
+        yojimbo_assert( !entry->block );
+        yojimbo_assert( !entry->message->IsSuperseded() );
+        yojimbo_assert( entry->message->GetOrderingKey() == message->GetOrderingKey() );
+
+        if ( entry->timeLastSent < 0.0 )
+            return true;
+
+        // the old message may already be on its way to the receiver, so it keeps its id. from now on it is sent without contents until acked.
+        // the new message gets a new id, which SendMessage points the key at
+
+        entry->message->SetSuperseded();
+        entry->measuredBits = 1;
+        entry->cachedBits = -1;
+
+        return false;
+    }
+
+    static int latest_value_index( uint32_t key, int mask )
+    {
+        // murmur3 finalizer. keys are often ids or packed fields that only differ in a few bits, so mix all of them into the low bits
+
+        uint32_t hash = key;
+        hash ^= hash >> 16;
+        hash *= 0x85EBCA6BU;
+        hash ^= hash >> 13;
+        hash *= 0xC2B2AE35U;
+        hash ^= hash >> 16;
+        return int( hash & uint32_t( mask ) );
+    }
+
+    bool ReliableOrderedChannel::FindLatestValue( uint32_t key, uint16_t & messageId ) const
+    {
+        yojimbo_assert( m_latestValues );
+
+        for ( int index = latest_value_index( key, m_latestValueMask ); m_latestValues[index].used; index = ( index + 1 ) & m_latestValueMask )
+        {
+            if ( m_latestValues[index].key == key )
+            {
+                messageId = m_latestValues[index].messageId;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void ReliableOrderedChannel::SetLatestValue( uint32_t key, uint16_t messageId )
+    {
+        yojimbo_assert( m_latestValues );
+
+        int index = latest_value_index( key, m_latestValueMask );
+
+        while ( m_latestValues[index].used && m_latestValues[index].key != key )
+            index = ( index + 1 ) & m_latestValueMask;
+
+        m_latestValues[index].key = key;
+        m_latestValues[index].messageId = messageId;
+        m_latestValues[index].used = 1;
+    }
+
+    void ReliableOrderedChannel::RemoveLatestValue( uint32_t key, uint16_t messageId )
+    {
+        yojimbo_assert( m_latestValues );
+
+        int index = latest_value_index( key, m_latestValueMask );
+
+        while ( m_latestValues[index].used && m_latestValues[index].key != key )
+            index = ( index + 1 ) & m_latestValueMask;
+
+        if ( !m_latestValues[index].used || m_latestValues[index].messageId != messageId )
+            return;
+
+        // shift later entries back into the hole, so every entry stays reachable from its home slot without probing past an empty slot
+
+        int next = index;
+
+        while ( true )
+        {
+            next = ( next + 1 ) & m_latestValueMask;
+
+            if ( !m_latestValues[next].used )
+                break;
+
+            const int home = latest_value_index( m_latestValues[next].key, m_latestValueMask );
+
+            // entries whose home slot is cyclically in (index,next] are already as close to home as they can be
+
+            const bool stays = ( index <= next ) ? ( home > index && home <= next ) : ( home > index || home <= next );
+
+            if ( !stays )
+            {
+                m_latestValues[index] = m_latestValues[next];
+                index = next;
+            }
+        }
+
+        m_latestValues[index].used = 0;
+    }
+
+    void ReliableOrderedChannel::QueueReceivedMessage( uint16_t messageId, int orderingOffset )
+    {
+        yojimbo_assert( m_messageArrivalQueue );
+
+        if ( orderingOffset > 0 )
+        {
+            // wait for the previous message with the same key, unless it has already been delivered or is ready to be
+
+            yojimbo_assert( m_waitingMessageIds );
+
+            const uint16_t previousMessageId = messageId - orderingOffset;
+
+            if ( !sequence_less_than( previousMessageId, m_receiveMessageId ) )
+            {
+                MessageReceiveQueueEntry * previousEntry = m_messageReceiveQueue->Find( previousMessageId );
+
+                if ( !previousEntry || !previousEntry->ready )
+                {
+                    uint16_t * waitingMessageId = m_waitingMessageIds->Insert( previousMessageId );
+                    if ( !waitingMessageId )
+                    {
+                        SetErrorLevel( CHANNEL_ERROR_DESYNC );
+                        return;
+                    }
+                    *waitingMessageId = messageId;
+                    return;
+                }
+            }
+        }
+
+        // this message is ready. so is the chain of messages with the same key that were waiting on it
+
+        while ( true )
+        {
+            MessageReceiveQueueEntry * entry = m_messageReceiveQueue->Find( messageId );
+            yojimbo_assert( entry );
+            entry->ready = true;
+
+            m_messageArrivalQueue->Push( messageId );
+
+            if ( !m_waitingMessageIds )
+                break;
+
+            const uint16_t * waitingMessageId = m_waitingMessageIds->Find( messageId );
+            if ( !waitingMessageId )
+                break;
+
+            const uint16_t nextMessageId = *waitingMessageId;
+            m_waitingMessageIds->Remove( messageId );
+            messageId = nextMessageId;
+        }
+    }
+
+    void ReliableOrderedChannel::AdvanceTime( double time )
+    {
+        m_time = time;
+    }
+    
+    int ReliableOrderedChannel::GetPacketData( void *context, ChannelPacketData & packetData, uint16_t packetSequence, int availableBits )
+    {
+        m_packetDataLimited = false;
+
+        if ( !HasMessagesToSend() )
+            return 0;
+
+        if ( !m_config.disableBlocks )
+            UpdateSendBlocks();
+
+        // with more than one block in flight, alternate between block fragments and regular messages so neither starves the other
+
+        const bool pipelined = !m_config.disableBlocks && m_config.maxBlocksInFlight > 1;
+        const bool fragmentsFirst = pipelined ? m_sendFragmentsNext : SendingBlockMessage();
+        const int numPasses = pipelined ? 2 : 1;
+
+        for ( int pass = 0; pass < numPasses; ++pass )
+        {
+            const bool sendFragments = ( pass == 0 ) ? fragmentsFirst : !fragmentsFirst;
+
+            if ( sendFragments )
+            {
+                int numFragments = 0;
+                uint16_t * messageIds = (uint16_t*) alloca( m_config.maxFragmentsPerPacket * sizeof( uint16_t ) );
+                uint16_t * fragmentIds = (uint16_t*) alloca( m_config.maxFragmentsPerPacket * sizeof( uint16_t ) );
+                const int fragmentBits = GetFragmentsToSend( messageIds, fragmentIds, numFragments, availableBits );
+
+                if ( numFragments > 0 && GetFragmentPacketData( packetData, messageIds, fragmentIds, numFragments ) )
+                {
+                    AddFragmentPacketEntry( messageIds, fragmentIds, numFragments, packetSequence );
+                    m_sendFragmentsNext = false;
+                    return fragmentBits;
+                }
+            }
+            else
+            {
+                int numMessageIds = 0;
+                uint16_t * messageIds = (uint16_t*) alloca( m_config.maxMessagesPerPacket * sizeof( uint16_t ) );
+                const int messageBits = GetMessagesToSend( messageIds, numMessageIds, availableBits, context );
+
+                if ( numMessageIds > 0 )
+                {
+                    GetMessagePacketData( packetData, messageIds, numMessageIds );
+                    AddMessagePacketEntry( messageIds, numMessageIds, packetSequence );
+                    m_sendFragmentsNext = true;
+                    return messageBits;
+                }
+            }
+        }
+
+        return 0;
+    }
+
+    bool ReliableOrderedChannel::HasMessagesToSend() const
+    {
+        return m_oldestUnackedMessageId != m_sendMessageId;
+    }
+
+    /**
+        Get the number of bits needed to insert a message id into a sorted array of message ids, and where to insert it.
+        The first message id is serialized with 16 bits, and each id after it relative to the one before.
+        Ids are ordered relative to the oldest unacked message id, so this works across sequence number wrap around.
+     */
+
+    static int message_id_insert_bits( const uint16_t * messageIds, int numMessageIds, uint16_t oldestMessageId, uint16_t messageId, int & insertIndex )
+    {
+        const uint16_t offset = messageId - oldestMessageId;
+
+        insertIndex = numMessageIds;
+        while ( insertIndex > 0 && uint16_t( messageIds[insertIndex-1] - oldestMessageId ) > offset )
+            insertIndex--;
+
+        if ( numMessageIds == 0 )
+            return 16;
+
+        if ( insertIndex == 0 )
+            return sequence_relative_bits( messageId, messageIds[0] );
+
+        if ( insertIndex == numMessageIds )
+            return sequence_relative_bits( messageIds[insertIndex-1], messageId );
+
+        return sequence_relative_bits( messageIds[insertIndex-1], messageId )
+             + sequence_relative_bits( messageId, messageIds[insertIndex] )
+             - sequence_relative_bits( messageIds[insertIndex-1], messageIds[insertIndex] );
+    }
+
+    int ReliableOrderedChannel::GetMessagesToSend( uint16_t * messageIds, int & numMessageIds, int availableBits, void *context )
+    {
+        yojimbo_assert( HasMessagesToSend() );
+
+        numMessageIds = 0;
+
+        if ( m_config.packetBudget > 0 )
+            availableBits = yojimbo_min( m_config.packetBudget * 8, availableBits );
 
         const int giveUpBits = 4 * 8;
         const int messageTypeBits = bits_required( 0, m_messageFactory->GetNumTypes() - 1 );
         const int messageLimit = yojimbo_min( m_config.messageSendQueueSize, m_config.messageReceiveQueueSize );
-        uint16_t previousMessageId = 0;
         int usedBits = ConservativeMessageHeaderBits;
         int giveUpCounter = 0;
 
-        for ( int i = 0; i < messageLimit; ++i )
+        UpdateFirstUnsentMessageId();
+
+        // drop entries off the front of the resend queues for messages that have been acked or sent again since
+
+        Queue<MessageResendQueueEntry> * resendQueues[] = { m_messageFastRetransmitQueue, m_messageResendQueue };
+
+        for ( int i = 0; i < 2; ++i )
         {
-            if ( availableBits - usedBits < giveUpBits )
+            if ( !resendQueues[i] )
+                continue;
+
+            while ( !resendQueues[i]->IsEmpty() )
+            {
+                const MessageResendQueueEntry & resendEntry = (*resendQueues[i])[0];
+                if ( resendEntry.timeLastSent >= 0.0 )
+                {
+                    MessageSendQueueEntry * entry = m_messageSendQueue->Find( resendEntry.messageId );
+                    if ( entry && entry->timeLastSent == resendEntry.timeLastSent )
+                        break;
+                }
+                resendQueues[i]->Pop();
+            }
+        }
+
+        if ( m_messageFastRetransmitQueue )
+            UpdateFastRetransmit();
+
+        // first consider messages in packets treated as lost, then sent messages that are due for resend, oldest first. then messages that have never been sent, in id order.
+
+        const float resendTime = GetResendTime( m_config.messageResendTime );
+        const int numFastRetransmitEntries = m_messageFastRetransmitQueue ? m_messageFastRetransmitQueue->GetNumEntries() : 0;
+        const int numResendEntries = m_messageResendQueue->GetNumEntries();
+        int fastRetransmitIndex = 0;
+        int resendIndex = 0;
+        uint16_t unsentMessageId = m_firstUnsentMessageId;
+
+        while ( numMessageIds < m_config.maxMessagesPerPacket )
+        {
+            // keep looking while nothing has been added, so a message that is ready to send but doesn't fit is noticed
+
+            if ( numMessageIds > 0 && availableBits - usedBits < giveUpBits )
                 break;
 
             if ( giveUpCounter > m_config.messageSendQueueSize )
                 break;
 
-            uint16_t messageId = m_oldestUnackedMessageId + i;
-            MessageSendQueueEntry * entry = m_messageSendQueue->Find( messageId );
-            if ( !entry )
-                continue;
+            uint16_t messageId;
+            MessageSendQueueEntry * entry;
+            MessageResendQueueEntry * resendEntry = NULL;
 
-            if ( entry->block )
-                break;
-            
-            if ( entry->timeLastSent + m_config.messageResendTime <= m_time && availableBits >= (int) entry->measuredBits )
-            {                
-                int messageBits = entry->measuredBits + messageTypeBits;
-                
-                if ( numMessageIds == 0 )
-                {
-                    messageBits += 16;
-                }
-                else
-                {
-                    MeasureStream stream( GetDefaultAllocator() );
-                    stream.SetContext( context );
-                    serialize_sequence_relative_internal( stream, previousMessageId, messageId );
-                    messageBits += stream.GetBitsProcessed();
-                }
+            if ( fastRetransmitIndex < numFastRetransmitEntries )
+            {
+                resendEntry = &(*m_messageFastRetransmitQueue)[fastRetransmitIndex++];
 
-                if ( usedBits + messageBits > availableBits )
+                messageId = resendEntry->messageId;
+                entry = m_messageSendQueue->Find( messageId );
+                if ( !entry || entry->timeLastSent < 0.0 || entry->timeLastSent != resendEntry->timeLastSent )
+                    continue;
+            }
+            else if ( resendIndex < numResendEntries )
+            {
+                resendEntry = &(*m_messageResendQueue)[resendIndex++];
+
+                if ( resendEntry->timeLastSent + resendTime > m_time )
                 {
-                    giveUpCounter++;
+                    // the resend queue is in send order, so nothing after this entry is due either
+                    resendIndex = numResendEntries;
                     continue;
                 }
 
-                usedBits += messageBits;
-                messageIds[numMessageIds++] = messageId;
-                previousMessageId = messageId;
-                entry->timeLastSent = m_time;
+                messageId = resendEntry->messageId;
+                entry = m_messageSendQueue->Find( messageId );
+                if ( !entry || entry->timeLastSent < 0.0 || entry->timeLastSent != resendEntry->timeLastSent )
+                    continue;
+            }
+            else
+            {
+                if ( unsentMessageId == m_sendMessageId )
+                    break;
+
+                if ( uint16_t( unsentMessageId - m_oldestUnackedMessageId ) >= messageLimit )
+                    break;
+
+                messageId = unsentMessageId++;
+                entry = m_messageSendQueue->Find( messageId );
+                if ( !entry )
+                    continue;
+
+                if ( entry->timeLastSent >= 0.0 )
+                    continue;
+
+                if ( entry->block )
+                    break;
             }
 
-            if ( numMessageIds == m_config.maxMessagesPerPacket )
-                break;
+            if ( availableBits < (int) entry->measuredBits )
+            {
+                m_packetDataLimited = true;
+                continue;
+            }
+
+            int insertIndex = 0;
+            const int messageBits = entry->measuredBits + messageTypeBits + message_id_insert_bits( messageIds, numMessageIds, m_oldestUnackedMessageId, messageId, insertIndex );
+
+            if ( usedBits + messageBits > availableBits )
+            {
+                m_packetDataLimited = true;
+                giveUpCounter++;
+                continue;
+            }
+
+            usedBits += messageBits;
+            for ( int j = numMessageIds; j > insertIndex; --j )
+                messageIds[j] = messageIds[j-1];
+            messageIds[insertIndex] = messageId;
+            numMessageIds++;
+            entry->timeLastSent = m_time;
+
+            if ( resendEntry )
+            {
+                resendEntry->timeLastSent = -1.0;
+
+                // most messages are acked the first time they are sent, so messages are only cached once they have to be sent again
+
+                if ( m_messageCache && entry->cachedBits >= 0 && !IsMessageCached( *entry ) )
+                    CacheMessage( messageId, context );
+            }
+        }
+
+        if ( m_messageResendQueue->GetNumEntries() + numMessageIds > m_messageResendQueue->GetSize() )
+            CompactMessageResendQueue();
+
+        for ( int i = 0; i < numMessageIds; ++i )
+        {
+            MessageResendQueueEntry resendEntry;
+            resendEntry.messageId = messageIds[i];
+            resendEntry.timeLastSent = m_time;
+            m_messageResendQueue->Push( resendEntry );
         }
 
         return usedBits;
@@ -1869,7 +2822,7 @@ namespace yojimbo
         if ( numMessageIds == 0 )
             return;
 
-        packetData.message.messages = (Message**) YOJIMBO_ALLOCATE( m_messageFactory->GetAllocator(), sizeof( Message* ) * numMessageIds );
+        packetData.message.messages = (Message**) YOJIMBO_ALLOCATE( *m_packetAllocator, sizeof( Message* ) * numMessageIds );
 
         for ( int i = 0; i < numMessageIds; ++i )
         {
@@ -1882,6 +2835,79 @@ namespace yojimbo
         }
     }
 
+    bool ReliableOrderedChannel::GetCachedMessage( uint16_t messageId, const uint32_t * & data, int & bits ) const
+    {
+        if ( !m_messageCache )
+            return false;
+
+        const MessageSendQueueEntry * entry = m_messageSendQueue->Find( messageId );
+        if ( !entry || !IsMessageCached( *entry ) )
+            return false;
+
+        data = m_messageCache + entry->cachePosition % m_messageCacheWords;
+        bits = entry->cachedBits;
+        return true;
+    }
+
+    bool ReliableOrderedChannel::IsMessageCached( const MessageSendQueueEntry & entry ) const
+    {
+        return entry.cachedBits > 0 && m_messageCacheHead - entry.cachePosition <= uint32_t( m_messageCacheWords );
+    }
+
+    void ReliableOrderedChannel::CacheMessage( uint16_t messageId, void * context )
+    {
+        yojimbo_assert( m_messageCache );
+
+        MessageSendQueueEntry * entry = m_messageSendQueue->Find( messageId );
+        yojimbo_assert( entry );
+        yojimbo_assert( !entry->block );
+
+        entry->cachedBits = -1;
+
+        // the measured bits are an upper bound on everything written for the message except its type, so this is enough space at either alignment below
+
+        const int messageTypeBits = bits_required( 0, m_messageFactory->GetNumTypes() - 1 );
+        const int numWords = ( int( entry->measuredBits ) + messageTypeBits + 1 + 31 ) / 32;
+
+        if ( entry->message->IsSuperseded() || numWords > m_messageCacheWords )
+            return;
+
+        // the data must be contiguous, so skip the end of the buffer if the message doesn't fit there
+
+        const int offset = m_messageCacheHead % m_messageCacheWords;
+        if ( offset + numWords > m_messageCacheWords )
+            m_messageCacheHead += m_messageCacheWords - offset;
+
+        const uint32_t position = m_messageCacheHead;
+        m_messageCacheHead += numWords;
+
+        uint32_t * data = m_messageCache + position % m_messageCacheWords;
+
+        Message * message = entry->message;
+        const int maxOrderingOffset = m_config.GetMaxOrderingOffset();
+        const bool supersededMessages = m_config.type == CHANNEL_TYPE_RELIABLE_LATEST_VALUE;
+
+        // serialize one bit along first, then at the start. if the sizes differ, the message contains an align and the cached bits would only be valid at one alignment
+
+        WriteStream alignmentStream( m_messageFactory->GetAllocator(), (uint8_t*) data, numWords * 4 );
+        alignmentStream.SetContext( context );
+        alignmentStream.SerializeBits( 0, 1 );
+        if ( !SerializeOrderedMessage( alignmentStream, *m_messageFactory, message, messageId, maxOrderingOffset, supersededMessages ) )
+            return;
+
+        WriteStream stream( m_messageFactory->GetAllocator(), (uint8_t*) data, numWords * 4 );
+        stream.SetContext( context );
+        if ( !SerializeOrderedMessage( stream, *m_messageFactory, message, messageId, maxOrderingOffset, supersededMessages ) )
+            return;
+        stream.Flush();
+
+        if ( stream.GetBitsProcessed() == 0 || stream.GetBitsProcessed() != alignmentStream.GetBitsProcessed() - 1 )
+            return;
+
+        entry->cachedBits = stream.GetBitsProcessed();
+        entry->cachePosition = position;
+    }
+
     void ReliableOrderedChannel::AddMessagePacketEntry( const uint16_t * messageIds, int numMessageIds, uint16_t sequence )
     {
         SentPacketEntry * sentPacket = m_sentPackets->Insert( sequence );
@@ -1936,9 +2962,20 @@ namespace yojimbo
                 return;
             }
 
+            entry->ready = false;
+
+            if ( message->IsSuperseded() )
+            {
+                entry->message = NULL;
+                continue;
+            }
+
             entry->message = message;
 
             m_messageFactory->AcquireMessage( message );
+
+            if ( m_messageArrivalQueue )
+                QueueReceivedMessage( messageId, message->GetOrderingOffset() );
         }
     }
 
@@ -1958,13 +2995,18 @@ namespace yojimbo
 
         if ( packetData.blockMessage )
         {
-            ProcessPacketFragment( packetData.block.messageType, 
-                                   packetData.block.messageId, 
-                                   packetData.block.numFragments, 
-                                   packetData.block.fragmentId, 
-                                   packetData.block.fragmentData, 
-                                   packetData.block.fragmentSize, 
-                                   packetData.block.message );
+            for ( int i = 0; i < packetData.block.numPacketFragments; ++i )
+            {
+                const ChannelPacketData::FragmentData & fragment = packetData.block.fragments[i];
+
+                ProcessPacketFragment( fragment.messageType, 
+                                       fragment.messageId, 
+                                       fragment.numFragments, 
+                                       fragment.fragmentId, 
+                                       fragment.fragmentData, 
+                                       fragment.fragmentSize, 
+                                       fragment.message );
+            }
         }
         else
         {
@@ -1980,7 +3022,28 @@ namespace yojimbo
 
         yojimbo_assert( !sentPacketEntry->acked );
 
-        for ( int i = 0; i < (int) sentPacketEntry->numMessageIds; ++i )
+        sentPacketEntry->acked = 1;
+
+        // each packet is acked at most once, so every ack is a clean round trip time sample. smoothed as per RFC 6298
+
+        const float rtt = float( m_time - sentPacketEntry->timeSent );
+
+        if ( m_smoothedRTT < 0.0f )
+        {
+            m_smoothedRTT = rtt;
+            m_rttVariance = rtt * 0.5f;
+            m_highestAckedSequence = ack;
+            m_fastRetransmitSequence = ack - uint16_t( m_config.sentPacketBufferSize - 1 );
+        }
+        else
+        {
+            m_rttVariance += ( yojimbo_abs( m_smoothedRTT - rtt ) - m_rttVariance ) * 0.25f;
+            m_smoothedRTT += ( rtt - m_smoothedRTT ) * 0.125f;
+            if ( sequence_greater_than( ack, m_highestAckedSequence ) )
+                m_highestAckedSequence = ack;
+        }
+
+        for ( int i = 0; i < (int) sentPacketEntry->numMessageIds; ++i )
         {
             const uint16_t messageId = sentPacketEntry->messageIds[i];
             MessageSendQueueEntry * sendQueueEntry = m_messageSendQueue->Find( messageId );
@@ -1988,31 +3051,47 @@ namespace yojimbo
             {
                 yojimbo_assert( sendQueueEntry->message );
                 yojimbo_assert( sendQueueEntry->message->GetId() == messageId );
+                if ( m_latestValues )
+                    RemoveLatestValue( sendQueueEntry->message->GetOrderingKey(), messageId );
                 m_messageFactory->ReleaseMessage( sendQueueEntry->message );
                 m_messageSendQueue->Remove( messageId );
                 UpdateOldestUnackedMessageId();
             }
         }
 
-        if ( !m_config.disableBlocks && sentPacketEntry->block && m_sendBlock->active && m_sendBlock->blockMessageId == sentPacketEntry->blockMessageId )
-        {        
-            const int messageId = sentPacketEntry->blockMessageId;
-            const int fragmentId = sentPacketEntry->blockFragmentId;
+        if ( m_config.disableBlocks || !sentPacketEntry->block )
+            return;
+
+        for ( int i = 0; i < (int) sentPacketEntry->numFragments; ++i )
+        {
+            const uint16_t messageId = sentPacketEntry->fragments[i].messageId;
+            const int fragmentId = sentPacketEntry->fragments[i].fragmentId;
 
-            if ( !m_sendBlock->ackedFragment->GetBit( fragmentId ) )
+            SendBlockData * sendBlock = NULL;
+            for ( int j = 0; j < m_config.maxBlocksInFlight; ++j )
             {
-                m_sendBlock->ackedFragment->SetBit( fragmentId );
-                m_sendBlock->numAckedFragments++;
-                if ( m_sendBlock->numAckedFragments == m_sendBlock->numFragments )
+                if ( m_sendBlocks[j]->active && m_sendBlocks[j]->blockMessageId == messageId )
                 {
-                    m_sendBlock->active = false;
-                    MessageSendQueueEntry * sendQueueEntry = m_messageSendQueue->Find( messageId );
-                    yojimbo_assert( sendQueueEntry );
-                    m_messageFactory->ReleaseMessage( sendQueueEntry->message );
-                    m_messageSendQueue->Remove( messageId );
-                    UpdateOldestUnackedMessageId();
+                    sendBlock = m_sendBlocks[j];
+                    break;
                 }
             }
+
+            if ( !sendBlock || sendBlock->ackedFragment->GetBit( fragmentId ) )
+                continue;
+
+            sendBlock->ackedFragment->SetBit( fragmentId );
+            sendBlock->readyFragment->ClearBit( fragmentId );
+            sendBlock->numAckedFragments++;
+            if ( sendBlock->numAckedFragments == sendBlock->numFragments )
+            {
+                sendBlock->Reset();
+                MessageSendQueueEntry * sendQueueEntry = m_messageSendQueue->Find( messageId );
+                yojimbo_assert( sendQueueEntry );
+                m_messageFactory->ReleaseMessage( sendQueueEntry->message );
+                m_messageSendQueue->Remove( messageId );
+                UpdateOldestUnackedMessageId();
+            }
         }
     }
 
@@ -2032,6 +3111,83 @@ namespace yojimbo
         yojimbo_assert( !sequence_greater_than( m_oldestUnackedMessageId, stopMessageId ) );
     }
 
+    void ReliableOrderedChannel::UpdateFirstUnsentMessageId()
+    {
+        if ( sequence_less_than( m_firstUnsentMessageId, m_oldestUnackedMessageId ) )
+            m_firstUnsentMessageId = m_oldestUnackedMessageId;
+
+        while ( m_firstUnsentMessageId != m_sendMessageId )
+        {
+            MessageSendQueueEntry * entry = m_messageSendQueue->Find( m_firstUnsentMessageId );
+            if ( entry && entry->timeLastSent < 0.0 )
+                break;
+            ++m_firstUnsentMessageId;
+        }
+    }
+
+    void ReliableOrderedChannel::CompactMessageResendQueue()
+    {
+        const int numEntries = m_messageResendQueue->GetNumEntries();
+
+        for ( int i = 0; i < numEntries; ++i )
+        {
+            MessageResendQueueEntry resendEntry = m_messageResendQueue->Pop();
+            MessageSendQueueEntry * entry = m_messageSendQueue->Find( resendEntry.messageId );
+            if ( entry && entry->timeLastSent >= 0.0 && entry->timeLastSent == resendEntry.timeLastSent )
+                m_messageResendQueue->Push( resendEntry );
+        }
+    }
+
+    void ReliableOrderedChannel::UpdateFastRetransmit()
+    {
+        if ( m_smoothedRTT < 0.0f )
+            return;
+
+        // packets are checked once each, in send order. acks of packets this channel had no data in are not seen, so the check is against the highest ack of a packet it did
+
+        const uint16_t lastLostSequence = m_highestAckedSequence - uint16_t( m_config.fastRetransmitPackets );
+
+        if ( sequence_greater_than( m_fastRetransmitSequence, lastLostSequence ) )
+            return;
+
+        if ( uint16_t( lastLostSequence - m_fastRetransmitSequence ) >= m_config.sentPacketBufferSize )
+            m_fastRetransmitSequence = lastLostSequence - uint16_t( m_config.sentPacketBufferSize - 1 );
+
+        while ( m_fastRetransmitSequence != uint16_t( lastLostSequence + 1 ) )
+        {
+            const uint16_t sequence = m_fastRetransmitSequence++;
+
+            SentPacketEntry * sentPacketEntry = m_sentPackets->Find( sequence );
+            if ( !sentPacketEntry || sentPacketEntry->acked )
+                continue;
+
+            for ( int i = 0; i < (int) sentPacketEntry->numMessageIds; ++i )
+            {
+                MessageSendQueueEntry * entry = m_messageSendQueue->Find( sentPacketEntry->messageIds[i] );
+                if ( !entry || entry->timeLastSent != sentPacketEntry->timeSent )
+                    continue;
+
+                // if the queue is full the message just waits for its resend time
+
+                if ( m_messageFastRetransmitQueue->IsFull() )
+                    return;
+
+                MessageResendQueueEntry resendEntry;
+                resendEntry.messageId = sentPacketEntry->messageIds[i];
+                resendEntry.timeLastSent = entry->timeLastSent;
+                m_messageFastRetransmitQueue->Push( resendEntry );
+            }
+        }
+    }
+
+    float ReliableOrderedChannel::GetResendTime( float fixedResendTime ) const
+    {
+        if ( !m_config.adaptiveResendTime || m_smoothedRTT < 0.0f )
+            return fixedResendTime;
+
+        return yojimbo_clamp( m_smoothedRTT + 4.0f * m_rttVariance, m_config.minResendTime, m_config.maxResendTime );
+    }
+
     bool ReliableOrderedChannel::SendingBlockMessage()
     {
         yojimbo_assert( HasMessagesToSend() );
@@ -2041,130 +3197,249 @@ namespace yojimbo
         return entry ? entry->block : false;
     }
 
-    uint8_t * ReliableOrderedChannel::GetFragmentToSend( uint16_t & messageId, uint16_t & fragmentId, int & fragmentBytes, int & numFragments, int & messageType )
+    void ReliableOrderedChannel::UpdateSendBlocks()
     {
-        MessageSendQueueEntry * entry = m_messageSendQueue->Find( m_oldestUnackedMessageId );
+        const int messageLimit = yojimbo_min( m_config.messageSendQueueSize, m_config.messageReceiveQueueSize );
 
-        yojimbo_assert( entry );
-        yojimbo_assert( entry->block );
+        while ( !m_pendingBlockMessageIds->IsEmpty() )
+        {
+            const uint16_t messageId = (*m_pendingBlockMessageIds)[0];
 
-        BlockMessage * blockMessage = (BlockMessage*) entry->message;
+            if ( m_config.maxBlocksInFlight == 1 )
+            {
+                if ( messageId != m_oldestUnackedMessageId )
+                    break;
+            }
+            else
+            {
+                if ( uint16_t( messageId - m_oldestUnackedMessageId ) >= messageLimit )
+                    break;
+            }
 
-        yojimbo_assert( blockMessage );
+            SendBlockData * sendBlock = NULL;
+            for ( int i = 0; i < m_config.maxBlocksInFlight; ++i )
+            {
+                if ( !m_sendBlocks[i]->active )
+                {
+                    sendBlock = m_sendBlocks[i];
+                    break;
+                }
+            }
 
-        messageId = blockMessage->GetId();
+            if ( !sendBlock )
+                break;
 
-        const int blockSize = blockMessage->GetBlockSize();
+            m_pendingBlockMessageIds->Pop();
+
+            MessageSendQueueEntry * entry = m_messageSendQueue->Find( messageId );
+
+            yojimbo_assert( entry );
+            yojimbo_assert( entry->block );
+
+            BlockMessage * blockMessage = (BlockMessage*) entry->message;
+
+            yojimbo_assert( blockMessage );
 
-        if ( !m_sendBlock->active )
-        {
             // start sending this block
 
-            m_sendBlock->active = true;
-            m_sendBlock->blockSize = blockSize;
-            m_sendBlock->blockMessageId = messageId;
-            m_sendBlock->numFragments = (int) ceil( blockSize / float( m_config.blockFragmentSize ) );
-            m_sendBlock->numAckedFragments = 0;
+            const int blockSize = blockMessage->GetBlockSize();
+
+            sendBlock->active = true;
+            sendBlock->blockSize = blockSize;
+            sendBlock->blockMessageId = messageId;
+            sendBlock->numFragments = (int) ceil( blockSize / float( m_config.blockFragmentSize ) );
+            sendBlock->numAckedFragments = 0;
 
             const int MaxFragmentsPerBlock = m_config.GetMaxFragmentsPerBlock();
 
-            yojimbo_assert( m_sendBlock->numFragments > 0 );
-            yojimbo_assert( m_sendBlock->numFragments <= MaxFragmentsPerBlock );
+            yojimbo_assert( sendBlock->numFragments > 0 );
+            yojimbo_assert( sendBlock->numFragments <= MaxFragmentsPerBlock );
 
-            m_sendBlock->ackedFragment->Clear();
+            sendBlock->ackedFragment->Clear();
+            sendBlock->readyFragment->Clear();
+            sendBlock->sentFragmentQueue->Clear();
 
             for ( int i = 0; i < MaxFragmentsPerBlock; ++i )
-                m_sendBlock->fragmentSendTime[i] = -1.0;
+                sendBlock->fragmentSendTime[i] = -1.0;
+
+            for ( int i = 0; i < sendBlock->numFragments; ++i )
+                sendBlock->readyFragment->SetBit( i );
+
+            // mark the block message as sent, so the search for unsent messages walks past it
+
+            entry->timeLastSent = m_time;
         }
+    }
+
+    int ReliableOrderedChannel::GetFragmentsToSend( uint16_t * messageIds, uint16_t * fragmentIds, int & numFragments, int availableBits )
+    {
+        numFragments = 0;
+
+        int budgetBits = availableBits;
+        if ( m_config.packetBudget > 0 )
+            budgetBits = yojimbo_min( m_config.packetBudget * 8, availableBits );
 
-        numFragments = m_sendBlock->numFragments;
+        const int messageTypeBits = bits_required( 0, m_messageFactory->GetNumTypes() - 1 );
+        int usedBits = ( m_config.maxFragmentsPerPacket > 1 ) ? bits_required( 1, m_config.maxFragmentsPerPacket ) : 0;
 
-        // find the next fragment to send (there may not be one)
+        // visit blocks in flight in message id order, so the block the receiver is waiting on gets the packet first
 
-        fragmentId = 0xFFFF;
+        int numSendBlocks = 0;
+        SendBlockData ** sendBlocks = (SendBlockData**) alloca( sizeof( SendBlockData* ) * m_config.maxBlocksInFlight );
 
-        for ( int i = 0; i < m_sendBlock->numFragments; ++i )
+        for ( int i = 0; i < m_config.maxBlocksInFlight; ++i )
         {
-            if ( !m_sendBlock->ackedFragment->GetBit( i ) && m_sendBlock->fragmentSendTime[i] + m_config.blockFragmentResendTime < m_time )
+            SendBlockData * sendBlock = m_sendBlocks[i];
+            if ( !sendBlock->active )
+                continue;
+            const uint16_t offset = sendBlock->blockMessageId - m_oldestUnackedMessageId;
+            int j = numSendBlocks;
+            while ( j > 0 && uint16_t( sendBlocks[j-1]->blockMessageId - m_oldestUnackedMessageId ) > offset )
             {
-                fragmentId = uint16_t( i );
-                break;
+                sendBlocks[j] = sendBlocks[j-1];
+                j--;
             }
+            sendBlocks[j] = sendBlock;
+            numSendBlocks++;
         }
 
-        if ( fragmentId == 0xFFFF )
-            return NULL;
+        const float fragmentResendTime = GetResendTime( m_config.blockFragmentResendTime );
 
-        // allocate and return a copy of the fragment data
+        bool packetFull = false;
 
-        messageType = blockMessage->GetType();
+        for ( int i = 0; i < numSendBlocks && !packetFull; ++i )
+        {
+            SendBlockData * sendBlock = sendBlocks[i];
 
-        fragmentBytes = m_config.blockFragmentSize;
-        
-        const int fragmentRemainder = blockSize % m_config.blockFragmentSize;
+            // fragments whose resend time has passed are ready to send again. sent fragments are queued in send order, so stop at the first one that is not due yet
 
-        if ( fragmentRemainder && fragmentId == m_sendBlock->numFragments - 1 )
-            fragmentBytes = fragmentRemainder;
+            Queue<uint16_t> & sentFragmentQueue = *sendBlock->sentFragmentQueue;
 
-        uint8_t * fragmentData = (uint8_t*) YOJIMBO_ALLOCATE( m_messageFactory->GetAllocator(), fragmentBytes );
+            while ( !sentFragmentQueue.IsEmpty() )
+            {
+                const uint16_t sentFragmentId = sentFragmentQueue[0];
+                if ( sendBlock->fragmentSendTime[sentFragmentId] + fragmentResendTime >= m_time )
+                    break;
+                sentFragmentQueue.Pop();
+                if ( !sendBlock->ackedFragment->GetBit( sentFragmentId ) )
+                    sendBlock->readyFragment->SetBit( sentFragmentId );
+            }
 
-        if ( fragmentData )
-        {
-            memcpy( fragmentData, blockMessage->GetBlockData() + fragmentId * m_config.blockFragmentSize, fragmentBytes );
+            MessageSendQueueEntry * entry = m_messageSendQueue->Find( sendBlock->blockMessageId );
+
+            yojimbo_assert( entry );
+
+            const int fragmentRemainder = sendBlock->blockSize % m_config.blockFragmentSize;
+
+            int fragmentId = sendBlock->readyFragment->FindFirstSetBit();
+
+            while ( fragmentId >= 0 )
+            {
+                if ( numFragments == m_config.maxFragmentsPerPacket )
+                {
+                    packetFull = true;
+                    break;
+                }
+
+                int fragmentBytes = m_config.blockFragmentSize;
+                if ( fragmentRemainder && fragmentId == sendBlock->numFragments - 1 )
+                    fragmentBytes = fragmentRemainder;
+
+                int fragmentBits = ConservativeFragmentHeaderBits + fragmentBytes * 8;
+                if ( fragmentId == 0 )
+                    fragmentBits += entry->measuredBits + messageTypeBits;
+
+                // the first fragment always goes in, as long as a full size fragment fits in the bits available. fragments after that must fit in the channel budget and the space left in the packet
+
+                if ( numFragments == 0 && m_config.blockFragmentSize * 8 > availableBits )
+                {
+                    m_packetDataLimited = true;
+                    packetFull = true;
+                    break;
+                }
+
+                if ( numFragments > 0 && usedBits + fragmentBits > budgetBits )
+                {
+                    packetFull = true;
+                    break;
+                }
+
+                messageIds[numFragments] = sendBlock->blockMessageId;
+                fragmentIds[numFragments] = uint16_t( fragmentId );
+                numFragments++;
+                usedBits += fragmentBits;
+
+                sendBlock->fragmentSendTime[fragmentId] = m_time;
+                sendBlock->readyFragment->ClearBit( fragmentId );
+                sentFragmentQueue.Push( uint16_t( fragmentId ) );
 
-            m_sendBlock->fragmentSendTime[fragmentId] = m_time;
+                fragmentId = sendBlock->readyFragment->FindFirstSetBit( fragmentId + 1 );
+            }
         }
 
-        return fragmentData;
+        return usedBits;
     }
 
-    int ReliableOrderedChannel::GetFragmentPacketData( ChannelPacketData & packetData, 
-                                                       uint16_t messageId, 
-                                                       uint16_t fragmentId, 
-                                                       uint8_t * fragmentData, 
-                                                       int fragmentSize, 
-                                                       int numFragments, 
-                                                       int messageType )
+    bool ReliableOrderedChannel::GetFragmentPacketData( ChannelPacketData & packetData, const uint16_t * messageIds, const uint16_t * fragmentIds, int numFragments )
     {
+        yojimbo_assert( messageIds );
+        yojimbo_assert( fragmentIds );
+        yojimbo_assert( numFragments > 0 );
+
         packetData.Initialize();
 
         packetData.channelIndex = GetChannelIndex();
 
         packetData.blockMessage = 1;
 
-        packetData.block.fragmentData = fragmentData;
-        packetData.block.messageId = messageId;
-        packetData.block.fragmentId = fragmentId;
-        packetData.block.fragmentSize = fragmentSize;
-        packetData.block.numFragments = numFragments;
-        packetData.block.messageType = messageType;
+        ChannelPacketData::FragmentData * fragments = (ChannelPacketData::FragmentData*) YOJIMBO_ALLOCATE( *m_packetAllocator, sizeof( ChannelPacketData::FragmentData ) * numFragments );
 
-        const int messageTypeBits = bits_required( 0, m_messageFactory->GetNumTypes() - 1 );
+        if ( !fragments )
+            return false;
 
-        int fragmentBits = ConservativeFragmentHeaderBits + fragmentSize * 8;
+        memset( fragments, 0, sizeof( ChannelPacketData::FragmentData ) * numFragments );
 
-        if ( fragmentId == 0 )
+        packetData.block.numPacketFragments = numFragments;
+        packetData.block.fragments = fragments;
+
+        for ( int i = 0; i < numFragments; ++i )
         {
-            MessageSendQueueEntry * entry = m_messageSendQueue->Find( packetData.block.messageId );
+            MessageSendQueueEntry * entry = m_messageSendQueue->Find( messageIds[i] );
 
             yojimbo_assert( entry );
-            yojimbo_assert( entry->message );
+            yojimbo_assert( entry->block );
 
-            packetData.block.message = (BlockMessage*) entry->message;
+            BlockMessage * blockMessage = (BlockMessage*) entry->message;
 
-            m_messageFactory->AcquireMessage( packetData.block.message );
+            const int blockSize = blockMessage->GetBlockSize();
+            const int numBlockFragments = ( blockSize + m_config.blockFragmentSize - 1 ) / m_config.blockFragmentSize;
+            const int fragmentId = fragmentIds[i];
 
-            fragmentBits += entry->measuredBits + messageTypeBits;
-        }
-        else
-        {
-            packetData.block.message = NULL;
+            int fragmentBytes = m_config.blockFragmentSize;
+
+            const int fragmentRemainder = blockSize % m_config.blockFragmentSize;
+
+            if ( fragmentRemainder && fragmentId == numBlockFragments - 1 )
+                fragmentBytes = fragmentRemainder;
+
+            // point at the fragment in the block. the reference to the block message keeps the block alive until the packet data is freed
+
+            fragments[i].fragmentData = blockMessage->GetBlockData() + fragmentId * m_config.blockFragmentSize;
+            fragments[i].ownsFragmentData = 0;
+            fragments[i].messageId = messageIds[i];
+            fragments[i].fragmentId = fragmentId;
+            fragments[i].fragmentSize = fragmentBytes;
+            fragments[i].numFragments = numBlockFragments;
+            fragments[i].messageType = blockMessage->GetType();
+            fragments[i].message = blockMessage;
+
+            m_messageFactory->AcquireMessage( blockMessage );
         }
 
-        return fragmentBits;
+        return true;
     }
 
-    void ReliableOrderedChannel::AddFragmentPacketEntry( uint16_t messageId, uint16_t fragmentId, uint16_t sequence )
+    void ReliableOrderedChannel::AddFragmentPacketEntry( const uint16_t * messageIds, const uint16_t * fragmentIds, int numFragments, uint16_t sequence )
     {
         SentPacketEntry * sentPacket = m_sentPackets->Insert( sequence );
         yojimbo_assert( sentPacket );
@@ -2175,8 +3450,13 @@ namespace yojimbo
             sentPacket->timeSent = m_time;
             sentPacket->acked = 0;
             sentPacket->block = 1;
-            sentPacket->blockMessageId = messageId;
-            sentPacket->blockFragmentId = fragmentId;
+            sentPacket->fragments = &m_sentPacketFragments[ ( sequence % m_config.sentPacketBufferSize ) * m_config.maxFragmentsPerPacket ];
+            sentPacket->numFragments = numFragments;
+            for ( int i = 0; i < numFragments; ++i )
+            {
+                sentPacket->fragments[i].messageId = messageIds[i];
+                sentPacket->fragments[i].fragmentId = fragmentIds[i];
+            }
         }
     }
 
@@ -2192,35 +3472,77 @@ namespace yojimbo
 
         if ( fragmentData )
         {
-            const uint16_t expectedMessageId = m_messageReceiveQueue->GetSequence();
-            if ( messageId != expectedMessageId )
+            // ignore fragments for blocks outside the receive window, and for blocks we have already received
+
+            const uint16_t minMessageId = m_receiveMessageId;
+            const uint16_t maxMessageId = m_receiveMessageId + m_config.messageReceiveQueueSize - 1;
+
+            if ( sequence_less_than( messageId, minMessageId ) || sequence_greater_than( messageId, maxMessageId ) )
+                return;
+
+            if ( m_messageReceiveQueue->Find( messageId ) )
                 return;
 
+            ReceiveBlockData * receiveBlock = NULL;
+            ReceiveBlockData * freeReceiveBlock = NULL;
+
+            for ( int i = 0; i < m_config.maxBlocksInFlight; ++i )
+            {
+                if ( !m_receiveBlocks[i]->active )
+                {
+                    if ( !freeReceiveBlock )
+                        freeReceiveBlock = m_receiveBlocks[i];
+                }
+                else if ( m_receiveBlocks[i]->messageId == messageId )
+                {
+                    receiveBlock = m_receiveBlocks[i];
+                    break;
+                }
+            }
+
             // start receiving a new block
 
-            if ( !m_receiveBlock->active )
+            if ( !receiveBlock )
             {
+                // the sender never has more blocks in flight than we have receive blocks for
+                if ( !freeReceiveBlock )
+                    return;
+
                 yojimbo_assert( numFragments >= 0 );
                 yojimbo_assert( numFragments <= m_config.GetMaxFragmentsPerBlock() );
 
-                m_receiveBlock->active = true;
-                m_receiveBlock->numFragments = numFragments;
-                m_receiveBlock->numReceivedFragments = 0;
-                m_receiveBlock->messageId = messageId;
-                m_receiveBlock->blockSize = 0;
-                m_receiveBlock->receivedFragment->Clear();
+                // fragments are written directly into the buffer that is attached to the block message, so there is no copy when the block completes
+
+                yojimbo_assert( !freeReceiveBlock->blockData );
+
+                freeReceiveBlock->blockData = (uint8_t*) YOJIMBO_ALLOCATE( m_messageFactory->GetBlockAllocator(), numFragments * m_config.blockFragmentSize );
+
+                if ( !freeReceiveBlock->blockData )
+                {
+                    // Not enough memory to allocate block data
+                    SetErrorLevel( CHANNEL_ERROR_OUT_OF_MEMORY );
+                    return;
+                }
+
+                receiveBlock = freeReceiveBlock;
+                receiveBlock->active = true;
+                receiveBlock->numFragments = numFragments;
+                receiveBlock->numReceivedFragments = 0;
+                receiveBlock->messageId = messageId;
+                receiveBlock->blockSize = 0;
+                receiveBlock->receivedFragment->Clear();
             }
 
             // validate fragment
 
-            if ( fragmentId >= m_receiveBlock->numFragments )
+            if ( fragmentId >= receiveBlock->numFragments )
             {
                 // The fragment id is out of range.
                 SetErrorLevel( CHANNEL_ERROR_DESYNC );
                 return;
             }
 
-            if ( numFragments != m_receiveBlock->numFragments )
+            if ( numFragments != receiveBlock->numFragments )
             {
                 // The number of fragments is out of range.
                 SetErrorLevel( CHANNEL_ERROR_DESYNC );
@@ -2229,22 +3551,22 @@ namespace yojimbo
 
             // receive the fragment
 
-            if ( !m_receiveBlock->receivedFragment->GetBit( fragmentId ) )
+            if ( !receiveBlock->receivedFragment->GetBit( fragmentId ) )
             {
-                m_receiveBlock->receivedFragment->SetBit( fragmentId );
+                receiveBlock->receivedFragment->SetBit( fragmentId );
 
-                memcpy( m_receiveBlock->blockData + fragmentId * m_config.blockFragmentSize, fragmentData, fragmentBytes );
+                memcpy( receiveBlock->blockData + fragmentId * m_config.blockFragmentSize, fragmentData, fragmentBytes );
 
                 if ( fragmentId == 0 )
                 {
-                    m_receiveBlock->messageType = messageType;
+                    receiveBlock->messageType = messageType;
                 }
 
-                if ( fragmentId == m_receiveBlock->numFragments - 1 )
+                if ( fragmentId == receiveBlock->numFragments - 1 )
                 {
-                    m_receiveBlock->blockSize = ( m_receiveBlock->numFragments - 1 ) * m_config.blockFragmentSize + fragmentBytes;
+                    receiveBlock->blockSize = ( receiveBlock->numFragments - 1 ) * m_config.blockFragmentSize + fragmentBytes;
 
-                    if ( m_receiveBlock->blockSize > (uint32_t) m_config.maxBlockSize )
+                    if ( receiveBlock->blockSize > (uint32_t) m_config.maxBlockSize )
                     {
                         // The block size is outside range
                         SetErrorLevel( CHANNEL_ERROR_DESYNC );
@@ -2252,16 +3574,16 @@ namespace yojimbo
                     }
                 }
 
-                m_receiveBlock->numReceivedFragments++;
+                receiveBlock->numReceivedFragments++;
 
                 if ( fragmentId == 0 )
                 {
                     // save block message (sent with fragment 0)
-                    m_receiveBlock->blockMessage = blockMessage;
-                    m_messageFactory->AcquireMessage( m_receiveBlock->blockMessage );
+                    receiveBlock->blockMessage = blockMessage;
+                    m_messageFactory->AcquireMessage( receiveBlock->blockMessage );
                 }
 
-                if ( m_receiveBlock->numReceivedFragments == m_receiveBlock->numFragments )
+                if ( receiveBlock->numReceivedFragments == receiveBlock->numFragments )
                 {
                     // finished receiving block
 
@@ -2272,62 +3594,345 @@ namespace yojimbo
                         return;
                     }
 
-                    blockMessage = m_receiveBlock->blockMessage;
+                    blockMessage = receiveBlock->blockMessage;
+
+                    yojimbo_assert( blockMessage );
+
+                    blockMessage->AttachBlock( m_messageFactory->GetBlockAllocator(), receiveBlock->blockData, receiveBlock->blockSize );
+
+                    receiveBlock->blockData = NULL;
+
+                    blockMessage->SetId( messageId );
+
+                    MessageReceiveQueueEntry * entry = m_messageReceiveQueue->Insert( messageId );
+                    yojimbo_assert( entry );
+                    entry->message = blockMessage;
+                    entry->ready = false;
+                    receiveBlock->active = false;
+                    receiveBlock->blockMessage = NULL;
+
+                    if ( m_messageArrivalQueue )
+                        QueueReceivedMessage( messageId, blockMessage->GetOrderingOffset() );
+                }
+            }
+        }
+    }
+
+    // ------------------------------------------------
+
+    UnreliableUnorderedChannel::UnreliableUnorderedChannel( Allocator & allocator, 
+                                                            MessageFactory & messageFactory, 
+                                                            const ChannelConfig & config, 
+                                                            int channelIndex, 
+                                                            double time ) 
+        : Channel( allocator, 
+                   messageFactory, 
+                   config, 
+                   channelIndex, 
+                   time )
+    {
+        yojimbo_assert( config.type == CHANNEL_TYPE_UNRELIABLE_UNORDERED || config.type == CHANNEL_TYPE_UNRELIABLE_SEQUENCED );
+        m_messageSendQueue = YOJIMBO_NEW( *m_allocator, Queue<Message*>, *m_allocator, m_config.messageSendQueueSize );
+        m_messageSendQueueBits = YOJIMBO_NEW( *m_allocator, Queue<int>, *m_allocator, m_config.messageSendQueueSize );
+        m_messageReceiveQueue = YOJIMBO_NEW( *m_allocator, Queue<Message*>, *m_allocator, m_config.messageReceiveQueueSize );
+        Reset();
+    }
+
+    UnreliableUnorderedChannel::~UnreliableUnorderedChannel()
+    {
+        Reset();
+        YOJIMBO_DELETE( *m_allocator, Queue<Message*>, m_messageSendQueue );
+        YOJIMBO_DELETE( *m_allocator, Queue<int>, m_messageSendQueueBits );
+        YOJIMBO_DELETE( *m_allocator, Queue<Message*>, m_messageReceiveQueue );
+    }
+
+    void UnreliableUnorderedChannel::Reset()
+    {
+        SetErrorLevel( CHANNEL_ERROR_NONE );
+
+        for ( int i = 0; i < m_messageSendQueue->GetNumEntries(); ++i )
+            m_messageFactory->ReleaseMessage( (*m_messageSendQueue)[i] );
+
+        for ( int i = 0; i < m_messageReceiveQueue->GetNumEntries(); ++i )
+            m_messageFactory->ReleaseMessage( (*m_messageReceiveQueue)[i] );
+
+        m_messageSendQueue->Clear();
+        m_messageSendQueueBits->Clear();
+        m_messageReceiveQueue->Clear();
+  
+        ResetCounters();
+    }
+
+    bool UnreliableUnorderedChannel::CanSendMessage() const
+    {
+        yojimbo_assert( m_messageSendQueue );
+        return !m_messageSendQueue->IsFull();
+    }
+
+    bool UnreliableUnorderedChannel::HasMessagesToSend() const
+    {
+        yojimbo_assert( m_messageSendQueue );
+        return !m_messageSendQueue->IsEmpty();
+    }
+
+    void UnreliableUnorderedChannel::SendMessage( Message * message, void *context )
+    {
+        yojimbo_assert( message );
+        yojimbo_assert( CanSendMessage() );
+
+        if ( GetErrorLevel() != CHANNEL_ERROR_NONE )
+        {
+            m_messageFactory->ReleaseMessage( message );
+            return;
+        }
+
+        if ( !CanSendMessage() )
+        {
+            SetErrorLevel( CHANNEL_ERROR_SEND_QUEUE_FULL );
+            m_messageFactory->ReleaseMessage( message );
+            return;
+        }
+
+        yojimbo_assert( !( message->IsBlockMessage() && m_config.disableBlocks ) );
+
+        if ( message->IsBlockMessage() && m_config.disableBlocks )
+        {
+            SetErrorLevel( CHANNEL_ERROR_BLOCKS_DISABLED );
+            m_messageFactory->ReleaseMessage( message );
+            return;
+        }
+
+        if ( message->IsBlockMessage() )
+        {
+            yojimbo_assert( ((BlockMessage*)message)->GetBlockSize() > 0 );
+            yojimbo_assert( ((BlockMessage*)message)->GetBlockSize() <= m_config.maxBlockSize );
+        }
+
+        MeasureStream measureStream( m_messageFactory->GetAllocator() );
+        measureStream.SetContext( context );
+        message->SerializeInternal( measureStream );
+
+        if ( message->IsBlockMessage() )
+        {
+            BlockMessage * blockMessage = (BlockMessage*) message;
+            SerializeMessageBlock( measureStream, *m_messageFactory, blockMessage, m_config.maxBlockSize );
+        }
+
+        m_messageSendQueue->Push( message );
+        m_messageSendQueueBits->Push( measureStream.GetBitsProcessed() );
+
+        m_counters[CHANNEL_COUNTER_MESSAGES_SENT]++;
+    }
+
+    Message * UnreliableUnorderedChannel::ReceiveMessage()
+    {
+        if ( GetErrorLevel() != CHANNEL_ERROR_NONE )
+            return NULL;
+
+        if ( m_messageReceiveQueue->IsEmpty() )
+            return NULL;
+
+        m_counters[CHANNEL_COUNTER_MESSAGES_RECEIVED]++;
+
+        return m_messageReceiveQueue->Pop();
+    }
+
+    void UnreliableUnorderedChannel::AdvanceTime( double time )
+    {
+        (void) time;
+    }
+    
+    int UnreliableUnorderedChannel::GetPacketData( void *context, ChannelPacketData & packetData, uint16_t packetSequence, int availableBits )
+    {
+        (void) context;
+        (void) packetSequence;
+
+        m_packetDataLimited = false;
+
+        if ( m_messageSendQueue->IsEmpty() )
+            return 0;
+
+        if ( m_config.packetBudget > 0 )
+            availableBits = yojimbo_min( m_config.packetBudget * 8, availableBits );
+
+        const int giveUpBits = 4 * 8;
+
+        const int messageTypeBits = bits_required( 0, m_messageFactory->GetNumTypes() - 1 );
+
+        int usedBits = ConservativeMessageHeaderBits;
+        if ( m_config.type == CHANNEL_TYPE_UNRELIABLE_SEQUENCED )
+            usedBits += 16;
+        int numMessages = 0;
+        Message ** messages = (Message**) alloca( sizeof( Message* ) * m_config.maxMessagesPerPacket );
+
+        while ( true )
+        {
+            if ( m_messageSendQueue->IsEmpty() )
+                break;
+
+            if ( availableBits - usedBits < giveUpBits )
+            {
+                m_packetDataLimited = true;
+                break;
+            }
+
+            if ( numMessages == m_config.maxMessagesPerPacket )
+                break;
+
+            Message * message = m_messageSendQueue->Pop();
+
+            yojimbo_assert( message );
+
+            const int messageBits = messageTypeBits + m_messageSendQueueBits->Pop();
+            
+            if ( usedBits + messageBits > availableBits )
+            {
+                m_packetDataLimited = true;
+                m_messageFactory->ReleaseMessage( message );
+                continue;
+            }
+
+            usedBits += messageBits;        
+
+            yojimbo_assert( usedBits <= availableBits );
+
+            messages[numMessages++] = message;
+        }
+
+        if ( numMessages == 0 )
+            return 0;
+
+        packetData.Initialize();
+        packetData.channelIndex = GetChannelIndex();
+        packetData.message.numMessages = numMessages;
+        packetData.message.messages = (Message**) YOJIMBO_ALLOCATE( *m_packetAllocator, sizeof( Message* ) * numMessages );
+        for ( int i = 0; i < numMessages; ++i )
+        {
+            packetData.message.messages[i] = messages[i];
+        }
+
+        return usedBits;
+    }
+
+    void UnreliableUnorderedChannel::ProcessPacketData( const ChannelPacketData & packetData, uint16_t packetSequence )
+    {
+        if ( m_errorLevel != CHANNEL_ERROR_NONE )
+            return;
+        
+        if ( packetData.messageFailedToSerialize )
+        {
+            SetErrorLevel( CHANNEL_ERROR_FAILED_TO_SERIALIZE );
+            return;
+        }
+
+        for ( int i = 0; i < (int) packetData.message.numMessages; ++i )
+        {
+            Message * message = packetData.message.messages[i];
+            yojimbo_assert( message );  
+            message->SetId( packetSequence );
+            if ( !m_messageReceiveQueue->IsFull() )
+            {
+                m_messageFactory->AcquireMessage( message );
+                m_messageReceiveQueue->Push( message );
+            }
+        }
+    }
+
+    void UnreliableUnorderedChannel::ProcessAck( uint16_t ack )
+    {
+        (void) ack;
+    }
+
+    // ------------------------------------------------
+
+    UnreliableSequencedChannel::UnreliableSequencedChannel( Allocator & allocator, 
+                                                            MessageFactory & messageFactory, 
+                                                            const ChannelConfig & config, 
+                                                            int channelIndex, 
+                                                            double time ) 
+        : UnreliableUnorderedChannel( allocator, 
+                                      messageFactory, 
+                                      config, 
+                                      channelIndex, 
+                                      time )
+    {
+        yojimbo_assert( config.type == CHANNEL_TYPE_UNRELIABLE_SEQUENCED );
+        m_sendSequence = 0;
+        m_receivedSequence = 0;
+        m_hasReceivedPacket = false;
+    }
 
-                    yojimbo_assert( blockMessage );
+    void UnreliableSequencedChannel::Reset()
+    {
+        UnreliableUnorderedChannel::Reset();
+        m_sendSequence = 0;
+        m_receivedSequence = 0;
+        m_hasReceivedPacket = false;
+    }
 
-                    uint8_t * blockData = (uint8_t*) YOJIMBO_ALLOCATE( m_messageFactory->GetAllocator(), m_receiveBlock->blockSize );
+    int UnreliableSequencedChannel::GetPacketData( void *context, ChannelPacketData & packetData, uint16_t packetSequence, int availableBits )
+    {
+        const int usedBits = UnreliableUnorderedChannel::GetPacketData( context, packetData, packetSequence, availableBits );
 
-                    if ( !blockData )
-                    {
-                        // Not enough memory to allocate block data
-                        SetErrorLevel( CHANNEL_ERROR_OUT_OF_MEMORY );
-                        return;
-                    }
+        if ( usedBits > 0 )
+            packetData.message.sequence = m_sendSequence++;
 
-                    memcpy( blockData, m_receiveBlock->blockData, m_receiveBlock->blockSize );
+        return usedBits;
+    }
 
-                    blockMessage->AttachBlock( m_messageFactory->GetAllocator(), blockData, m_receiveBlock->blockSize );
+    void UnreliableSequencedChannel::ProcessPacketData( const ChannelPacketData & packetData, uint16_t packetSequence )
+    {
+        if ( m_errorLevel == CHANNEL_ERROR_NONE && !packetData.messageFailedToSerialize && packetData.message.numMessages > 0 )
+        {
+            // messages older than the newest messages already received on this channel are stale. they are released with the packet
 
-                    blockMessage->SetId( messageId );
+            if ( m_hasReceivedPacket && !sequence_greater_than( packetData.message.sequence, m_receivedSequence ) )
+                return;
 
-                    MessageReceiveQueueEntry * entry = m_messageReceiveQueue->Insert( messageId );
-                    yojimbo_assert( entry );
-                    entry->message = blockMessage;
-                    m_receiveBlock->active = false;
-                    m_receiveBlock->blockMessage = NULL;
-                }
-            }
+            m_receivedSequence = packetData.message.sequence;
+            m_hasReceivedPacket = true;
         }
+
+        UnreliableUnorderedChannel::ProcessPacketData( packetData, packetSequence );
     }
 
     // ------------------------------------------------
 
-    UnreliableUnorderedChannel::UnreliableUnorderedChannel( Allocator & allocator, 
-                                                            MessageFactory & messageFactory, 
-                                                            const ChannelConfig & config, 
-                                                            int channelIndex, 
-                                                            double time ) 
+    SnapshotDeltaChannel::SnapshotDeltaChannel( Allocator & allocator, 
+                                                MessageFactory & messageFactory, 
+                                                const ChannelConfig & config, 
+                                                int channelIndex, 
+                                                double time ) 
         : Channel( allocator, 
                    messageFactory, 
                    config, 
                    channelIndex, 
                    time )
     {
-        yojimbo_assert( config.type == CHANNEL_TYPE_UNRELIABLE_UNORDERED );
+        yojimbo_assert( config.type == CHANNEL_TYPE_SNAPSHOT_DELTA );
+        yojimbo_assert( config.snapshotHistorySize >= 2 );
+        yojimbo_assert( config.snapshotHistorySize <= 32768 );
         m_messageSendQueue = YOJIMBO_NEW( *m_allocator, Queue<Message*>, *m_allocator, m_config.messageSendQueueSize );
         m_messageReceiveQueue = YOJIMBO_NEW( *m_allocator, Queue<Message*>, *m_allocator, m_config.messageReceiveQueueSize );
+        m_sentPackets = YOJIMBO_NEW( *m_allocator, SequenceBuffer<uint16_t>, *m_allocator, m_config.sentPacketBufferSize );
+        m_sentSnapshots = (SnapshotEntry*) YOJIMBO_ALLOCATE( *m_allocator, sizeof( SnapshotEntry ) * m_config.snapshotHistorySize );
+        m_receivedSnapshots = (SnapshotEntry*) YOJIMBO_ALLOCATE( *m_allocator, sizeof( SnapshotEntry ) * m_config.snapshotHistorySize );
+        memset( m_sentSnapshots, 0, sizeof( SnapshotEntry ) * m_config.snapshotHistorySize );
+        memset( m_receivedSnapshots, 0, sizeof( SnapshotEntry ) * m_config.snapshotHistorySize );
         Reset();
     }
 
-    UnreliableUnorderedChannel::~UnreliableUnorderedChannel()
+    SnapshotDeltaChannel::~SnapshotDeltaChannel()
     {
         Reset();
         YOJIMBO_DELETE( *m_allocator, Queue<Message*>, m_messageSendQueue );
         YOJIMBO_DELETE( *m_allocator, Queue<Message*>, m_messageReceiveQueue );
+        YOJIMBO_DELETE( *m_allocator, SequenceBuffer<uint16_t>, m_sentPackets );
+        YOJIMBO_FREE( *m_allocator, m_sentSnapshots );
+        YOJIMBO_FREE( *m_allocator, m_receivedSnapshots );
     }
 
-    void UnreliableUnorderedChannel::Reset()
+    void SnapshotDeltaChannel::Reset()
     {
         SetErrorLevel( CHANNEL_ERROR_NONE );
 
@@ -2337,29 +3942,48 @@ namespace yojimbo
         for ( int i = 0; i < m_messageReceiveQueue->GetNumEntries(); ++i )
             m_messageFactory->ReleaseMessage( (*m_messageReceiveQueue)[i] );
 
+        for ( int i = 0; i < m_config.snapshotHistorySize; ++i )
+        {
+            if ( m_sentSnapshots[i].message )
+                m_messageFactory->ReleaseMessage( m_sentSnapshots[i].message );
+
+            if ( m_receivedSnapshots[i].message )
+                m_messageFactory->ReleaseMessage( m_receivedSnapshots[i].message );
+        }
+
         m_messageSendQueue->Clear();
         m_messageReceiveQueue->Clear();
+        m_sentPackets->Reset();
+
+        memset( m_sentSnapshots, 0, sizeof( SnapshotEntry ) * m_config.snapshotHistorySize );
+        memset( m_receivedSnapshots, 0, sizeof( SnapshotEntry ) * m_config.snapshotHistorySize );
+
+        m_sendSnapshotId = 0;
+        m_ackedSnapshotId = 0;
+        m_hasAckedSnapshot = false;
   
         ResetCounters();
     }
 
-    bool UnreliableUnorderedChannel::CanSendMessage() const
+    bool SnapshotDeltaChannel::CanSendMessage() const
     {
         yojimbo_assert( m_messageSendQueue );
         return !m_messageSendQueue->IsFull();
     }
 
-    bool UnreliableUnorderedChannel::HasMessagesToSend() const
+    bool SnapshotDeltaChannel::HasMessagesToSend() const
     {
         yojimbo_assert( m_messageSendQueue );
         return !m_messageSendQueue->IsEmpty();
     }
 
-    void UnreliableUnorderedChannel::SendMessage( Message * message, void *context )
+    void SnapshotDeltaChannel::SendMessage( Message * message, void *context )
     {
+        (void) context;
+
         yojimbo_assert( message );
+        yojimbo_assert( !message->IsProxyMessage() );
         yojimbo_assert( CanSendMessage() );
-		(void)context;
 
         if ( GetErrorLevel() != CHANNEL_ERROR_NONE )
         {
@@ -2389,12 +4013,14 @@ namespace yojimbo
             yojimbo_assert( ((BlockMessage*)message)->GetBlockSize() <= m_config.maxBlockSize );
         }
 
+        // snapshots are measured when they are included in a packet, since their size depends on the baseline at that time
+
         m_messageSendQueue->Push( message );
 
         m_counters[CHANNEL_COUNTER_MESSAGES_SENT]++;
     }
 
-    Message * UnreliableUnorderedChannel::ReceiveMessage()
+    Message * SnapshotDeltaChannel::ReceiveMessage()
     {
         if ( GetErrorLevel() != CHANNEL_ERROR_NONE )
             return NULL;
@@ -2407,14 +4033,48 @@ namespace yojimbo
         return m_messageReceiveQueue->Pop();
     }
 
-    void UnreliableUnorderedChannel::AdvanceTime( double time )
+    void SnapshotDeltaChannel::AdvanceTime( double time )
     {
         (void) time;
     }
+
+    const Message * SnapshotDeltaChannel::GetSendBaseline( uint16_t snapshotId ) const
+    {
+        if ( !m_hasAckedSnapshot )
+            return NULL;
+
+        if ( uint16_t( snapshotId - m_ackedSnapshotId ) >= m_config.snapshotHistorySize )
+            return NULL;
+
+        const SnapshotEntry & entry = m_sentSnapshots[m_ackedSnapshotId % m_config.snapshotHistorySize];
+
+        if ( !entry.message || entry.snapshotId != m_ackedSnapshotId )
+            return NULL;
+
+        return entry.message;
+    }
+
+    void SnapshotDeltaChannel::AddSnapshot( SnapshotEntry * history, uint16_t snapshotId, Message * message )
+    {
+        SnapshotEntry & entry = history[snapshotId % m_config.snapshotHistorySize];
+
+        if ( entry.message )
+        {
+            if ( !sequence_greater_than( snapshotId, entry.snapshotId ) )
+                return;
+
+            m_messageFactory->ReleaseMessage( entry.message );
+        }
+
+        m_messageFactory->AcquireMessage( message );
+
+        entry.snapshotId = snapshotId;
+        entry.message = message;
+    }
     
-    int UnreliableUnorderedChannel::GetPacketData( void *context, ChannelPacketData & packetData, uint16_t packetSequence, int availableBits )
+    int SnapshotDeltaChannel::GetPacketData( void *context, ChannelPacketData & packetData, uint16_t packetSequence, int availableBits )
     {
-        (void) packetSequence;
+        m_packetDataLimited = false;
 
         if ( m_messageSendQueue->IsEmpty() )
             return 0;
@@ -2426,6 +4086,8 @@ namespace yojimbo
 
         const int messageTypeBits = bits_required( 0, m_messageFactory->GetNumTypes() - 1 );
 
+        const int snapshotHeaderBits = 16 + 1 + bits_required( 1, m_config.snapshotHistorySize - 1 );
+
         int usedBits = ConservativeMessageHeaderBits;
         int numMessages = 0;
         Message ** messages = (Message**) alloca( sizeof( Message* ) * m_config.maxMessagesPerPacket );
@@ -2436,7 +4098,10 @@ namespace yojimbo
                 break;
 
             if ( availableBits - usedBits < giveUpBits )
+            {
+                m_packetDataLimited = true;
                 break;
+            }
 
             if ( numMessages == m_config.maxMessagesPerPacket )
                 break;
@@ -2445,20 +4110,25 @@ namespace yojimbo
 
             yojimbo_assert( message );
 
+            message->SetId( m_sendSnapshotId );
+            message->SetBaseline( GetSendBaseline( m_sendSnapshotId ) );
+
             MeasureStream measureStream( m_messageFactory->GetAllocator() );
-			measureStream.SetContext( context );
+            measureStream.SetContext( context );
             message->SerializeInternal( measureStream );
-            
+
             if ( message->IsBlockMessage() )
             {
                 BlockMessage * blockMessage = (BlockMessage*) message;
                 SerializeMessageBlock( measureStream, *m_messageFactory, blockMessage, m_config.maxBlockSize );
             }
 
-            const int messageBits = messageTypeBits + measureStream.GetBitsProcessed();
+            const int messageBits = messageTypeBits + snapshotHeaderBits + measureStream.GetBitsProcessed();
             
             if ( usedBits + messageBits > availableBits )
             {
+                m_packetDataLimited = true;
+                message->SetBaseline( NULL );
                 m_messageFactory->ReleaseMessage( message );
                 continue;
             }
@@ -2467,18 +4137,30 @@ namespace yojimbo
 
             yojimbo_assert( usedBits <= availableBits );
 
+            // never evict the baseline from the history. snapshots already in this packet may be delta encoded against it, and they aren't written until the whole packet is.
+            // a snapshot that would evict it is too far ahead of the baseline to be delta encoded anyway, so it only misses out on becoming a baseline itself
+
+            const SnapshotEntry & entry = m_sentSnapshots[m_sendSnapshotId % m_config.snapshotHistorySize];
+
+            if ( !m_hasAckedSnapshot || !entry.message || entry.snapshotId != m_ackedSnapshotId )
+                AddSnapshot( m_sentSnapshots, m_sendSnapshotId, message );
+
+            m_sendSnapshotId++;
+
             messages[numMessages++] = message;
         }
 
         if ( numMessages == 0 )
             return 0;
 
-        Allocator & allocator = m_messageFactory->GetAllocator();
+        uint16_t * sentPacket = m_sentPackets->Insert( packetSequence );
+        if ( sentPacket )
+            *sentPacket = uint16_t( m_sendSnapshotId - 1 );
 
         packetData.Initialize();
         packetData.channelIndex = GetChannelIndex();
         packetData.message.numMessages = numMessages;
-        packetData.message.messages = (Message**) YOJIMBO_ALLOCATE( allocator, sizeof( Message* ) * numMessages );
+        packetData.message.messages = (Message**) YOJIMBO_ALLOCATE( *m_packetAllocator, sizeof( Message* ) * numMessages );
         for ( int i = 0; i < numMessages; ++i )
         {
             packetData.message.messages[i] = messages[i];
@@ -2487,8 +4169,10 @@ namespace yojimbo
         return usedBits;
     }
 
-    void UnreliableUnorderedChannel::ProcessPacketData( const ChannelPacketData & packetData, uint16_t packetSequence )
+    void SnapshotDeltaChannel::ProcessPacketData( const ChannelPacketData & packetData, uint16_t packetSequence )
     {
+        (void) packetSequence;
+
         if ( m_errorLevel != CHANNEL_ERROR_NONE )
             return;
         
@@ -2498,22 +4182,52 @@ namespace yojimbo
             return;
         }
 
+        yojimbo_assert( !packetData.baselineMissing );
+
         for ( int i = 0; i < (int) packetData.message.numMessages; ++i )
         {
             Message * message = packetData.message.messages[i];
             yojimbo_assert( message );  
-            message->SetId( packetSequence );
             if ( !m_messageReceiveQueue->IsFull() )
             {
                 m_messageFactory->AcquireMessage( message );
                 m_messageReceiveQueue->Push( message );
             }
+            AddSnapshot( m_receivedSnapshots, message->GetId(), message );
         }
     }
 
-    void UnreliableUnorderedChannel::ProcessAck( uint16_t ack )
+    void SnapshotDeltaChannel::ProcessAck( uint16_t ack )
     {
-        (void) ack;
+        const uint16_t * sentPacket = m_sentPackets->Find( ack );
+        if ( !sentPacket )
+            return;
+
+        const uint16_t snapshotId = *sentPacket;
+
+        if ( !m_hasAckedSnapshot || sequence_greater_than( snapshotId, m_ackedSnapshotId ) )
+        {
+            m_ackedSnapshotId = snapshotId;
+            m_hasAckedSnapshot = true;
+        }
+
+        m_sentPackets->Remove( ack );
+    }
+
+    const Message * SnapshotDeltaChannel::FindReceivedSnapshot( uint16_t snapshotId ) const
+    {
+        const SnapshotEntry & entry = m_receivedSnapshots[snapshotId % m_config.snapshotHistorySize];
+
+        if ( !entry.message || entry.snapshotId != snapshotId )
+            return NULL;
+
+        return entry.message;
+    }
+
+    bool SnapshotDeltaChannel::GetAckedSnapshotId( uint16_t & snapshotId ) const
+    {
+        snapshotId = m_ackedSnapshotId;
+        return m_hasAckedSnapshot;
     }
 }
 
@@ -2526,12 +4240,18 @@ namespace yojimbo
         int numChannelEntries;
         ChannelPacketData * channelEntry;
         MessageFactory * messageFactory;
+        Allocator * allocator;
+        Channel ** channels;
+        bool baselineMissing;
 
-        ConnectionPacket()
+        ConnectionPacket( Allocator & _allocator )
         {
             messageFactory = NULL;
+            allocator = &_allocator;
             numChannelEntries = 0;
             channelEntry = NULL;
+            channels = NULL;
+            baselineMissing = false;
         }
 
         ~ConnectionPacket()
@@ -2540,9 +4260,9 @@ namespace yojimbo
             {
                 for ( int i = 0; i < numChannelEntries; ++i )
                 {
-                    channelEntry[i].Free( *messageFactory );
+                    channelEntry[i].Free( *messageFactory, *allocator );
                 }
-                YOJIMBO_FREE( messageFactory->GetAllocator(), channelEntry );
+                YOJIMBO_FREE( *allocator, channelEntry );
                 messageFactory = NULL;
             }        
         }
@@ -2552,8 +4272,7 @@ namespace yojimbo
             yojimbo_assert( numEntries > 0 );
             yojimbo_assert( numEntries <= MaxChannels );
             messageFactory = &_messageFactory;
-            Allocator & allocator = messageFactory->GetAllocator();
-            channelEntry = (ChannelPacketData*) YOJIMBO_ALLOCATE( allocator, sizeof( ChannelPacketData ) * numEntries );
+            channelEntry = (ChannelPacketData*) YOJIMBO_ALLOCATE( *allocator, sizeof( ChannelPacketData ) * numEntries );
             if ( channelEntry == NULL )
                 return false;
             for ( int i = 0; i < numEntries; ++i )
@@ -2588,11 +4307,17 @@ namespace yojimbo
                 for ( int i = 0; i < numChannelEntries; ++i )
                 {
                     yojimbo_assert( channelEntry[i].messageFailedToSerialize == 0 );
-                    if ( !channelEntry[i].SerializeInternal( stream, messageFactory, connectionConfig.channel, numChannels ) )
+                    if ( !channelEntry[i].SerializeInternal( stream, messageFactory, *allocator, connectionConfig.channel, numChannels, channels ) )
                     {
                         yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: failed to serialize channel %d\n", i );
                         return false;
                     }
+                    if ( channelEntry[i].baselineMissing )
+                    {
+                        // the rest of the packet can't be read without the baseline. stop here and let the connection drop the packet
+                        baselineMissing = true;
+                        return true;
+                    }
                 }
             }
             return true;
@@ -2622,13 +4347,122 @@ namespace yojimbo
 
     // ------------------------------------------------------------------------------
 
+    CongestionController::CongestionController( const ConnectionConfig & config, double time )
+    {
+        yojimbo_assert( config.minSendBandwidth > 0.0f );
+        yojimbo_assert( config.maxSendBandwidth >= config.minSendBandwidth );
+        m_maxPacketSize = config.maxPacketSize;
+        m_minSendBandwidth = config.minSendBandwidth;
+        m_maxSendBandwidth = config.maxSendBandwidth;
+        m_congestionPacketLoss = config.congestionPacketLoss;
+        m_congestionRTT = config.congestionRTT;
+        m_time = time;
+        Reset();
+    }
+
+    void CongestionController::Reset()
+    {
+        m_lastUpdateTime = m_time;
+        m_lastDecreaseTime = m_time - CongestionHoldTime;
+        m_sendBandwidth = m_minSendBandwidth;
+        m_tokens = 0.0f;
+        m_minRTT = 0.0f;
+        m_previousMinRTT = 0.0f;
+        m_minRTTWindowStart = m_time;
+        m_slowStart = true;
+    }
+
+    void CongestionController::AdvanceTime( double time )
+    {
+        const double deltaTime = time - m_time;
+        m_time = time;
+        if ( deltaTime <= 0.0 )
+            return;
+        // the bucket holds one packet. a connection sends one packet per-update, so anything more would be wasted
+        m_tokens = yojimbo_min( m_tokens + float( m_sendBandwidth * 1000.0f / 8.0f * deltaTime ), float( m_maxPacketSize ) );
+    }
+
+    void CongestionController::UpdateNetworkConditions( float RTT, float packetLoss )
+    {
+        const float deltaTime = float( m_time - m_lastUpdateTime );
+        m_lastUpdateTime = m_time;
+
+        // the lowest round trip time is taken over the current and previous windows, so a longer route raises it within two windows.
+        // the rate is halved until then, but it can't be held down forever by a round trip time the network no longer has
+
+        if ( m_time - m_minRTTWindowStart >= MinRTTWindowTime )
+        {
+            m_previousMinRTT = m_minRTT;
+            m_minRTT = 0.0f;
+            m_minRTTWindowStart = m_time;
+        }
+
+        if ( RTT > 0.0f && ( m_minRTT == 0.0f || RTT < m_minRTT ) )
+            m_minRTT = RTT;
+
+        const float minRTT = ( m_previousMinRTT > 0.0f && ( m_minRTT == 0.0f || m_previousMinRTT < m_minRTT ) ) ? m_previousMinRTT : m_minRTT;
+
+        // network statistics are averaged over time, so they lag behind changes to the send rate. hold the rate after halving it
+
+        if ( m_time - m_lastDecreaseTime < CongestionHoldTime )
+            return;
+
+        const bool congested = packetLoss > m_congestionPacketLoss || ( minRTT > 0.0f && RTT > minRTT + m_congestionRTT );
+
+        if ( congested )
+        {
+            m_sendBandwidth = yojimbo_max( m_sendBandwidth * 0.5f, m_minSendBandwidth );
+            m_lastDecreaseTime = m_time;
+            m_slowStart = false;
+        }
+        else if ( m_slowStart )
+        {
+            m_sendBandwidth = yojimbo_min( m_sendBandwidth * ( 1.0f + deltaTime ), m_maxSendBandwidth );
+        }
+        else
+        {
+            m_sendBandwidth = yojimbo_min( m_sendBandwidth + m_maxSendBandwidth * 0.05f * deltaTime, m_maxSendBandwidth );
+        }
+    }
+
+    int CongestionController::GetMaxPacketBytes( int maxPacketBytes ) const
+    {
+        // always leave room for the packet header and serialize checks, so an empty packet still carries acks
+        const int packetBytes = yojimbo_min( yojimbo_max( int( m_tokens ), MinPacketBytes ), maxPacketBytes );
+        return packetBytes - ( packetBytes % 4 );
+    }
+
+    void CongestionController::PacketSent( int packetBytes )
+    {
+        m_tokens -= packetBytes;
+    }
+
+    // ------------------------------------------------------------------------------------
+
     Connection::Connection( Allocator & allocator, MessageFactory & messageFactory, const ConnectionConfig & connectionConfig, double time ) 
         : m_connectionConfig( connectionConfig )
     {
         m_allocator = &allocator;
         m_messageFactory = &messageFactory;
         m_errorLevel = CONNECTION_ERROR_NONE;
+        m_packetArena = NULL;
+        m_packetAllocator = &messageFactory.GetAllocator();
+        m_congestionController = NULL;
+        if ( m_connectionConfig.congestionControl )
+        {
+            m_congestionController = YOJIMBO_NEW( *m_allocator, CongestionController, m_connectionConfig, time );
+        }
+        if ( m_connectionConfig.packetArenaSize > 0 )
+        {
+            m_packetArena = YOJIMBO_NEW( *m_allocator, BumpAllocator, messageFactory.GetAllocator(), m_connectionConfig.packetArenaSize );
+            m_packetAllocator = m_packetArena;
+        }
         memset( m_channel, 0, sizeof( m_channel ) );
+        memset( m_channelDeficitBits, 0, sizeof( m_channelDeficitBits ) );
+        memset( m_channelMessageSent, 0, sizeof( m_channelMessageSent ) );
+        m_time = time;
+        m_lastFlushTime = 0.0;
+        m_flushed = false;
         yojimbo_assert( m_connectionConfig.numChannels >= 1 );
         yojimbo_assert( m_connectionConfig.numChannels <= MaxChannels );
         for ( int channelIndex = 0; channelIndex < m_connectionConfig.numChannels; ++channelIndex )
@@ -2636,6 +4470,8 @@ namespace yojimbo
             switch ( m_connectionConfig.channel[channelIndex].type )
             {
                 case CHANNEL_TYPE_RELIABLE_ORDERED: 
+                case CHANNEL_TYPE_RELIABLE_UNORDERED: 
+                case CHANNEL_TYPE_RELIABLE_LATEST_VALUE: 
                 {
                     m_channel[channelIndex] = YOJIMBO_NEW( *m_allocator, 
                                                            ReliableOrderedChannel, 
@@ -2659,9 +4495,35 @@ namespace yojimbo
                 }
                 break;
 
+                case CHANNEL_TYPE_UNRELIABLE_SEQUENCED: 
+                {
+                    m_channel[channelIndex] = YOJIMBO_NEW( *m_allocator, 
+                                                           UnreliableSequencedChannel, 
+                                                           *m_allocator, 
+                                                           messageFactory, 
+                                                           m_connectionConfig.channel[channelIndex], 
+                                                           channelIndex, 
+                                                           time ); 
+                }
+                break;
+
+                case CHANNEL_TYPE_SNAPSHOT_DELTA: 
+                {
+                    m_channel[channelIndex] = YOJIMBO_NEW( *m_allocator, 
+                                                           SnapshotDeltaChannel, 
+                                                           *m_allocator, 
+                                                           messageFactory, 
+                                                           m_connectionConfig.channel[channelIndex], 
+                                                           channelIndex, 
+                                                           time ); 
+                }
+                break;
+
                 default: 
                     yojimbo_assert( !"unknown channel type" );
             }
+
+            m_channel[channelIndex]->SetPacketAllocator( *m_packetAllocator );
         }
     }
 
@@ -2673,6 +4535,8 @@ namespace yojimbo
         {
             YOJIMBO_DELETE( *m_allocator, Channel, m_channel[i] );
         }
+        YOJIMBO_DELETE( *m_allocator, BumpAllocator, m_packetArena );
+        YOJIMBO_DELETE( *m_allocator, CongestionController, m_congestionController );
         m_allocator = NULL;
     }
 
@@ -2683,6 +4547,14 @@ namespace yojimbo
         {
             m_channel[i]->Reset();
         }
+        memset( m_channelDeficitBits, 0, sizeof( m_channelDeficitBits ) );
+        memset( m_channelMessageSent, 0, sizeof( m_channelMessageSent ) );
+        m_lastFlushTime = 0.0;
+        m_flushed = false;
+        if ( m_congestionController )
+        {
+            m_congestionController->Reset();
+        }
     }
 
     bool Connection::CanSendMessage( int channelIndex ) const
@@ -2702,6 +4574,7 @@ namespace yojimbo
     {
         yojimbo_assert( channelIndex >= 0 );
         yojimbo_assert( channelIndex < m_connectionConfig.numChannels );
+        m_channelMessageSent[channelIndex] = true;
         return m_channel[channelIndex]->SendMessage( message, context );
     }
 
@@ -2750,7 +4623,32 @@ namespace yojimbo
 
     bool Connection::GeneratePacket( void * context, uint16_t packetSequence, uint8_t * packetData, int maxPacketBytes, int & packetBytes )
     {
-        ConnectionPacket packet;
+        // congestion control cuts the packet down to the bytes in its token bucket, which limits the bits channels get
+
+        if ( m_congestionController )
+            maxPacketBytes = m_congestionController->GetMaxPacketBytes( maxPacketBytes );
+
+        const bool result = GeneratePacketInternal( context, packetSequence, packetData, maxPacketBytes, packetBytes );
+
+        if ( result && m_congestionController )
+            m_congestionController->PacketSent( packetBytes );
+
+        if ( result )
+            memset( m_channelMessageSent, 0, sizeof( m_channelMessageSent ) );
+
+        // everything allocated while generating the packet has been freed, so release the arena in one step
+
+        if ( m_packetArena )
+            m_packetArena->Reset();
+
+        return result;
+    }
+
+    bool Connection::GeneratePacketInternal( void * context, uint16_t packetSequence, uint8_t * packetData, int maxPacketBytes, int & packetBytes )
+    {
+        ConnectionPacket packet( *m_packetAllocator );
+
+        packet.channels = m_channel;
 
         if ( m_connectionConfig.numChannels > 0 )
         {
@@ -2760,16 +4658,54 @@ namespace yojimbo
             ChannelPacketData channelData[MaxChannels];
             
             int availableBits = maxPacketBytes * 8 - ConservativePacketHeaderBits;
+
+            // split the packet between weighted channels with data to send. each channel gets its share of the bits
+            // left over by the channels before it, so bits one channel doesn't use go to the channels after it.
+            // unweighted channels may use all the bits left, like they did before channels had weights
+
+            bool channelActive[MaxChannels];
+            float remainingWeight = 0.0f;
+
+            for ( int channelIndex = 0; channelIndex < m_connectionConfig.numChannels; ++channelIndex )
+            {
+                channelActive[channelIndex] = m_channel[channelIndex]->HasMessagesToSend();
+                if ( channelActive[channelIndex] )
+                    remainingWeight += m_connectionConfig.channel[channelIndex].weight;
+                else
+                    m_channelDeficitBits[channelIndex] = 0;
+            }
             
             for ( int channelIndex = 0; channelIndex < m_connectionConfig.numChannels; ++channelIndex )
             {
-                int packetDataBits = m_channel[channelIndex]->GetPacketData( context, channelData[channelIndex], packetSequence, availableBits );
+                if ( !channelActive[channelIndex] )
+                    continue;
+
+                const float weight = m_connectionConfig.channel[channelIndex].weight;
+
+                yojimbo_assert( weight >= 0.0f );
+
+                const int shareBits = ( weight <= 0.0f || weight >= remainingWeight ) ? availableBits : int( availableBits * ( weight / remainingWeight ) );
+                const int channelBits = yojimbo_min( shareBits + m_channelDeficitBits[channelIndex], availableBits );
+
+                remainingWeight -= weight;
+
+                int packetDataBits = m_channel[channelIndex]->GetPacketData( context, channelData[channelIndex], packetSequence, channelBits );
                 if ( packetDataBits > 0 )
                 {
                     availableBits -= ConservativeChannelHeaderBits;
                     availableBits -= packetDataBits;
                     channelHasData[channelIndex] = true;
                     numChannelsWithData++;
+                    m_channelDeficitBits[channelIndex] = 0;
+                }
+                else if ( m_channel[channelIndex]->IsPacketDataLimited() )
+                {
+                    m_channelDeficitBits[channelIndex] = yojimbo_min( m_channelDeficitBits[channelIndex] + shareBits, maxPacketBytes * 8 );
+                }
+                else
+                {
+                    // nothing was ready to send, eg. reliable messages waiting for their resend time. that is not a share the channel missed out on
+                    m_channelDeficitBits[channelIndex] = 0;
                 }
             }
 
@@ -2796,6 +4732,19 @@ namespace yojimbo
 
         packetBytes = WritePacket( context, *m_messageFactory, m_connectionConfig, packet, packetData, maxPacketBytes );
 
+        // the baseline of a snapshot is only guaranteed to be alive while the packet is written. clear it, so sent snapshots don't point at baselines that left the history
+
+        for ( int i = 0; i < packet.numChannelEntries; ++i )
+        {
+            const ChannelPacketData & channelEntry = packet.channelEntry[i];
+
+            if ( m_connectionConfig.channel[channelEntry.channelIndex].type != CHANNEL_TYPE_SNAPSHOT_DELTA )
+                continue;
+
+            for ( int j = 0; j < (int) channelEntry.message.numMessages; ++j )
+                channelEntry.message.messages[j]->SetBaseline( NULL );
+        }
+
         return true;
     }
 
@@ -2819,6 +4768,9 @@ namespace yojimbo
             return false;
         }
 
+        if ( packet.baselineMissing )
+            return true;
+
 #if YOJIMBO_SERIALIZE_CHECKS
         if ( !stream.SerializeCheck() )
         {
@@ -2831,6 +4783,18 @@ namespace yojimbo
     }
 
     bool Connection::ProcessPacket( void * context, uint16_t packetSequence, const uint8_t * packetData, int packetBytes )
+    {
+        const bool result = ProcessPacketInternal( context, packetSequence, packetData, packetBytes );
+
+        // everything allocated while reading the packet has been freed, so release the arena in one step
+
+        if ( m_packetArena )
+            m_packetArena->Reset();
+
+        return result;
+    }
+
+    bool Connection::ProcessPacketInternal( void * context, uint16_t packetSequence, const uint8_t * packetData, int packetBytes )
     {
         if ( m_errorLevel != CONNECTION_ERROR_NONE )
         {
@@ -2838,7 +4802,9 @@ namespace yojimbo
             return false;
         }
 
-        ConnectionPacket packet;
+        ConnectionPacket packet( *m_packetAllocator );
+
+        packet.channels = m_channel;
 
         if ( !ReadPacket( context, *m_messageFactory, m_connectionConfig, packet, packetData, packetBytes ) )
         {
@@ -2847,6 +4813,12 @@ namespace yojimbo
             return false;            
         }
 
+        if ( packet.baselineMissing )
+        {
+            yojimbo_printf( YOJIMBO_LOG_LEVEL_DEBUG, "dropped packet %d because a snapshot baseline is no longer in the history\n", packetSequence );
+            return false;
+        }
+
         for ( int i = 0; i < packet.numChannelEntries; ++i )
         {
             const int channelIndex = packet.channelEntry[i].channelIndex;
@@ -2876,6 +4848,11 @@ namespace yojimbo
 
     void Connection::AdvanceTime( double time )
     {
+        m_time = time;
+        if ( m_congestionController )
+        {
+            m_congestionController->AdvanceTime( time );
+        }
         for ( int i = 0; i < m_connectionConfig.numChannels; ++i )
         {
             m_channel[i]->AdvanceTime( time );
@@ -2897,6 +4874,50 @@ namespace yojimbo
             return;
         }
     }
+
+    void Connection::UpdateNetworkConditions( float RTT, float packetLoss )
+    {
+        if ( m_congestionController )
+        {
+            m_congestionController->UpdateNetworkConditions( RTT, packetLoss );
+        }
+    }
+
+    float Connection::GetSendBandwidthLimit() const
+    {
+        return m_congestionController ? m_congestionController->GetSendBandwidth() : 0.0f;
+    }
+
+    int Connection::GetMaxPacketBytes( int maxPacketBytes ) const
+    {
+        return m_congestionController ? m_congestionController->GetMaxPacketBytes( maxPacketBytes ) : maxPacketBytes;
+    }
+
+    bool Connection::CanFlush( int channelIndex, double time ) const
+    {
+        yojimbo_assert( channelIndex >= -1 );
+        yojimbo_assert( channelIndex < m_connectionConfig.numChannels );
+
+        if ( m_flushed && time - m_lastFlushTime < m_connectionConfig.minFlushInterval )
+            return false;
+
+        if ( channelIndex >= 0 )
+            return m_channelMessageSent[channelIndex];
+
+        for ( int i = 0; i < m_connectionConfig.numChannels; ++i )
+        {
+            if ( m_channelMessageSent[i] )
+                return true;
+        }
+
+        return false;
+    }
+
+    void Connection::PacketFlushed( double time )
+    {
+        m_lastFlushTime = time;
+        m_flushed = true;
+    }
 }
 
 // ---------------------------------------------------------------------------------
@@ -2946,6 +4967,7 @@ namespace yojimbo
                 return;
             }
             reliable_endpoint_update( m_endpoint, m_time );
+            m_connection->UpdateNetworkConditions( reliable_endpoint_rtt( m_endpoint ), reliable_endpoint_packet_loss( m_endpoint ) );
             int numAcks;
             const uint16_t * acks = reliable_endpoint_get_acks( m_endpoint, &numAcks );
             m_connection->ProcessAcks( acks, numAcks );
@@ -3083,7 +5105,8 @@ namespace yojimbo
 
     uint8_t * BaseClient::AllocateBlock( int bytes )
     {
-        return (uint8_t*) YOJIMBO_ALLOCATE( *m_clientAllocator, bytes );
+        yojimbo_assert( m_messageFactory );
+        return (uint8_t*) YOJIMBO_ALLOCATE( m_messageFactory->GetBlockAllocator(), bytes );
     }
 
     void BaseClient::AttachBlockToMessage( Message * message, uint8_t * block, int bytes )
@@ -3092,13 +5115,15 @@ namespace yojimbo
         yojimbo_assert( block );
         yojimbo_assert( bytes > 0 );
         yojimbo_assert( message->IsBlockMessage() );
+        yojimbo_assert( m_messageFactory );
         BlockMessage * blockMessage = (BlockMessage*) message;
-        blockMessage->AttachBlock( *m_clientAllocator, block, bytes );
+        blockMessage->AttachBlock( m_messageFactory->GetBlockAllocator(), block, bytes );
     }
 
     void BaseClient::FreeBlock( uint8_t * block )
     {
-        YOJIMBO_FREE( *m_clientAllocator, block );
+        yojimbo_assert( m_messageFactory );
+        YOJIMBO_FREE( m_messageFactory->GetBlockAllocator(), block );
     }
 
     bool BaseClient::CanSendMessage( int channelIndex ) const
@@ -3144,6 +5169,7 @@ namespace yojimbo
             info.RTT = reliable_endpoint_rtt( m_endpoint );
             info.packetLoss = reliable_endpoint_packet_loss( m_endpoint );
             reliable_endpoint_bandwidth( m_endpoint, &info.sentBandwidth, &info.receivedBandwidth, &info.ackedBandwidth );
+            info.sendBandwidthLimit = m_connection->GetSendBandwidthLimit();
         }
     }
 
@@ -3262,6 +5288,16 @@ namespace yojimbo
         }
     }
 
+    void Client::FlushPackets( double time, int channelIndex )
+    {
+        if ( !IsConnected() )
+            return;
+        if ( !GetConnection().CanFlush( channelIndex, time ) )
+            return;
+        GetConnection().PacketFlushed( time );
+        SendPackets();
+    }
+
     void Client::ReceivePackets()
     {
         if ( !IsConnected() )
@@ -3432,6 +5468,379 @@ namespace yojimbo
 
 namespace yojimbo
 {
+    /**
+        A simple pool of worker threads used by the server to run per-client jobs in parallel.
+        The calling thread participates in running jobs, and Run does not return until all jobs have completed.
+     */
+
+    class WorkerPool
+    {
+    public:
+
+        WorkerPool( Allocator & allocator, int numThreads ) : m_allocator( allocator )
+        {
+            yojimbo_assert( numThreads > 0 );
+            m_numThreads = numThreads;
+            m_function = NULL;
+            m_context = NULL;
+            m_numJobs = 0;
+            m_nextJob = 0;
+            m_remainingJobs = 0;
+            m_activeWorkers = 0;
+            m_generation = 0;
+            m_quit = false;
+            m_threads = (std::thread*) YOJIMBO_ALLOCATE( m_allocator, sizeof( std::thread ) * numThreads );
+            for ( int i = 0; i < numThreads; ++i )
+            {
+                new ( &m_threads[i] ) std::thread( WorkerThread, this );
+            }
+        }
+
+        ~WorkerPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock( m_mutex );
+                m_quit = true;
+            }
+            m_workCondition.notify_all();
+            for ( int i = 0; i < m_numThreads; ++i )
+            {
+                m_threads[i].join();
+                m_threads[i].~thread();
+            }
+            YOJIMBO_FREE( m_allocator, m_threads );
+        }
+
+        void Run( void (*function)( void * context, int jobIndex ), void * context, int numJobs )
+        {
+            if ( numJobs <= 0 )
+                return;
+
+            if ( numJobs == 1 )
+            {
+                function( context, 0 );
+                return;
+            }
+
+            {
+                // IMPORTANT: wait for workers still finishing up the previous run before changing the job.
+                std::unique_lock<std::mutex> lock( m_mutex );
+                while ( m_activeWorkers > 0 )
+                    m_doneCondition.wait( lock );
+                m_function = function;
+                m_context = context;
+                m_numJobs = numJobs;
+                m_nextJob = 0;
+                m_remainingJobs = numJobs;
+                m_generation++;
+            }
+
+            m_workCondition.notify_all();
+
+            RunJobs();
+
+            std::unique_lock<std::mutex> lock( m_mutex );
+            while ( m_remainingJobs > 0 )
+                m_doneCondition.wait( lock );
+        }
+
+    private:
+
+        void RunJobs()
+        {
+            while ( true )
+            {
+                const int jobIndex = m_nextJob++;
+                if ( jobIndex >= m_numJobs )
+                    break;
+                m_function( m_context, jobIndex );
+                if ( --m_remainingJobs == 0 )
+                {
+                    std::lock_guard<std::mutex> lock( m_mutex );
+                    m_doneCondition.notify_all();
+                }
+            }
+        }
+
+        static void WorkerThread( WorkerPool * pool )
+        {
+            uint64_t generation = 0;
+            std::unique_lock<std::mutex> lock( pool->m_mutex );
+            while ( true )
+            {
+                while ( !pool->m_quit && pool->m_generation == generation )
+                    pool->m_workCondition.wait( lock );
+                if ( pool->m_quit )
+                    break;
+                generation = pool->m_generation;
+                pool->m_activeWorkers++;
+                lock.unlock();
+                pool->RunJobs();
+                lock.lock();
+                if ( --pool->m_activeWorkers == 0 )
+                    pool->m_doneCondition.notify_all();
+            }
+        }
+
+        Allocator & m_allocator;                                    ///< The allocator used to allocate the thread array.
+        int m_numThreads;                                           ///< The number of worker threads.
+        std::thread * m_threads;                                    ///< The worker threads.
+        std::mutex m_mutex;                                         ///< Protects the job description and the worker state below.
+        std::condition_variable m_workCondition;                    ///< Signalled when new jobs are available, or when the pool is shutting down.
+        std::condition_variable m_doneCondition;                    ///< Signalled when the last job completes, or when the last active worker goes idle.
+        void (*m_function)( void * context, int jobIndex );         ///< The job function for the current run.
+        void * m_context;                                           ///< The context passed to the job function.
+        int m_numJobs;                                              ///< The number of jobs in the current run.
+        std::atomic<int> m_nextJob;                                 ///< Index of the next job to be picked up.
+        std::atomic<int> m_remainingJobs;                           ///< Number of jobs in the current run that have not completed yet.
+        int m_activeWorkers;                                        ///< Number of worker threads currently picking up jobs.
+        uint64_t m_generation;                                      ///< Incremented each time a new set of jobs is submitted.
+        bool m_quit;                                                ///< Set to true to shut down the worker threads.
+    };
+
+    /**
+        A broadcast message payload, serialized once and shared by the proxy messages sent to each client.
+        If the message serializes differently depending on bit alignment (eg. it uses serialize_align or serialize_bytes), one variant is stored for each bit offset mod 8, otherwise there is a single variant.
+        Immutable once created, so it can be read by worker threads writing packets for different clients at the same time.
+     */
+
+    struct BroadcastPayload
+    {
+        enum { MaxVariants = 8 };
+
+        BroadcastPayload() : refCount(0), next(NULL), data(NULL), measuredBits(0), numVariants(0) {}
+
+        std::atomic<int> refCount;                                  ///< Number of proxy messages referencing this payload. Payloads are freed in BaseServer::AdvanceTime once this reaches zero.
+        BroadcastPayload * next;                                    ///< Next payload in the server's list of broadcast payloads.
+        uint8_t * data;                                             ///< The serialized variants, each padded to a multiple of four bytes.
+        int measuredBits;                                           ///< Number of bits reported when the message is measured. Upper bound on the size of each variant.
+        int numVariants;                                            ///< Number of variants. Either 1 or MaxVariants.
+        int variantOffset[MaxVariants];                             ///< Byte offset of each variant in the data.
+        int variantBytes[MaxVariants];                              ///< Number of bytes in each variant, including the alignment prefix.
+        int variantBits[MaxVariants];                               ///< Number of payload bits in each variant, excluding the alignment prefix.
+    };
+
+    /**
+        Message sent to each client for a broadcast.
+        Has the same type as the broadcast message, so it is read on the other side as a regular message, but writes out the shared serialized payload instead of serializing itself.
+     */
+
+    class BroadcastProxyMessage : public Message
+    {
+    public:
+
+        BroadcastProxyMessage( BroadcastPayload * payload, int type, uint32_t orderingKey ) : m_payload( payload )
+        {
+            yojimbo_assert( payload );
+            SetType( type );
+            SetOrderingKey( orderingKey );
+            SetProxyMessage();
+            m_payload->refCount++;
+        }
+
+        bool SerializeInternal( ReadStream & stream )
+        {
+            (void) stream;
+            yojimbo_assert( !"proxy messages are never read" );
+            return false;
+        }
+
+        bool SerializeInternal( WriteStream & stream )
+        {
+            // pick the variant that was serialized at the same bit alignment as the current position in the packet
+
+            const int variant = ( m_payload->numVariants > 1 ) ? ( stream.GetBitsProcessed() % 8 ) : 0;
+
+            BitReader reader( m_payload->data + m_payload->variantOffset[variant], m_payload->variantBytes[variant] );
+
+            if ( variant > 0 )
+                reader.ReadBits( variant );
+
+            int bits = m_payload->variantBits[variant];
+
+            while ( bits >= 32 )
+            {
+                if ( !stream.SerializeBits( reader.ReadBits( 32 ), 32 ) )
+                    return false;
+                bits -= 32;
+            }
+
+            if ( bits > 0 )
+            {
+                if ( !stream.SerializeBits( reader.ReadBits( bits ), bits ) )
+                    return false;
+            }
+
+            return true;
+        }
+
+        bool SerializeInternal( MeasureStream & stream )
+        {
+            int bits = m_payload->measuredBits;
+
+            while ( bits >= 32 )
+            {
+                stream.SerializeBits( 0, 32 );
+                bits -= 32;
+            }
+
+            if ( bits > 0 )
+                stream.SerializeBits( 0, bits );
+
+            return true;
+        }
+
+    protected:
+
+        ~BroadcastProxyMessage()
+        {
+            m_payload->refCount--;
+        }
+
+    private:
+
+        BroadcastPayload * m_payload;                               ///< The shared payload. The server frees it after the last proxy referencing it is destroyed.
+    };
+
+    /**
+        Allocator for read-only blocks shared by block messages sent to multiple clients.
+        Each block is reference counted. Attaching the block to a message adds a reference, and the block message destructor frees its block through this allocator, which releases that reference.
+        References may be released on worker threads, so blocks with no references left are only freed back to the backing allocator in Update, on the main thread.
+     */
+
+    class SharedBlockAllocator : public Allocator
+    {
+    public:
+
+        SharedBlockAllocator( Allocator & allocator ) : m_allocator( allocator ), m_blocks( NULL ) {}
+
+        ~SharedBlockAllocator()
+        {
+            Update( true );
+        }
+
+        void * Allocate( size_t size, const char * file, int line )
+        {
+            uint8_t * memory = (uint8_t*) m_allocator.Allocate( HeaderBytes + size, file, line );
+            if ( !memory )
+            {
+                SetErrorLevel( ALLOCATOR_ERROR_OUT_OF_MEMORY );
+                return NULL;
+            }
+            SharedBlock * block = new ( memory ) SharedBlock();
+            block->refCount = 1;
+            block->next = m_blocks;
+            m_blocks = block;
+            return memory + HeaderBytes;
+        }
+
+        void Free( void * p, const char * file, int line )
+        {
+            (void) file;
+            (void) line;
+            if ( !p )
+                return;
+            SharedBlock * block = GetSharedBlock( p );
+            yojimbo_assert( block->refCount > 0 );
+            block->refCount--;
+        }
+
+        void Acquire( void * p )
+        {
+            yojimbo_assert( p );
+            SharedBlock * block = GetSharedBlock( p );
+            yojimbo_assert( block->refCount > 0 );
+            block->refCount++;
+        }
+
+        void Update( bool all )
+        {
+            (void) all;
+            SharedBlock ** previous = &m_blocks;
+            while ( *previous )
+            {
+                SharedBlock * block = *previous;
+                if ( block->refCount == 0 )
+                {
+                    *previous = block->next;
+                    YOJIMBO_DELETE( m_allocator, SharedBlock, block );
+                }
+                else
+                {
+                    yojimbo_assert( !all );
+                    previous = &block->next;
+                }
+            }
+        }
+
+    private:
+
+        struct SharedBlock
+        {
+            std::atomic<int> refCount;                              ///< Number of references to the block. One for the server until Server::FreeSharedBlock, plus one per message the block is attached to.
+            SharedBlock * next;                                     ///< Next block in the list of shared blocks.
+        };
+
+        enum { HeaderBytes = ( sizeof( SharedBlock ) + 15 ) & ~15 };
+
+        static SharedBlock * GetSharedBlock( void * p )
+        {
+            return (SharedBlock*) ( ( (uint8_t*) p ) - HeaderBytes );
+        }
+
+        Allocator & m_allocator;                                    ///< The backing allocator.
+        SharedBlock * m_blocks;                                     ///< List of shared blocks that have not been freed yet.
+    };
+
+    // -----------------------------------------------------------------------------------------------------
+
+    struct DemandPerWeightLess
+    {
+        const int * demands;
+        const float * weights;
+
+        bool operator () ( int a, int b ) const
+        {
+            // compare demand per-weight without dividing. ties go by index, so the order doesn't depend on the sort implementation
+            const float x = demands[a] * weights[b];
+            const float y = demands[b] * weights[a];
+            return x < y || ( x == y && a < b );
+        }
+    };
+
+    void max_min_fair_share( const int * demands, const float * weights, int count, int budget, int * order, int * shares )
+    {
+        yojimbo_assert( count >= 0 );
+
+        // visit consumers from the smallest demand per-weight up. each gets the smaller of its demand and its weighted share
+        // of the budget that is left, so whatever small consumers don't need goes to the larger ones after them
+
+        float remainingWeight = 0.0f;
+
+        for ( int i = 0; i < count; ++i )
+        {
+            yojimbo_assert( weights[i] > 0.0f );
+            order[i] = i;
+            remainingWeight += weights[i];
+        }
+
+        DemandPerWeightLess less;
+        less.demands = demands;
+        less.weights = weights;
+        std::sort( order, order + count, less );
+
+        int remainingBudget = yojimbo_max( budget, 0 );
+
+        for ( int j = 0; j < count; ++j )
+        {
+            const int i = order[j];
+            const int share = ( weights[i] >= remainingWeight ) ? remainingBudget : int( remainingBudget * ( weights[i] / remainingWeight ) );
+            shares[i] = yojimbo_min( demands[i], share );
+            remainingBudget -= shares[i];
+            remainingWeight -= weights[i];
+        }
+    }
+
     BaseServer::BaseServer( Allocator & allocator, const ClientServerConfig & config, Adapter & adapter, double time ) : m_config( config )
     {
         m_allocator = &allocator;
@@ -3442,16 +5851,24 @@ namespace yojimbo
         m_maxClients = 0;
         m_globalMemory = NULL;
         m_globalAllocator = NULL;
-        for ( int i = 0; i < MaxClients; ++i )
-        {
-            m_clientMemory[i] = NULL;
-            m_clientAllocator[i] = NULL;
-            m_clientMessageFactory[i] = NULL;
-            m_clientConnection[i] = NULL;
-            m_clientEndpoint[i] = NULL;
-        }
+        m_clientSlots = NULL;
+        m_activeClients = NULL;
+        m_numActiveClients = 0;
+        m_numClientsToDisconnect = 0;
+        m_clientMemoryPool = NULL;
+        m_freeClientMemory = NULL;
+        m_numFreeClientMemory = 0;
         m_networkSimulator = NULL;
         m_packetBuffer = NULL;
+        m_workerPool = NULL;
+        m_broadcastMessageFactory = NULL;
+        m_broadcastBuffer = NULL;
+        m_broadcastPayloads = NULL;
+        m_sharedBlockAllocator = NULL;
+        m_budgetDemands = NULL;
+        m_budgetWeights = NULL;
+        m_budgetOrder = NULL;
+        m_budgetShares = NULL;
     }
 
     BaseServer::~BaseServer()
@@ -3469,109 +5886,272 @@ namespace yojimbo
 
     void BaseServer::Start( int maxClients )
     {
-        Stop();
-        m_running = true;
-        m_maxClients = maxClients;
-        yojimbo_assert( !m_globalMemory );
-        yojimbo_assert( !m_globalAllocator );
-        m_globalMemory = (uint8_t*) YOJIMBO_ALLOCATE( *m_allocator, m_config.serverGlobalMemory );
-        m_globalAllocator = m_adapter->CreateAllocator( *m_allocator, m_globalMemory, m_config.serverGlobalMemory );
-        yojimbo_assert( m_globalAllocator );
-        if ( m_config.networkSimulator )
+        Stop();
+        yojimbo_assert( maxClients >= 1 );
+        yojimbo_assert( maxClients <= MaxClients );
+        m_running = true;
+        m_maxClients = maxClients;
+        yojimbo_assert( !m_clientSlots );
+        m_clientSlots = (ClientSlot*) YOJIMBO_ALLOCATE( *m_allocator, sizeof( ClientSlot ) * m_maxClients );
+        memset( m_clientSlots, 0, sizeof( ClientSlot ) * m_maxClients );
+        m_activeClients = (int*) YOJIMBO_ALLOCATE( *m_allocator, sizeof( int ) * m_maxClients );
+        m_numActiveClients = 0;
+        m_budgetDemands = (int*) YOJIMBO_ALLOCATE( *m_allocator, sizeof( int ) * m_maxClients );
+        m_budgetWeights = (float*) YOJIMBO_ALLOCATE( *m_allocator, sizeof( float ) * m_maxClients );
+        m_budgetOrder = (int*) YOJIMBO_ALLOCATE( *m_allocator, sizeof( int ) * m_maxClients );
+        m_budgetShares = (int*) YOJIMBO_ALLOCATE( *m_allocator, sizeof( int ) * m_maxClients );
+        memset( m_budgetDemands, 0, sizeof( int ) * m_maxClients );
+        memset( m_budgetOrder, 0, sizeof( int ) * m_maxClients );
+        memset( m_budgetShares, 0, sizeof( int ) * m_maxClients );
+        for ( int i = 0; i < m_maxClients; ++i )
+            m_budgetWeights[i] = 1.0f;
+        m_numClientsToDisconnect = 0;
+        yojimbo_assert( !m_globalMemory );
+        yojimbo_assert( !m_globalAllocator );
+        m_globalMemory = (uint8_t*) YOJIMBO_ALLOCATE( *m_allocator, m_config.serverGlobalMemory );
+        m_globalAllocator = m_adapter->CreateAllocator( *m_allocator, m_globalMemory, m_config.serverGlobalMemory );
+        yojimbo_assert( m_globalAllocator );
+        if ( m_config.networkSimulator )
+        {
+            m_networkSimulator = YOJIMBO_NEW( *m_globalAllocator, NetworkSimulator, *m_globalAllocator, m_config.maxSimulatorPackets, m_time );
+        }
+        if ( m_config.serverClientMemoryPool > 0 )
+        {
+            // per-client memory is carved out of this pool when clients connect, and returned to it when they disconnect.
+            yojimbo_assert( !m_clientMemoryPool );
+            m_clientMemoryPool = (uint8_t*) YOJIMBO_ALLOCATE( *m_allocator, (size_t) m_config.serverPerClientMemory * m_config.serverClientMemoryPool );
+            m_freeClientMemory = (uint8_t**) YOJIMBO_ALLOCATE( *m_allocator, sizeof( uint8_t* ) * m_config.serverClientMemoryPool );
+            m_numFreeClientMemory = m_config.serverClientMemoryPool;
+            for ( int i = 0; i < m_numFreeClientMemory; ++i )
+            {
+                m_freeClientMemory[i] = m_clientMemoryPool + (size_t) m_config.serverPerClientMemory * ( m_numFreeClientMemory - 1 - i );
+            }
+        }
+        else
+        {
+            for ( int i = 0; i < m_maxClients; ++i )
+            {
+                uint8_t * memory = (uint8_t*) YOJIMBO_ALLOCATE( *m_allocator, m_config.serverPerClientMemory );
+                CreateClientSlot( i, memory );
+            }
+        }
+        m_packetBuffer = (uint8_t*) YOJIMBO_ALLOCATE( *m_globalAllocator, m_config.maxPacketSize );
+        if ( m_config.serverWorkerThreads > 0 )
+        {
+            m_workerPool = YOJIMBO_NEW( *m_globalAllocator, WorkerPool, *m_globalAllocator, m_config.serverWorkerThreads );
+        }
+        m_broadcastMessageFactory = m_adapter->CreateMessageFactory( *m_globalAllocator );
+        yojimbo_assert( m_broadcastMessageFactory );
+        m_broadcastBuffer = (uint8_t*) YOJIMBO_ALLOCATE( *m_globalAllocator, BroadcastPayload::MaxVariants * ( ( m_config.maxPacketSize + 3 ) & ~3 ) );
+        m_sharedBlockAllocator = YOJIMBO_NEW( *m_globalAllocator, SharedBlockAllocator, *m_globalAllocator );
+        m_egressTokens = 0.0f;
+    }
+
+    void BaseServer::Stop()
+    {
+        if ( IsRunning() )
+        {
+            YOJIMBO_DELETE( *m_globalAllocator, WorkerPool, m_workerPool );
+            YOJIMBO_FREE( *m_globalAllocator, m_packetBuffer );
+            yojimbo_assert( m_globalMemory );
+            yojimbo_assert( m_globalAllocator );
+            YOJIMBO_DELETE( *m_globalAllocator, NetworkSimulator, m_networkSimulator );
+            for ( int i = 0; i < m_maxClients; ++i )
+            {
+                if ( !m_clientSlots[i].connection )
+                    continue;
+                uint8_t * memory = DestroyClientSlot( i );
+                if ( !m_clientMemoryPool )
+                {
+                    YOJIMBO_FREE( *m_allocator, memory );
+                }
+            }
+            FreeBroadcastPayloads( true );
+            YOJIMBO_DELETE( *m_globalAllocator, SharedBlockAllocator, m_sharedBlockAllocator );
+            YOJIMBO_FREE( *m_globalAllocator, m_broadcastBuffer );
+            YOJIMBO_DELETE( *m_globalAllocator, MessageFactory, m_broadcastMessageFactory );
+            YOJIMBO_FREE( *m_allocator, m_clientMemoryPool );
+            YOJIMBO_FREE( *m_allocator, m_freeClientMemory );
+            m_numFreeClientMemory = 0;
+            YOJIMBO_FREE( *m_allocator, m_clientSlots );
+            YOJIMBO_FREE( *m_allocator, m_activeClients );
+            m_numActiveClients = 0;
+            YOJIMBO_FREE( *m_allocator, m_budgetDemands );
+            YOJIMBO_FREE( *m_allocator, m_budgetWeights );
+            YOJIMBO_FREE( *m_allocator, m_budgetOrder );
+            YOJIMBO_FREE( *m_allocator, m_budgetShares );
+            m_numClientsToDisconnect = 0;
+            YOJIMBO_DELETE( *m_allocator, Allocator, m_globalAllocator );
+            YOJIMBO_FREE( *m_allocator, m_globalMemory );
+        }
+        m_running = false;
+        m_maxClients = 0;
+        m_packetBuffer = NULL;
+    }
+
+    void BaseServer::CreateClientSlot( int clientIndex, uint8_t * memory )
+    {
+        yojimbo_assert( clientIndex >= 0 );
+        yojimbo_assert( clientIndex < m_maxClients );
+        yojimbo_assert( memory );
+
+        ClientSlot & slot = m_clientSlots[clientIndex];
+
+        yojimbo_assert( !slot.memory );
+        yojimbo_assert( !slot.allocator );
+
+        slot.memory = memory;
+        slot.allocator = m_adapter->CreateAllocator( *m_allocator, slot.memory, m_config.serverPerClientMemory );
+        yojimbo_assert( slot.allocator );
+        
+        slot.messageFactory = m_adapter->CreateMessageFactory( *slot.allocator );
+        yojimbo_assert( slot.messageFactory );
+        
+        slot.connection = YOJIMBO_NEW( *slot.allocator, Connection, *slot.allocator, *slot.messageFactory, m_config, m_time );
+        yojimbo_assert( slot.connection );
+
+        reliable_config_t reliable_config;
+        reliable_default_config( &reliable_config );
+        strcpy( reliable_config.name, "server endpoint" );
+        reliable_config.context = (void*) this;
+        reliable_config.index = clientIndex;
+        reliable_config.max_packet_size = m_config.maxPacketSize;
+        reliable_config.fragment_above = m_config.fragmentPacketsAbove;
+        reliable_config.max_fragments = m_config.maxPacketFragments;
+        reliable_config.fragment_size = m_config.packetFragmentSize; 
+        reliable_config.ack_buffer_size = m_config.ackedPacketsBufferSize;
+        reliable_config.received_packets_buffer_size = m_config.receivedPacketsBufferSize;
+        reliable_config.fragment_reassembly_buffer_size = m_config.packetReassemblyBufferSize;
+        reliable_config.transmit_packet_function = BaseServer::StaticTransmitPacketFunction;
+        reliable_config.process_packet_function = BaseServer::StaticProcessPacketFunction;
+        // IMPORTANT: when packets are processed on worker threads, each endpoint must allocate from its own client allocator
+        reliable_config.allocator_context = ( m_config.serverWorkerThreads > 0 ) ? slot.allocator : &GetGlobalAllocator();
+        reliable_config.allocate_function = BaseServer::StaticAllocateFunction;
+        reliable_config.free_function = BaseServer::StaticFreeFunction;
+        slot.endpoint = reliable_endpoint_create( &reliable_config, m_time );
+        reliable_endpoint_reset( slot.endpoint );
+
+        if ( m_config.serverWorkerThreads > 0 )
+        {
+            slot.packetBuffer = (uint8_t*) YOJIMBO_ALLOCATE( *slot.allocator, m_config.maxPacketSize );
+        }
+    }
+
+    uint8_t * BaseServer::DestroyClientSlot( int clientIndex )
+    {
+        yojimbo_assert( clientIndex >= 0 );
+        yojimbo_assert( clientIndex < m_maxClients );
+
+        ClientSlot & slot = m_clientSlots[clientIndex];
+
+        yojimbo_assert( slot.memory );
+        yojimbo_assert( slot.allocator );
+        yojimbo_assert( slot.messageFactory );
+        yojimbo_assert( slot.endpoint );
+
+        reliable_endpoint_destroy( slot.endpoint ); slot.endpoint = NULL;
+        YOJIMBO_FREE( *slot.allocator, slot.packetBuffer );
+        YOJIMBO_DELETE( *slot.allocator, Connection, slot.connection );
+        YOJIMBO_DELETE( *slot.allocator, MessageFactory, slot.messageFactory );
+        YOJIMBO_DELETE( *m_allocator, Allocator, slot.allocator );
+
+        uint8_t * memory = slot.memory;
+        slot.memory = NULL;
+        return memory;
+    }
+
+    bool BaseServer::AcquireClientSlot( int clientIndex )
+    {
+        yojimbo_assert( IsRunning() ); 
+        yojimbo_assert( clientIndex >= 0 ); 
+        yojimbo_assert( clientIndex < m_maxClients );
+        if ( !m_clientMemoryPool )
+            return true;
+        yojimbo_assert( !m_clientSlots[clientIndex].connection );
+        if ( m_numFreeClientMemory == 0 )
+        {
+            yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "client memory pool is exhausted. disconnecting client %d\n", clientIndex );
+            m_clientSlots[clientIndex].disconnect = true;
+            m_numClientsToDisconnect++;
+            return false;
+        }
+        CreateClientSlot( clientIndex, m_freeClientMemory[--m_numFreeClientMemory] );
+        return true;
+    }
+
+    void BaseServer::ReleaseClientSlot( int clientIndex )
+    {
+        yojimbo_assert( IsRunning() ); 
+        yojimbo_assert( clientIndex >= 0 ); 
+        yojimbo_assert( clientIndex < m_maxClients );
+        if ( !m_clientMemoryPool )
+            return;
+        ClientSlot & slot = m_clientSlots[clientIndex];
+        if ( slot.disconnect )
         {
-            m_networkSimulator = YOJIMBO_NEW( *m_globalAllocator, NetworkSimulator, *m_globalAllocator, m_config.maxSimulatorPackets, m_time );
+            slot.disconnect = false;
+            m_numClientsToDisconnect--;
         }
-        for ( int i = 0; i < m_maxClients; ++i )
+        if ( slot.connection )
         {
-            yojimbo_assert( !m_clientMemory[i] );
-            yojimbo_assert( !m_clientAllocator[i] );
-            
-            m_clientMemory[i] = (uint8_t*) YOJIMBO_ALLOCATE( *m_allocator, m_config.serverPerClientMemory );
-            m_clientAllocator[i] = m_adapter->CreateAllocator( *m_allocator, m_clientMemory[i], m_config.serverPerClientMemory );
-            yojimbo_assert( m_clientAllocator[i] );
-            
-            m_clientMessageFactory[i] = m_adapter->CreateMessageFactory( *m_clientAllocator[i] );
-            yojimbo_assert( m_clientMessageFactory[i] );
-            
-            m_clientConnection[i] = YOJIMBO_NEW( *m_clientAllocator[i], Connection, *m_clientAllocator[i], *m_clientMessageFactory[i], m_config, m_time );
-            yojimbo_assert( m_clientConnection[i] );
-
-            reliable_config_t reliable_config;
-            reliable_default_config( &reliable_config );
-            strcpy( reliable_config.name, "server endpoint" );
-            reliable_config.context = (void*) this;
-            reliable_config.index = i;
-            reliable_config.max_packet_size = m_config.maxPacketSize;
-            reliable_config.fragment_above = m_config.fragmentPacketsAbove;
-            reliable_config.max_fragments = m_config.maxPacketFragments;
-            reliable_config.fragment_size = m_config.packetFragmentSize; 
-            reliable_config.ack_buffer_size = m_config.ackedPacketsBufferSize;
-            reliable_config.received_packets_buffer_size = m_config.receivedPacketsBufferSize;
-            reliable_config.fragment_reassembly_buffer_size = m_config.packetReassemblyBufferSize;
-            reliable_config.transmit_packet_function = BaseServer::StaticTransmitPacketFunction;
-            reliable_config.process_packet_function = BaseServer::StaticProcessPacketFunction;
-            reliable_config.allocator_context = &GetGlobalAllocator();
-            reliable_config.allocate_function = BaseServer::StaticAllocateFunction;
-            reliable_config.free_function = BaseServer::StaticFreeFunction;
-            m_clientEndpoint[i] = reliable_endpoint_create( &reliable_config, m_time );
-            reliable_endpoint_reset( m_clientEndpoint[i] );
+            yojimbo_assert( m_numFreeClientMemory < m_config.serverClientMemoryPool );
+            m_freeClientMemory[m_numFreeClientMemory++] = DestroyClientSlot( clientIndex );
         }
-        m_packetBuffer = (uint8_t*) YOJIMBO_ALLOCATE( *m_globalAllocator, m_config.maxPacketSize );
     }
 
-    void BaseServer::Stop()
+    bool BaseServer::HasClientSlot( int clientIndex ) const
     {
-        if ( IsRunning() )
-        {
-            YOJIMBO_FREE( *m_globalAllocator, m_packetBuffer );
-            yojimbo_assert( m_globalMemory );
-            yojimbo_assert( m_globalAllocator );
-            YOJIMBO_DELETE( *m_globalAllocator, NetworkSimulator, m_networkSimulator );
-            for ( int i = 0; i < m_maxClients; ++i )
-            {
-                yojimbo_assert( m_clientMemory[i] );
-                yojimbo_assert( m_clientAllocator[i] );
-                yojimbo_assert( m_clientMessageFactory[i] );
-                yojimbo_assert( m_clientEndpoint[i] );
-                reliable_endpoint_destroy( m_clientEndpoint[i] ); m_clientEndpoint[i] = NULL;
-                YOJIMBO_DELETE( *m_clientAllocator[i], Connection, m_clientConnection[i] );
-                YOJIMBO_DELETE( *m_clientAllocator[i], MessageFactory, m_clientMessageFactory[i] );
-                YOJIMBO_DELETE( *m_allocator, Allocator, m_clientAllocator[i] );
-                YOJIMBO_FREE( *m_allocator, m_clientMemory[i] );
-            }
-            YOJIMBO_DELETE( *m_allocator, Allocator, m_globalAllocator );
-            YOJIMBO_FREE( *m_allocator, m_globalMemory );
-        }
-        m_running = false;
-        m_maxClients = 0;
-        m_packetBuffer = NULL;
+        yojimbo_assert( IsRunning() ); 
+        yojimbo_assert( clientIndex >= 0 ); 
+        yojimbo_assert( clientIndex < m_maxClients );
+        return m_clientSlots[clientIndex].connection != NULL;
     }
 
     void BaseServer::AdvanceTime( double time )
     {
+        const double deltaTime = time - m_time;
         m_time = time;
         if ( IsRunning() )
         {
-            for ( int i = 0; i < m_maxClients; ++i )
+            if ( m_config.serverMaxSendBandwidth > 0.0f && deltaTime > 0.0 )
+            {
+                const float bytesPerSecond = m_config.serverMaxSendBandwidth * 1000.0f / 8.0f;
+                m_egressTokens = yojimbo_min( m_egressTokens + float( bytesPerSecond * deltaTime ), float( bytesPerSecond * yojimbo_max( deltaTime, ServerEgressBurstTime ) ) );
+            }
+            for ( int i = 0; i < m_maxClients && m_numClientsToDisconnect > 0; ++i )
+            {
+                if ( m_clientSlots[i].disconnect )
+                {
+                    m_clientSlots[i].disconnect = false;
+                    m_numClientsToDisconnect--;
+                    DisconnectClient( i );
+                }
+            }
+            // IMPORTANT: iterate backwards, because disconnecting a client removes it from the active client list.
+            for ( int j = m_numActiveClients - 1; j >= 0; --j )
             {
-                m_clientConnection[i]->AdvanceTime( time );
-                if ( m_clientConnection[i]->GetErrorLevel() != CONNECTION_ERROR_NONE )
+                const int i = m_activeClients[j];
+                m_clientSlots[i].connection->AdvanceTime( time );
+                if ( m_clientSlots[i].connection->GetErrorLevel() != CONNECTION_ERROR_NONE )
                 {
-                    yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "client %d connection is in error state. disconnecting client\n", m_clientConnection[i]->GetErrorLevel() );
+                    yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "client %d connection is in error state. disconnecting client\n", m_clientSlots[i].connection->GetErrorLevel() );
                     DisconnectClient( i );
                     continue;
                 }
-                reliable_endpoint_update( m_clientEndpoint[i], m_time );
+                reliable_endpoint_update( m_clientSlots[i].endpoint, m_time );
+                m_clientSlots[i].connection->UpdateNetworkConditions( reliable_endpoint_rtt( m_clientSlots[i].endpoint ), reliable_endpoint_packet_loss( m_clientSlots[i].endpoint ) );
                 int numAcks;
-                const uint16_t * acks = reliable_endpoint_get_acks( m_clientEndpoint[i], &numAcks );
-                m_clientConnection[i]->ProcessAcks( acks, numAcks );
-                reliable_endpoint_clear_acks( m_clientEndpoint[i] );
+                const uint16_t * acks = reliable_endpoint_get_acks( m_clientSlots[i].endpoint, &numAcks );
+                m_clientSlots[i].connection->ProcessAcks( acks, numAcks );
+                reliable_endpoint_clear_acks( m_clientSlots[i].endpoint );
             }
             NetworkSimulator * networkSimulator = GetNetworkSimulator();
             if ( networkSimulator )
             {
                 networkSimulator->AdvanceTime( time );
             }        
+            FreeBroadcastPayloads( false );
+            m_sharedBlockAllocator->Update( false );
         }
     }
 
@@ -3611,16 +6191,16 @@ namespace yojimbo
     {
         yojimbo_assert( clientIndex >= 0 );
         yojimbo_assert( clientIndex < m_maxClients );
-        yojimbo_assert( m_clientMessageFactory[clientIndex] );
-        return m_clientMessageFactory[clientIndex]->CreateMessage( type );
+        yojimbo_assert( m_clientSlots[clientIndex].messageFactory );
+        return m_clientSlots[clientIndex].messageFactory->CreateMessage( type );
     }
 
     uint8_t * BaseServer::AllocateBlock( int clientIndex, int bytes )
     {
         yojimbo_assert( clientIndex >= 0 );
         yojimbo_assert( clientIndex < m_maxClients );
-        yojimbo_assert( m_clientAllocator[clientIndex] );
-        return (uint8_t*) YOJIMBO_ALLOCATE( *m_clientAllocator[clientIndex], bytes );
+        yojimbo_assert( m_clientSlots[clientIndex].messageFactory );
+        return (uint8_t*) YOJIMBO_ALLOCATE( m_clientSlots[clientIndex].messageFactory->GetBlockAllocator(), bytes );
     }
 
     void BaseServer::AttachBlockToMessage( int clientIndex, Message * message, uint8_t * block, int bytes )
@@ -3631,55 +6211,218 @@ namespace yojimbo
         yojimbo_assert( block );
         yojimbo_assert( bytes > 0 );
         yojimbo_assert( message->IsBlockMessage() );
+        yojimbo_assert( m_clientSlots[clientIndex].messageFactory );
         BlockMessage * blockMessage = (BlockMessage*) message;
-        blockMessage->AttachBlock( *m_clientAllocator[clientIndex], block, bytes );
+        blockMessage->AttachBlock( m_clientSlots[clientIndex].messageFactory->GetBlockAllocator(), block, bytes );
     }
 
     void BaseServer::FreeBlock( int clientIndex, uint8_t * block )
     {
         yojimbo_assert( clientIndex >= 0 );
         yojimbo_assert( clientIndex < m_maxClients );
-        YOJIMBO_FREE( *m_clientAllocator[clientIndex], block );
+        yojimbo_assert( m_clientSlots[clientIndex].messageFactory );
+        YOJIMBO_FREE( m_clientSlots[clientIndex].messageFactory->GetBlockAllocator(), block );
+    }
+
+    uint8_t * BaseServer::AllocateSharedBlock( int bytes )
+    {
+        yojimbo_assert( bytes > 0 );
+        yojimbo_assert( m_sharedBlockAllocator );
+        return (uint8_t*) YOJIMBO_ALLOCATE( *m_sharedBlockAllocator, bytes );
+    }
+
+    void BaseServer::AttachSharedBlockToMessage( int clientIndex, Message * message, uint8_t * block, int bytes )
+    {
+        yojimbo_assert( clientIndex >= 0 );
+        yojimbo_assert( clientIndex < m_maxClients );
+        yojimbo_assert( message );
+        yojimbo_assert( block );
+        yojimbo_assert( bytes > 0 );
+        yojimbo_assert( message->IsBlockMessage() );
+        yojimbo_assert( m_sharedBlockAllocator );
+        (void) clientIndex;
+        m_sharedBlockAllocator->Acquire( block );
+        BlockMessage * blockMessage = (BlockMessage*) message;
+        blockMessage->AttachBlock( *m_sharedBlockAllocator, block, bytes );
+    }
+
+    void BaseServer::FreeSharedBlock( uint8_t * block )
+    {
+        yojimbo_assert( m_sharedBlockAllocator );
+        YOJIMBO_FREE( *m_sharedBlockAllocator, block );
     }
 
     bool BaseServer::CanSendMessage( int clientIndex, int channelIndex ) const
     {
         yojimbo_assert( clientIndex >= 0 );
         yojimbo_assert( clientIndex < m_maxClients );
-        yojimbo_assert( m_clientConnection[clientIndex] );
-        return m_clientConnection[clientIndex]->CanSendMessage( channelIndex );
+        yojimbo_assert( m_clientSlots[clientIndex].connection );
+        return m_clientSlots[clientIndex].connection->CanSendMessage( channelIndex );
     }
 
     bool BaseServer::HasMessagesToSend( int clientIndex, int channelIndex ) const
     {
         yojimbo_assert( clientIndex >= 0 );
         yojimbo_assert( clientIndex < m_maxClients );
-        yojimbo_assert( m_clientConnection[clientIndex] );
-        return m_clientConnection[clientIndex]->HasMessagesToSend( channelIndex );
+        yojimbo_assert( m_clientSlots[clientIndex].connection );
+        return m_clientSlots[clientIndex].connection->HasMessagesToSend( channelIndex );
     }
 
     void BaseServer::SendMessage( int clientIndex, int channelIndex, Message * message )
     {
         yojimbo_assert( clientIndex >= 0 );
         yojimbo_assert( clientIndex < m_maxClients );
-        yojimbo_assert( m_clientConnection[clientIndex] );
-        return m_clientConnection[clientIndex]->SendMessage( channelIndex, message, GetContext() );
+        yojimbo_assert( m_clientSlots[clientIndex].connection );
+        return m_clientSlots[clientIndex].connection->SendMessage( channelIndex, message, GetContext() );
+    }
+
+    Message * BaseServer::CreateBroadcastMessage( int type )
+    {
+        yojimbo_assert( m_broadcastMessageFactory );
+        return m_broadcastMessageFactory->CreateMessage( type );
+    }
+
+    void BaseServer::BroadcastMessage( int channelIndex, Message * message )
+    {
+        yojimbo_assert( message );
+        yojimbo_assert( !message->IsBlockMessage() );
+        yojimbo_assert( m_config.channel[channelIndex].type != CHANNEL_TYPE_SNAPSHOT_DELTA );
+        yojimbo_assert( m_broadcastMessageFactory );
+        yojimbo_assert( m_broadcastBuffer );
+
+        if ( m_numActiveClients == 0 )
+        {
+            m_broadcastMessageFactory->ReleaseMessage( message );
+            return;
+        }
+
+        // measure the message first. this gives the bits to reserve for it in each client packet
+
+        MeasureStream measureStream( *m_globalAllocator );
+        measureStream.SetContext( GetContext() );
+        message->SerializeInternal( measureStream );
+
+        const int measuredBits = measureStream.GetBitsProcessed();
+
+        const int bufferBytes = ( m_config.maxPacketSize + 3 ) & ~3;
+
+        if ( measuredBits + BroadcastPayload::MaxVariants > bufferBytes * 8 )
+        {
+            yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "broadcast message is too large (%d bits)\n", measuredBits );
+            m_broadcastMessageFactory->ReleaseMessage( message );
+            return;
+        }
+
+        // serialize the message once for each bit alignment, unless the message doesn't depend on alignment.
+        // if the message contains an align, the padding for the first align differs between bit offset zero and one, so the sizes differ.
+
+        BroadcastPayload * payload = YOJIMBO_NEW( *m_globalAllocator, BroadcastPayload );
+        payload->measuredBits = measuredBits;
+        payload->numVariants = 2;
+
+        int dataBytes = 0;
+
+        for ( int i = 0; i < payload->numVariants; ++i )
+        {
+            WriteStream stream( *m_globalAllocator, m_broadcastBuffer + dataBytes, bufferBytes );
+            stream.SetContext( GetContext() );
+            if ( i > 0 )
+                stream.SerializeBits( 0, i );
+            if ( !message->SerializeInternal( stream ) )
+            {
+                yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "broadcast message failed to serialize\n" );
+                YOJIMBO_DELETE( *m_globalAllocator, BroadcastPayload, payload );
+                m_broadcastMessageFactory->ReleaseMessage( message );
+                return;
+            }
+            stream.Flush();
+            payload->variantOffset[i] = dataBytes;
+            payload->variantBytes[i] = ( stream.GetBytesProcessed() + 3 ) & ~3;
+            payload->variantBits[i] = stream.GetBitsProcessed() - i;
+            dataBytes += payload->variantBytes[i];
+            if ( i == 1 && payload->variantBits[1] == payload->variantBits[0] )
+            {
+                payload->numVariants = 1;
+                dataBytes = payload->variantBytes[0];
+            }
+            else if ( i == 1 )
+            {
+                payload->numVariants = BroadcastPayload::MaxVariants;
+            }
+        }
+
+        payload->data = (uint8_t*) YOJIMBO_ALLOCATE( *m_globalAllocator, dataBytes );
+        if ( !payload->data )
+        {
+            yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "failed to allocate broadcast message payload\n" );
+            YOJIMBO_DELETE( *m_globalAllocator, BroadcastPayload, payload );
+            m_broadcastMessageFactory->ReleaseMessage( message );
+            return;
+        }
+        memcpy( payload->data, m_broadcastBuffer, dataBytes );
+
+        const int type = message->GetType();
+        const uint32_t orderingKey = message->GetOrderingKey();
+
+        m_broadcastMessageFactory->ReleaseMessage( message );
+
+        payload->next = m_broadcastPayloads;
+        m_broadcastPayloads = payload;
+
+        // IMPORTANT: iterate backwards, because disconnecting a client removes it from the active client list.
+        for ( int i = m_numActiveClients - 1; i >= 0; --i )
+        {
+            const int clientIndex = m_activeClients[i];
+            ClientSlot & slot = m_clientSlots[clientIndex];
+            yojimbo_assert( slot.connection );
+            void * memory = YOJIMBO_ALLOCATE( slot.messageFactory->GetAllocator(), sizeof( BroadcastProxyMessage ) );
+            if ( !memory )
+            {
+                // the client would miss this message, so disconnect it, just like when its message factory runs out of memory
+                yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "failed to allocate broadcast message for client %d. disconnecting client\n", clientIndex );
+                DisconnectClient( clientIndex );
+                continue;
+            }
+            Message * proxy = new ( memory ) BroadcastProxyMessage( payload, type, orderingKey );
+            slot.connection->SendMessage( channelIndex, proxy, GetContext() );
+        }
+    }
+
+    void BaseServer::FreeBroadcastPayloads( bool all )
+    {
+        (void) all;
+        BroadcastPayload ** previous = &m_broadcastPayloads;
+        while ( *previous )
+        {
+            BroadcastPayload * payload = *previous;
+            if ( payload->refCount == 0 )
+            {
+                *previous = payload->next;
+                YOJIMBO_FREE( *m_globalAllocator, payload->data );
+                YOJIMBO_DELETE( *m_globalAllocator, BroadcastPayload, payload );
+            }
+            else
+            {
+                yojimbo_assert( !all );
+                previous = &payload->next;
+            }
+        }
     }
 
     Message * BaseServer::ReceiveMessage( int clientIndex, int channelIndex )
     {
         yojimbo_assert( clientIndex >= 0 );
         yojimbo_assert( clientIndex < m_maxClients );
-        yojimbo_assert( m_clientConnection[clientIndex] );
-        return m_clientConnection[clientIndex]->ReceiveMessage( channelIndex );
+        yojimbo_assert( m_clientSlots[clientIndex].connection );
+        return m_clientSlots[clientIndex].connection->ReceiveMessage( channelIndex );
     }
 
     void BaseServer::ReleaseMessage( int clientIndex, Message * message )
     {
         yojimbo_assert( clientIndex >= 0 );
         yojimbo_assert( clientIndex < m_maxClients );
-        yojimbo_assert( m_clientConnection[clientIndex] );
-        m_clientConnection[clientIndex]->ReleaseMessage( message );
+        yojimbo_assert( m_clientSlots[clientIndex].connection );
+        m_clientSlots[clientIndex].connection->ReleaseMessage( message );
     }
 
     void BaseServer::GetNetworkInfo( int clientIndex, NetworkInfo & info ) const
@@ -3690,14 +6433,15 @@ namespace yojimbo
         memset( &info, 0, sizeof( info ) );
         if ( IsClientConnected( clientIndex ) )
         {
-            yojimbo_assert( m_clientEndpoint[clientIndex] );
-            const uint64_t * counters = reliable_endpoint_counters( m_clientEndpoint[clientIndex] );
+            yojimbo_assert( m_clientSlots[clientIndex].endpoint );
+            const uint64_t * counters = reliable_endpoint_counters( m_clientSlots[clientIndex].endpoint );
             info.numPacketsSent = counters[RELIABLE_ENDPOINT_COUNTER_NUM_PACKETS_SENT];
             info.numPacketsReceived = counters[RELIABLE_ENDPOINT_COUNTER_NUM_PACKETS_RECEIVED];
             info.numPacketsAcked = counters[RELIABLE_ENDPOINT_COUNTER_NUM_PACKETS_ACKED];
-            info.RTT = reliable_endpoint_rtt( m_clientEndpoint[clientIndex] );
-            info.packetLoss = reliable_endpoint_packet_loss( m_clientEndpoint[clientIndex] );
-            reliable_endpoint_bandwidth( m_clientEndpoint[clientIndex], &info.sentBandwidth, &info.receivedBandwidth, &info.ackedBandwidth );
+            info.RTT = reliable_endpoint_rtt( m_clientSlots[clientIndex].endpoint );
+            info.packetLoss = reliable_endpoint_packet_loss( m_clientSlots[clientIndex].endpoint );
+            reliable_endpoint_bandwidth( m_clientSlots[clientIndex].endpoint, &info.sentBandwidth, &info.receivedBandwidth, &info.ackedBandwidth );
+            info.sendBandwidthLimit = m_clientSlots[clientIndex].connection->GetSendBandwidthLimit();
         }
     }
 
@@ -3706,7 +6450,7 @@ namespace yojimbo
         yojimbo_assert( IsRunning() ); 
         yojimbo_assert( clientIndex >= 0 ); 
         yojimbo_assert( clientIndex < m_maxClients );
-        return *m_clientMessageFactory[clientIndex];
+        return *m_clientSlots[clientIndex].messageFactory;
     }
 
     reliable_endpoint_t * BaseServer::GetClientEndpoint( int clientIndex )
@@ -3714,7 +6458,7 @@ namespace yojimbo
         yojimbo_assert( IsRunning() ); 
         yojimbo_assert( clientIndex >= 0 ); 
         yojimbo_assert( clientIndex < m_maxClients );
-        return m_clientEndpoint[clientIndex];
+        return m_clientSlots[clientIndex].endpoint;
     }
 
     Connection & BaseServer::GetClientConnection( int clientIndex )
@@ -3722,8 +6466,128 @@ namespace yojimbo
         yojimbo_assert( IsRunning() ); 
         yojimbo_assert( clientIndex >= 0 ); 
         yojimbo_assert( clientIndex < m_maxClients );
-        yojimbo_assert( m_clientConnection[clientIndex] );
-        return *m_clientConnection[clientIndex];
+        yojimbo_assert( m_clientSlots[clientIndex].connection );
+        return *m_clientSlots[clientIndex].connection;
+    }
+
+    void BaseServer::SetClientPriority( int clientIndex, float priority )
+    {
+        yojimbo_assert( IsRunning() ); 
+        yojimbo_assert( clientIndex >= 0 ); 
+        yojimbo_assert( clientIndex < m_maxClients );
+        yojimbo_assert( priority > 0.0f );
+        m_clientSlots[clientIndex].priority = priority;
+    }
+
+    float BaseServer::GetClientPriority( int clientIndex ) const
+    {
+        yojimbo_assert( IsRunning() ); 
+        yojimbo_assert( clientIndex >= 0 ); 
+        yojimbo_assert( clientIndex < m_maxClients );
+        return m_clientSlots[clientIndex].priority;
+    }
+
+    void BaseServer::GetClientPacketBudgets( int numClients, const int * clientIndex, int * maxPacketBytes )
+    {
+        for ( int i = 0; i < numClients; ++i )
+        {
+            maxPacketBytes[i] = m_clientSlots[clientIndex[i]].connection->GetMaxPacketBytes( m_config.maxPacketSize );
+        }
+
+        if ( m_config.serverMaxSendBandwidth <= 0.0f || numClients == 0 )
+            return;
+
+        yojimbo_assert( numClients <= m_maxClients );
+
+        // estimate how much each client wants from the size of its last packet. doubling it lets a client that was idle ramp up quickly
+
+        int totalDemand = 0;
+
+        for ( int i = 0; i < numClients; ++i )
+        {
+            const ClientSlot & slot = m_clientSlots[clientIndex[i]];
+            m_budgetDemands[i] = yojimbo_min( yojimbo_max( slot.lastPacketBytes * 2, MinPacketBytes ), maxPacketBytes[i] );
+            m_budgetWeights[i] = slot.priority;
+            totalDemand += m_budgetDemands[i];
+        }
+
+        const int budget = int( m_egressTokens );
+
+        if ( totalDemand <= budget )
+            return;
+
+        max_min_fair_share( m_budgetDemands, m_budgetWeights, numClients, budget, m_budgetOrder, m_budgetShares );
+
+        for ( int i = 0; i < numClients; ++i )
+        {
+            const int packetBytes = yojimbo_max( m_budgetShares[i] - ( m_budgetShares[i] % 4 ), MinPacketBytes );
+            maxPacketBytes[i] = yojimbo_min( packetBytes, maxPacketBytes[i] );
+        }
+    }
+
+    void BaseServer::ClientPacketSent( int clientIndex, int packetBytes )
+    {
+        m_clientSlots[clientIndex].lastPacketBytes = packetBytes;
+        if ( m_config.serverMaxSendBandwidth > 0.0f )
+        {
+            m_egressTokens -= packetBytes;
+        }
+    }
+
+    uint8_t * BaseServer::GetClientPacketBuffer( int clientIndex )
+    {
+        yojimbo_assert( IsRunning() ); 
+        yojimbo_assert( clientIndex >= 0 ); 
+        yojimbo_assert( clientIndex < m_maxClients );
+        return m_clientSlots[clientIndex].packetBuffer ? m_clientSlots[clientIndex].packetBuffer : m_packetBuffer;
+    }
+
+    void BaseServer::AddActiveClient( int clientIndex )
+    {
+        yojimbo_assert( IsRunning() ); 
+        yojimbo_assert( clientIndex >= 0 ); 
+        yojimbo_assert( clientIndex < m_maxClients );
+        yojimbo_assert( m_numActiveClients < m_maxClients );
+        int i = m_numActiveClients;
+        while ( i > 0 && m_activeClients[i-1] > clientIndex )
+        {
+            m_activeClients[i] = m_activeClients[i-1];
+            --i;
+        }
+        yojimbo_assert( i == 0 || m_activeClients[i-1] != clientIndex );
+        m_activeClients[i] = clientIndex;
+        m_numActiveClients++;
+        m_clientSlots[clientIndex].priority = 1.0f;
+        m_clientSlots[clientIndex].lastPacketBytes = 0;
+    }
+
+    void BaseServer::RemoveActiveClient( int clientIndex )
+    {
+        yojimbo_assert( IsRunning() ); 
+        for ( int i = 0; i < m_numActiveClients; ++i )
+        {
+            if ( m_activeClients[i] == clientIndex )
+            {
+                memmove( &m_activeClients[i], &m_activeClients[i+1], sizeof( int ) * ( m_numActiveClients - i - 1 ) );
+                m_numActiveClients--;
+                return;
+            }
+        }
+    }
+
+    void BaseServer::RunClientJobs( void (*function)( void * context, int jobIndex ), void * context, int numJobs )
+    {
+        if ( m_workerPool )
+        {
+            m_workerPool->Run( function, context, numJobs );
+        }
+        else
+        {
+            for ( int i = 0; i < numJobs; ++i )
+            {
+                function( context, i );
+            }
+        }
     }
 
     void BaseServer::StaticTransmitPacketFunction( void * context, int index, uint16_t packetSequence, uint8_t * packetData, int packetBytes )
@@ -3764,6 +6628,13 @@ namespace yojimbo
         m_boundAddress = address;
         m_config = config;
         m_server = NULL;
+        m_numJobs = 0;
+        m_jobClientIndex = NULL;
+        m_jobPacketBytes = NULL;
+        m_jobFirstPacket = NULL;
+        m_numReceivedPackets = 0;
+        m_maxReceivedPackets = 0;
+        m_receivedPackets = NULL;
     }
 
     Server::~Server()
@@ -3778,6 +6649,10 @@ namespace yojimbo
             Stop();
         
         BaseServer::Start( maxClients );
+
+        m_jobClientIndex = (int*) YOJIMBO_ALLOCATE( GetGlobalAllocator(), sizeof( int ) * maxClients );
+        m_jobPacketBytes = (int*) YOJIMBO_ALLOCATE( GetGlobalAllocator(), sizeof( int ) * maxClients );
+        m_jobFirstPacket = (int*) YOJIMBO_ALLOCATE( GetGlobalAllocator(), sizeof( int ) * ( maxClients + 1 ) );
         
         char addressString[MaxAddressLength];
         m_address.ToString( addressString, MaxAddressLength );
@@ -3815,6 +6690,14 @@ namespace yojimbo
             netcode_server_destroy( m_server );
             m_server = NULL;
         }
+        if ( IsRunning() )
+        {
+            YOJIMBO_FREE( GetGlobalAllocator(), m_jobClientIndex );
+            YOJIMBO_FREE( GetGlobalAllocator(), m_jobPacketBytes );
+            YOJIMBO_FREE( GetGlobalAllocator(), m_jobFirstPacket );
+            YOJIMBO_FREE( GetGlobalAllocator(), m_receivedPackets );
+            m_maxReceivedPackets = 0;
+        }
         BaseServer::Stop();
     }
 
@@ -3834,30 +6717,60 @@ namespace yojimbo
     {
         if ( m_server )
         {
-            const int maxClients = GetMaxClients();
-            for ( int i = 0; i < maxClients; ++i )
+            if ( HasWorkerThreads() )
             {
-                if ( IsClientConnected( i ) )
-                {
-                    uint8_t * packetData = GetPacketBuffer();
-                    int packetBytes;
-                    uint16_t packetSequence = reliable_endpoint_next_packet_sequence( GetClientEndpoint(i) );
-                    if ( GetClientConnection(i).GeneratePacket( GetContext(), packetSequence, packetData, m_config.maxPacketSize, packetBytes ) )
-                    {
-                        reliable_endpoint_send_packet( GetClientEndpoint(i), packetData, packetBytes );
-                    }
-                }
+                SendPacketsParallel();
+                return;
+            }
+            const int numActiveClients = GetNumActiveClients();
+            const int * activeClients = GetActiveClients();
+            int * maxPacketBytes = (int*) alloca( sizeof( int ) * ( numActiveClients + 1 ) );
+            GetClientPacketBudgets( numActiveClients, activeClients, maxPacketBytes );
+            for ( int j = 0; j < numActiveClients; ++j )
+            {
+                SendClientPacket( activeClients[j], maxPacketBytes[j] );
             }
         }
     }
 
+    void Server::FlushPackets( double time, int clientIndex, int channelIndex )
+    {
+        if ( !m_server || !IsClientConnected( clientIndex ) )
+            return;
+        if ( !GetClientConnection( clientIndex ).CanFlush( channelIndex, time ) )
+            return;
+        GetClientConnection( clientIndex ).PacketFlushed( time );
+        int maxPacketBytes;
+        GetClientPacketBudgets( 1, &clientIndex, &maxPacketBytes );
+        SendClientPacket( clientIndex, maxPacketBytes );
+    }
+
+    void Server::SendClientPacket( int clientIndex, int maxPacketBytes )
+    {
+        uint8_t * packetData = GetPacketBuffer();
+        int packetBytes;
+        uint16_t packetSequence = reliable_endpoint_next_packet_sequence( GetClientEndpoint( clientIndex ) );
+        if ( GetClientConnection( clientIndex ).GeneratePacket( GetContext(), packetSequence, packetData, maxPacketBytes, packetBytes ) )
+        {
+            reliable_endpoint_send_packet( GetClientEndpoint( clientIndex ), packetData, packetBytes );
+            ClientPacketSent( clientIndex, packetBytes );
+        }
+    }
+
     void Server::ReceivePackets()
     {
         if ( m_server )
         {
-            const int maxClients = GetMaxClients();
-            for ( int clientIndex = 0; clientIndex < maxClients; ++clientIndex )
+            if ( HasWorkerThreads() )
+            {
+                ReceivePacketsParallel();
+                return;
+            }
+            const int numActiveClients = GetNumActiveClients();
+            const int * activeClients = GetActiveClients();
+            for ( int j = 0; j < numActiveClients; ++j )
             {
+                const int clientIndex = activeClients[j];
                 while ( true )
                 {
                     int packetBytes;
@@ -3872,6 +6785,101 @@ namespace yojimbo
         }
     }
 
+    void Server::SendPacketsParallel()
+    {
+        // generate packets for all connected clients in parallel, then send them in client index order on this thread.
+        m_numJobs = GetNumActiveClients();
+        memcpy( m_jobClientIndex, GetActiveClients(), sizeof( int ) * m_numJobs );
+        GetClientPacketBudgets( m_numJobs, m_jobClientIndex, m_jobPacketBytes );
+        RunClientJobs( StaticGeneratePacketJob, this, m_numJobs );
+        for ( int i = 0; i < m_numJobs; ++i )
+        {
+            if ( m_jobPacketBytes[i] > 0 )
+            {
+                const int clientIndex = m_jobClientIndex[i];
+                reliable_endpoint_send_packet( GetClientEndpoint( clientIndex ), GetClientPacketBuffer( clientIndex ), m_jobPacketBytes[i] );
+                ClientPacketSent( clientIndex, m_jobPacketBytes[i] );
+            }
+        }
+        m_numJobs = 0;
+    }
+
+    void Server::ReceivePacketsParallel()
+    {
+        // pull packets off netcode.io on this thread, process them in parallel per-client, then free them back to netcode.io on this thread.
+        m_numJobs = 0;
+        m_numReceivedPackets = 0;
+        const int numActiveClients = GetNumActiveClients();
+        const int * activeClients = GetActiveClients();
+        for ( int j = 0; j < numActiveClients; ++j )
+        {
+            const int clientIndex = activeClients[j];
+            const int firstPacket = m_numReceivedPackets;
+            while ( true )
+            {
+                int packetBytes;
+                uint64_t packetSequence;
+                uint8_t * packetData = netcode_server_receive_packet( m_server, clientIndex, &packetBytes, &packetSequence );
+                if ( !packetData )
+                    break;
+                if ( m_numReceivedPackets == m_maxReceivedPackets )
+                {
+                    const int maxReceivedPackets = m_maxReceivedPackets ? m_maxReceivedPackets * 2 : 256;
+                    ReceivedPacket * receivedPackets = (ReceivedPacket*) YOJIMBO_ALLOCATE( GetGlobalAllocator(), sizeof( ReceivedPacket ) * maxReceivedPackets );
+                    if ( m_receivedPackets )
+                    {
+                        memcpy( receivedPackets, m_receivedPackets, sizeof( ReceivedPacket ) * m_numReceivedPackets );
+                        YOJIMBO_FREE( GetGlobalAllocator(), m_receivedPackets );
+                    }
+                    m_receivedPackets = receivedPackets;
+                    m_maxReceivedPackets = maxReceivedPackets;
+                }
+                m_receivedPackets[m_numReceivedPackets].packetData = packetData;
+                m_receivedPackets[m_numReceivedPackets].packetBytes = packetBytes;
+                m_numReceivedPackets++;
+            }
+            if ( m_numReceivedPackets > firstPacket )
+            {
+                m_jobClientIndex[m_numJobs] = clientIndex;
+                m_jobFirstPacket[m_numJobs] = firstPacket;
+                m_numJobs++;
+            }
+        }
+        m_jobFirstPacket[m_numJobs] = m_numReceivedPackets;
+        RunClientJobs( StaticProcessPacketsJob, this, m_numJobs );
+        for ( int i = 0; i < m_numReceivedPackets; ++i )
+        {
+            netcode_server_free_packet( m_server, m_receivedPackets[i].packetData );
+        }
+        m_numReceivedPackets = 0;
+        m_numJobs = 0;
+    }
+
+    void Server::StaticGeneratePacketJob( void * context, int jobIndex )
+    {
+        Server * server = (Server*) context;
+        const int clientIndex = server->m_jobClientIndex[jobIndex];
+        const int maxPacketBytes = server->m_jobPacketBytes[jobIndex];
+        int packetBytes;
+        uint16_t packetSequence = reliable_endpoint_next_packet_sequence( server->GetClientEndpoint( clientIndex ) );
+        if ( !server->GetClientConnection( clientIndex ).GeneratePacket( server->GetContext(), packetSequence, server->GetClientPacketBuffer( clientIndex ), maxPacketBytes, packetBytes ) )
+        {
+            packetBytes = 0;
+        }
+        server->m_jobPacketBytes[jobIndex] = packetBytes;
+    }
+
+    void Server::StaticProcessPacketsJob( void * context, int jobIndex )
+    {
+        Server * server = (Server*) context;
+        const int clientIndex = server->m_jobClientIndex[jobIndex];
+        reliable_endpoint_t * endpoint = server->GetClientEndpoint( clientIndex );
+        for ( int i = server->m_jobFirstPacket[jobIndex]; i < server->m_jobFirstPacket[jobIndex+1]; ++i )
+        {
+            reliable_endpoint_receive_packet( endpoint, server->m_receivedPackets[i].packetData, server->m_receivedPackets[i].packetBytes );
+        }
+    }
+
     void Server::AdvanceTime( double time )
     {
         if ( m_server )
@@ -3896,7 +6904,7 @@ namespace yojimbo
 
     bool Server::IsClientConnected( int clientIndex ) const
     {
-        return netcode_server_client_connected( m_server, clientIndex ) != 0;
+        return netcode_server_client_connected( m_server, clientIndex ) != 0 && HasClientSlot( clientIndex );
     }
 
     uint64_t Server::GetClientId( int clientIndex ) const
@@ -3952,6 +6960,13 @@ namespace yojimbo
     {
         if ( connected == 0 )
         {
+            if ( !HasClientSlot( clientIndex ) )
+            {
+                // this client was never given a slot, because the client memory pool was exhausted when it connected.
+                ReleaseClientSlot( clientIndex );
+                return;
+            }
+            RemoveActiveClient( clientIndex );
             GetAdapter().OnServerClientDisconnected( clientIndex );
             reliable_endpoint_reset( GetClientEndpoint( clientIndex ) );
             GetClientConnection( clientIndex ).Reset();
@@ -3960,9 +6975,13 @@ namespace yojimbo
             {
                 networkSimulator->DiscardClientPackets( clientIndex );
             }
+            ReleaseClientSlot( clientIndex );
         }
         else
         {
+            if ( !AcquireClientSlot( clientIndex ) )
+                return;
+            AddActiveClient( clientIndex );
             GetAdapter().OnServerClientConnected( clientIndex );
         }
     }
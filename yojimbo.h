@@ -94,6 +94,10 @@
 #define YOJIMBO_DEFAULT_TIMEOUT 5
 #endif
 
+#ifndef YOJIMBO_MAX_CLIENTS
+#define YOJIMBO_MAX_CLIENTS 64
+#endif
+
 #if !defined( YOJIMBO_WITH_MBEDTLS )
 #define YOJIMBO_WITH_MBEDTLS 1
 #endif // #if !defined( YOJIMBO_WITH_MBEDTLS )
@@ -159,8 +163,9 @@ struct reliable_endpoint_t;
 
 namespace yojimbo
 {
-    const int MaxClients = 64;                                      ///< The maximum number of clients supported by this library. You can increase this if you want, but this library is designed around patterns that work best for [2,64] player games. If your game has less than 64 clients, reducing this will save memory.
+    const int MaxClients = YOJIMBO_MAX_CLIENTS;                     ///< The maximum number of clients supported by this library. Define YOJIMBO_MAX_CLIENTS to change it. Per-client state is only allocated for the number of clients passed to Server::Start, so increasing this costs no memory by itself. It must not exceed NETCODE_MAX_CLIENTS in netcode.io, which yojimbo.cpp checks at compile time.
     const int MaxChannels = 64;                                     ///< The maximum number of message channels supported by this library. If you need less than 64 channels per-packet, reducing this will save memory.
+    const int MaxMessageTypes = 1 << 14;                            ///< The maximum number of message types a message factory can create. Limited by the width of the type field in Message.
     const int KeyBytes = 32;                                        ///< Size of encryption key for dedicated client/server in bytes. Must be equal to key size for libsodium encryption primitive. Do not change.
     const int ConnectTokenBytes = 2048;                             ///< Size of the encrypted connect token data return from the matchmaker. Must equal size of NETCODE_CONNECT_TOKEN_BYTE (2048).
     const uint32_t SerializeCheckValue = 0x12345678;                ///< The value written to the stream for serialize checks. See WriteStream::SerializeCheck and ReadStream::SerializeCheck.
@@ -168,13 +173,21 @@ namespace yojimbo
     const int ConservativeFragmentHeaderBits = 64;                  ///< Conservative number of bits per-fragment header.
     const int ConservativeChannelHeaderBits = 32;                   ///< Conservative number of bits per-channel header.
     const int ConservativePacketHeaderBits = 16;                    ///< Conservative number of bits per-packet header.
+    const int MinPacketBytes = 16;                                  ///< Packets are never cut down below this size by send rate limits, so acks keep flowing (bytes).
+    const double ServerEgressBurstTime = 0.1;                       ///< Unused server egress budget carries over for at most this long, or one update if that is longer (seconds). See ClientServerConfig::serverMaxSendBandwidth.
+    const double CongestionHoldTime = 1.0;                          ///< Time after the send rate is halved before congestion control changes it again (seconds).
+    const double MinRTTWindowTime = 10.0;                           ///< Congestion control compares the round trip time against the lowest seen in the last one to two of these windows, so it adapts when the route to the other side changes (seconds).
 
     /// Determines the reliability and ordering guarantees for a channel.
 
     enum ChannelType
     {
         CHANNEL_TYPE_RELIABLE_ORDERED,                              ///< Messages are received reliably and in the same order they were sent. 
-        CHANNEL_TYPE_UNRELIABLE_UNORDERED                           ///< Messages are sent unreliably. Messages may arrive out of order, or not at all.
+        CHANNEL_TYPE_UNRELIABLE_UNORDERED,                          ///< Messages are sent unreliably. Messages may arrive out of order, or not at all.
+        CHANNEL_TYPE_UNRELIABLE_SEQUENCED,                          ///< Messages are sent unreliably. Messages older than the newest message already received are dropped, so messages arrive in order, but not all of them arrive.
+        CHANNEL_TYPE_RELIABLE_UNORDERED,                            ///< Messages are received reliably, but are delivered as soon as they arrive, so they may be received in a different order than they were sent.
+        CHANNEL_TYPE_SNAPSHOT_DELTA,                                ///< Messages are snapshots sent unreliably. Each snapshot may be delta encoded against the most recent snapshot the other side acked.
+        CHANNEL_TYPE_RELIABLE_LATEST_VALUE                          ///< Messages are received reliably and in order, except that a message replaces any unacked message sent before it with the same key. Only the latest value for each key is guaranteed to arrive.
     };
 
     /** 
@@ -182,14 +195,31 @@ namespace yojimbo
      
         Channels let you specify different reliability and ordering guarantees for messages sent across a connection.
      
-        They may be configured as one of two types: reliable-ordered or unreliable-unordered.
+        They may be configured as one of six types: reliable-ordered, reliable-unordered, reliable-latest-value, unreliable-unordered, unreliable-sequenced or snapshot-delta.
      
         Reliable ordered channels guarantee that messages (see Message) are received reliably and in the same order they were sent. 
         This channel type is designed for control messages and RPCs sent between the client and server.
+
+        Reliable unordered channels send and resend messages just like reliable-ordered channels, but deliver each message as soon as it arrives.
+        A lost packet only delays the messages it carried, instead of every message sent after it. Use this for RPCs that don't depend on each other.
+
+        Reliable latest-value channels are for replicated state where only the newest value matters, like player loadout or settings. 
+        Each message carries a key (see Message::SetOrderingKey). Sending a message replaces any message with the same key that has not been acked yet,
+        so obsolete values are not resent when packets are lost.
+
+        Reliable ordered channels can also be split into independent ordering keys (see ChannelConfig::numOrderingKeys and Message::SetOrderingKey). 
+        Messages are then only ordered relative to other messages with the same key, for example per-entity, while sharing one set of send and receive queues.
     
         Unreliable unordered channels are like UDP. There is no guarantee that messages will arrive, and messages may arrive out of order.
         This channel type is designed for data that is time critical and should not be resent if dropped, like snapshots of world state sent rapidly 
         from server to client, or cosmetic events such as effects and sounds.
+
+        Unreliable sequenced channels are unreliable-unordered channels that drop any message older than the newest message already received.
+        This channel type is designed for state updates where only the most recent value matters, so a late update should never overwrite a newer one.
+
+        Snapshot-delta channels send messages unreliably, like unreliable-unordered channels, but keep track of which snapshot the other side acked most recently.
+        Each snapshot is serialized with that snapshot as its baseline (see Message::GetBaseline), so your serialize function only needs to write what changed.
+        This channel type is designed for snapshots of world state, where sending each snapshot in full is the dominant cost.
         
         Both channel types support blocks of data attached to messages (see BlockMessage), but their treatment of blocks is quite different.
         
@@ -207,17 +237,27 @@ namespace yojimbo
 
     struct ChannelConfig
     {
-        ChannelType type;                                           ///< Channel type: reliable-ordered or unreliable-unordered.
+        ChannelType type;                                           ///< Channel type: reliable-ordered, reliable-unordered, reliable-latest-value, unreliable-unordered, unreliable-sequenced or snapshot-delta.
         bool disableBlocks;                                         ///< Disables blocks being sent across this channel.
         int sentPacketBufferSize;                                   ///< Number of packet entries in the sent packet sequence buffer. Please consider your packet send rate and make sure you have at least a few seconds worth of entries in this buffer.
         int messageSendQueueSize;                                   ///< Number of messages in the send queue for this channel.
         int messageReceiveQueueSize;                                ///< Number of messages in the receive queue for this channel.
         int maxMessagesPerPacket;                                   ///< Maximum number of messages to include in each packet. Will write up to this many messages, provided the messages fit into the channel packet budget and the number of bytes remaining in the packet.
         int packetBudget;                                           ///< Maximum amount of message data to write to the packet for this channel (bytes). Specifying -1 means the channel can use up to the rest of the bytes remaining in the packet.
+        float weight;                                               ///< Relative share of each packet this channel gets while other weighted channels also have data to send. A channel with weight 3 gets three times the bits of a channel with weight 1, and bits a channel doesn't use are shared between the channels after it. 0 (default) means the channel may use all bits left in the packet, so it can starve channels after it. Unreliable messages that don't fit in the share of their channel are dropped.
         int maxBlockSize;                                           ///< The size of the largest block that can be sent across this channel (bytes).
-        int blockFragmentSize;                                      ///< Blocks are split up into fragments of this size (bytes). Reliable-ordered channel only.
-        float messageResendTime;                                    ///< Minimum delay between message resends (seconds). Avoids sending the same message too frequently. Reliable-ordered channel only.
-        float blockFragmentResendTime;                              ///< Minimum delay between block fragment resends (seconds). Avoids sending the same fragment too frequently. Reliable-ordered channel only.
+        int blockFragmentSize;                                      ///< Blocks are split up into fragments of this size (bytes). Reliable channels only.
+        float messageResendTime;                                    ///< Minimum delay between message resends (seconds). Avoids sending the same message too frequently. Reliable channels only.
+        float blockFragmentResendTime;                              ///< Minimum delay between block fragment resends (seconds). Avoids sending the same fragment too frequently. Reliable channels only.
+        bool adaptiveResendTime;                                    ///< If true, messages and block fragments are resent after the smoothed round trip time plus four times its variance, measured from acks, instead of after messageResendTime and blockFragmentResendTime. The fixed times are used until the first ack arrives. Reliable channels only.
+        float minResendTime;                                        ///< Lower bound on the adaptive resend time (seconds). Stops acks that arrive a tick late from triggering resends on low latency links. Reliable channels only.
+        float maxResendTime;                                        ///< Upper bound on the adaptive resend time (seconds). Reliable channels only.
+        int fastRetransmitPackets;                                  ///< When greater than zero, a message is resent as soon as a packet sent this many packets after the packet carrying it has been acked, without waiting for its resend time. 0 (default) disables fast retransmit. Reliable channels only.
+        int messageCacheSize;                                       ///< Size of the buffer the channel caches serialized messages in (bytes). A message is serialized into the cache the first time it is resent, and copied from there into each packet after that. Once the cache is full, messages cached longest ago are evicted. Worth enabling (eg. 16 KB) when many messages are resent each packet. 0 (default) disables the cache. Reliable channels only.
+        int maxFragmentsPerPacket;                                  ///< Maximum number of block fragments to include in each packet. Will write up to this many fragments, provided they fit into the channel packet budget and the number of bytes remaining in the packet. Reliable channels only.
+        int maxBlocksInFlight;                                      ///< Maximum number of block messages that can be sent at the same time. When greater than one, block messages are sent as soon as they are within the receive window, and regular messages after a block message are sent without waiting for the block to be acked. Messages are still delivered in order. Each block being received gets a buffer from the message factory block allocator when its first fragment arrives, sized by its number of fragments, so only blocks actually in flight use memory. Reliable channels only.
+        int numOrderingKeys;                                        ///< Number of independent ordering keys. When greater than one, messages are only delivered in order relative to messages with the same key (see Message::SetOrderingKey), so a lost message only holds back later messages with its key. Costs some bits per-message. Reliable-ordered channel only.
+        int snapshotHistorySize;                                    ///< Number of recent snapshots each side of the connection keeps as delta baselines. Snapshots are only delta encoded against an acked snapshot sent less than this many snapshots ago. Must be at least 2. Snapshot-delta channel only.
 
         ChannelConfig() : type ( CHANNEL_TYPE_RELIABLE_ORDERED )
         {
@@ -227,16 +267,31 @@ namespace yojimbo
             messageReceiveQueueSize = 1024;
             maxMessagesPerPacket = 256;
             packetBudget = -1;
+            weight = 0.0f;
             maxBlockSize = 256 * 1024;
             blockFragmentSize = 1024;
             messageResendTime = 0.1f;
             blockFragmentResendTime = 0.25f;
+            adaptiveResendTime = false;
+            minResendTime = 0.02f;
+            maxResendTime = 1.0f;
+            fastRetransmitPackets = 0;
+            messageCacheSize = 0;
+            maxFragmentsPerPacket = 1;
+            maxBlocksInFlight = 1;
+            numOrderingKeys = 1;
+            snapshotHistorySize = 32;
         }
 
         int GetMaxFragmentsPerBlock() const
         {
             return maxBlockSize / blockFragmentSize;
         }
+
+        int GetMaxOrderingOffset() const
+        {
+            return ( type == CHANNEL_TYPE_RELIABLE_ORDERED && numOrderingKeys > 1 ) ? messageReceiveQueueSize - 1 : 0;
+        }
     };
 
     /** 
@@ -249,12 +304,26 @@ namespace yojimbo
     {
         int numChannels;                                        ///< Number of message channels in [1,MaxChannels]. Each message channel must have a corresponding configuration below.
         int maxPacketSize;                                      ///< The maximum size of packets generated to transmit messages between client and server (bytes).
+        int packetArenaSize;                                    ///< Size of the arena the connection uses for temporary allocations while generating and processing each packet (bytes). The arena is reset after each packet. Allocations that don't fit fall back to the connection allocator. 0 disables the arena.
+        bool congestionControl;                                 ///< If true, the connection limits the rate it sends packet data at, and adapts that rate to packet loss and round trip time. See CongestionController.
+        float minSendBandwidth;                                 ///< The send rate never drops below this (kbps). The send rate starts here and ramps up. Congestion control only.
+        float maxSendBandwidth;                                 ///< The send rate never goes above this (kbps). Congestion control only.
+        float congestionPacketLoss;                             ///< Packet loss above this percentage is treated as congestion, and halves the send rate. Congestion control only.
+        float congestionRTT;                                    ///< Round trip time more than this above the lowest round trip time seen recently is treated as congestion, and halves the send rate (milliseconds). See MinRTTWindowTime. Congestion control only.
+        float minFlushInterval;                                 ///< Minimum time between flushed packets (seconds). Measured with the time passed to FlushPackets. Messages sent before this has passed since the last flush wait for the next flush, or the next call to SendPackets. See Client::FlushPackets and Server::FlushPackets.
         ChannelConfig channel[MaxChannels];                     ///< Per-channel configuration. See ChannelConfig for details.
 
         ConnectionConfig()
         {
             numChannels = 1;
             maxPacketSize = 8 * 1024;
+            packetArenaSize = 16 * 1024;
+            congestionControl = false;
+            minSendBandwidth = 64.0f;
+            maxSendBandwidth = 4096.0f;
+            congestionPacketLoss = 5.0f;
+            congestionRTT = 100.0f;
+            minFlushInterval = 0.004f;
         }
     };
 
@@ -279,6 +348,9 @@ namespace yojimbo
         int packetReassemblyBufferSize;                         ///< Number of packet entries in the fragmentation reassembly buffer.
         int ackedPacketsBufferSize;                             ///< Number of packet entries in the acked packet buffer. Consider your packet send rate and aim to have at least a few seconds worth of entries.
         int receivedPacketsBufferSize;                          ///< Number of packet entries in the received packet sequence buffer. Consider your packet send rate and aim to have at least a few seconds worth of entries.
+        int serverWorkerThreads;                                ///< Number of worker threads the server uses to generate and process packets for different clients in parallel. 0 (default) does all work on the calling thread.
+        int serverClientMemoryPool;                             ///< If non-zero, the server reserves this many blocks of serverPerClientMemory on start and hands them out to clients as they connect. Clients that connect when the pool is empty are disconnected. 0 (default) reserves memory for every client slot on start.
+        float serverMaxSendBandwidth;                           ///< If non-zero, caps the packet data the server sends to all clients combined (kbps). When clients want more than that, it is shared max-min fairly, weighted by client priority. See Server::SetClientPriority. 0 (default) means no cap.
 
         ClientServerConfig()
         {
@@ -295,6 +367,9 @@ namespace yojimbo
             packetReassemblyBufferSize = 64;
             ackedPacketsBufferSize = 256;
             receivedPacketsBufferSize = 256;
+            serverWorkerThreads = 0;
+            serverClientMemoryPool = 0;
+            serverMaxSendBandwidth = 0.0f;
         }
     };
 }
@@ -730,6 +805,173 @@ namespace yojimbo
         TLSF_Allocator & operator = ( const TLSF_Allocator & other );
     };
 
+    /**
+        A bump allocator for short lived allocations that are all released together.
+        Allocations are carved off the front of a fixed block of memory, and Free does nothing for memory that came from the block. Call Reset to release everything at once.
+        When the block is full, allocations fall back to the allocator passed in to the constructor, and are freed back to it as usual.
+        The connection uses this to serve the temporary allocations made while generating and processing each packet. See ConnectionConfig::packetArenaSize.
+     */
+
+    class BumpAllocator : public Allocator
+    {
+    public:
+
+        /**
+            Bump allocator constructor.
+            @param allocator The allocator used to allocate the block of memory, and for allocations that don't fit in it.
+            @param bytes The size of the block of memory (bytes).
+         */
+
+        BumpAllocator( Allocator & allocator, size_t bytes );
+
+        /**
+            Bump allocator destructor.
+            Frees the block of memory back to the allocator passed in to the constructor.
+         */
+
+        ~BumpAllocator();
+
+        /**
+            Allocates a block of memory from the front of the remaining space, or from the fallback allocator if there isn't enough room.
+            IMPORTANT: Don't call this directly. Use the YOJIMBO_NEW or YOJIMBO_ALLOCATE macros instead, because they automatically pass in the source filename and line number for you.
+            @param size The size of the block of memory to allocate (bytes).
+            @param file The source code filename that is performing the allocation. Used for tracking allocations and reporting on memory leaks.
+            @param line The line number in the source code file that is performing the allocation.
+            @returns A block of memory of the requested size, or NULL if the allocation could not be performed. If NULL is returned, the error level is set to ALLOCATION_ERROR_FAILED_TO_ALLOCATE.
+         */
+
+        void * Allocate( size_t size, const char * file, int line );
+
+        /**
+            Free a block of memory.
+            Does nothing if the memory came from the bump allocator block. That memory is released by Reset. Otherwise the memory is freed back to the fallback allocator.
+            IMPORTANT: Don't call this directly. Use the YOJIMBO_DELETE or YOJIMBO_FREE macros instead, because they automatically pass in the source filename and line number for you.
+            @param p Pointer to the block of memory to free.
+            @param file The source code filename that is performing the free. Used for tracking allocations and reporting on memory leaks.
+            @param line The line number in the source code file that is performing the free.
+         */
+
+        void Free( void * p, const char * file, int line );
+
+        /**
+            Release all allocations made from the block of memory in one step.
+            IMPORTANT: Make sure nothing allocated from this allocator is still in use when you call this.
+         */
+
+        void Reset();
+
+    private:
+
+        Allocator * m_allocator;    ///< The allocator that owns the block of memory, and serves allocations that don't fit in it.
+        uint8_t * m_memory;         ///< The block of memory allocations are made from.
+        size_t m_size;              ///< The size of the block of memory (bytes).
+        size_t m_offset;            ///< Offset of the first free byte in the block of memory.
+
+        BumpAllocator( const BumpAllocator & other );
+        BumpAllocator & operator = ( const BumpAllocator & other );
+    };
+
+    /**
+        Block allocator statistics for a single size class.
+        @see BlockAllocator::GetStats
+     */
+
+    struct BlockAllocatorStats
+    {
+        int numLive;                                                            ///< The number of blocks in this size class currently allocated.
+        int maxLive;                                                            ///< High water mark for the number of blocks in this size class allocated at the same time.
+        int numFree;                                                            ///< The number of freed blocks in this size class held in the free list, ready to be reused.
+        uint64_t numAllocated;                                                  ///< The total number of blocks allocated in this size class.
+        uint64_t numRecycled;                                                   ///< The number of those allocations served from the free list, without going to the backing allocator.
+    };
+
+    /**
+        A size class pool allocator for block message payloads.
+        Allocations are rounded up to a power of two size class. Freed blocks are kept in a free list per size class and reused by later allocations in the same class, so blocks sent and received every tick don't go to the backing allocator in steady state.
+        If the backing allocator runs out of memory, all free lists are released back to it and the allocation is retried before failing.
+        Each message factory owns one of these. See MessageFactory::GetBlockAllocator.
+     */
+
+    class BlockAllocator : public Allocator
+    {
+    public:
+
+        /**
+            Block allocator constructor.
+            @param allocator The backing allocator that block memory is allocated from.
+         */
+
+        BlockAllocator( Allocator & allocator );
+
+        /**
+            Block allocator destructor.
+            Frees all blocks held in the free lists back to the backing allocator. All blocks must have been freed before this is called.
+         */
+
+        ~BlockAllocator();
+
+        /**
+            Allocates a block from the free list for its size class, or from the backing allocator if the free list is empty.
+            IMPORTANT: Don't call this directly. Use the YOJIMBO_NEW or YOJIMBO_ALLOCATE macros instead, because they automatically pass in the source filename and line number for you.
+            @param size The size of the block of memory to allocate (bytes).
+            @param file The source code filename that is performing the allocation. Used for tracking allocations and reporting on memory leaks.
+            @param line The line number in the source code file that is performing the allocation.
+            @returns A block of memory of at least the requested size, or NULL if the allocation could not be performed. If NULL is returned, the error level is set to ALLOCATION_ERROR_FAILED_TO_ALLOCATE.
+         */
+
+        void * Allocate( size_t size, const char * file, int line );
+
+        /**
+            Free a block of memory by pushing it on to the free list for its size class.
+            IMPORTANT: Don't call this directly. Use the YOJIMBO_DELETE or YOJIMBO_FREE macros instead, because they automatically pass in the source filename and line number for you.
+            @param p Pointer to the block of memory to free. Must have been allocated with this allocator.
+            @param file The source code filename that is performing the free. Used for tracking allocations and reporting on memory leaks.
+            @param line The line number in the source code file that is performing the free.
+         */
+
+        void Free( void * p, const char * file, int line );
+
+        /**
+            Release all blocks held in the free lists back to the backing allocator.
+         */
+
+        void Trim();
+
+        /**
+            Get the number of size classes.
+            @returns The number of size classes.
+         */
+
+        static int GetNumSizeClasses() { return NumSizeClasses; }
+
+        /**
+            Get the size of blocks in a size class.
+            @param sizeClass The size class in [0,GetNumSizeClasses()-1].
+            @returns The size of blocks in this size class (bytes).
+         */
+
+        static size_t GetSizeClassBytes( int sizeClass ) { return size_t(1) << ( sizeClass + MinSizeClassBits ); }
+
+        /**
+            Get statistics for a size class.
+            @param sizeClass The size class in [0,GetNumSizeClasses()-1].
+            @returns The statistics for this size class.
+         */
+
+        const BlockAllocatorStats & GetStats( int sizeClass ) const;
+
+    private:
+
+        enum { MinSizeClassBits = 6, MaxSizeClassBits = 30, NumSizeClasses = MaxSizeClassBits - MinSizeClassBits + 1, HeaderBytes = 16 };
+
+        Allocator * m_allocator;                                                ///< The backing allocator.
+        void * m_freeList[NumSizeClasses];                                      ///< Singly linked list of free blocks per size class. The next pointer is stored in the header of each block.
+        BlockAllocatorStats m_stats[NumSizeClasses];                            ///< Statistics per size class.
+
+        BlockAllocator( const BlockAllocator & other );
+        BlockAllocator & operator = ( const BlockAllocator & other );
+    };
+
     /**
         Generate cryptographically secure random data.
         @param data The buffer to store the random data.
@@ -877,6 +1119,24 @@ namespace yojimbo
 #endif // #ifdef __GNUC__
     }
 
+    /**
+        Calculates the number of trailing zero bits in an unsigned 64 bit integer.
+        This is the index of the lowest bit set to 1.
+        @param x The input integer value. Must not be zero.
+        @returns The number of trailing zero bits in the input value.
+     */
+
+    inline int count_trailing_zeros( uint64_t x )
+    {
+        yojimbo_assert( x != 0 );
+#ifdef __GNUC__
+        return __builtin_ctzll( x );
+#else // #ifdef __GNUC__
+        const uint64_t mask = ( x & ( ~x + 1 ) ) - 1;
+        return int( popcount( uint32_t( mask ) ) + popcount( uint32_t( mask >> 32 ) ) );
+#endif // #ifdef __GNUC__
+    }
+
     /**
         Reverse the order of bytes in a 64 bit integer.
         @param value The input value.
@@ -1163,6 +1423,34 @@ namespace yojimbo
             return ( m_data[data_index] >> bit_index ) & 1;
         }
 
+        /**
+            Find the first bit set to 1, starting from an index.
+            Scans a 64 bit word at a time, so large runs of zero bits are skipped quickly.
+            @param startIndex The index of the first bit to consider.
+            @returns The index of the first bit set to 1 at or after the start index, or -1 if there is none.
+         */
+
+        int FindFirstSetBit( int startIndex = 0 ) const
+        {
+            yojimbo_assert( startIndex >= 0 );
+            if ( startIndex >= m_size )
+                return -1;
+            const int numWords = m_bytes / 8;
+            int data_index = startIndex >> 6;
+            uint64_t word = m_data[data_index] & ( ~uint64_t(0) << ( startIndex & ( (1<<6) - 1 ) ) );
+            while ( true )
+            {
+                if ( word )
+                {
+                    const int index = ( data_index << 6 ) + count_trailing_zeros( word );
+                    return ( index < m_size ) ? index : -1;
+                }
+                if ( ++data_index == numWords )
+                    return -1;
+                word = m_data[data_index];
+            }
+        }
+
         /**
             Gets the size of the bit array, in number of bits.
             @returns The number of bits.
@@ -1247,7 +1535,7 @@ namespace yojimbo
         {
             yojimbo_assert( !IsEmpty() );
             const T & entry = m_entries[m_startIndex];
-            m_startIndex = ( m_startIndex + 1 ) % m_arraySize;
+            m_startIndex = WrapIndex( m_startIndex + 1 );
             m_numEntries--;
             return entry;
         }
@@ -1261,7 +1549,7 @@ namespace yojimbo
         void Push( const T & value )
         {
             yojimbo_assert( !IsFull() );
-            const int index = ( m_startIndex + m_numEntries ) % m_arraySize;
+            const int index = WrapIndex( m_startIndex + m_numEntries );
             m_entries[index] = value;
             m_numEntries++;
         }
@@ -1277,7 +1565,7 @@ namespace yojimbo
             yojimbo_assert( !IsEmpty() );
             yojimbo_assert( index >= 0 );
             yojimbo_assert( index < m_numEntries );
-            return m_entries[ ( m_startIndex + index ) % m_arraySize ];
+            return m_entries[ WrapIndex( m_startIndex + index ) ];
         }
 
         /**
@@ -1291,7 +1579,7 @@ namespace yojimbo
             yojimbo_assert( !IsEmpty() );
             yojimbo_assert( index >= 0 );
             yojimbo_assert( index < m_numEntries );
-            return m_entries[ ( m_startIndex + index ) % m_arraySize ];
+            return m_entries[ WrapIndex( m_startIndex + index ) ];
         }
 
         /**
@@ -1337,6 +1625,19 @@ namespace yojimbo
 
     private:
 
+        /**
+            Wrap an index into the circular buffer.
+            Indices passed in are always less than twice the array size, so a compare and subtract avoids an integer divide.
+            @param index The index to wrap, in [0,2*GetSize()-1].
+            @returns The index in [0,GetSize()-1].
+         */
+
+        int WrapIndex( int index ) const
+        {
+            yojimbo_assert( index >= 0 );
+            yojimbo_assert( index < 2 * m_arraySize );
+            return ( index >= m_arraySize ) ? index - m_arraySize : index;
+        }
 
         Allocator * m_allocator;                        ///< The allocator passed in to the constructor.
         T * m_entries;                                  ///< Array of entries backing the queue (circular buffer).
@@ -1718,6 +2019,43 @@ namespace yojimbo
             yojimbo_assert( headBytes + numWords * 4 + tailBytes == bytes );
         }
 
+        /**
+            Write bits that were written to another buffer by a bit writer.
+            Faster than reading the bits back and writing them with BitWriter::WriteBits, because whole dwords are shifted into place in a single pass without going through the scratch in memory.
+            @param data The buffer the bits were written to. The last dword must have been flushed with BitWriter::FlushBits.
+            @param bits The number of bits to write.
+         */
+
+        void WriteBitArray( const uint32_t * data, int bits )
+        {
+            yojimbo_assert( data );
+            yojimbo_assert( bits >= 0 );
+            yojimbo_assert( m_bitsWritten + bits <= m_numBits );
+
+            const int numWords = bits / 32;
+            const int scratchBits = m_scratchBits;
+            uint64_t scratch = m_scratch;
+            int wordIndex = m_wordIndex;
+
+            // there are always less than 32 bits in scratch between writes, so each dword in pushes exactly one dword out
+
+            for ( int i = 0; i < numWords; ++i )
+            {
+                scratch |= uint64_t( network_to_host( data[i] ) ) << scratchBits;
+                yojimbo_assert( wordIndex < m_numWords );
+                m_data[wordIndex++] = host_to_network( uint32_t( scratch & 0xFFFFFFFF ) );
+                scratch >>= 32;
+            }
+
+            m_scratch = scratch;
+            m_wordIndex = wordIndex;
+            m_bitsWritten += numWords * 32;
+
+            const int tailBits = bits - numWords * 32;
+            if ( tailBits > 0 )
+                WriteBits( network_to_host( data[numWords] ) & uint32_t( ( 1ULL << tailBits ) - 1 ), tailBits );
+        }
+
         /**
             Flush any remaining bits to memory.
             Call this once after you've finished writing bits to flush the last dword of scratch to memory!
@@ -2178,6 +2516,20 @@ namespace yojimbo
             return true;
         }
 
+        /**
+            Copy bits written by another write stream (write).
+            @param data The data written by the other stream, after it was flushed.
+            @param bits The number of bits to copy.
+            @returns Always returns true. All checking is performed by debug asserts on write.
+            @see BitWriter::WriteBitArray
+         */
+
+        bool SerializeBitArray( const uint32_t * data, int bits )
+        {
+            m_writer.WriteBitArray( data, bits );
+            return true;
+        }
+
         /**
             Serialize an align (write).
             @returns Always returns true. All checking is performed by debug asserts on write.
@@ -3489,6 +3841,47 @@ namespace yojimbo
             }                                                                                       \
         } while (0)
 
+    /**
+        Get the number of bits serialize_int_relative writes for an integer value relative to another.
+        This matches serialize_int_relative_internal exactly, without needing to construct a measure stream. Use it in hot loops that only need the cost.
+        @param previous The previous integer value.
+        @param current The current integer value. Must be greater than previous.
+        @returns The number of bits written by serialize_int_relative( stream, previous, current ).
+     */
+
+    inline int int_relative_bits( uint32_t previous, uint32_t current )
+    {
+        yojimbo_assert( previous < current );
+        const uint32_t difference = current - previous;
+        if ( difference == 1 )
+            return 1;
+        if ( difference <= 6 )
+            return 2 + 3;
+        if ( difference <= 23 )
+            return 3 + 5;
+        if ( difference <= 280 )
+            return 4 + 9;
+        if ( difference <= 4377 )
+            return 5 + 13;
+        if ( difference <= 69914 )
+            return 6 + 17;
+        return 6 + 32;
+    }
+
+    /**
+        Get the number of bits serialize_sequence_relative writes for a sequence number relative to another.
+        @param sequence1 The first sequence number to serialize relative to.
+        @param sequence2 The second sequence number to be encoded relative to the first. Must not be equal to sequence1.
+        @returns The number of bits written by serialize_sequence_relative( stream, sequence1, sequence2 ).
+     */
+
+    inline int sequence_relative_bits( uint16_t sequence1, uint16_t sequence2 )
+    {
+        const uint32_t a = sequence1;
+        const uint32_t b = sequence2 + ( ( sequence1 > sequence2 ) ? 65536 : 0 );
+        return int_relative_bits( a, b );
+    }
+
     // read macros corresponding to each serialize_*. useful when you want separate read and write functions.
 
     #define read_bits( stream, value, bits )                                                \
@@ -3664,12 +4057,13 @@ namespace yojimbo
             @see MessageFactory::Create
          */
 
-        Message( int blockMessage = 0 ) : m_refCount(1), m_id(0), m_type(0), m_blockMessage( blockMessage ) {}
+        Message( int blockMessage = 0 ) : m_refCount(1), m_id(0), m_type(0), m_blockMessage( blockMessage ), m_proxyMessage(0), m_baseline(NULL), m_orderingKey(0), m_orderingOffset(0), m_superseded(false) {}
 
         /** 
             Set the message id.
-            When messages are sent over a reliable-ordered channel, the message id starts at 0 and increases with each message sent over that channel.
-            When messages are sent over an unreliable-unordered channel, the message id is set to the sequence number of the packet it was delivered in.
+            When messages are sent over a reliable channel, the message id starts at 0 and increases with each message sent over that channel.
+            When messages are sent over an unreliable-unordered or unreliable-sequenced channel, the message id is set to the sequence number of the packet it was delivered in.
+            When messages are sent over a snapshot-delta channel, the message id is the snapshot id. This starts at 0 and increases with each snapshot sent over that channel.
             @param id The message id.
          */
 
@@ -3709,6 +4103,81 @@ namespace yojimbo
 
         bool IsBlockMessage() const { return m_blockMessage; }
 
+        /**
+            Is this a proxy message?
+            Proxy messages are created by the server when a message is broadcast. They write out a message payload that was serialized once, and are never seen by the receiver.
+            @returns True if this is a proxy message, false otherwise.
+            @see Server::BroadcastMessage
+         */
+
+        bool IsProxyMessage() const { return m_proxyMessage; }
+
+        /**
+            Get the baseline to delta encode this message against.
+            Only set for messages sent over a snapshot-delta channel, and only while the message is being serialized. The baseline is a message of the same channel that the other side has already received.
+            In your serialize function, write the message relative to the baseline if there is one, and in full if there isn't. The read side gets the same baseline, so it can reconstruct the message.
+            Don't modify messages received over a snapshot-delta channel. The channel keeps them as baselines for the snapshots that follow.
+            @returns The baseline message, or NULL if this message should be serialized in full.
+            @see CHANNEL_TYPE_SNAPSHOT_DELTA
+         */
+
+        const Message * GetBaseline() const { return m_baseline; }
+
+        /**
+            Set the baseline to delta encode this message against.
+            Called by the snapshot-delta channel before the message is serialized.
+            @param baseline The baseline message. NULL to serialize the message in full.
+         */
+
+        void SetBaseline( const Message * baseline ) { m_baseline = baseline; }
+
+        /**
+            Set the ordering key for this message.
+            When a reliable-ordered channel has more than one ordering key, messages are only delivered in order relative to other messages with the same key. See ChannelConfig::numOrderingKeys.
+            Keys are mapped onto the ordering keys of the channel modulo ChannelConfig::numOrderingKeys, so an entity id can be used directly. The key is not sent over the network.
+            On reliable latest-value channels the key identifies the value the message holds. Sending a message replaces any unacked message with the same key. See CHANNEL_TYPE_RELIABLE_LATEST_VALUE.
+            @param key The ordering key.
+         */
+
+        void SetOrderingKey( uint32_t key ) { m_orderingKey = key; }
+
+        /**
+            Get the ordering key for this message.
+            @returns The ordering key set with SetOrderingKey. 0 by default.
+         */
+
+        uint32_t GetOrderingKey() const { return m_orderingKey; }
+
+        /**
+            Set the ordering offset.
+            Set by reliable-ordered channels with more than one ordering key when the message is sent, and read back on the receiver.
+            @param offset The number of messages back to the previous message with the same ordering key. 0 if the receiver is known to have that message already.
+         */
+
+        void SetOrderingOffset( uint16_t offset ) { m_orderingOffset = offset; }
+
+        /**
+            Get the ordering offset.
+            @returns The number of messages back to the previous message with the same ordering key. 0 if the message doesn't have to wait for an earlier message.
+         */
+
+        int GetOrderingOffset() const { return m_orderingOffset; }
+
+        /**
+            Mark this message as superseded.
+            Set by reliable latest-value channels when a later message with the same key is sent before this message is acked. 
+            Superseded messages are sent without their contents, so the receiver skips over them.
+         */
+
+        void SetSuperseded() { m_superseded = true; }
+
+        /**
+            Has this message been superseded?
+            @returns True if a later message with the same key replaced this message. See CHANNEL_TYPE_RELIABLE_LATEST_VALUE.
+         */
+
+        bool IsSuperseded() const { return m_superseded; }
+
         /**
             Virtual serialize function (read).
             Reads the message in from a bitstream.
@@ -3749,6 +4218,13 @@ namespace yojimbo
 
         void SetType( int type ) { m_type = type; }
 
+        /**
+            Mark this message as a proxy message.
+            Called by the server when it creates a proxy message for a broadcast.
+         */
+
+        void SetProxyMessage() { m_proxyMessage = 1; }
+
         /**
             Add a reference to the message.
             This is called when a message is included in a packet and added to the receive queue. 
@@ -3784,8 +4260,13 @@ namespace yojimbo
 
         int m_refCount;                             ///< Number of references on this message object. Starts at 1. Message is destroyed when it reaches 0.
         uint32_t m_id : 16;                         ///< The message id. For messages sent over reliable-ordered channels, this starts at 0 and increases with each message sent. For unreliable-unordered channels this is set to the sequence number of the packet the message was included in.
-        uint32_t m_type : 15;                       ///< The message type. Corresponds to the type integer used when the message was created though the message factory.
+        uint32_t m_type : 14;                       ///< The message type. Corresponds to the type integer used when the message was created though the message factory. Must be wide enough for MaxMessageTypes.
         uint32_t m_blockMessage : 1;                ///< 1 if this is a block message. 0 otherwise. If 1 then you can cast the Message* to BlockMessage*. Lightweight RTTI.
+        uint32_t m_proxyMessage : 1;                ///< 1 if this is a proxy for a broadcast message payload. 0 otherwise. Proxy messages are not created by the message factory.
+        const Message * m_baseline;                 ///< The baseline this message is delta encoded against while it is serialized over a snapshot-delta channel. NULL otherwise.
+        uint32_t m_orderingKey;                     ///< The ordering key. Only used by reliable-ordered channels with more than one ordering key.
+        uint16_t m_orderingOffset;                  ///< Number of messages back to the previous message with the same ordering key. Only used by reliable-ordered channels with more than one ordering key.
+        bool m_superseded;                          ///< True if a later message with the same key replaced this message before it was acked. Only used by reliable latest-value channels.
     };
 
     /**
@@ -3923,6 +4404,21 @@ namespace yojimbo
         MESSAGE_FACTORY_ERROR_FAILED_TO_ALLOCATE_MESSAGE,                       ///< Failed to allocate a message. Typically this means we ran out of memory on the allocator backing the message factory.
     };
 
+    /**
+        Message pool statistics for a single message type.
+        @see MessageFactory::GetMessagePoolStats
+        @see YOJIMBO_DECLARE_POOLED_MESSAGE_TYPE
+     */
+
+    struct MessagePoolStats
+    {
+        int numLive;                                                            ///< The number of messages of this type currently alive.
+        int numFree;                                                            ///< The number of destroyed message objects of this type held in the free list, ready to be recycled.
+        int maxFree;                                                            ///< The maximum number of message objects of this type kept in the free list. 0 if this type is not pooled.
+        uint64_t numCreated;                                                    ///< The total number of messages of this type created.
+        uint64_t numRecycled;                                                   ///< The number of messages of this type created from the free list, without going to the allocator.
+    };
+
     /**
         Defines the set of message types that can be created.
 
@@ -3930,8 +4426,12 @@ namespace yojimbo
         
             YOJIMBO_MESSAGE_FACTORY_START
             YOJIMBO_DECLARE_MESSAGE_TYPE
+            YOJIMBO_DECLARE_POOLED_MESSAGE_TYPE
             YOJIMBO_MESSAGE_FACTORY_FINISH
         
+        Message types declared as pooled keep a per-type free list of destroyed message objects. 
+        Creating a message of a pooled type reuses an object from this free list when one is available, so high frequency messages don't go to the allocator in steady state.
+
         See tests/shared.h for an example showing how to use the macros.
      */
 
@@ -3943,14 +4443,22 @@ namespace yojimbo
             Message factory allocator.
             Pass in the number of message types for the message factory from the derived class.
             @param allocator The allocator used to create messages.
-            @param numTypes The number of message types. Valid types are in [0,numTypes-1].
+            @param numTypes The number of message types. Valid types are in [0,numTypes-1]. Must not exceed MaxMessageTypes.
+            If the per-type message pools can't be allocated, the error level is set to MESSAGE_FACTORY_ERROR_FAILED_TO_ALLOCATE_MESSAGE and all message creation fails.
          */
 
-        MessageFactory( Allocator & allocator, int numTypes )
+        MessageFactory( Allocator & allocator, int numTypes ) : m_blockAllocator( allocator )
         {
+            yojimbo_assert( numTypes > 0 );
+            yojimbo_assert( numTypes <= MaxMessageTypes );
             m_allocator = &allocator;
             m_numTypes = numTypes;
             m_errorLevel = MESSAGE_FACTORY_ERROR_NONE;
+            m_pools = (MessagePool*) YOJIMBO_ALLOCATE( allocator, sizeof( MessagePool ) * numTypes );
+            if ( m_pools )
+                memset( m_pools, 0, sizeof( MessagePool ) * numTypes );
+            else
+                m_errorLevel = MESSAGE_FACTORY_ERROR_FAILED_TO_ALLOCATE_MESSAGE;
         }
 
         /**
@@ -3962,6 +4470,19 @@ namespace yojimbo
         {
             yojimbo_assert( m_allocator );
 
+            for ( int i = 0; m_pools && i < m_numTypes; ++i )
+            {
+                void * memory = m_pools[i].freeList;
+                while ( memory )
+                {
+                    void * next = *( (void**) memory );
+                    YOJIMBO_FREE( *m_allocator, memory );
+                    memory = next;
+                }
+            }
+
+            YOJIMBO_FREE( *m_allocator, m_pools );
+
             m_allocator = NULL;
 
             #if YOJIMBO_DEBUG_MESSAGE_LEAKS
@@ -3994,12 +4515,14 @@ namespace yojimbo
         {
             yojimbo_assert( type >= 0 );
             yojimbo_assert( type < m_numTypes );
-            Message * message = CreateMessageInternal( type );
+            Message * message = m_pools ? CreateMessageInternal( type ) : NULL;
             if ( !message )
             {
                 m_errorLevel = MESSAGE_FACTORY_ERROR_FAILED_TO_ALLOCATE_MESSAGE;
                 return NULL;
             }
+            m_pools[type].stats.numLive++;
+            m_pools[type].stats.numCreated++;
             #if YOJIMBO_DEBUG_MESSAGE_LEAKS
             allocated_messages[message] = 1;
             yojimbo_assert( allocated_messages.find( message ) != allocated_messages.end() );
@@ -4024,6 +4547,7 @@ namespace yojimbo
         /**
             Remove a reference from a message.
             Messages have 1 reference when created. When the reference count reaches 0, they are destroyed.
+            If the message type is pooled and its free list has room, the destroyed message object is kept for reuse instead of being freed.
             @see MessageFactory::Create
             @see MessageFactory::AddRef
          */
@@ -4038,12 +4562,42 @@ namespace yojimbo
             message->Release();
             if ( message->GetRefCount() == 0 )
             {
+                yojimbo_assert( m_allocator );
+                if ( message->IsProxyMessage() )
+                {
+                    // proxy messages are allocated by the server from this factory's allocator, not created by the factory
+                    message->~Message();
+                    YOJIMBO_FREE( *m_allocator, message );
+                    return;
+                }
                 #if YOJIMBO_DEBUG_MESSAGE_LEAKS
                 yojimbo_assert( allocated_messages.find( message ) != allocated_messages.end() );
                 allocated_messages.erase( message );
                 #endif // #if YOJIMBO_DEBUG_MESSAGE_LEAKS
-                yojimbo_assert( m_allocator );
-                YOJIMBO_DELETE( *m_allocator, Message, message );
+                const int type = message->GetType();
+                yojimbo_assert( type >= 0 );
+                yojimbo_assert( type < m_numTypes );
+                yojimbo_assert( m_pools );
+                if ( !m_pools )
+                {
+                    message->~Message();
+                    YOJIMBO_FREE( *m_allocator, message );
+                    return;
+                }
+                MessagePool & pool = m_pools[type];
+                yojimbo_assert( pool.stats.numLive > 0 );
+                pool.stats.numLive--;
+                message->~Message();
+                if ( pool.stats.numFree < pool.stats.maxFree )
+                {
+                    *( (void**) message ) = pool.freeList;
+                    pool.freeList = message;
+                    pool.stats.numFree++;
+                }
+                else
+                {
+                    YOJIMBO_FREE( *m_allocator, message );
+                }
             }
         }
 
@@ -4068,6 +4622,18 @@ namespace yojimbo
             return *m_allocator;
         }
 
+        /**
+            Get the allocator used for block message payloads.
+            This is a size class pool on top of the message factory allocator, so blocks of similar size are reused instead of going back to the general allocator each time.
+            @returns The block allocator.
+            @see BlockAllocator
+         */
+
+        BlockAllocator & GetBlockAllocator()
+        {
+            return m_blockAllocator;
+        }
+
         /**
             Get the error level.
             When used with a client or server, an error level on a message factory other than MESSAGE_FACTORY_ERROR_NONE triggers a client disconnect.
@@ -4078,6 +4644,26 @@ namespace yojimbo
             return m_errorLevel;
         }
 
+        /**
+            Get message pool statistics for a message type.
+            Live and created counts are tracked for all message types. Free list counts are only non-zero for pooled message types.
+            @param type The message type in [0,numTypes-1].
+            @returns The pool statistics for the message type. All zero if the message pools could not be allocated.
+            @see YOJIMBO_DECLARE_POOLED_MESSAGE_TYPE
+         */
+
+        const MessagePoolStats & GetMessagePoolStats( int type ) const
+        {
+            yojimbo_assert( type >= 0 );
+            yojimbo_assert( type < m_numTypes );
+            if ( !m_pools )
+            {
+                static const MessagePoolStats NoStats = {};
+                return NoStats;
+            }
+            return m_pools[type].stats;
+        }
+
         /**
             Clear the error level back to no error.
          */
@@ -4105,8 +4691,44 @@ namespace yojimbo
 
         void SetMessageType( Message * message, int type ) { message->SetType( type ); }
 
+        /**
+            Get memory for a message of a pooled type.
+            Pops a destroyed message object off the free list for this type if there is one, otherwise allocates fresh memory from the message factory allocator.
+            The caller constructs the message in place. The memory is returned to the free list (or freed) when the message reference count reaches zero.
+            @param type The message type.
+            @param bytes The size of the message class (bytes). Must be the same for every call with this type.
+            @param poolSize The maximum number of destroyed message objects of this type to keep in the free list.
+            @returns The memory for the message, or NULL if the allocation failed.
+         */
+
+        void * AllocateMessageMemory( int type, size_t bytes, int poolSize )
+        {
+            yojimbo_assert( type >= 0 );
+            yojimbo_assert( type < m_numTypes );
+            yojimbo_assert( bytes >= sizeof( void* ) );
+            yojimbo_assert( poolSize >= 0 );
+            yojimbo_assert( m_pools );
+            MessagePool & pool = m_pools[type];
+            pool.stats.maxFree = poolSize;
+            void * memory = pool.freeList;
+            if ( memory )
+            {
+                pool.freeList = *( (void**) memory );
+                pool.stats.numFree--;
+                pool.stats.numRecycled++;
+                return memory;
+            }
+            return YOJIMBO_ALLOCATE( *m_allocator, bytes );
+        }
+
     private:
 
+        struct MessagePool
+        {
+            void * freeList;                                                    ///< Singly linked list of destroyed message objects. The next pointer is stored in the first bytes of each object.
+            MessagePoolStats stats;                                             ///< Pool statistics for this message type.
+        };
+
         #if YOJIMBO_DEBUG_MESSAGE_LEAKS
         std::map<void*,int> allocated_messages;                                 ///< The set of allocated messages for this factory. Used to track down message leaks.
         #endif // #if YOJIMBO_DEBUG_MESSAGE_LEAKS
@@ -4116,6 +4738,10 @@ namespace yojimbo
         int m_numTypes;                                                         ///< The number of message types.
         
         MessageFactoryErrorLevel m_errorLevel;                                  ///< The message factory error level.
+
+        MessagePool * m_pools;                                                  ///< Per-type message pools and statistics. Array of size numTypes.
+
+        BlockAllocator m_blockAllocator;                                        ///< Size class pool allocator for block message payloads.
     };
 }
 
@@ -4158,6 +4784,28 @@ namespace yojimbo
                     SetMessageType( message, message_type );                                                                            \
                     return message;
 
+/** 
+    Add a pooled message type to a message factory.
+    Destroyed messages of this type are kept in a free list and recycled when new messages of this type are created, instead of going back to the allocator.
+    Use this for message types that are created and destroyed at a high rate.
+    @param message_type The message type value. This is typically an enum value.
+    @param message_class The message class to instantiate when a message of this type is created.
+    @param pool_size The maximum number of destroyed messages of this type to keep around for reuse.
+    See tests/shared.h for an example of usage.
+ */
+
+#define YOJIMBO_DECLARE_POOLED_MESSAGE_TYPE( message_type, message_class, pool_size )                                                   \
+                                                                                                                                        \
+                case message_type:                                                                                                      \
+                {                                                                                                                       \
+                    void * memory = AllocateMessageMemory( message_type, sizeof( message_class ), pool_size );                          \
+                    if ( !memory )                                                                                                      \
+                        return NULL;                                                                                                    \
+                    message = new ( memory ) message_class();                                                                           \
+                    SetMessageType( message, message_type );                                                                            \
+                    return message;                                                                                                     \
+                }
+
 /** 
     Finish the definition of a new message factory.
     This is a helper macro to make declaring your own message factory class easier.
@@ -4173,20 +4821,24 @@ namespace yojimbo
 
 namespace yojimbo
 {
+    class Channel;
+
     struct ChannelPacketData
     {
         uint32_t channelIndex : 16;
         uint32_t initialized : 1;
         uint32_t blockMessage : 1;
         uint32_t messageFailedToSerialize : 1;
+        uint32_t baselineMissing : 1;
 
         struct MessageData
         {
             int numMessages;
             Message ** messages;
+            uint16_t sequence;
         };
 
-        struct BlockData
+        struct FragmentData
         {
             BlockMessage * message;
             uint8_t * fragmentData;
@@ -4195,6 +4847,13 @@ namespace yojimbo
             uint64_t fragmentSize : 16;
             uint64_t numFragments : 16;
             int messageType;
+            uint32_t ownsFragmentData : 1;
+        };
+
+        struct BlockData
+        {
+            int numPacketFragments;
+            FragmentData * fragments;
         };
 
         union
@@ -4207,13 +4866,15 @@ namespace yojimbo
 
         void Free( MessageFactory & messageFactory );
 
-        template <typename Stream> bool Serialize( Stream & stream, MessageFactory & messageFactory, const ChannelConfig * channelConfigs, int numChannels );
+        void Free( MessageFactory & messageFactory, Allocator & allocator );
 
-        bool SerializeInternal( ReadStream & stream, MessageFactory & messageFactory, const ChannelConfig * channelConfigs, int numChannels );
+        template <typename Stream> bool Serialize( Stream & stream, MessageFactory & messageFactory, Allocator & allocator, const ChannelConfig * channelConfigs, int numChannels, Channel ** channels );
 
-        bool SerializeInternal( WriteStream & stream, MessageFactory & messageFactory, const ChannelConfig * channelConfigs, int numChannels );
+        bool SerializeInternal( ReadStream & stream, MessageFactory & messageFactory, Allocator & allocator, const ChannelConfig * channelConfigs, int numChannels, Channel ** channels );
 
-        bool SerializeInternal( MeasureStream & stream, MessageFactory & messageFactory, const ChannelConfig * channelConfigs, int numChannels );
+        bool SerializeInternal( WriteStream & stream, MessageFactory & messageFactory, Allocator & allocator, const ChannelConfig * channelConfigs, int numChannels, Channel ** channels );
+
+        bool SerializeInternal( MeasureStream & stream, MessageFactory & messageFactory, Allocator & allocator, const ChannelConfig * channelConfigs, int numChannels, Channel ** channels );
     };
 
     /**
@@ -4349,7 +5010,8 @@ namespace yojimbo
             Process a connection packet ack.
             Depending on the channel type: 
                 1. Acks messages and block fragments so they stop being included in outgoing connection packets (reliable-ordered channel), 
-                2. Does nothing at all (unreliable-unordered).
+                2. Does nothing at all (unreliable-unordered),
+                3. Advances the baseline to the newest snapshot included in the acked packet (snapshot-delta).
             @param sequence The sequence number of the connection packet that was acked.
          */
 
@@ -4371,6 +5033,15 @@ namespace yojimbo
 
         int GetChannelIndex() const;
 
+        /**
+            Check if the last call to GetPacketData left out data that was ready to send, because it didn't fit in the bits available.
+            Data that isn't ready yet, like reliable messages waiting for their resend time, doesn't count.
+            @returns True if the last call to GetPacketData was limited by the bits available.
+            @see ChannelConfig::weight
+         */
+
+        bool IsPacketDataLimited() const;
+
         /**
             Get a counter value.
             @param index The index of the counter to retrieve. See ChannelCounters.
@@ -4386,6 +5057,15 @@ namespace yojimbo
 
         void ResetCounters();
 
+        /**
+            Set the allocator used for channel packet data.
+            Channel packet data only lives for the duration of one packet, so the connection points this at its packet arena. See ConnectionConfig::packetArenaSize.
+            Defaults to the message factory allocator. Packet data filled by GetPacketData must be freed with the same allocator.
+            @param allocator The allocator to use for channel packet data.
+         */
+
+        void SetPacketAllocator( Allocator & allocator );
+
     protected:
 
         /**
@@ -4399,9 +5079,11 @@ namespace yojimbo
 
         const ChannelConfig m_config;                                                   ///< Channel configuration data.
         Allocator * m_allocator;                                                        ///< Allocator for allocations matching life cycle of this channel.
+        Allocator * m_packetAllocator;                                                  ///< Allocator for channel packet data. See SetPacketAllocator.
         int m_channelIndex;                                                             ///< The channel index in [0,numChannels-1].
         double m_time;                                                                  ///< The current time.
         ChannelErrorLevel m_errorLevel;                                                 ///< The channel error level.
+        bool m_packetDataLimited;                                                       ///< True if the last call to GetPacketData left out data that was ready to send because it didn't fit. See IsPacketDataLimited.
         MessageFactory * m_messageFactory;                                              ///< Message factory for creating and destroying messages.
         uint64_t m_counters[CHANNEL_COUNTER_NUM_COUNTERS];                              ///< Counters for unit testing, stats etc.
     };
@@ -4411,7 +5093,10 @@ namespace yojimbo
         This channel type is best used for control messages and RPCs.
         Messages sent over this channel are included in connection packets until one of those packets is acked. Messages are acked individually and remain in the send queue until acked.
         Blocks attached to messages sent over this channel are split up into fragments. Each fragment of the block is included in a connection packet until one of those packets are acked. Eventually, all fragments are received on the other side, and block is reassembled and attached to the message.
-        Only one message block may be in flight over the network at any time, so blocks stall out message delivery slightly. Therefore, only use blocks for large data that won't fit inside a single connection packet where you actually need the channel to split it up into fragments. If your block fits inside a packet, just serialize it inside your message serialize via serialize_bytes instead.
+        By default only one message block may be in flight over the network at any time, so blocks stall out message delivery slightly. See ChannelConfig::maxBlocksInFlight and ChannelConfig::maxFragmentsPerPacket to relax this. Even so, only use blocks for large data that won't fit inside a single connection packet where you actually need the channel to split it up into fragments. If your block fits inside a packet, just serialize it inside your message serialize via serialize_bytes instead.
+        This class also implements the reliable-unordered channel type. Sending is identical, but received messages are delivered in the order they arrive instead of waiting for every earlier message. See CHANNEL_TYPE_RELIABLE_UNORDERED.
+        It also implements the reliable latest-value channel type. Sending a message replaces the unacked message with the same key: in place if it was never sent, otherwise the old message is superseded and sent without its contents until acked. See CHANNEL_TYPE_RELIABLE_LATEST_VALUE.
+        With more than one ordering key, each message waits only for the previous message with the same key. See ChannelConfig::numOrderingKeys.
      */
 
     class ReliableOrderedChannel : public Channel
@@ -4462,7 +5147,9 @@ namespace yojimbo
         /**
             Get messages to include in a packet.
             Messages are measured to see how many bits they take, and only messages that fit within the channel packet budget will be included. See ChannelConfig::packetBudget.
-            Takes care not to send messages too rapidly by respecting ChannelConfig::messageResendTime for each message, and to only include messages that that the receiver is able to buffer in their receive queue. In other words, won't run ahead of the receiver.
+            Takes care not to send messages too rapidly by respecting the resend time for each message (see GetResendTime), and to only include messages that that the receiver is able to buffer in their receive queue. In other words, won't run ahead of the receiver.
+            Only visits messages that are ready to send: messages in packets treated as lost come off the fast retransmit queue, then messages due for resend come off the front of the resend queue, followed by messages that have never been sent. The cost does not depend on the number of unacked messages waiting in the send queue.
+            Message ids are returned in increasing order, as required by relative message id encoding.
             @param messageIds Array of message ids to be filled [out]. Fills up to ChannelConfig::maxMessagesPerPacket messages, make sure your array is at least this size.
             @param numMessageIds The number of message ids written to the array.
             @param remainingPacketBits Number of bits remaining in the packet. Considers this as a hard limit when determining how many messages can fit into the packet.
@@ -4484,6 +5171,19 @@ namespace yojimbo
 
         void GetMessagePacketData( ChannelPacketData & packetData, const uint16_t * messageIds, int numMessageIds );
 
+        /**
+            Get the cached serialized data of a message in the send queue.
+            The data is everything written for the message in a packet after the message ids: its type, whether it is superseded, its contents and its ordering offset.
+            Called while writing packets, so messages that are resent are copied into the packet instead of being serialized again.
+            @param messageId The id of the message.
+            @param data Set to the serialized data of the message [out].
+            @param bits Set to the number of bits of serialized data [out].
+            @returns True if the message is cached, false if it has to be serialized.
+            @see ChannelConfig::messageCacheSize
+         */
+
+        bool GetCachedMessage( uint16_t messageId, const uint32_t * & data, int & bits ) const;
+
         /**
             Add a packet entry for the set of messages included in a packet.
             This lets us look up the set of messages that were included in that packet later on when it is acked, so we can ack those messages individually.
@@ -4503,6 +5203,59 @@ namespace yojimbo
 
         void ProcessPacketMessages( int numMessages, Message ** messages );
 
+        /**
+            Pop the next message off the receive queue of a reliable-unordered channel.
+            Messages are returned in the order they arrived. The receive window moves forward once every message before it has been delivered.
+            @returns A pointer to the received message, NULL if there are no messages to receive.
+         */
+
+        Message * ReceiveMessageUnordered();
+
+        /**
+            Replace the unacked message with the same key as a message sent over a reliable latest-value channel.
+            If the old message was never sent, the new message takes over its entry in the send queue. Otherwise the old message is marked as superseded.
+            @param message The message being sent. Must not be a block message.
+            @param messageId Set to the id of the message to take over, if any.
+            @returns True if the new message should take over the send queue entry of the old message. False if it needs a new entry.
+         */
+
+        bool ReplaceLatestValue( Message * message, uint16_t & messageId );
+
+        /**
+            Find the unacked message with a key in the latest-value index.
+            @param key The message key. See Message::GetOrderingKey.
+            @param messageId Set to the id of the message, if found [out].
+            @returns True if there is an unacked message with the key that has not been superseded.
+         */
+
+        bool FindLatestValue( uint32_t key, uint16_t & messageId ) const;
+
+        /**
+            Point a key at a message in the latest-value index.
+            @param key The message key.
+            @param messageId The id of the message. Replaces the message the key pointed at before, if any.
+         */
+
+        void SetLatestValue( uint32_t key, uint16_t messageId );
+
+        /**
+            Remove a message from the latest-value index when it is acked.
+            Does nothing if the key points at a later message, because this message was superseded.
+            @param key The message key.
+            @param messageId The id of the acked message.
+         */
+
+        void RemoveLatestValue( uint32_t key, uint16_t messageId );
+
+        /**
+            Add a message that was just inserted in the receive queue to the arrival queue, once it is ready to be delivered.
+            With ordering keys, a message is ready once the previous message with the same key is ready. Messages that were waiting on this message are added after it.
+            @param messageId The id of the received message.
+            @param orderingOffset The number of messages back to the previous message with the same ordering key. 0 if the message doesn't have to wait.
+         */
+
+        void QueueReceivedMessage( uint16_t messageId, int orderingOffset );
+
         /**
             Track the oldest unacked message id in the send queue.
             Because messages are acked individually, the send queue is not a true queue and may have holes. 
@@ -4513,66 +5266,112 @@ namespace yojimbo
 
         void UpdateOldestUnackedMessageId();
 
+        /**
+            Track the first message id in the send queue that has never been sent.
+            Walks forward over messages that have been sent, and block messages that have been acked. Stops at the first regular message that has never been sent, or at a block message that is waiting to be sent.
+            @see GetMessagesToSend
+         */
+
+        void UpdateFirstUnsentMessageId();
+
+        /**
+            Remove stale entries from the resend queue.
+            Called when the resend queue does not have enough room for the messages about to be pushed onto it. Order of the remaining entries is preserved.
+         */
+
+        void CompactMessageResendQueue();
+
+        /**
+            Queue messages in lost packets for fast retransmit.
+            A sent packet that is still not acked once a packet sent ChannelConfig::fastRetransmitPackets later has been acked is treated as lost. Messages in it that have not been sent again since are pushed onto the fast retransmit queue, so GetMessagesToSend resends them ahead of their resend time.
+         */
+
+        void UpdateFastRetransmit();
+
+        /**
+            Serialize a message that is about to be resent into the message cache.
+            Space for the message is taken from the front of the cache, which evicts the messages cached longest ago.
+            Messages that serialize differently depending on bit alignment (eg. they use serialize_align or serialize_bytes), messages larger than ChannelConfig::messageCacheSize, and superseded messages are not cached.
+            @param messageId The id of the message.
+            @param context The serialization context.
+            @see GetCachedMessage
+         */
+
+        void CacheMessage( uint16_t messageId, void * context );
+
+        /**
+            Get the time to wait before resending a message or block fragment.
+            @param fixedResendTime The resend time to use without an adaptive resend time. Either ChannelConfig::messageResendTime or ChannelConfig::blockFragmentResendTime.
+            @returns The smoothed round trip time plus four times its variance, clamped to [ChannelConfig::minResendTime,ChannelConfig::maxResendTime], if ChannelConfig::adaptiveResendTime is set and an ack has arrived. Otherwise fixedResendTime.
+         */
+
+        float GetResendTime( float fixedResendTime ) const;
+
         /**
             True if we are currently sending a block message.
             Block messages are treated differently to regular messages. 
             Regular messages are small so we try to fit as many into the packet we can. See ReliableChannelData::GetMessagesToSend.
             Blocks attached to block messages are usually larger than the maximum packet size or channel budget, so they are split up fragments. 
-            While in the mode of sending a block message, each channel packet data generated has exactly one fragment from the current block in it. Fragments keep getting included in packets until all fragments of that block are acked.
+            While in the mode of sending a block message, each channel packet data generated has fragments from the current block in it, up to ChannelConfig::maxFragmentsPerPacket. Fragments keep getting included in packets until all fragments of that block are acked.
+            Only used when ChannelConfig::maxBlocksInFlight is 1. When more than one block can be in flight, packets alternate between block fragments and regular messages instead.
             @returns True if currently sending a block message over the network, false otherwise.
             @see BlockMessage
-            @see GetFragmentToSend
+            @see GetFragmentsToSend
          */
 
         bool SendingBlockMessage();
 
         /**
-            Get the next block fragment to send.
-            The next block fragment is selected by scanning left to right over the set of fragments in the block, skipping over any fragments that have already been acked or have been sent within ChannelConfig::fragmentResendTime.
-            @param messageId The id of the message that the block is attached to [out].
-            @param fragmentId The id of the fragment to send [out].
-            @param fragmentBytes The size of the fragment in bytes.
-            @param numFragments The total number of fragments in this block.
-            @param messageType The type of message the block is attached to. See MessageFactory.
-            @returns Pointer to the fragment data.
+            Start sending block messages that are waiting to be sent.
+            Block messages are queued in the order they were sent. When ChannelConfig::maxBlocksInFlight is 1, the block at the front of the queue starts once it is the oldest unacked message. Otherwise it starts as soon as it is within the receive window and a send block is free.
          */
 
-        uint8_t * GetFragmentToSend( uint16_t & messageId, uint16_t & fragmentId, int & fragmentBytes, int & numFragments, int & messageType );
+        void UpdateSendBlocks();
 
         /**
-            Fill the packet data with block and fragment data.
-            This is the payload function that fills the channel packet data while we are sending a block message.
+            Get block fragments to include in a packet.
+            Visits blocks in flight in message id order. For each block, the lowest fragments that have not been acked, and have not been sent within ChannelConfig::blockFragmentResendTime, are included first.
+            Sent fragments wait in a queue ordered by send time and move back to the ready set once their resend time passes, so selection is a word at a time scan of the ready bits rather than a check per fragment.
+            The first fragment only has to fit in the packet. Each fragment after that must also fit in the channel packet budget. See ChannelConfig::packetBudget.
+            @param messageIds Array of block message ids to be filled [out]. Fills up to ChannelConfig::maxFragmentsPerPacket entries, make sure your array is at least this size.
+            @param fragmentIds Array of fragment ids to be filled [out]. Same size as the message id array.
+            @param numFragments The number of fragments written to the arrays.
+            @param availableBits Number of bits remaining in the packet. Considers this as a hard limit when determining how many fragments can fit into the packet.
+            @returns Estimate of the number of bits required to serialize the fragments (upper bound).
+            @see GetFragmentPacketData
+         */
+
+        int GetFragmentsToSend( uint16_t * messageIds, uint16_t * fragmentIds, int & numFragments, int availableBits );
+
+        /**
+            Fill the packet data with block fragments.
+            This is the payload function that fills the channel packet data while we are sending block messages.
+            Fragment data is not copied. Each fragment points into the block attached to the block message, and holds a reference to the block message so the block stays valid until the packet data is freed.
             @param packetData The packet data to fill [out]
-            @param messageId The id of the message that the block is attached to.
-            @param fragmentId The id of the block fragment being sent.
-            @param fragmentData The fragment data.
-            @param fragmentSize The size of the fragment data (bytes).
-            @param numFragments The number of fragments in the block.
-            @param messageType The type of message the block is attached to.
-            @returns An estimate of the number of bits required to serialize the block message and fragment data (upper bound).
+            @param messageIds Array of block message ids, one per fragment.
+            @param fragmentIds Array of fragment ids.
+            @param numFragments The number of fragments in the arrays.
+            @returns True if the packet data was filled, false if we ran out of memory.
+            @see GetFragmentsToSend
          */
 
-        int GetFragmentPacketData( ChannelPacketData & packetData, 
-                                   uint16_t messageId, 
-                                   uint16_t fragmentId, 
-                                   uint8_t * fragmentData, 
-                                   int fragmentSize, 
-                                   int numFragments, 
-                                   int messageType );
+        bool GetFragmentPacketData( ChannelPacketData & packetData, const uint16_t * messageIds, const uint16_t * fragmentIds, int numFragments );
 
         /**
-            Adds a packet entry for the fragment.
-            This lets us look up the fragment that was in the packet later on when it is acked, so we can ack that block fragment.
-            @param messageId The message id that the block was attached to.
-            @param fragmentId The fragment id.
-            @param sequence The sequence number of the packet the fragment was included in.
+            Adds a packet entry for the fragments included in a packet.
+            This lets us look up the fragments that were in the packet later on when it is acked, so we can ack those block fragments.
+            @param messageIds The block message ids, one per fragment.
+            @param fragmentIds The fragment ids.
+            @param numFragments The number of fragments in the arrays.
+            @param sequence The sequence number of the packet the fragments were included in.
          */
 
-        void AddFragmentPacketEntry( uint16_t messageId, uint16_t fragmentId, uint16_t sequence );
+        void AddFragmentPacketEntry( const uint16_t * messageIds, const uint16_t * fragmentIds, int numFragments, uint16_t sequence );
 
         /**
             Process a packet fragment.
             The fragment is added to the set of received fragments for the block. When all packet fragments are received, that block is reconstructed, attached to the block message and added to the message receive queue.
+            Fragments for blocks outside the receive window, or for blocks that have already been received, are ignored.
             @param messageType The type of the message this block fragment is attached to. This is used to make sure this message type actually allows blocks to be attached to it.
             @param messageId The id of the message the block fragment belongs to.
             @param numFragments The number of fragments in the block.
@@ -4603,6 +5402,32 @@ namespace yojimbo
             double timeLastSent;                                                        ///< The time the message was last sent. Used to implement ChannelConfig::messageResendTime.
             uint32_t measuredBits : 31;                                                 ///< The number of bits the message takes up in a bit stream.
             uint32_t block : 1;                                                         ///< 1 if this is a block message. Block messages are treated differently to regular messages when sent over a reliable-ordered channel.
+            int cachedBits;                                                             ///< Number of bits of serialized data in the message cache. 0 if the message has not been cached yet, -1 if it can't be cached.
+            uint32_t cachePosition;                                                     ///< Position of the serialized data in the message cache (dwords). The data has been evicted once the cache head is more than the cache size past this.
+        };
+
+        /**
+            An entry in the resend queue of the reliable-ordered channel.
+            Sent messages are pushed onto the back of the resend queue each time they are sent, so the queue is ordered by the time messages become eligible for resend.
+            Entries are not removed when a message is acked or sent again. They are detected as stale when the message is no longer in the send queue, or its time last sent no longer matches.
+         */
+
+        struct MessageResendQueueEntry
+        {
+            uint16_t messageId;                                                         ///< The message id.
+            double timeLastSent;                                                        ///< The time the message was sent when this entry was pushed.
+        };
+
+        /**
+            An entry in the latest-value index of the reliable latest-value channel.
+            Maps a message key to the unacked message with that key that has not been superseded, so sending a message finds the message it replaces without searching the send queue.
+         */
+
+        struct LatestValueEntry
+        {
+            uint32_t key;                                                               ///< The message key.
+            uint16_t messageId;                                                         ///< The id of the message.
+            uint16_t used;                                                              ///< 1 if this slot of the index is in use.
         };
 
         /**
@@ -4612,6 +5437,17 @@ namespace yojimbo
         struct MessageReceiveQueueEntry
         {
             Message * message;                                                          ///< The message pointer. Has at a reference count of at least 1 while in the receive queue. Ownership of the message is passed back to the caller when the message is dequeued.
+            bool ready;                                                                 ///< True once the message has been added to the arrival queue. Reliable-unordered channels and channels with ordering keys only.
+        };
+
+        /**
+            A block fragment included in a sent packet.
+         */
+
+        struct SentPacketFragment
+        {
+            uint16_t messageId;                                                         ///< The id of the block message the fragment belongs to.
+            uint16_t fragmentId;                                                        ///< The fragment id.
         };
 
         /**
@@ -4624,15 +5460,15 @@ namespace yojimbo
             uint16_t * messageIds;                                                      ///< Pointer to an array of message ids. Dynamically allocated because the user can configure the maximum number of messages in a packet per-channel with ChannelConfig::maxMessagesPerPacket.
             uint32_t numMessageIds : 16;                                                ///< The number of message ids in in the array.
             uint32_t acked : 1;                                                         ///< 1 if this packet has been acked.
-            uint64_t block : 1;                                                         ///< 1 if this packet contains a fragment of a block message.
-            uint64_t blockMessageId : 16;                                               ///< The block message id. Valid only if "block" is 1.
-            uint64_t blockFragmentId : 16;                                              ///< The block fragment id. Valid only if "block" is 1.
+            uint32_t block : 1;                                                         ///< 1 if this packet contains fragments of block messages.
+            uint32_t numFragments : 16;                                                 ///< The number of block fragments in the packet. Valid only if "block" is 1.
+            SentPacketFragment * fragments;                                             ///< Pointer to an array of block fragments included in the packet. Dynamically allocated because the user can configure the maximum number of fragments in a packet per-channel with ChannelConfig::maxFragmentsPerPacket.
         };
 
         /**
             Internal state for a block being sent across the reliable ordered channel.
             Stores the block data and tracks which fragments have been acked. The block send completes when all fragments have been acked.
-            IMPORTANT: Although there can be multiple block messages in the message send and receive queues, only one data block can be in flights over the wire at a time.
+            There is one of these per block that can be in flight at the same time. See ChannelConfig::maxBlocksInFlight.
          */
 
         struct SendBlockData
@@ -4641,8 +5477,12 @@ namespace yojimbo
             {
                 m_allocator = &allocator;
                 ackedFragment = YOJIMBO_NEW( allocator, BitArray, allocator, maxFragmentsPerBlock );
+                readyFragment = YOJIMBO_NEW( allocator, BitArray, allocator, maxFragmentsPerBlock );
+                sentFragmentQueue = YOJIMBO_NEW( allocator, Queue<uint16_t>, allocator, maxFragmentsPerBlock );
                 fragmentSendTime = (double*) YOJIMBO_ALLOCATE( allocator, sizeof( double) * maxFragmentsPerBlock );
                 yojimbo_assert( ackedFragment );
+                yojimbo_assert( readyFragment );
+                yojimbo_assert( sentFragmentQueue );
                 yojimbo_assert( fragmentSendTime );
                 Reset();
             }
@@ -4650,6 +5490,8 @@ namespace yojimbo
             ~SendBlockData()
             {
                 YOJIMBO_DELETE( *m_allocator, BitArray, ackedFragment );
+                YOJIMBO_DELETE( *m_allocator, BitArray, readyFragment );
+                YOJIMBO_DELETE( *m_allocator, Queue<uint16_t>, sentFragmentQueue );
                 YOJIMBO_FREE( *m_allocator, fragmentSendTime );
             }
 
@@ -4660,6 +5502,8 @@ namespace yojimbo
                 numAckedFragments = 0;
                 blockMessageId = 0;
                 blockSize = 0;
+                readyFragment->Clear();
+                sentFragmentQueue->Clear();
             }
 
             bool active;                                                                ///< True if we are currently sending a block.
@@ -4668,6 +5512,8 @@ namespace yojimbo
             int numAckedFragments;                                                      ///< Number of acked fragments in the block being sent.
             uint16_t blockMessageId;                                                    ///< The message id the block is attached to.
             BitArray * ackedFragment;                                                   ///< Has fragment n been received?
+            BitArray * readyFragment;                                                   ///< Is fragment n ready to send? Set for fragments that have not been acked and have never been sent, or are due for resend.
+            Queue<uint16_t> * sentFragmentQueue;                                        ///< Fragments that have been sent and are waiting on their resend time, in the order they were sent. Each fragment is in this queue at most once.
             double * fragmentSendTime;                                                  ///< Last time fragment was sent.
 
         private:
@@ -4682,25 +5528,26 @@ namespace yojimbo
         /**
             Internal state for a block being received across the reliable ordered channel.
             Stores the fragments received over the network for the block, and completes once all fragments have been received.
-            IMPORTANT: Although there can be multiple block messages in the message send and receive queues, only one data block can be in flights over the wire at a time.
+            Fragments are written straight into the block data buffer, which is allocated with the message factory block allocator when the first fragment arrives, sized by the number of fragments in the block, and handed over to the block message when the block completes.
+            There is one of these per block that can be in flight at the same time. See ChannelConfig::maxBlocksInFlight.
          */
 
         struct ReceiveBlockData
         {
-            ReceiveBlockData( Allocator & allocator, int maxBlockSize, int maxFragmentsPerBlock )
+            ReceiveBlockData( Allocator & allocator, int maxFragmentsPerBlock )
             {
                 m_allocator = &allocator;
                 receivedFragment = YOJIMBO_NEW( allocator, BitArray, allocator, maxFragmentsPerBlock );
-                blockData = (uint8_t*) YOJIMBO_ALLOCATE( allocator, maxBlockSize );
-                yojimbo_assert( receivedFragment && blockData );
+                yojimbo_assert( receivedFragment );
+                blockData = NULL;
                 blockMessage = NULL;
                 Reset();
             }
 
             ~ReceiveBlockData()
             {
+                yojimbo_assert( !blockData );
                 YOJIMBO_DELETE( *m_allocator, BitArray, receivedFragment );
-                YOJIMBO_FREE( *m_allocator, blockData );
             }
 
             void Reset()
@@ -4720,7 +5567,7 @@ namespace yojimbo
             int messageType;                                                            ///< Message type of the block being received.
             uint32_t blockSize;                                                         ///< Block size in bytes.
             BitArray * receivedFragment;                                                ///< Has fragment n been received?
-            uint8_t * blockData;                                                        ///< Block data for receive.
+            uint8_t * blockData;                                                        ///< Block data for receive. Sized to hold numFragments full fragments, allocated with the message factory allocator. Ownership passes to the block message once all fragments are received.
             BlockMessage * blockMessage;                                                ///< Block message (sent with fragment 0).
 
         private:
@@ -4732,17 +5579,43 @@ namespace yojimbo
             ReceiveBlockData & operator = ( const ReceiveBlockData & other );
         };
 
+        /**
+            Is the serialized data of a message in the message cache?
+            @param entry The send queue entry of the message.
+            @returns True if the message was cached and has not been evicted since.
+         */
+
+        bool IsMessageCached( const MessageSendQueueEntry & entry ) const;
+
     private:
 
         uint16_t m_sendMessageId;                                                       ///< Id of the next message to be added to the send queue.
-        uint16_t m_receiveMessageId;                                                    ///< Id of the next message to be added to the receive queue.
+        uint16_t m_receiveMessageId;                                                    ///< Id of the next message to be added to the receive queue. For reliable-unordered channels, the id of the oldest message not yet delivered.
         uint16_t m_oldestUnackedMessageId;                                              ///< Id of the oldest unacked message in the send queue.
+        uint16_t m_firstUnsentMessageId;                                                ///< Id of the first message in the send queue that has never been sent. Messages before this id are found via the resend queue.
         SequenceBuffer<SentPacketEntry> * m_sentPackets;                                ///< Stores information per sent connection packet about messages and block data included in each packet. Used to walk from connection packet level acks to message and data block fragment level acks.
         SequenceBuffer<MessageSendQueueEntry> * m_messageSendQueue;                     ///< Message send queue.
+        Queue<MessageResendQueueEntry> * m_messageResendQueue;                          ///< Sent messages in the order they become eligible for resend. Lets GetMessagesToSend visit only messages that are ready to be sent.
+        Queue<MessageResendQueueEntry> * m_messageFastRetransmitQueue;                  ///< Sent messages in packets treated as lost, resent before the resend queue. NULL unless ChannelConfig::fastRetransmitPackets is greater than zero.
+        float m_smoothedRTT;                                                            ///< Smoothed round trip time measured from acks of packets this channel sent data in (seconds). Negative until the first ack arrives.
+        float m_rttVariance;                                                            ///< Smoothed mean deviation of the round trip time (seconds).
+        uint16_t m_highestAckedSequence;                                                ///< Most recent packet sequence acked. Only valid once an ack has arrived.
+        uint16_t m_fastRetransmitSequence;                                              ///< Next sent packet sequence to check for loss. See UpdateFastRetransmit.
         SequenceBuffer<MessageReceiveQueueEntry> * m_messageReceiveQueue;               ///< Message receive queue.
+        Queue<uint16_t> * m_messageArrivalQueue;                                        ///< Ids of received messages in the order they are ready to be delivered. Reliable-unordered channels and channels with ordering keys deliver messages from this queue. NULL otherwise.
+        SequenceBuffer<uint16_t> * m_waitingMessageIds;                                 ///< For each received message that is not ready yet, the id of the next message with the same ordering key waiting on it. NULL without ordering keys.
+        uint32_t * m_orderingKeyMessageIds;                                             ///< Id of the last message sent with each ordering key, or 0xFFFFFFFF if none. Array size is ChannelConfig::numOrderingKeys. NULL without ordering keys.
+        LatestValueEntry * m_latestValues;                                              ///< Open addressed hash table from message key to the message it replaces, with linear probing. Twice the send queue size, so it is never more than half full. NULL unless this is a reliable latest-value channel.
+        int m_latestValueMask;                                                          ///< Size of the latest-value index minus one. The size is a power of two.
         uint16_t * m_sentPacketMessageIds;                                              ///< Array of n message ids per sent connection packet. Allows the maximum number of messages per-packet to be allocated dynamically.
-        SendBlockData * m_sendBlock;                                                    ///< Data about the block being currently sent.
-        ReceiveBlockData * m_receiveBlock;                                              ///< Data about the block being currently received.
+        SentPacketFragment * m_sentPacketFragments;                                     ///< Array of n block fragments per sent connection packet. Allows the maximum number of fragments per-packet to be allocated dynamically.
+        Queue<uint16_t> * m_pendingBlockMessageIds;                                     ///< Ids of block messages in the send queue that have not started sending yet, in send order.
+        SendBlockData ** m_sendBlocks;                                                  ///< Data about the blocks currently being sent. Array size is ChannelConfig::maxBlocksInFlight.
+        ReceiveBlockData ** m_receiveBlocks;                                            ///< Data about the blocks currently being received. Array size is ChannelConfig::maxBlocksInFlight.
+        bool m_sendFragmentsNext;                                                       ///< When more than one block can be in flight, packets alternate between block fragments and regular messages. True if the next packet should prefer block fragments.
+        uint32_t * m_messageCache;                                                      ///< Circular buffer of serialized messages that have been resent. NULL if the cache is disabled.
+        int m_messageCacheWords;                                                        ///< Size of the message cache (dwords).
+        uint32_t m_messageCacheHead;                                                    ///< Position the next message is cached at (dwords). Only ever increases, so it wraps around the cache many times.
 
     private:
 
@@ -4798,6 +5671,7 @@ namespace yojimbo
     protected:
 
         Queue<Message*> * m_messageSendQueue;                   ///< Message send queue.
+        Queue<int> * m_messageSendQueueBits;                    ///< Measured size of each message in the send queue (bits), including its block. Kept in lockstep with the send queue.
         Queue<Message*> * m_messageReceiveQueue;                ///< Message receive queue.
 
     private:
@@ -4807,6 +5681,155 @@ namespace yojimbo
         UnreliableUnorderedChannel & operator = ( const UnreliableUnorderedChannel & other );
     };
 
+    /**
+        Messages sent across this channel are not guaranteed to arrive, but are never received out of order.
+        Works just like the unreliable-unordered channel, except each packet carrying messages for this channel also carries a 16 bit channel sequence number, and the receiver drops messages with a sequence older than the newest one it already received.
+        The sequence only advances when this channel sends messages, so staleness does not depend on how many packets the connection sent while the channel was idle.
+        Stale messages are released as soon as the packet is read, so they never take up a slot in the receive queue.
+        This channel type is best used for state updates where only the most recent value matters.
+     */
+
+    class UnreliableSequencedChannel : public UnreliableUnorderedChannel
+    {
+    public:
+
+        /** 
+            Unreliable sequenced channel constructor.
+            @param allocator The allocator to use.
+            @param messageFactory Message factory for creating and destroying messages.
+            @param config The configuration for this channel.
+            @param channelIndex The channel index in [0,numChannels-1].
+         */
+
+        UnreliableSequencedChannel( Allocator & allocator, MessageFactory & messageFactory, const ChannelConfig & config, int channelIndex, double time );
+
+        void Reset();
+
+        int GetPacketData( void *context, ChannelPacketData & packetData, uint16_t packetSequence, int availableBits );
+
+        void ProcessPacketData( const ChannelPacketData & packetData, uint16_t packetSequence );
+
+    protected:
+
+        uint16_t m_sendSequence;                                ///< Channel sequence number written with the next packet carrying messages for this channel.
+        uint16_t m_receivedSequence;                            ///< Channel sequence number of the newest packet messages were received from. Only valid if m_hasReceivedPacket is true.
+        bool m_hasReceivedPacket;                               ///< True if messages have been received since the channel was reset.
+
+    private:
+
+        UnreliableSequencedChannel( const UnreliableSequencedChannel & other );
+
+        UnreliableSequencedChannel & operator = ( const UnreliableSequencedChannel & other );
+    };
+
+    /**
+        Messages sent across this channel are snapshots of state, delta encoded against the most recent snapshot the other side acked.
+        Snapshots are sent unreliably, just like the unreliable-unordered channel. Each snapshot gets a snapshot id when it is included in a packet, and keeps that id as its message id on the receiver.
+        When a packet containing a snapshot is acked, that snapshot becomes the baseline for snapshots sent after it. See Message::GetBaseline.
+        Both sides keep the last ChannelConfig::snapshotHistorySize snapshots, so the receiver still has the baseline when a delta encoded snapshot arrives. These snapshots hold a reference, so they count against the message memory for the connection.
+        A packet that arrives so late that its baseline has left the receiver history is dropped as if it were lost. It is not acked, so the sender never uses the snapshots in it as a baseline.
+     */
+
+    class SnapshotDeltaChannel : public Channel
+    {
+    public:
+
+        /** 
+            Snapshot delta channel constructor.
+            @param allocator The allocator to use.
+            @param messageFactory Message factory for creating and destroying messages.
+            @param config The configuration for this channel.
+            @param channelIndex The channel index in [0,numChannels-1].
+         */
+
+        SnapshotDeltaChannel( Allocator & allocator, MessageFactory & messageFactory, const ChannelConfig & config, int channelIndex, double time );
+
+        /**
+            Snapshot delta channel destructor.
+            Any messages still in the send or receive queues, or in the snapshot history, will be released.
+         */
+
+        ~SnapshotDeltaChannel();
+
+        void Reset();
+
+        bool CanSendMessage() const;
+
+        bool HasMessagesToSend() const;
+
+        void SendMessage( Message * message, void *context );
+
+        Message * ReceiveMessage();
+
+        void AdvanceTime( double time );
+
+        int GetPacketData( void *context, ChannelPacketData & packetData, uint16_t packetSequence, int availableBits );
+
+        void ProcessPacketData( const ChannelPacketData & packetData, uint16_t packetSequence );
+
+        void ProcessAck( uint16_t ack );
+
+        /**
+            Find a received snapshot by snapshot id.
+            Used to look up the baseline when reading a delta encoded snapshot.
+            @param snapshotId The snapshot id.
+            @returns The snapshot if it is still in the receive history, NULL otherwise.
+         */
+
+        const Message * FindReceivedSnapshot( uint16_t snapshotId ) const;
+
+        /**
+            Get the id of the most recent snapshot acked by the other side.
+            @param snapshotId The acked snapshot id [out].
+            @returns True if a snapshot has been acked since the channel was reset, false otherwise.
+         */
+
+        bool GetAckedSnapshotId( uint16_t & snapshotId ) const;
+
+    protected:
+
+        /// An entry in the snapshot history. Snapshots are stored at their snapshot id modulo the history size.
+
+        struct SnapshotEntry
+        {
+            uint16_t snapshotId;                                ///< The snapshot id.
+            Message * message;                                  ///< The snapshot. NULL if the entry is empty.
+        };
+
+        /**
+            Get the baseline to encode a snapshot against.
+            @param snapshotId The id of the snapshot being sent.
+            @returns The most recent acked snapshot, if it is still in the send history and close enough to be referenced from this snapshot. NULL otherwise.
+         */
+
+        const Message * GetSendBaseline( uint16_t snapshotId ) const;
+
+        /**
+            Add a snapshot to a history.
+            Acquires a reference to the snapshot and releases the snapshot it replaces. If the history already holds a newer snapshot in the same slot, the history is left unchanged.
+            @param history The history to add the snapshot to.
+            @param snapshotId The snapshot id.
+            @param message The snapshot.
+         */
+
+        void AddSnapshot( SnapshotEntry * history, uint16_t snapshotId, Message * message );
+
+        Queue<Message*> * m_messageSendQueue;                   ///< Message send queue.
+        Queue<Message*> * m_messageReceiveQueue;                ///< Message receive queue.
+        SequenceBuffer<uint16_t> * m_sentPackets;               ///< The newest snapshot id included in each sent packet. When one of these packets is acked, that snapshot becomes the baseline.
+        SnapshotEntry * m_sentSnapshots;                        ///< The most recent snapshots sent. Baseline candidates for the snapshots we send.
+        SnapshotEntry * m_receivedSnapshots;                    ///< The most recent snapshots received. Baselines for the snapshots we read.
+        uint16_t m_sendSnapshotId;                              ///< Id for the next snapshot included in a packet.
+        uint16_t m_ackedSnapshotId;                             ///< Id of the most recent snapshot acked by the other side. Only valid if m_hasAckedSnapshot is true.
+        bool m_hasAckedSnapshot;                                ///< True if a snapshot has been acked since the channel was reset.
+
+    private:
+
+        SnapshotDeltaChannel( const SnapshotDeltaChannel & other );
+
+        SnapshotDeltaChannel & operator = ( const SnapshotDeltaChannel & other );
+    };
+
     /// Connection error level.
 
     enum ConnectionErrorLevel
@@ -4818,6 +5841,88 @@ namespace yojimbo
         CONNECTION_ERROR_READ_PACKET_FAILED,                    ///< Failed to read packet. Received an invalid packet?     
     };
 
+    /**
+        Limits the rate a connection sends packet data at, and adapts that rate to network conditions.
+        Sending is limited by a token bucket. It fills at the current send rate, holds up to one packet, and each packet sent takes its size out of the bucket. Packets are cut down to the bytes in the bucket, which in turn limits the bits channels get to write messages into.
+        The send rate starts at ConnectionConfig::minSendBandwidth and grows exponentially until the first sign of congestion, then linearly. Packet loss or round trip time above the limits in the connection config halves the rate.
+        @see ConnectionConfig::congestionControl
+     */
+
+    class CongestionController
+    {
+    public:
+
+        /**
+            Congestion controller constructor.
+            @param config The connection config. Specifies the send rate limits and what counts as congestion.
+            @param time The current time (seconds).
+         */
+
+        CongestionController( const ConnectionConfig & config, double time );
+
+        /**
+            Reset the send rate back to the minimum, and empty the token bucket.
+            Call this when the connection is reset, eg. when a new client connects to a server slot.
+         */
+
+        void Reset();
+
+        /**
+            Advance time and fill the token bucket at the current send rate.
+            @param time The current time (seconds).
+         */
+
+        void AdvanceTime( double time );
+
+        /**
+            Adapt the send rate to the latest network statistics.
+            Call once per-update after AdvanceTime. The rate is changed at most once per CongestionHoldTime after a decrease, so the statistics have time to reflect the new rate.
+            @param RTT The round trip time estimate (milliseconds). 0 if there is no estimate yet.
+            @param packetLoss The packet loss estimate (percent).
+         */
+
+        void UpdateNetworkConditions( float RTT, float packetLoss );
+
+        /**
+            Get the number of bytes the next packet may use.
+            @param maxPacketBytes The maximum packet size (bytes).
+            @returns The bytes in the token bucket, clamped between the smallest useful packet and maxPacketBytes, rounded down to a multiple of 4. Packets are always allowed so acks keep flowing.
+         */
+
+        int GetMaxPacketBytes( int maxPacketBytes ) const;
+
+        /**
+            Take a sent packet out of the token bucket.
+            @param packetBytes The size of the packet sent (bytes).
+         */
+
+        void PacketSent( int packetBytes );
+
+        /**
+            Get the current send rate.
+            @returns The send rate (kbps).
+         */
+
+        float GetSendBandwidth() const { return m_sendBandwidth; }
+
+    private:
+
+        int m_maxPacketSize;                                    ///< The maximum packet size (bytes). This is also the size of the token bucket.
+        float m_minSendBandwidth;                               ///< The lowest send rate (kbps). See ConnectionConfig::minSendBandwidth.
+        float m_maxSendBandwidth;                               ///< The highest send rate (kbps). See ConnectionConfig::maxSendBandwidth.
+        float m_congestionPacketLoss;                           ///< Packet loss treated as congestion (percent). See ConnectionConfig::congestionPacketLoss.
+        float m_congestionRTT;                                  ///< Round trip time above the lowest seen recently that is treated as congestion (milliseconds). See ConnectionConfig::congestionRTT.
+        double m_time;                                          ///< The current time (seconds).
+        double m_lastUpdateTime;                                ///< Time of the last call to UpdateNetworkConditions (seconds).
+        double m_lastDecreaseTime;                              ///< Time the send rate was last halved (seconds).
+        float m_sendBandwidth;                                  ///< The current send rate (kbps).
+        float m_tokens;                                         ///< Bytes in the token bucket. May be negative after a packet larger than the bucket is sent.
+        float m_minRTT;                                         ///< Lowest round trip time seen in the current window (milliseconds). 0 if there is no estimate yet.
+        float m_previousMinRTT;                                 ///< Lowest round trip time seen in the previous window (milliseconds). 0 if there is no estimate.
+        double m_minRTTWindowStart;                             ///< Time the current window started (seconds). See MinRTTWindowTime.
+        bool m_slowStart;                                       ///< True until the first congestion event. The send rate grows exponentially while true.
+    };
+
     /**
         Sends and receives messages across a set of user defined channels.
      */
@@ -4850,14 +5955,38 @@ namespace yojimbo
 
         void AdvanceTime( double time );
 
+        void UpdateNetworkConditions( float RTT, float packetLoss );
+
+        float GetSendBandwidthLimit() const;
+
+        int GetMaxPacketBytes( int maxPacketBytes ) const;
+
+        bool CanFlush( int channelIndex, double time ) const;
+
+        void PacketFlushed( double time );
+
         ConnectionErrorLevel GetErrorLevel() { return m_errorLevel; }
 
+    private:
+
+        bool GeneratePacketInternal( void * context, uint16_t packetSequence, uint8_t * packetData, int maxPacketBytes, int & packetBytes );
+
+        bool ProcessPacketInternal( void * context, uint16_t packetSequence, const uint8_t * packetData, int packetBytes );
+
     private:
 
         Allocator * m_allocator;                                ///< Allocator passed in to the connection constructor.
         MessageFactory * m_messageFactory;                      ///< Message factory for creating and destroying messages.
+        BumpAllocator * m_packetArena;                          ///< Arena for temporary allocations made while generating and processing a packet. Reset after each packet. NULL if ConnectionConfig::packetArenaSize is 0.
+        Allocator * m_packetAllocator;                          ///< Allocator for temporary per-packet allocations. The packet arena if there is one, otherwise the message factory allocator.
         ConnectionConfig m_connectionConfig;                    ///< Connection configuration.
         Channel * m_channel[MaxChannels];                       ///< Array of connection channels. Array size corresponds to m_connectionConfig.numChannels
+        CongestionController * m_congestionController;         ///< Limits the send rate of the connection. NULL unless ConnectionConfig::congestionControl is true.
+        int m_channelDeficitBits[MaxChannels];                  ///< Share of earlier packets each channel had data ready to send for, but couldn't fit anything into (bits). Added to its share of the next packet, so messages and fragments bigger than its share still get sent. See ChannelConfig::weight.
+        bool m_channelMessageSent[MaxChannels];                 ///< True if a message has been sent on the channel since the last packet was generated. Used to decide if there is anything to flush.
+        double m_time;                                          ///< The current time (seconds).
+        double m_lastFlushTime;                                 ///< Time of the last flushed packet (seconds). Flushes happen between calls to AdvanceTime, so this is on the clock passed to CanFlush, not the connection time. See ConnectionConfig::minFlushInterval.
+        bool m_flushed;                                         ///< True if a packet has been flushed since the connection was reset.
         ConnectionErrorLevel m_errorLevel;                      ///< The connection error level.
     };
 
@@ -5130,6 +6259,7 @@ namespace yojimbo
         float sentBandwidth;                        ///< Sent bandwidth (kbps).
         float receivedBandwidth;                    ///< Received bandwidth (kbps).
         float ackedBandwidth;                       ///< Acked bandwidth (kbps).
+        float sendBandwidthLimit;                   ///< Send rate allowed by congestion control (kbps). 0 if congestion control is disabled.
         uint64_t numPacketsSent;                    ///< Number of packets sent.
         uint64_t numPacketsReceived;                ///< Number of packets received.
         uint64_t numPacketsAcked;                   ///< Number of packets acked.
@@ -5194,6 +6324,17 @@ namespace yojimbo
 
         virtual void SendPackets() = 0;
 
+        /**
+            Send a packet to a client right away, without waiting for the next call to SendPackets.
+            Call this after sending latency critical messages to a client, to save up to a full tick of latency.
+            Coalesces: nothing is sent unless messages have been sent to the client since its last packet, and at most one packet is flushed to each client per ConnectionConfig::minFlushInterval.
+            @param time The current time (seconds), on the same clock passed to AdvanceTime. Flushes more than once between updates must pass a time that has moved on since the last flush.
+            @param clientIndex The index of the client to send a packet to.
+            @param channelIndex Only flush if messages have been sent on this channel. Pass -1 to flush if messages have been sent on any channel.
+         */
+
+        virtual void FlushPackets( double time, int clientIndex, int channelIndex = -1 ) = 0;
+
         /**
             Receive packets from connected clients.
             This function drives the procesing of messages included in packets received from connected clients.
@@ -5267,6 +6408,7 @@ namespace yojimbo
         /**
             Helper function to allocate a data block.
             This is typically used to create blocks of data to attach to block messages. See BlockMessage for details.
+            Blocks come from the block allocator of the client's message factory, so blocks of similar size are reused. See MessageFactory::GetBlockAllocator.
             @param clientIndex The index of the client this message belongs to. Determines which client heap is used to allocate the data.
             @param bytes The number of bytes to allocate.
             @returns The pointer to the data block. This must be attached to a message via Client::AttachBlockToMessage, or freed via Client::FreeBlock.
@@ -5292,6 +6434,54 @@ namespace yojimbo
 
         virtual void FreeBlock( int clientIndex, uint8_t * block ) = 0;
 
+        /**
+            Allocate a data block that can be attached to messages for any number of clients.
+            Use this to send the same large block (eg. a map or config) to many clients without a copy of the block per-client. The block is allocated once with the server global allocator and reference counted across all messages it is attached to.
+            The block is read-only once it has been attached to a message.
+            @param bytes The number of bytes to allocate.
+            @returns The pointer to the shared data block, or NULL if the allocation failed. This holds one reference, which must be released with Server::FreeSharedBlock once you have attached it to messages.
+            @see Server::AttachSharedBlockToMessage
+         */
+
+        virtual uint8_t * AllocateSharedBlock( int bytes ) = 0;
+
+        /**
+            Attach a shared data block to a message.
+            Adds a reference to the shared block. The reference is released when the message is destroyed.
+            @param clientIndex The index of the client this message belongs to.
+            @param message The message to attach the block to. This message must be derived from BlockMessage.
+            @param block Pointer to the shared block. Must be created via Server::AllocateSharedBlock.
+            @param bytes Length of the block of data in bytes.
+         */
+
+        virtual void AttachSharedBlockToMessage( int clientIndex, Message * message, uint8_t * block, int bytes ) = 0;
+
+        /**
+            Release the reference on a shared block returned by Server::AllocateSharedBlock.
+            The block memory is freed once it is no longer attached to any message.
+            @param block The shared block.
+         */
+
+        virtual void FreeSharedBlock( uint8_t * block ) = 0;
+
+        /**
+            Set the priority of a client.
+            When the server caps how much it sends (see ClientServerConfig::serverMaxSendBandwidth), clients share the cap in proportion to their priority. For example, give players priority 4 and spectators priority 1.
+            Priority resets to 1 when a client connects.
+            @param clientIndex The index of the client.
+            @param priority The client priority. Must be greater than zero.
+         */
+
+        virtual void SetClientPriority( int clientIndex, float priority ) = 0;
+
+        /**
+            Get the priority of a client.
+            @param clientIndex The index of the client.
+            @returns The client priority set with SetClientPriority. 1 by default.
+         */
+
+        virtual float GetClientPriority( int clientIndex ) const = 0;
+
         /**
             Can we send a message to a particular client on a channel?
             @param clientIndex The index of the client to send a message to.
@@ -5310,6 +6500,27 @@ namespace yojimbo
 
         virtual void SendMessage( int clientIndex, int channelIndex, Message * message ) = 0;
 
+        /**
+            Create a message of the specified type to broadcast to all connected clients.
+            Broadcast messages come from a message factory shared by all clients, backed by the server global allocator.
+            @param type The type of the message to create. The message types corresponds to the message factory created by the adaptor set on the server.
+            @returns The message created, or NULL if the message could not be allocated.
+            @see Server::BroadcastMessage
+         */
+
+        virtual Message * CreateBroadcastMessage( int type ) = 0;
+
+        /**
+            Send a message to all connected clients over a channel.
+            The message payload is serialized once, then each client is sent a lightweight proxy message that copies the serialized payload into its packets. This saves serializing the same message once per-client.
+            Client message ids and packet headers are still written per-client. Block messages cannot be broadcast, and messages cannot be broadcast over a snapshot-delta channel, since each client has its own baseline.
+            Just like Server::SendMessage, make sure the channel can accept a message for each client first.
+            @param channelIndex The channel index in range [0,numChannels-1].
+            @param message The message to broadcast. Must have been created with Server::CreateBroadcastMessage. The server takes ownership of this message.
+         */
+
+        virtual void BroadcastMessage( int channelIndex, Message * message ) = 0;
+
         /**
             Receive a message from a client over a channel.
             @param clientIndex The index of the client to receive messages from.
@@ -5375,6 +6586,26 @@ namespace yojimbo
         virtual void ProcessLoopbackPacket( int clientIndex, const uint8_t * packetData, int packetBytes, uint64_t packetSequence ) = 0;
     };
 
+    class WorkerPool;
+
+    struct BroadcastPayload;
+
+    class SharedBlockAllocator;
+
+    /**
+        Share a budget max-min fairly between consumers with different demands and weights.
+        Consumers that want less than their weighted share of the budget get all they want, and what they leave is shared between the rest by weight.
+        Used by the server to split its egress cap between clients.
+        @param demands How much each consumer wants.
+        @param weights The weight of each consumer. Must be greater than zero.
+        @param count The number of consumers.
+        @param budget The budget to share. Negative budgets are treated as zero.
+        @param order Scratch space for count consumer indices, so the caller controls where it is allocated.
+        @param shares The share of each consumer [out]. Never more than its demand.
+     */
+
+    void max_min_fair_share( const int * demands, const float * weights, int count, int budget, int * order, int * shares );
+
     /**
         Common functionality across all server implementations.
      */
@@ -5417,12 +6648,26 @@ namespace yojimbo
 
         void FreeBlock( int clientIndex, uint8_t * block );
 
+        uint8_t * AllocateSharedBlock( int bytes );
+
+        void AttachSharedBlockToMessage( int clientIndex, Message * message, uint8_t * block, int bytes );
+
+        void FreeSharedBlock( uint8_t * block );
+
+        void SetClientPriority( int clientIndex, float priority );
+
+        float GetClientPriority( int clientIndex ) const;
+
         bool CanSendMessage( int clientIndex, int channelIndex ) const;
 
         bool HasMessagesToSend( int clientIndex, int channelIndex ) const;
 
         void SendMessage( int clientIndex, int channelIndex, Message * message );
 
+        Message * CreateBroadcastMessage( int type );
+
+        void BroadcastMessage( int channelIndex, Message * message );
+
         Message * ReceiveMessage( int clientIndex, int channelIndex );
 
         void ReleaseMessage( int clientIndex, Message * message );
@@ -5433,6 +6678,26 @@ namespace yojimbo
 
         uint8_t * GetPacketBuffer() { return m_packetBuffer; }
 
+        uint8_t * GetClientPacketBuffer( int clientIndex );
+
+        int GetNumActiveClients() const { return m_numActiveClients; }
+
+        const int * GetActiveClients() const { return m_activeClients; }
+
+        void AddActiveClient( int clientIndex );
+
+        void RemoveActiveClient( int clientIndex );
+
+        bool AcquireClientSlot( int clientIndex );
+
+        void ReleaseClientSlot( int clientIndex );
+
+        bool HasClientSlot( int clientIndex ) const;
+
+        bool HasWorkerThreads() const { return m_workerPool != NULL; }
+
+        void RunClientJobs( void (*function)( void * context, int jobIndex ), void * context, int numJobs );
+
         void * GetContext() { return m_context; }
 
         Adapter & GetAdapter() { yojimbo_assert( m_adapter ); return *m_adapter; }
@@ -5447,6 +6712,10 @@ namespace yojimbo
 
         Connection & GetClientConnection( int clientIndex );
 
+        void GetClientPacketBudgets( int numClients, const int * clientIndex, int * maxPacketBytes );
+
+        void ClientPacketSent( int clientIndex, int packetBytes );
+
         virtual void TransmitPacketFunction( int clientIndex, uint16_t packetSequence, uint8_t * packetData, int packetBytes ) = 0;
 
         virtual int ProcessPacketFunction( int clientIndex, uint16_t packetSequence, uint8_t * packetData, int packetBytes ) = 0;
@@ -5461,6 +6730,29 @@ namespace yojimbo
 
     private:
 
+        /**
+            Everything the server keeps for a client slot.
+         */
+
+        struct ClientSlot
+        {
+            uint8_t * memory;                                       ///< The block of memory backing the client allocator. Allocated with m_allocator.
+            Allocator * allocator;                                  ///< The client allocator. Used for allocations related to the client in this slot.
+            MessageFactory * messageFactory;                        ///< The client message factory. This silos message allocations per-client slot.
+            Connection * connection;                                ///< The client connection. This is how messages are exchanged with the client.
+            reliable_endpoint_t * endpoint;                         ///< The client reliable.io endpoint.
+            uint8_t * packetBuffer;                                 ///< Buffer used when writing packets on worker threads. NULL unless worker threads are enabled.
+            bool disconnect;                                        ///< True if this client connected when the client memory pool was empty, and must be disconnected.
+            float priority;                                         ///< Share of the server egress cap this client gets relative to other clients. See Server::SetClientPriority.
+            int lastPacketBytes;                                    ///< Size of the last packet sent to this client (bytes). Used to estimate how much the client wants to send under the egress cap.
+        };
+
+        void CreateClientSlot( int clientIndex, uint8_t * memory );
+
+        uint8_t * DestroyClientSlot( int clientIndex );
+
+        void FreeBroadcastPayloads( bool all );
+
         ClientServerConfig m_config;                                ///< Base client/server config.
         Allocator * m_allocator;                                    ///< Allocator passed in to constructor.
         Adapter * m_adapter;                                        ///< The adapter specifies the allocator to use, and the message factory class.
@@ -5469,14 +6761,26 @@ namespace yojimbo
         bool m_running;                                             ///< True if server is currently running, eg. after "Start" is called, before "Stop".
         double m_time;                                              ///< Current server time in seconds.
         uint8_t * m_globalMemory;                                   ///< The block of memory backing the global allocator. Allocated with m_allocator.
-        uint8_t * m_clientMemory[MaxClients];                       ///< The block of memory backing the per-client allocators. Allocated with m_allocator.
         Allocator * m_globalAllocator;                              ///< The global allocator. Used for allocations that don't belong to a specific client.
-        Allocator * m_clientAllocator[MaxClients];                  ///< Array of per-client allocator. These are used for allocations related to connected clients.
-        MessageFactory * m_clientMessageFactory[MaxClients];        ///< Array of per-client message factories. This silos message allocations per-client slot.
-        Connection * m_clientConnection[MaxClients];                ///< Array of per-client connection classes. This is how messages are exchanged with clients.
-        reliable_endpoint_t * m_clientEndpoint[MaxClients];         ///< Array of per-client reliable.io endpoints.
+        ClientSlot * m_clientSlots;                                 ///< Array of client slots [0,maxClients-1]. Allocated with m_allocator in Start.
+        int * m_activeClients;                                      ///< Sorted array of connected client indices. Per-tick work only touches these slots.
+        int m_numActiveClients;                                     ///< Number of entries in the active client array.
+        int m_numClientsToDisconnect;                               ///< Number of client slots flagged for disconnect because the client memory pool was empty.
+        uint8_t * m_clientMemoryPool;                               ///< Memory backing the client memory pool. NULL unless config.serverClientMemoryPool is non-zero.
+        uint8_t ** m_freeClientMemory;                              ///< Stack of per-client memory blocks in the pool that are not in use.
+        int m_numFreeClientMemory;                                  ///< Number of entries in the free client memory stack.
         NetworkSimulator * m_networkSimulator;                      ///< The network simulator used to simulate packet loss, latency, jitter etc. Optional. 
         uint8_t * m_packetBuffer;                                   ///< Buffer used when writing packets.
+        WorkerPool * m_workerPool;                                  ///< Pool of worker threads used to generate and process packets in parallel. NULL if config.serverWorkerThreads is 0.
+        MessageFactory * m_broadcastMessageFactory;                 ///< Message factory for broadcast messages. Allocated with the global allocator in Start.
+        uint8_t * m_broadcastBuffer;                                ///< Scratch buffer that broadcast messages are serialized into.
+        BroadcastPayload * m_broadcastPayloads;                     ///< List of serialized broadcast message payloads still referenced by client proxy messages.
+        SharedBlockAllocator * m_sharedBlockAllocator;              ///< Allocator for blocks shared across clients. Allocated with the global allocator in Start.
+        float m_egressTokens;                                       ///< Bytes the server may still send to clients under ClientServerConfig::serverMaxSendBandwidth. May be negative after sending more than the budget.
+        int * m_budgetDemands;                                      ///< How much each client wants to send this update when sharing the egress budget (bytes). Array size is maxClients. Allocated with m_allocator in Start.
+        float * m_budgetWeights;                                    ///< The priority of each client when sharing the egress budget. Array size is maxClients.
+        int * m_budgetOrder;                                        ///< Scratch space for sharing the egress budget. Array size is maxClients.
+        int * m_budgetShares;                                       ///< The share of the egress budget each client gets (bytes). Array size is maxClients.
     };
 
     /**
@@ -5501,6 +6805,8 @@ namespace yojimbo
 
         void SendPackets();
 
+        void FlushPackets( double time, int clientIndex, int channelIndex = -1 );
+
         void ReceivePackets();
 
         void AdvanceTime( double time );
@@ -5531,15 +6837,42 @@ namespace yojimbo
 
         void SendLoopbackPacketCallbackFunction( int clientIndex, const uint8_t * packetData, int packetBytes, uint64_t packetSequence );
 
+        void SendClientPacket( int clientIndex, int maxPacketBytes );
+
+        void SendPacketsParallel();
+
+        void ReceivePacketsParallel();
+
         static void StaticConnectDisconnectCallbackFunction( void * context, int clientIndex, int connected );
 
         static void StaticSendLoopbackPacketCallbackFunction( void * context, int clientIndex, const uint8_t * packetData, int packetBytes, uint64_t packetSequence );
 
+        static void StaticGeneratePacketJob( void * context, int jobIndex );
+
+        static void StaticProcessPacketsJob( void * context, int jobIndex );
+
+        /**
+            A packet received from netcode.io, queued up so it can be processed on a worker thread.
+         */
+
+        struct ReceivedPacket
+        {
+            uint8_t * packetData;                           ///< The packet data owned by netcode.io. Freed once all jobs have completed.
+            int packetBytes;                                ///< The size of the packet in bytes.
+        };
+
         ClientServerConfig m_config;
         netcode_server_t * m_server;
         Address m_address;                                  // original address passed to ctor
         Address m_boundAddress;                             // address after socket bind, eg. valid port
         uint8_t m_privateKey[KeyBytes];
+        int m_numJobs;                                      // number of jobs in flight when sending or receiving packets on worker threads
+        int * m_jobClientIndex;                             // client index for each job [0,maxClients-1]
+        int * m_jobPacketBytes;                             // maximum size of the packet each send job may generate, then the size of the packet generated. 0 if no packet was generated
+        int * m_jobFirstPacket;                             // range of received packets processed by each receive job [0,maxClients]
+        int m_numReceivedPackets;                           // number of packets queued up for processing on worker threads
+        int m_maxReceivedPackets;                           // capacity of the received packet array. grows as needed
+        ReceivedPacket * m_receivedPackets;                 // packets queued up for processing on worker threads
     };
 
     /**
@@ -5585,6 +6918,16 @@ namespace yojimbo
 
         virtual void SendPackets() = 0;
 
+        /**
+            Send a packet to the server right away, without waiting for the next call to SendPackets.
+            Call this after sending latency critical messages, such as player input, to save up to a full tick of latency.
+            Coalesces: nothing is sent unless messages have been sent since the last packet, and at most one packet is flushed per ConnectionConfig::minFlushInterval.
+            @param time The current time (seconds), on the same clock passed to AdvanceTime. Flushes more than once between updates must pass a time that has moved on since the last flush.
+            @param channelIndex Only flush if messages have been sent on this channel. Pass -1 to flush if messages have been sent on any channel.
+         */
+
+        virtual void FlushPackets( double time, int channelIndex = -1 ) = 0;
+
         /**
             Receive packets from the server.
          */
@@ -5670,6 +7013,7 @@ namespace yojimbo
         /**
             Helper function to allocate a data block.
             This is typically used to create blocks of data to attach to block messages. See BlockMessage for details.
+            Blocks come from the block allocator of the client message factory, so blocks of similar size are reused. See MessageFactory::GetBlockAllocator.
             @param bytes The number of bytes to allocate.
             @returns The pointer to the data block. This must be attached to a message via Client::AttachBlockToMessage, or freed via Client::FreeBlock.
          */
@@ -5924,6 +7268,8 @@ namespace yojimbo
 
         void SendPackets();
 
+        void FlushPackets( double time, int channelIndex = -1 );
+
         void ReceivePackets();
 
         void AdvanceTime( double time );